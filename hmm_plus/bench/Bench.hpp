@@ -0,0 +1,204 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <ctime>
+#include <limits>
+#include <algorithm>
+#include <thread>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* Minimal harness in the style of google-benchmark: each benchmark
+ * is a functor run in batches of growing size until a batch takes at
+ * least the minimum time, and the results are written as JSON so
+ * runs can be compared over time.
+ */
+
+struct BenchResult {
+  std::string name;
+  size_t iterations;
+  double seconds;     // wall time of the final batch
+  size_t items;       // items (usually CpGs) processed per iteration
+  size_t peak_rss_kb; // 0 when not measured separately
+
+  double
+  ns_per_iter() const {return 1e9*seconds/iterations;}
+  double
+  items_per_sec() const {return seconds > 0 ? items*iterations/seconds : 0;}
+};
+
+
+// keeps the compiler from discarding a result that is never used
+static volatile double bench_sink;
+
+inline void
+bench_keep(const double x) {bench_sink = x;}
+
+
+inline double
+bench_seconds() {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// the peak resident set size recorded in usage, e.g. by wait4 for a
+// single child; ru_maxrss is in bytes on macOS and kB elsewhere
+inline size_t
+peak_rss_kb(const struct rusage &usage) {
+#ifdef __APPLE__
+  return usage.ru_maxrss/1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+// peak resident set size of this process, or with RUSAGE_CHILDREN of
+// the largest child waited for
+inline size_t
+peak_rss_kb(const int who = RUSAGE_SELF) {
+  struct rusage usage;
+  getrusage(who, &usage);
+  return peak_rss_kb(usage);
+}
+
+
+template <class F> BenchResult
+run_benchmark(const std::string &name, const size_t items, F &f,
+              const double min_time) {
+  f(); // warm up caches and grow-only buffers
+  size_t n_iter = 1;
+  double elapsed = 0;
+  for (;;) {
+    const double start = bench_seconds();
+    for (size_t i = 0; i < n_iter; ++i)
+      f();
+    elapsed = bench_seconds() - start;
+    if (elapsed >= min_time || n_iter >= 1000000000ul)
+      break;
+    // aim past the minimum from the rate observed so far
+    const double scale = elapsed > 0 ? 1.4*min_time/elapsed : 10.0;
+    n_iter = std::max(n_iter + 1,
+                      static_cast<size_t>(n_iter*std::min(scale, 10.0)));
+  }
+  BenchResult r = {name, n_iter, elapsed, items, 0};
+  return r;
+}
+
+
+inline bool
+bench_selected(const std::string &filter, const std::string &name) {
+  return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+
+inline std::string
+json_escape(const std::string &s) {
+  std::string out;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '"' || s[i] == '\\') out += '\\';
+    out += s[i];
+  }
+  return out;
+}
+
+
+inline void
+write_bench_json(std::ostream &out, const std::string &suite,
+                 const std::vector<BenchResult> &results) {
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  char date[64] = "";
+  const time_t now = time(0);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+  out << "{" << std::endl
+      << "  \"context\": {" << std::endl
+      << "    \"suite\": \"" << json_escape(suite) << "\"," << std::endl
+      << "    \"date\": \"" << date << "\"," << std::endl
+      << "    \"host_name\": \"" << json_escape(host) << "\"," << std::endl
+      << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ","
+      << std::endl
+      << "    \"peak_rss_kb\": " << peak_rss_kb() << std::endl
+      << "  }," << std::endl
+      << "  \"benchmarks\": [" << std::endl;
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchResult &r = results[i];
+    out << "    {\"name\": \"" << json_escape(r.name) << "\", "
+        << "\"iterations\": " << r.iterations << ", "
+        << "\"real_time\": " << r.ns_per_iter() << ", "
+        << "\"time_unit\": \"ns\", "
+        << "\"items\": " << r.items << ", "
+        << "\"items_per_second\": " << r.items_per_sec();
+    if (r.peak_rss_kb > 0)
+      out << ", \"peak_rss_kb\": " << r.peak_rss_kb;
+    out << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+  }
+  out << "  ]" << std::endl << "}" << std::endl;
+}
+
+
+/* Two-state synthetic methylation: states switch with probability
+ * switch_prob per site, coverage is uniform on [1, 30] and distances
+ * uniform on [1, 300]. A chromosome boundary is placed every
+ * chrom_size sites; boundaries holds the first index of each
+ * chromosome followed by n.
+ */
+inline void
+simulate_cpgs(const size_t n, const size_t chrom_size,
+              const double switch_prob, const unsigned seed,
+              std::vector<std::pair<double, double> > &meth,
+              std::vector<size_t> &dists, std::vector<size_t> &boundaries) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  std::uniform_int_distribution<int> coverage(1, 30);
+  std::uniform_int_distribution<size_t> spacing(1, 300);
+  meth.clear();
+  dists.clear();
+  boundaries.assign(1, 0);
+  bool fg = false;
+  for (size_t i = 0; i < n; ++i) {
+    if (unif(gen) < switch_prob) fg = !fg;
+    const int cov = coverage(gen);
+    std::binomial_distribution<int> methylated(cov, fg ? 0.15 : 0.85);
+    const int m = methylated(gen);
+    meth.push_back(std::make_pair(static_cast<double>(m),
+                                  static_cast<double>(cov - m)));
+    if (i + 1 < n) {
+      if ((i + 1) % chrom_size == 0) {
+        dists.push_back(std::numeric_limits<size_t>::max());
+        boundaries.push_back(i + 1);
+      }
+      else dists.push_back(spacing(gen));
+    }
+  }
+  boundaries.push_back(n);
+}
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Microbenchmarks for the emission distribution, the transition
+ * rate estimators and the continuous-time HMM
+ *
+ * Copyright (C) 2020-2021 University of Southern California
+ *                         Andrew D Smith
+ *
+ * Author: Andrew D. Smith, Xiaojing Ji
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+#include "OptionParser.hpp"
+#include "TwoStateCTHMM.hpp"
+#include "Bench.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::endl;
+using std::cerr;
+using std::cout;
+
+
+struct BetaBinEval {
+  BetaBinEval(const vector<pair<double, double> > &m) :
+    meth(m), distr(0.5, 5.4) {}
+  void operator()() {
+    double total = 0;
+    for (size_t i = 0; i < meth.size(); ++i)
+      total += distr(meth[i]);
+    bench_keep(total);
+  }
+  const vector<pair<double, double> > &meth;
+  const BetaBin distr;
+};
+
+
+struct BetaBinFit {
+  BetaBinFit(const vector<double> &a, const vector<double> &b,
+             const vector<double> &p) : meth_lp(a), unmeth_lp(b), probs(p) {}
+  void operator()() {
+    BetaBin distr(1.0, 1.0);
+    distr.fit(meth_lp, unmeth_lp, probs);
+    bench_keep(distr.alpha);
+  }
+  const vector<double> &meth_lp;
+  const vector<double> &unmeth_lp;
+  const vector<double> &probs;
+};
+
+
+struct LogSumLogVec {
+  LogSumLogVec(const vector<double> &v) : vals(v) {}
+  void operator()() {bench_keep(log_sum_log_vec(vals, vals.size()));}
+  const vector<double> &vals;
+};
+
+
+struct TransEstimate {
+  TransEstimate(const matrix &_r, const vector<size_t> &t, const bool cg) :
+    r(_r), dists(t), CG(cg) {}
+  void operator()() {
+    ExpTransEstimator estimator(0.5, 0.01, true);
+    if (CG) estimator.mle_CG(r, dists);
+    else estimator.mle_GradAscent(r, dists);
+    bench_keep(estimator.get_b());
+  }
+  const matrix &r;
+  const vector<size_t> &dists;
+  const bool CG;
+};
+
+
+// one forward, one backward and the posteriors
+struct CTHMMDecode {
+  CTHMMDecode(TwoVarHMM &h, vector<pair<double, double> > &m,
+              const vector<size_t> &t) : hmm(h), meth(m), dists(t) {}
+  void operator()() {
+    bench_keep(hmm.PosteriorDecoding(meth, dists, classes, scores));
+  }
+  TwoVarHMM &hmm;
+  vector<pair<double, double> > &meth;
+  const vector<size_t> &dists;
+  vector<int> classes;
+  vector<double> scores;
+};
+
+
+// a single Baum-Welch iteration: forward, backward and the M-step
+struct CTHMMTrainStep {
+  CTHMMTrainStep(vector<pair<double, double> > &m, const vector<size_t> &t) :
+    meth(m), dists(t) {}
+  void operator()() {
+    TwoVarHMM hmm(1e-10, 1e-10, 1, false, false, 2);
+    hmm.set_parameters(BetaBin(0.33, 0.67), BetaBin(0.67, 0.33),
+                       0.02, 0.02, 0.5, 0.5, 1e-10, 1e-10);
+    bench_keep(hmm.BaumWelchTraining(meth, dists));
+  }
+  vector<pair<double, double> > &meth;
+  const vector<size_t> &dists;
+};
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    string outfile;
+    string filter;
+    size_t n_cpgs = 100000;
+    double min_time = 0.5;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "microbenchmarks for the "
+                           "emission model, rate estimators and ctHMM", "");
+    opt_parse.add_opt("out", 'o', "output JSON file (default: stdout)",
+                      false, outfile);
+    opt_parse.add_opt("cpgs", 'n', "number of simulated CpGs",
+                      false, n_cpgs);
+    opt_parse.add_opt("min-time", 'm', "minimum seconds per benchmark",
+                      false, min_time);
+    opt_parse.add_opt("filter", 'f', "only run benchmarks whose name "
+                      "contains this string", false, filter);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    vector<pair<double, double> > meth;
+    vector<size_t> dists, boundaries;
+    simulate_cpgs(n_cpgs, 50000, 0.01, 7, meth, dists, boundaries);
+
+    vector<double> meth_lp(n_cpgs), unmeth_lp(n_cpgs), probs(n_cpgs);
+    vector<double> log_vals(n_cpgs);
+    for (size_t i = 0; i < n_cpgs; ++i) {
+      const double level = std::min(std::max(
+        meth[i].first/(meth[i].first + meth[i].second), 1e-2), 1.0 - 1e-2);
+      meth_lp[i] = log(level);
+      unmeth_lp[i] = log(1.0 - level);
+      probs[i] = level < 0.5 ? 0.9 : 0.1;
+      log_vals[i] = -1e-3*(i % 1000);
+    }
+
+    // transition posteriors as the E-step would produce them
+    matrix r(4, vector<double>(n_cpgs, 0.0));
+    for (size_t i = 0; i + 1 < n_cpgs; ++i) {
+      const double stay = dists[i] == std::numeric_limits<size_t>::max() ?
+        0.5 : exp(-0.002*dists[i]);
+      const double fg = probs[i];
+      r[0][i] = (1 - fg)*(0.5 + 0.5*stay);
+      r[1][i] = (1 - fg)*(0.5 - 0.5*stay);
+      r[2][i] = fg*(0.5 - 0.5*stay);
+      r[3][i] = fg*(0.5 + 0.5*stay);
+    }
+
+    TwoVarHMM hmm(1e-10, 1e-10, 30, false, false, 2);
+    hmm.set_parameters(BetaBin(0.5, 5.4), BetaBin(2.4, 0.6),
+                       0.005, 0.0003, 0.5, 0.5, 1e-10, 1e-10);
+
+    vector<BenchResult> results;
+
+    BetaBinEval betabin_eval(meth);
+    if (bench_selected(filter, "BetaBin::operator()"))
+      results.push_back(run_benchmark("BetaBin::operator()", n_cpgs,
+                                      betabin_eval, min_time));
+    BetaBinFit betabin_fit(meth_lp, unmeth_lp, probs);
+    if (bench_selected(filter, "BetaBin::fit"))
+      results.push_back(run_benchmark("BetaBin::fit", n_cpgs,
+                                      betabin_fit, min_time));
+    LogSumLogVec lslv(log_vals);
+    if (bench_selected(filter, "log_sum_log_vec"))
+      results.push_back(run_benchmark("log_sum_log_vec", n_cpgs,
+                                      lslv, min_time));
+    TransEstimate grad_ascent(r, dists, false);
+    if (bench_selected(filter, "ExpTransEstimator::mle_GradAscent"))
+      results.push_back(run_benchmark("ExpTransEstimator::mle_GradAscent",
+                                      n_cpgs, grad_ascent, min_time));
+    TransEstimate conj_grad(r, dists, true);
+    if (bench_selected(filter, "ExpTransEstimator::mle_CG"))
+      results.push_back(run_benchmark("ExpTransEstimator::mle_CG",
+                                      n_cpgs, conj_grad, min_time));
+    CTHMMDecode decode(hmm, meth, dists);
+    if (bench_selected(filter, "CTHMM/forward_backward"))
+      results.push_back(run_benchmark("CTHMM/forward_backward", n_cpgs,
+                                      decode, min_time));
+    CTHMMTrainStep train_step(meth, dists);
+    if (bench_selected(filter, "CTHMM/baum_welch_iteration"))
+      results.push_back(run_benchmark("CTHMM/baum_welch_iteration", n_cpgs,
+                                      train_step, min_time));
+
+    std::ofstream of;
+    if (!outfile.empty()) of.open(outfile.c_str());
+    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+    write_bench_json(out, "cthmm", results);
+  }
+  catch (SMITHLABException &e) {
+    cerr << "ERROR:\t" << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,262 @@
+/*
+ * End-to-end benchmarks: simulate a genome with cthmm_sim, then time
+ * cthmm and vdhmr on it, recording throughput and peak memory
+ *
+ * Copyright (C) 2020-2021 University of Southern California
+ *                         Andrew D Smith
+ *
+ * Author: Andrew D. Smith, Xiaojing Ji
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <fstream>
+#include <iostream>
+#include <random>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+#include "OptionParser.hpp"
+#include "Bench.hpp"
+
+using std::string;
+using std::vector;
+using std::endl;
+using std::cerr;
+using std::cout;
+
+
+// CpG positions in the methcounts layout that cthmm_sim reads; the
+// methylation columns are placeholders it overwrites
+static void
+write_cpg_positions(const string &filename, const size_t n_cpgs,
+                    const size_t n_chroms, const unsigned seed) {
+  std::ofstream out(filename.c_str());
+  if (!out)
+    throw SMITHLABException("could not write: " + filename);
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<size_t> spacing(2, 400);
+  const size_t per_chrom = (n_cpgs + n_chroms - 1)/n_chroms;
+  for (size_t i = 0, chrom = 0, pos = 0; i < n_cpgs; ++i) {
+    if (i % per_chrom == 0) {
+      ++chrom;
+      pos = 0;
+    }
+    pos += spacing(gen);
+    out << "chr" << chrom << "\t" << pos << "\t+\tCpG\t0\t0\n";
+  }
+}
+
+
+// runs the command with output sent to log_file; the rusage of wait4
+// gives the peak RSS of this child alone, where RUSAGE_CHILDREN would
+// give the largest of all the commands run so far
+static BenchResult
+run_command(const string &name, const vector<string> &args,
+            const string &log_file, const size_t items) {
+  vector<char *> argv;
+  for (size_t i = 0; i < args.size(); ++i)
+    argv.push_back(const_cast<char *>(args[i].c_str()));
+  argv.push_back(0);
+
+  const double start = bench_seconds();
+  const pid_t pid = fork();
+  if (pid < 0)
+    throw SMITHLABException("could not fork for: " + args.front());
+  if (pid == 0) {
+    const int fd = open(log_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execv(argv.front(), &argv.front());
+    _exit(127);
+  }
+
+  int status = 0;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0)
+    throw SMITHLABException("lost child process: " + args.front());
+  const double elapsed = bench_seconds() - start;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    throw SMITHLABException(name + " failed, see " + log_file);
+
+  BenchResult r = {name, 1, elapsed, items, peak_rss_kb(usage)};
+  return r;
+}
+
+
+// the work directory made when none is given, with all the files the
+// runs left in it
+static void
+remove_work_dir(const string &dir) {
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return;
+  for (struct dirent *e = readdir(d); e; e = readdir(d)) {
+    const string name(e->d_name);
+    if (name != "." && name != "..")
+      unlink((dir + "/" + name).c_str());
+  }
+  closedir(d);
+  rmdir(dir.c_str());
+}
+
+
+// fastest of n_repeats runs, with the largest peak RSS seen
+static BenchResult
+repeat_command(const string &name, const vector<string> &args,
+               const string &log_file, const size_t items,
+               const size_t n_repeats) {
+  BenchResult best = run_command(name, args, log_file, items);
+  for (size_t i = 1; i < n_repeats; ++i) {
+    const BenchResult r = run_command(name, args, log_file, items);
+    best.peak_rss_kb = std::max(best.peak_rss_kb, r.peak_rss_kb);
+    best.seconds = std::min(best.seconds, r.seconds);
+  }
+  return best;
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    string outfile;
+    string bin_dir = "../hmm";
+    string work_dir;
+    size_t n_cpgs = 1000000;
+    size_t n_chroms = 4;
+    size_t n_repeats = 1;
+    size_t n_threads = 1;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "end-to-end benchmarks of "
+                           "cthmm and vdhmr on a simulated genome", "");
+    opt_parse.add_opt("out", 'o', "output JSON file (default: stdout)",
+                      false, outfile);
+    opt_parse.add_opt("bin", 'b', "directory holding cthmm, vdhmr and "
+                      "cthmm_sim", false, bin_dir);
+    opt_parse.add_opt("work", 'w', "directory for the simulated data "
+                      "(default: a new directory in /tmp, removed after a "
+                      "successful run)", false, work_dir);
+    opt_parse.add_opt("cpgs", 'n', "number of simulated CpGs",
+                      false, n_cpgs);
+    opt_parse.add_opt("chroms", 'c', "number of simulated chromosomes",
+                      false, n_chroms);
+    opt_parse.add_opt("repeats", 'r', "runs per program (fastest is "
+                      "reported)", false, n_repeats);
+    opt_parse.add_opt("threads", 't', "threads for cthmm and vdhmr",
+                      false, n_threads);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    if (n_chroms == 0 || n_repeats == 0)
+      throw SMITHLABException("chroms and repeats must be positive");
+
+    // kept when a run fails, for the logs its error names
+    bool REMOVE_WORK_DIR = false;
+    if (work_dir.empty()) {
+      char templ[] = "/tmp/hmm_bench.XXXXXX";
+      if (!mkdtemp(templ))
+        throw SMITHLABException("could not create a work directory");
+      work_dir = templ;
+      REMOVE_WORK_DIR = true;
+    }
+    const string positions = work_dir + "/positions.meth";
+    const string sim_meth = work_dir + "/sim.meth";
+    const string sim_segs = work_dir + "/sim_segments.bed";
+    const string threads = toa(n_threads);
+
+    write_cpg_positions(positions, n_cpgs, n_chroms, 7);
+
+    vector<BenchResult> results;
+
+    vector<string> sim_args;
+    sim_args.push_back(bin_dir + "/cthmm_sim");
+    sim_args.push_back("-o");
+    sim_args.push_back(sim_meth);
+    sim_args.push_back("-s");
+    sim_args.push_back(sim_segs);
+    sim_args.push_back("-e");
+    sim_args.push_back("7");
+    sim_args.push_back("-t");
+    sim_args.push_back(threads);
+    sim_args.push_back(positions);
+    results.push_back(run_command("cthmm_sim", sim_args,
+                                  work_dir + "/cthmm_sim.log", n_cpgs));
+
+    vector<string> cthmm_args;
+    cthmm_args.push_back(bin_dir + "/cthmm");
+    cthmm_args.push_back("-t");
+    cthmm_args.push_back(threads);
+    cthmm_args.push_back("-o");
+    cthmm_args.push_back(work_dir + "/cthmm.hmr");
+    cthmm_args.push_back(sim_meth);
+    results.push_back(repeat_command("cthmm/t" + threads, cthmm_args,
+                                     work_dir + "/cthmm.log", n_cpgs,
+                                     n_repeats));
+
+    vector<string> vdhmr_args;
+    vdhmr_args.push_back(bin_dir + "/vdhmr");
+    vdhmr_args.push_back("-t");
+    vdhmr_args.push_back(threads);
+    vdhmr_args.push_back("-o");
+    vdhmr_args.push_back(work_dir + "/vdhmr.hmr");
+    vdhmr_args.push_back("-S");
+    vdhmr_args.push_back(work_dir + "/vdhmr.seg");
+    vdhmr_args.push_back(sim_meth);
+    results.push_back(repeat_command("vdhmr/t" + threads, vdhmr_args,
+                                     work_dir + "/vdhmr.log", n_cpgs,
+                                     n_repeats));
+
+    std::ofstream of;
+    if (!outfile.empty()) of.open(outfile.c_str());
+    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+    write_bench_json(out, "end-to-end", results);
+
+    if (REMOVE_WORK_DIR)
+      remove_work_dir(work_dir);
+  }
+  catch (SMITHLABException &e) {
+    cerr << "ERROR:\t" << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
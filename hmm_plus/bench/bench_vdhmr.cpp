@@ -0,0 +1,170 @@
+/*
+ * Microbenchmarks for the negative binomial duration HMM
+ *
+ * Copyright (C) 2020-2021 University of Southern California
+ *                         Andrew D Smith
+ *
+ * Author: Andrew D. Smith, Xiaojing Ji
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+#include "OptionParser.hpp"
+#include "NBVDHMM.hpp"
+#include "Bench.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::endl;
+using std::cerr;
+using std::cout;
+
+
+// one forward, one backward and the posteriors
+struct NBVDHMMDecode {
+  NBVDHMMDecode(TwoVarHMM &h, const vector<pair<double, double> > &m,
+                const vector<size_t> &b) : hmm(h), meth(m), boundaries(b) {}
+  void operator()() {
+    bench_keep(hmm.PosteriorDecoding(meth, boundaries, classes, scores));
+  }
+  TwoVarHMM &hmm;
+  const vector<pair<double, double> > &meth;
+  const vector<size_t> &boundaries;
+  vector<int> classes;
+  vector<double> scores;
+};
+
+
+struct NBVDHMMViterbi {
+  NBVDHMMViterbi(const TwoVarHMM &h, const vector<pair<double, double> > &m,
+                 const vector<size_t> &b) : hmm(h), meth(m), boundaries(b) {}
+  void operator()() {
+    bench_keep(hmm.ViterbiDecoding(meth, boundaries, classes));
+  }
+  const TwoVarHMM &hmm;
+  const vector<pair<double, double> > &meth;
+  const vector<size_t> &boundaries;
+  vector<int> classes;
+};
+
+
+// a single Baum-Welch iteration: forward, backward and the M-step
+struct NBVDHMMTrainStep {
+  NBVDHMMTrainStep(const vector<pair<double, double> > &m,
+                   const vector<size_t> &b, const size_t fg, const size_t bg) :
+    meth(m), boundaries(b), fg_mode(fg), bg_mode(bg) {}
+  void operator()() {
+    TwoVarHMM hmm(1e-10, 1e-10, 1, false);
+    hmm.set_parameters(BetaBin(0.33, 0.67), BetaBin(0.67, 0.33),
+                       fg_mode, bg_mode, 0.02, 0.02, 0.5, 0.5, 1e-10, 1e-10);
+    bench_keep(hmm.BaumWelchTraining(meth, boundaries));
+  }
+  const vector<pair<double, double> > &meth;
+  const vector<size_t> &boundaries;
+  const size_t fg_mode;
+  const size_t bg_mode;
+};
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    string outfile;
+    string filter;
+    size_t n_cpgs = 100000;
+    size_t fg_mode = 2;
+    size_t bg_mode = 1;
+    double min_time = 0.5;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "microbenchmarks for the "
+                           "negative binomial duration HMM", "");
+    opt_parse.add_opt("out", 'o', "output JSON file (default: stdout)",
+                      false, outfile);
+    opt_parse.add_opt("cpgs", 'n', "number of simulated CpGs",
+                      false, n_cpgs);
+    opt_parse.add_opt("fg_mode", 'F', "inner states in foreground",
+                      false, fg_mode);
+    opt_parse.add_opt("bg_mode", 'B', "inner states in background",
+                      false, bg_mode);
+    opt_parse.add_opt("min-time", 'm', "minimum seconds per benchmark",
+                      false, min_time);
+    opt_parse.add_opt("filter", 'f', "only run benchmarks whose name "
+                      "contains this string", false, filter);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    vector<pair<double, double> > meth;
+    vector<size_t> dists, boundaries;
+    simulate_cpgs(n_cpgs, 2000, 0.02, 7, meth, dists, boundaries);
+
+    TwoVarHMM hmm(1e-10, 1e-10, 30, false);
+    hmm.set_parameters(BetaBin(0.5, 5.4), BetaBin(2.4, 0.6),
+                       fg_mode, bg_mode, 0.02, 0.02, 0.5, 0.5, 1e-10, 1e-10);
+
+    const string suffix = "/F" + toa(fg_mode) + "B" + toa(bg_mode);
+    vector<BenchResult> results;
+
+    NBVDHMMDecode decode(hmm, meth, boundaries);
+    if (bench_selected(filter, "NBVDHMM/forward_backward" + suffix))
+      results.push_back(run_benchmark("NBVDHMM/forward_backward" + suffix,
+                                      n_cpgs, decode, min_time));
+    NBVDHMMViterbi viterbi(hmm, meth, boundaries);
+    if (bench_selected(filter, "NBVDHMM/viterbi" + suffix))
+      results.push_back(run_benchmark("NBVDHMM/viterbi" + suffix,
+                                      n_cpgs, viterbi, min_time));
+    NBVDHMMTrainStep train_step(meth, boundaries, fg_mode, bg_mode);
+    if (bench_selected(filter, "NBVDHMM/baum_welch_iteration" + suffix))
+      results.push_back(run_benchmark("NBVDHMM/baum_welch_iteration" + suffix,
+                                      n_cpgs, train_step, min_time));
+
+    std::ofstream of;
+    if (!outfile.empty()) of.open(outfile.c_str());
+    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+    write_bench_json(out, "vdhmr", results);
+  }
+  catch (SMITHLABException &e) {
+    cerr << "ERROR:\t" << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
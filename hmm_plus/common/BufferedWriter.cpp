@@ -0,0 +1,286 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "BufferedWriter.hpp"
+
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <cerrno>
+#include <algorithm>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "smithlab_utils.hpp"
+#include "GenomicRegion.hpp"
+
+using std::string;
+using std::vector;
+
+
+// uncompressed bytes per BGZF block, as in htslib, so that even
+// incompressible data fits the 64 kB limit on a compressed block
+static const size_t BGZF_BLOCK_SIZE = 0xff00;
+static const size_t BGZF_MAX_BLOCK = 0x10000;
+static const size_t BGZF_HEADER = 18;
+static const size_t BGZF_FOOTER = 8;
+// the empty block that marks the end of a BGZF file
+static const unsigned char BGZF_EOF[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+  0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00
+};
+
+// uncompressed buffer; compressed buffers hold 16 BGZF blocks
+static const size_t BUFFER_SIZE = 1 << 20;
+
+
+static bool
+ends_with(const string &s, const string &suffix) {
+  return s.size() > suffix.size() &&
+    s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+
+BufferedWriter::BufferedWriter(const string &f) :
+  filename(f), fd(1), compress(ends_with(f, ".gz")), precision(6),
+  used(0), file_offset(0) {
+#ifndef HAVE_ZLIB
+  if (compress)
+    throw SMITHLABException("gzip output needs a build with HAVE_ZLIB: " +
+                            filename);
+#endif
+  if (!filename.empty()) {
+    fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      throw SMITHLABException("cannot open output file " + filename);
+  }
+  buffer.resize(compress ? 16*BGZF_BLOCK_SIZE : BUFFER_SIZE);
+}
+
+
+BufferedWriter::~BufferedWriter() {
+  try {
+    close();
+  }
+  catch (SMITHLABException &e) {}
+}
+
+
+void
+BufferedWriter::flush() {
+  if (fd < 0 || used == 0)
+    return;
+  if (compress)
+    write_compressed(&buffer[0], used);
+  else write_fd(&buffer[0], used);
+  used = 0;
+}
+
+
+void
+BufferedWriter::close() {
+  if (fd < 0)
+    return;
+  flush();
+  if (compress)
+    write_fd(reinterpret_cast<const char *>(BGZF_EOF), sizeof(BGZF_EOF));
+  const int to_close = fd;
+  fd = -1;
+  if (to_close != 1 && ::close(to_close) != 0)
+    throw SMITHLABException("error writing output file " + filename);
+  if (to_close == 1)
+    std::cout.flush();
+}
+
+
+void
+BufferedWriter::overwrite(const size_t offset, const void *data,
+                          const size_t n) {
+  if (compress || fd < 0)
+    throw SMITHLABException("cannot rewrite output file " + filename);
+  flush();
+  if (offset + n > file_offset ||
+      pwrite(fd, data, n, offset) != static_cast<ssize_t>(n))
+    throw SMITHLABException("error writing output file " + filename);
+}
+
+
+void
+BufferedWriter::write_direct(const char *s, const size_t n) {
+  if (compress)
+    write_compressed(s, n);
+  else write_fd(s, n);
+}
+
+
+void
+BufferedWriter::write_fd(const char *s, size_t n) {
+  if (fd < 0)
+    throw SMITHLABException("write after close of " + filename);
+  if (fd == 1) // keep the order of anything else written to stdout
+    std::cout.flush();
+  while (n > 0) {
+    const ssize_t r = ::write(fd, s, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      throw SMITHLABException("error writing output file " +
+                              (filename.empty() ? string("stdout") : filename));
+    s += r;
+    n -= r;
+    file_offset += r;
+  }
+}
+
+
+#ifdef HAVE_ZLIB
+
+static void
+put_le(unsigned char *p, uint32_t x, const size_t n_bytes) {
+  for (size_t i = 0; i < n_bytes; ++i, x >>= 8)
+    p[i] = x & 0xff;
+}
+
+
+// one BGZF block: a gzip member whose extra field holds its size
+static bool
+deflate_block(const char *s, const size_t n, vector<unsigned char> &block) {
+  block.resize(BGZF_MAX_BLOCK);
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(s));
+  zs.avail_in = n;
+  zs.next_out = &block[BGZF_HEADER];
+  zs.avail_out = BGZF_MAX_BLOCK - BGZF_HEADER - BGZF_FOOTER;
+  const int status = deflate(&zs, Z_FINISH);
+  const size_t compressed = zs.total_out;
+  deflateEnd(&zs);
+  if (status != Z_STREAM_END)
+    return false;
+
+  const size_t size = BGZF_HEADER + compressed + BGZF_FOOTER;
+  memcpy(&block[0], BGZF_EOF, 16); // the header up to the block size
+  put_le(&block[16], size - 1, 2);
+  put_le(&block[size - 8],
+         crc32(0, reinterpret_cast<const Bytef *>(s), n), 4);
+  put_le(&block[size - 4], n, 4);
+  block.resize(size);
+  return true;
+}
+
+
+/* Blocks are deflated in parallel into their own buffers and written
+ * in order, so the file is the same for any number of threads.
+ */
+void
+BufferedWriter::write_compressed(const char *s, const size_t n) {
+  const size_t n_blocks = (n + BGZF_BLOCK_SIZE - 1)/BGZF_BLOCK_SIZE;
+  vector<vector<unsigned char> > blocks(n_blocks);
+  bool ok = true;
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < n_blocks; ++i) {
+    const size_t start = i*BGZF_BLOCK_SIZE;
+    const size_t len = std::min(BGZF_BLOCK_SIZE, n - start);
+    if (!deflate_block(s + start, len, blocks[i])) {
+#pragma omp critical
+      ok = false;
+    }
+  }
+  if (!ok)
+    throw SMITHLABException("error compressing output file " + filename);
+  for (size_t i = 0; i < n_blocks; ++i)
+    write_fd(reinterpret_cast<const char *>(&blocks[i][0]), blocks[i].size());
+}
+
+#else
+
+void
+BufferedWriter::write_compressed(const char *, const size_t) {
+  throw SMITHLABException("gzip output needs a build with HAVE_ZLIB: " +
+                          filename);
+}
+
+#endif
+
+
+BufferedWriter &
+BufferedWriter::put_unsigned(unsigned long long x) {
+  char digits[MAX_DIGITS];
+  char *p = digits + MAX_DIGITS;
+  do {
+    *--p = '0' + x % 10;
+    x /= 10;
+  } while (x > 0);
+  return write(p, digits + MAX_DIGITS - p);
+}
+
+
+BufferedWriter &
+BufferedWriter::put_signed(const long long x) {
+  if (x >= 0)
+    return put_unsigned(x);
+  put('-');
+  // negated as unsigned so the smallest value does not overflow
+  return put_unsigned(0ull - static_cast<unsigned long long>(x));
+}
+
+
+/* %g prints a whole number below 10^precision in full, which is the
+ * common case of counts stored as doubles, so those skip snprintf.
+ */
+BufferedWriter &
+BufferedWriter::put_double(const double x) {
+  static const double POWERS[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                  1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+                                  1e15};
+  const int p = precision < 1 ? 1 : precision;
+  if (p <= 15 && x == std::floor(x) && std::fabs(x) < POWERS[p] &&
+      !(x == 0 && std::signbit(x)))
+    return put_signed(static_cast<long long>(x));
+  char text[64];
+  const int n = snprintf(text, sizeof(text), "%.*g", precision, x);
+  return write(text, std::min(static_cast<size_t>(n), sizeof(text) - 1));
+}
+
+
+// the formats of GenomicRegion::tostring and SimpleGenomicRegion::tostring
+BufferedWriter &
+operator<<(BufferedWriter &out, const GenomicRegion &r) {
+  out << r.get_chrom() << '\t' << r.get_start() << '\t' << r.get_end();
+  const string name(r.get_name());
+  if (!name.empty())
+    out << '\t' << name << '\t' << r.get_score() << '\t' << r.get_strand();
+  return out;
+}
+
+
+BufferedWriter &
+operator<<(BufferedWriter &out, const SimpleGenomicRegion &r) {
+  return out << r.get_chrom() << '\t' << r.get_start() << '\t' << r.get_end();
+}
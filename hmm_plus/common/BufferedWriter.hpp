@@ -0,0 +1,126 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BUFFERED_WRITER_HPP
+#define BUFFERED_WRITER_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+
+class GenomicRegion;
+class SimpleGenomicRegion;
+
+/* Text output through one large buffer, written with a system call
+ * only when it fills, instead of an ostream flushed by endl on every
+ * line. Numbers are formatted directly into the buffer and produce
+ * the same text as an ostream with default flags: integers in full,
+ * floating point as printf %g with the writer's precision (6 unless
+ * changed).
+ *
+ * An empty filename is stdout. A filename ending in .gz is written as
+ * BGZF, the blocked gzip of samtools and tabix, which gunzip reads as
+ * usual; each full buffer is cut into 64 kB blocks that are deflated
+ * in parallel with OpenMP. Compression needs a build with HAVE_ZLIB.
+ *
+ * close() reports write errors by throwing; the destructor flushes
+ * but cannot report them.
+ */
+class BufferedWriter {
+public:
+  explicit BufferedWriter(const std::string &filename);
+  ~BufferedWriter();
+
+  bool is_compressed() const {return compress;}
+  const std::string &get_filename() const {return filename;}
+
+  void set_precision(const int p) {precision = p;}
+  int get_precision() const {return precision;}
+
+  BufferedWriter &
+  write(const char *s, const size_t n) {
+    if (n > buffer.size() - used)
+      flush();
+    if (n > buffer.size() - used)
+      write_direct(s, n);
+    else {
+      memcpy(&buffer[used], s, n);
+      used += n;
+    }
+    return *this;
+  }
+  BufferedWriter &
+  put(const char c) {
+    if (used == buffer.size())
+      flush();
+    buffer[used++] = c;
+    return *this;
+  }
+
+  BufferedWriter &operator<<(const char c) {return put(c);}
+  BufferedWriter &operator<<(const char *s) {return write(s, strlen(s));}
+  BufferedWriter &
+  operator<<(const std::string &s) {return write(s.data(), s.size());}
+  BufferedWriter &operator<<(const int x) {return put_signed(x);}
+  BufferedWriter &operator<<(const long x) {return put_signed(x);}
+  BufferedWriter &operator<<(const long long x) {return put_signed(x);}
+  BufferedWriter &operator<<(const unsigned x) {return put_unsigned(x);}
+  BufferedWriter &operator<<(const unsigned long x) {return put_unsigned(x);}
+  BufferedWriter &
+  operator<<(const unsigned long long x) {return put_unsigned(x);}
+  BufferedWriter &operator<<(const double x) {return put_double(x);}
+  BufferedWriter &operator<<(const float x) {return put_double(x);}
+
+  // writes the buffer out; data already written is then on its way
+  // to the file even if the program later fails
+  void flush();
+  // flushes, finishes a compressed file and closes it
+  void close();
+
+  // replaces n bytes at offset in an uncompressed file, for headers
+  // whose contents are only known at the end
+  void overwrite(const size_t offset, const void *data, const size_t n);
+
+private:
+  BufferedWriter(const BufferedWriter &);
+  BufferedWriter &operator=(const BufferedWriter &);
+
+  static const size_t MAX_DIGITS = 24;
+
+  BufferedWriter &put_unsigned(unsigned long long x);
+  BufferedWriter &put_signed(const long long x);
+  BufferedWriter &put_double(const double x);
+
+  void write_direct(const char *s, const size_t n);
+  void write_fd(const char *s, size_t n);
+  void write_compressed(const char *s, const size_t n);
+
+  std::string filename;
+  int fd;
+  bool compress;
+  int precision;
+  std::vector<char> buffer;
+  size_t used;
+  size_t file_offset; // bytes written to fd so far
+};
+
+BufferedWriter &operator<<(BufferedWriter &out, const GenomicRegion &r);
+BufferedWriter &operator<<(BufferedWriter &out, const SimpleGenomicRegion &r);
+
+#endif
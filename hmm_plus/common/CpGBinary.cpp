@@ -0,0 +1,186 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "CpGBinary.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+
+static const char MAGIC[4] = {'C', 'P', 'G', 'B'};
+static const uint32_t VERSION = 1;
+static const size_t HEADER_SIZE = 4 + sizeof(uint32_t) + 2*sizeof(uint64_t);
+static const size_t MAX_COUNT = std::numeric_limits<uint16_t>::max();
+
+
+static size_t
+pad8(const size_t n) {
+  return (n + 7) & ~static_cast<size_t>(7);
+}
+
+bool
+CpGBinaryReader::is_cpg_binary(const string &filename) {
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  char magic[4];
+  return in.read(magic, 4) && memcmp(magic, MAGIC, 4) == 0;
+}
+
+
+CpGBinaryReader::CpGBinaryReader(const string &filename) :
+  map(MAP_FAILED), map_size(0), n_sites(0),
+  pos(0), n_meth(0), n_unmeth(0) {
+
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw SMITHLABException("cannot open input file " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < HEADER_SIZE) {
+    ::close(fd);
+    throw SMITHLABException("truncated binary CpG file " + filename);
+  }
+  map_size = st.st_size;
+  map = mmap(0, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    throw SMITHLABException("cannot map input file " + filename);
+
+  const char *data = static_cast<const char *>(map);
+  uint32_t version = 0;
+  uint64_t n_chroms = 0, n = 0;
+  memcpy(&version, data + 4, sizeof(uint32_t));
+  memcpy(&n, data + 8, sizeof(uint64_t));
+  memcpy(&n_chroms, data + 16, sizeof(uint64_t));
+  if (memcmp(data, MAGIC, 4) != 0 || version != VERSION) {
+    munmap(map, map_size);
+    throw SMITHLABException("not a binary CpG file (version " +
+                            smithlab::toa(VERSION) + "): " + filename);
+  }
+  n_sites = n;
+
+  size_t offset = HEADER_SIZE;
+  for (size_t i = 0; i < n_chroms; ++i) {
+    uint64_t first = 0;
+    uint32_t len = 0;
+    if (offset + sizeof(uint64_t) + sizeof(uint32_t) > map_size)
+      break;
+    memcpy(&first, data + offset, sizeof(uint64_t));
+    memcpy(&len, data + offset + sizeof(uint64_t), sizeof(uint32_t));
+    offset += sizeof(uint64_t) + sizeof(uint32_t);
+    if (offset + len > map_size)
+      break;
+    names.push_back(string(data + offset, len));
+    chrom_starts.push_back(first);
+    offset += len;
+  }
+  chrom_starts.push_back(n_sites);
+  offset = pad8(offset);
+
+  if (names.size() != n_chroms ||
+      offset + n_sites*(sizeof(uint32_t) + 2*sizeof(uint16_t)) > map_size) {
+    munmap(map, map_size);
+    throw SMITHLABException("truncated binary CpG file " + filename);
+  }
+  pos = reinterpret_cast<const uint32_t *>(data + offset);
+  n_meth = reinterpret_cast<const uint16_t *>(pos + n_sites);
+  n_unmeth = n_meth + n_sites;
+}
+
+
+CpGBinaryReader::~CpGBinaryReader() {
+  if (map != MAP_FAILED)
+    munmap(map, map_size);
+}
+
+
+void
+CpGBinaryWriter::add(const string &chrom, const size_t position,
+                     size_t meth, size_t unmeth) {
+  if (names.empty() || chrom != names.back()) {
+    if (!names.empty() && chrom < names.back())
+      throw SMITHLABException("CpGs not sorted at " + chrom + ":" +
+                              smithlab::toa(position));
+    names.push_back(chrom);
+    chrom_starts.push_back(pos.size());
+  }
+  else if (position < pos.back())
+    throw SMITHLABException("CpGs not sorted at " + chrom + ":" +
+                            smithlab::toa(position));
+  if (position > std::numeric_limits<uint32_t>::max())
+    throw SMITHLABException("position too large for binary CpG file: " +
+                            chrom + ":" + smithlab::toa(position));
+
+  const size_t coverage = meth + unmeth;
+  if (coverage > MAX_COUNT) {
+    meth = static_cast<size_t>(round(meth*static_cast<double>(MAX_COUNT)/
+                                     coverage));
+    unmeth = MAX_COUNT - meth;
+  }
+  pos.push_back(position);
+  n_meth.push_back(meth);
+  n_unmeth.push_back(unmeth);
+}
+
+
+void
+CpGBinaryWriter::close() {
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  if (!out)
+    throw SMITHLABException("cannot open output file " + filename);
+
+  const uint64_t n_sites = pos.size();
+  const uint64_t n_chroms = names.size();
+  out.write(MAGIC, 4);
+  out.write(reinterpret_cast<const char *>(&VERSION), sizeof(uint32_t));
+  out.write(reinterpret_cast<const char *>(&n_sites), sizeof(uint64_t));
+  out.write(reinterpret_cast<const char *>(&n_chroms), sizeof(uint64_t));
+
+  size_t offset = HEADER_SIZE;
+  for (size_t i = 0; i < names.size(); ++i) {
+    const uint32_t len = names[i].size();
+    out.write(reinterpret_cast<const char *>(&chrom_starts[i]),
+              sizeof(uint64_t));
+    out.write(reinterpret_cast<const char *>(&len), sizeof(uint32_t));
+    out.write(names[i].data(), len);
+    offset += sizeof(uint64_t) + sizeof(uint32_t) + len;
+  }
+  const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  out.write(zeros, pad8(offset) - offset);
+
+  if (n_sites > 0) {
+    out.write(reinterpret_cast<const char *>(&pos[0]),
+              n_sites*sizeof(uint32_t));
+    out.write(reinterpret_cast<const char *>(&n_meth[0]),
+              n_sites*sizeof(uint16_t));
+    out.write(reinterpret_cast<const char *>(&n_unmeth[0]),
+              n_sites*sizeof(uint16_t));
+  }
+  if (!out)
+    throw SMITHLABException("error writing output file " + filename);
+}
@@ -0,0 +1,96 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef CPG_BINARY_HPP
+#define CPG_BINARY_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+/* Binary columnar CpG file, in native byte order:
+ *
+ *   header   char[4] "CPGB", uint32 version, uint64 n_sites,
+ *            uint64 n_chroms
+ *   chroms   per chrom: uint64 first site, uint32 name length, name;
+ *            the table is zero padded to a multiple of 8 bytes
+ *   columns  uint32 pos[n_sites], uint16 meth[n_sites],
+ *            uint16 unmeth[n_sites]
+ *
+ * Sites are sorted by chromosome name then position, as required of
+ * the text input, so each chromosome is a contiguous range of sites.
+ */
+
+class CpGBinaryReader {
+public:
+  explicit CpGBinaryReader(const std::string &filename);
+  ~CpGBinaryReader();
+
+  // true if the file starts with the binary magic number
+  static bool is_cpg_binary(const std::string &filename);
+
+  size_t size() const {return n_sites;}
+  size_t n_chroms() const {return names.size();}
+  const std::string &chrom_name(const size_t c) const {return names[c];}
+  size_t chrom_begin(const size_t c) const {return chrom_starts[c];}
+  size_t chrom_end(const size_t c) const {return chrom_starts[c + 1];}
+
+  // the columns, mapped from the file
+  const uint32_t *positions() const {return pos;}
+  const uint16_t *meth() const {return n_meth;}
+  const uint16_t *unmeth() const {return n_unmeth;}
+
+private:
+  CpGBinaryReader(const CpGBinaryReader &) = delete;
+  CpGBinaryReader &operator=(const CpGBinaryReader &) = delete;
+
+  void *map;
+  size_t map_size;
+  size_t n_sites;
+  std::vector<std::string> names;
+  std::vector<size_t> chrom_starts; // n_chroms + 1 entries
+  const uint32_t *pos;
+  const uint16_t *n_meth;
+  const uint16_t *n_unmeth;
+};
+
+
+// Sites are held in memory until close(), which writes the file.
+class CpGBinaryWriter {
+public:
+  explicit CpGBinaryWriter(const std::string &f) : filename(f) {}
+
+  // counts above the uint16 range are scaled down, keeping the level
+  void
+  add(const std::string &chrom, const size_t position,
+      size_t meth, size_t unmeth);
+
+  void close();
+
+private:
+  std::string filename;
+  std::vector<std::string> names;
+  std::vector<uint64_t> chrom_starts;
+  std::vector<uint32_t> pos;
+  std::vector<uint16_t> n_meth;
+  std::vector<uint16_t> n_unmeth;
+};
+
+#endif
@@ -0,0 +1,169 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "CpGStream.hpp"
+#include "CpGBinary.hpp"
+
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+using std::pair;
+
+
+CpGChromStream::CpGChromStream(const string &f) :
+  filename(f), binary(0), chrom_idx(0), have_pending(false),
+  pending_pos(0), pending_coverage(0), started(false) {
+  if (CpGBinaryReader::is_cpg_binary(filename))
+    binary = new CpGBinaryReader(filename);
+  else {
+    in.open(filename.c_str());
+    if (!in)
+      throw SMITHLABException("cannot open input file " + filename);
+  }
+}
+
+
+CpGChromStream::~CpGChromStream() {
+  if (reading.valid())
+    reading.wait();
+  delete binary;
+}
+
+
+bool
+CpGChromStream::read_site(string &chrom, size_t &pos,
+                          pair<double, double> &meth, size_t &coverage) {
+  string strand, seq;
+  double level;
+  if (!(in >> chrom >> pos >> strand >> seq >> level >> coverage))
+    return false;
+  if (chrom.empty() || strand.empty() || seq.empty()
+      || level < 0.0 || level > 1.0) {
+    std::ostringstream oss;
+    oss << chrom << "\t" << pos << "\t" << strand << "\t"
+        << seq << "\t" << level << "\t" << coverage << "\n";
+    throw SMITHLABException("Invalid input line:" + oss.str());
+  }
+  meth.first = static_cast<size_t>(round(level * coverage));
+  meth.second = static_cast<size_t>(coverage - meth.first);
+  return true;
+}
+
+
+bool
+CpGChromStream::read_chrom(CpGBlock &block) {
+  block.clear();
+  if (binary) {
+    if (chrom_idx == binary->n_chroms())
+      return false;
+    const string &chrom = binary->chrom_name(chrom_idx);
+    const uint32_t *pos = binary->positions();
+    const uint16_t *n_meth = binary->meth();
+    const uint16_t *n_unmeth = binary->unmeth();
+    for (size_t i = binary->chrom_begin(chrom_idx);
+         i < binary->chrom_end(chrom_idx); ++i) {
+      block.cpgs.push_back(SimpleGenomicRegion(chrom, pos[i], pos[i] + 1));
+      block.meth.push_back(std::make_pair(n_meth[i], n_unmeth[i]));
+      block.reads.push_back(n_meth[i] + n_unmeth[i]);
+    }
+    ++chrom_idx;
+    return true;
+  }
+
+  if (!have_pending &&
+      !read_site(pending_chrom, pending_pos, pending_meth, pending_coverage))
+    return false;
+  have_pending = false;
+
+  const string chrom = pending_chrom;
+  size_t prev_pos = pending_pos;
+  string c;
+  size_t pos, coverage;
+  pair<double, double> meth;
+  block.cpgs.push_back(SimpleGenomicRegion(chrom, pending_pos,
+                                           pending_pos + 1));
+  block.meth.push_back(pending_meth);
+  block.reads.push_back(pending_coverage);
+  while (read_site(c, pos, meth, coverage)) {
+    if (c != chrom) {
+      if (c < chrom)
+        throw SMITHLABException("CpGs not sorted in file \"" +
+                                filename + "\"");
+      pending_chrom = c;
+      pending_pos = pos;
+      pending_meth = meth;
+      pending_coverage = coverage;
+      have_pending = true;
+      break;
+    }
+    if (pos < prev_pos)
+      throw SMITHLABException("CpGs not sorted in file \"" + filename + "\"");
+    prev_pos = pos;
+    block.cpgs.push_back(SimpleGenomicRegion(chrom, pos, pos + 1));
+    block.meth.push_back(meth);
+    block.reads.push_back(coverage);
+  }
+  return true;
+}
+
+
+bool
+CpGChromStream::next(CpGBlock &block) {
+  if (!started) {
+    started = true;
+    reading = std::async(std::launch::async, &CpGChromStream::read_chrom,
+                         this, std::ref(ahead));
+  }
+  if (!reading.valid() || !reading.get())
+    return false;
+  std::swap(block, ahead);
+  reading = std::async(std::launch::async, &CpGChromStream::read_chrom,
+                       this, std::ref(ahead));
+  return true;
+}
+
+
+void
+load_cpg_sample(const string &filename, const size_t every,
+                const size_t block_size, CpGBlock &sample) {
+  if (every == 0 || block_size == 0)
+    throw SMITHLABException("bad sampling of blocks from " + filename);
+  sample.clear();
+  CpGChromStream in(filename);
+  CpGBlock chrom;
+  // counted within each chromosome, so each gives at least its first
+  // block however short it is
+  while (in.next(chrom))
+    for (size_t i = 0, block_idx = 0; i < chrom.size();
+         i += block_size, ++block_idx)
+      if (block_idx % every == 0) {
+        const size_t end = std::min(i + block_size, chrom.size());
+        sample.cpgs.insert(sample.cpgs.end(), chrom.cpgs.begin() + i,
+                           chrom.cpgs.begin() + end);
+        sample.meth.insert(sample.meth.end(), chrom.meth.begin() + i,
+                           chrom.meth.begin() + end);
+        sample.reads.insert(sample.reads.end(), chrom.reads.begin() + i,
+                            chrom.reads.begin() + end);
+      }
+}
@@ -0,0 +1,83 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef CPG_STREAM_HPP
+#define CPG_STREAM_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <future>
+
+#include "GenomicRegion.hpp"
+
+class CpGBinaryReader;
+
+struct CpGBlock {
+  std::vector<SimpleGenomicRegion> cpgs;
+  std::vector<std::pair<double, double> > meth;
+  std::vector<size_t> reads;
+  void clear() {cpgs.clear(); meth.clear(); reads.clear();}
+  size_t size() const {return cpgs.size();}
+};
+
+/* Reads a sorted CpG file, methcounts text or binary, one chromosome
+ * at a time. The next chromosome is read on a separate thread while
+ * the caller works on the current one.
+ */
+class CpGChromStream {
+public:
+  explicit CpGChromStream(const std::string &filename);
+  ~CpGChromStream();
+
+  // false once every chromosome has been returned
+  bool next(CpGBlock &block);
+
+private:
+  CpGChromStream(const CpGChromStream &) = delete;
+  CpGChromStream &operator=(const CpGChromStream &) = delete;
+
+  bool read_chrom(CpGBlock &block);
+  bool read_site(std::string &chrom, size_t &pos,
+                 std::pair<double, double> &meth, size_t &coverage);
+
+  std::string filename;
+  CpGBinaryReader *binary;
+  size_t chrom_idx;
+  std::ifstream in;
+
+  // the text site read past the end of the previous chromosome
+  bool have_pending;
+  std::string pending_chrom;
+  size_t pending_pos;
+  std::pair<double, double> pending_meth;
+  size_t pending_coverage;
+
+  bool started;
+  CpGBlock ahead;
+  std::future<bool> reading;
+};
+
+// Concatenate every k-th block of block_size consecutive sites of
+// each chromosome, for training when the genome is not held in memory
+void
+load_cpg_sample(const std::string &filename, const size_t every,
+                const size_t block_size, CpGBlock &sample);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Xiaojing Ji and Andrew D. Smith
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef EM_ACCEL_HPP
+#define EM_ACCEL_HPP
+
+#include <vector>
+#include <ostream>
+#include <iomanip>
+#include <chrono>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
+/* SQUAREM acceleration of EM (Varadhan and Roland, 2008). Two EM
+ * passes from theta0 give theta1 and theta2; with r = theta1 - theta0
+ * and v = theta2 - theta1 - r the next point is
+ *
+ *   theta0 - 2*alpha*r + alpha^2*v,   alpha = -|r|/|v| <= -1
+ *
+ * followed by one EM pass from it. If that pass scores lower than
+ * theta1 the point is dropped and EM continues from theta2, so the
+ * likelihood never goes down. alpha = -1 gives theta2 exactly.
+ * Parameters are extrapolated on the log scale (positive values) or
+ * the logit scale (probabilities) so every point stays valid.
+ */
+
+// one forward/backward pass per entry
+struct EMTrace {
+  void
+  clear() {loglik.clear(); seconds.clear(); step.clear();}
+  void
+  add(const double l, const double s, const char c) {
+    loglik.push_back(l);
+    seconds.push_back(s);
+    step.push_back(c);
+  }
+  size_t
+  size() const {return loglik.size();}
+
+  void
+  report(std::ostream &out) const {
+    out << std::setw(5) << "PASS" << std::setw(6) << "STEP"
+        << std::setw(22) << "LOGLIK" << std::setw(12) << "SECONDS"
+        << std::endl;
+    const std::streamsize precision = out.precision();
+    double total = 0;
+    size_t n_extrapolated = 0, n_rejected = 0;
+    for (size_t i = 0; i < loglik.size(); ++i) {
+      out << std::setw(5) << i + 1 << std::setw(6) << step[i]
+          << std::setw(22) << std::setprecision(15) << loglik[i]
+          << std::setw(12) << std::setprecision(4) << seconds[i]
+          << std::endl;
+      total += seconds[i];
+      n_extrapolated += (step[i] == 'X');
+      n_rejected += (step[i] == 'R');
+    }
+    out << "EM PASSES: " << loglik.size() << " (" << n_extrapolated
+        << " extrapolated, " << n_rejected << " rejected) in "
+        << total << " seconds" << std::endl;
+    out.precision(precision);
+  }
+
+  std::vector<double> loglik;  // of the parameters the pass started from
+  std::vector<double> seconds;
+  std::vector<char> step;      // E: EM, X: extrapolated, R: rejected
+};
+
+
+inline double
+em_seconds() {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline double
+em_logit(const double p) {return std::log(p/(1.0 - p));}
+
+inline double
+em_expit(const double x) {return 1.0/(1.0 + std::exp(-x));}
+
+
+// returns alpha; theta is left equal to theta2 when alpha is -1
+inline double
+squarem_extrapolate(const std::vector<double> &theta0,
+                    const std::vector<double> &theta1,
+                    const std::vector<double> &theta2,
+                    std::vector<double> &theta) {
+  // longest step tried, as a multiple of the plain EM step
+  static const double STEP_MAX = 16.0;
+  double r_sq = 0, v_sq = 0;
+  for (size_t i = 0; i < theta0.size(); ++i) {
+    const double r = theta1[i] - theta0[i];
+    const double v = theta2[i] - 2.0*theta1[i] + theta0[i];
+    r_sq += r*r;
+    v_sq += v*v;
+  }
+  theta = theta2;
+  if (!(v_sq > 0) || !std::isfinite(r_sq) || !std::isfinite(v_sq))
+    return -1.0;
+  const double alpha =
+    std::max(-STEP_MAX, std::min(-1.0, -std::sqrt(r_sq/v_sq)));
+  if (alpha == -1.0)
+    return alpha;
+  for (size_t i = 0; i < theta0.size(); ++i) {
+    const double r = theta1[i] - theta0[i];
+    const double v = theta2[i] - 2.0*theta1[i] + theta0[i];
+    theta[i] = theta0[i] - 2.0*alpha*r + alpha*alpha*v;
+  }
+  return alpha;
+}
+
+
+/* EM with SQUAREM steps over a model M providing
+ *
+ *   double pass(const size_t n)   EM pass n (from 1); returns the
+ *                                 log-likelihood it started from
+ *   void get(vector<double> &)    parameters, transformed
+ *   void set(const vector<double> &)
+ *   bool converged(const double score, const double prev_score)
+ *
+ * At most max_passes passes are run. Returns the last score before
+ * convergence, like the plain EM loops.
+ */
+template <class M> double
+squarem_training(M &model, const size_t max_passes, EMTrace &trace) {
+  std::vector<double> theta0, theta1, theta2, theta;
+  double prev_score = -std::numeric_limits<double>::max();
+  size_t n = 0;
+  while (n < max_passes) {
+    model.get(theta0);
+    double start = em_seconds();
+    const double score0 = model.pass(++n);
+    trace.add(score0, em_seconds() - start, 'E');
+    if (model.converged(score0, prev_score))
+      break;
+    prev_score = score0;
+    if (n == max_passes)
+      break;
+
+    model.get(theta1);
+    start = em_seconds();
+    const double score1 = model.pass(++n);
+    trace.add(score1, em_seconds() - start, 'E');
+    if (model.converged(score1, prev_score))
+      break;
+    prev_score = score1;
+    if (n == max_passes)
+      break;
+
+    model.get(theta2);
+    if (squarem_extrapolate(theta0, theta1, theta2, theta) == -1.0)
+      continue;
+    model.set(theta);
+    start = em_seconds();
+    const double score = model.pass(++n);
+    if (!(score >= score1)) { // also catches NaN
+      trace.add(score, em_seconds() - start, 'R');
+      model.set(theta2);
+      continue;
+    }
+    trace.add(score, em_seconds() - start, 'X');
+    if (model.converged(score, prev_score))
+      break;
+    prev_score = score;
+  }
+  return prev_score;
+}
+
+#endif
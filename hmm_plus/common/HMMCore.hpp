@@ -0,0 +1,311 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef HMM_CORE_HPP
+#define HMM_CORE_HPP
+
+#include <vector>
+#include <cmath>
+
+#include "Lattice.hpp"
+
+/* The log space forward and backward recursions of the HMMs, written
+ * once as templates over an emission policy and a transition policy.
+ * Each model instantiates its own loop, in which the policies inline
+ * to the arithmetic the model used to spell out by hand, so the
+ * results do not change.
+ *
+ * An emission policy E gives the log emission of state s at site i:
+ *
+ *   double operator()(const size_t i, const size_t s) const;
+ *
+ * The emissions are tables filled before the recursions, where each
+ * distribution evaluates its own kind of observation (see
+ * fill_log_emissions), so no recursion step tests what a site holds.
+ *
+ * A transition policy T has n_states() states, start(s) and end(s)
+ * log probabilities and, for the interval between sites i - 1 and i,
+ *
+ *   forward(e, i, prev, curr):  forward row i from row i - 1
+ *   backward(e, i, next, curr): backward row i - 1 from row i
+ *
+ * The two-state policies also step in place, with curr the same row
+ * as prev or next.
+ */
+
+inline double
+log_sum_log(const double p, const double q) {
+  if (p == 0) {return q;}
+  else if (q == 0) {return p;}
+  if (!std::isfinite(p) && !std::isfinite(q)) {return p;}
+  const double larger = (p > q) ? p : q;
+  const double smaller = (p > q) ? q : p;
+  return larger + log(1.0 + exp(smaller - larger));
+}
+
+
+////////////////////////////////////////////////////////////////////////
+//////  emission policies
+
+// one array of log emissions per two-state class: 0 background,
+// 1 foreground
+struct TwoStateEmissions {
+  TwoStateEmissions(const std::vector<double> &b,
+                    const std::vector<double> &f) : bg(b.data()), fg(f.data()) {}
+  double
+  operator()(const size_t i, const size_t s) const {
+    return s == 0 ? bg[i] : fg[i];
+  }
+  const double *bg;
+  const double *fg;
+};
+
+// log emissions held as a [site][state] lattice
+struct LatticeEmissions {
+  explicit LatticeEmissions(const Lattice<double> &e) : emit(e) {}
+  double
+  operator()(const size_t i, const size_t s) const {return emit[i][s];}
+  const Lattice<double> &emit;
+};
+
+// states sharing the emissions of their class: the array of each
+// state is looked up once, not chosen at every site
+struct ClassEmissions {
+  ClassEmissions(const std::vector<double> &fg, const std::vector<double> &bg,
+                 const size_t fg_states, const size_t n_states) :
+    rows(n_states) {
+    for (size_t s = 0; s < n_states; ++s)
+      rows[s] = s < fg_states ? fg.data() : bg.data();
+  }
+  double
+  operator()(const size_t i, const size_t s) const {return rows[s][i];}
+  std::vector<const double *> rows;
+};
+
+
+////////////////////////////////////////////////////////////////////////
+//////  transition policies
+
+// log transition probabilities of two states, in the order of tables
+// indexed [interval][transition]
+enum {LP_BB, LP_BF, LP_FB, LP_FF};
+
+template <class E> inline void
+two_state_forward(const E &e, const size_t i, const double *lp,
+                  const double *prev, double *curr) {
+  const double bg = e(i, 0) + log_sum_log(prev[0] + lp[LP_BB],
+                                          prev[1] + lp[LP_FB]);
+  curr[1] = e(i, 1) + log_sum_log(prev[0] + lp[LP_BF], prev[1] + lp[LP_FF]);
+  curr[0] = bg;
+}
+
+template <class E> inline void
+two_state_backward(const E &e, const size_t i, const double *lp,
+                   const double *next, double *curr) {
+  const double bg_emi = e(i, 0) + next[0];
+  const double fg_emi = e(i, 1) + next[1];
+  curr[0] = log_sum_log(bg_emi + lp[LP_BB], fg_emi + lp[LP_BF]);
+  curr[1] = log_sum_log(bg_emi + lp[LP_FB], fg_emi + lp[LP_FF]);
+}
+
+// two states with the same transitions across every interval
+struct DiscreteTransitions {
+  DiscreteTransitions(const double bb, const double bf,
+                      const double fb, const double ff,
+                      const double sb, const double sf,
+                      const double tb = 0.0, const double tf = 0.0) {
+    lp[LP_BB] = bb;
+    lp[LP_BF] = bf;
+    lp[LP_FB] = fb;
+    lp[LP_FF] = ff;
+    ls[0] = sb;
+    ls[1] = sf;
+    lt[0] = tb;
+    lt[1] = tf;
+  }
+  size_t n_states() const {return 2;}
+  double start(const size_t s) const {return ls[s];}
+  double end(const size_t s) const {return lt[s];}
+  template <class E> void
+  forward(const E &e, const size_t i, const double *prev, double *curr) const {
+    two_state_forward(e, i, lp, prev, curr);
+  }
+  template <class E> void
+  backward(const E &e, const size_t i, const double *next, double *curr) const {
+    two_state_backward(e, i, lp, next, curr);
+  }
+  double lp[4], ls[2], lt[2];
+};
+
+/* The continuous-time two-state chain: across t bases the foreground
+ * is kept with probability a + (1 - a)exp(-bt) and the background
+ * with 1 - a + a exp(-bt). The probabilities are computed for each
+ * interval as it is crossed.
+ */
+struct ExpTransitions {
+  ExpTransitions(const double _a, const double _b,
+                 const std::vector<size_t> &t, const double sb,
+                 const double sf, const double tb, const double tf) :
+    a(_a), b(_b), time(t) {
+    ls[0] = sb;
+    ls[1] = sf;
+    lt[0] = tb;
+    lt[1] = tf;
+  }
+  void
+  log_probs(const size_t k, double *lp) const {
+    const double ff = a + (1 - a) * exp(-(b * time[k]));
+    const double bb = 1 - a + a * exp(-(b * time[k]));
+    lp[LP_FF] = log(ff);
+    lp[LP_FB] = log(1 - ff);
+    lp[LP_BF] = log(1 - bb);
+    lp[LP_BB] = log(bb);
+  }
+  // the log probabilities of every interval, for TabledTransitions
+  void
+  fill(Lattice<double> &ltp) const {
+    for (size_t k = 0; k < ltp.size(); ++k)
+      log_probs(k, ltp[k]);
+  }
+  size_t n_states() const {return 2;}
+  double start(const size_t s) const {return ls[s];}
+  double end(const size_t s) const {return lt[s];}
+  template <class E> void
+  forward(const E &e, const size_t i, const double *prev, double *curr) const {
+    double lp[4];
+    log_probs(i - 1, lp);
+    two_state_forward(e, i, lp, prev, curr);
+  }
+  template <class E> void
+  backward(const E &e, const size_t i, const double *next, double *curr) const {
+    double lp[4];
+    log_probs(i - 1, lp);
+    two_state_backward(e, i, lp, next, curr);
+  }
+  double a, b;
+  const std::vector<size_t> &time;
+  double ls[2], lt[2];
+};
+
+// two states with the log probabilities of interval k in row k of a
+// table, e.g. one filled by ExpTransitions::fill
+struct TabledTransitions {
+  TabledTransitions(const Lattice<double> &t, const double sb,
+                    const double sf, const double tb, const double tf) :
+    ltp(t) {
+    ls[0] = sb;
+    ls[1] = sf;
+    lt[0] = tb;
+    lt[1] = tf;
+  }
+  size_t n_states() const {return 2;}
+  double start(const size_t s) const {return ls[s];}
+  double end(const size_t s) const {return lt[s];}
+  template <class E> void
+  forward(const E &e, const size_t i, const double *prev, double *curr) const {
+    two_state_forward(e, i, ltp[i - 1], prev, curr);
+  }
+  template <class E> void
+  backward(const E &e, const size_t i, const double *next, double *curr) const {
+    two_state_backward(e, i, ltp[i - 1], next, curr);
+  }
+  const Lattice<double> &ltp;
+  double ls[2], lt[2];
+};
+
+/* The variable-duration chain: states form a ring in which each
+ * state only stays or moves to the next, so a step costs two terms
+ * per state rather than one per pair of states.
+ */
+struct RingTransitions {
+  RingTransitions(const std::vector<double> &s, const std::vector<double> &t,
+                  const std::vector<double> &st,
+                  const std::vector<double> &nx) :
+    lp_s(s), lp_t(t), lp_stay(st), lp_next(nx), n(st.size()) {}
+  size_t n_states() const {return n;}
+  double start(const size_t s) const {return lp_s[s];}
+  double end(const size_t s) const {return lp_t[s];}
+  size_t prev_state(const size_t s) const {return s == 0 ? n - 1 : s - 1;}
+  size_t next_state(const size_t s) const {return s + 1 == n ? 0 : s + 1;}
+  template <class E> void
+  forward(const E &e, const size_t i, const double *prev, double *curr) const {
+    for (size_t s2 = 0; s2 < n; ++s2) {
+      const size_t s1 = prev_state(s2);
+      const double emit = e(i, s2);
+      curr[s2] = log_sum_log(prev[s2] + lp_stay[s2] + emit,
+                             prev[s1] + lp_next[s1] + emit);
+    }
+  }
+  template <class E> void
+  backward(const E &e, const size_t i, const double *next, double *curr) const {
+    for (size_t s1 = 0; s1 < n; ++s1) {
+      const size_t s2 = next_state(s1);
+      curr[s1] = log_sum_log(next[s1] + lp_stay[s1] + e(i, s1),
+                             next[s2] + lp_next[s1] + e(i, s2));
+    }
+  }
+  const std::vector<double> &lp_s, &lp_t, &lp_stay, &lp_next;
+  size_t n;
+};
+
+
+////////////////////////////////////////////////////////////////////////
+//////  recursions
+
+// log likelihood of sites [start, end) given the end probabilities
+template <class T> double
+end_score(const T &t, const double *row) {
+  double score = row[0] + t.end(0);
+  for (size_t s = 1; s < t.n_states(); ++s)
+    score = log_sum_log(score, row[s] + t.end(s));
+  return score;
+}
+
+// fills rows [start, end) of f and returns the log likelihood
+template <class E, class T> double
+forward_algorithm(const E &e, const T &t, const size_t start,
+                  const size_t end, Lattice<double> &f) {
+  for (size_t s = 0; s < t.n_states(); ++s)
+    f[start][s] = e(start, s) + t.start(s);
+  for (size_t i = start + 1; i < end; ++i)
+    t.forward(e, i, f[i - 1], f[i]);
+  return end_score(t, f[end - 1]);
+}
+
+// log likelihood of sites [start, end) from backward row start
+template <class E, class T> double
+start_score(const E &e, const T &t, const size_t start, const double *row) {
+  double score = row[0] + e(start, 0) + t.start(0);
+  for (size_t s = 1; s < t.n_states(); ++s)
+    score = log_sum_log(score, row[s] + e(start, s) + t.start(s));
+  return score;
+}
+
+// fills rows [start, end) of b and returns the log likelihood
+template <class E, class T> double
+backward_algorithm(const E &e, const T &t, const size_t start,
+                   const size_t end, Lattice<double> &b) {
+  for (size_t s = 0; s < t.n_states(); ++s)
+    b[end - 1][s] = t.end(s);
+  for (size_t k = end - 1; k > start; --k)
+    t.backward(e, k, b[k], b[k - 1]);
+  return start_score(e, t, start, b[start]);
+}
+
+#endif
@@ -0,0 +1,240 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Xiaojing Ji and Andrew D. Smith
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef INSTRUMENT_HPP
+#define INSTRUMENT_HPP
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <chrono>
+#include <mutex>
+#include <cstring>
+
+#include <sys/resource.h>
+
+/* Per-phase timing for the --profile report. A ProfileTimer adds the
+ * wall and CPU time of its scope to a named phase along with the
+ * number of items (CpGs, reads, intervals) it handled; profile_count
+ * adds to a named counter. Nothing is recorded until Profile::enable
+ * is called, and building with -DNO_INSTRUMENT removes the timers and
+ * counters altogether. Both take a lock, so they belong around whole
+ * passes, not inside per-site loops. CPU time is that of the process,
+ * so it includes the OpenMP threads a phase starts and any phase
+ * running at the same time on another thread.
+ */
+class Profile {
+public:
+  static Profile &
+  get() {
+    static Profile profile;
+    return profile;
+  }
+
+  // starts the clocks for the totals
+  void
+  enable() {
+    start_wall = wall_seconds();
+    start_cpu = cpu_seconds();
+    enabled = true;
+  }
+  bool
+  is_enabled() const {return enabled;}
+
+  void
+  add_phase(const char *name, const double wall, const double cpu,
+            const size_t items) {
+    std::lock_guard<std::mutex> guard(lock);
+    Phase &p = find(phases, name);
+    ++p.calls;
+    p.wall += wall;
+    p.cpu += cpu;
+    p.items += items;
+    p.peak_rss_kb = peak_rss_kb();
+  }
+  void
+  add_count(const char *name, const size_t n) {
+    std::lock_guard<std::mutex> guard(lock);
+    find(counters, name).items += n;
+  }
+
+  void
+  write_json(std::ostream &out, const std::string &program) const {
+    std::lock_guard<std::mutex> guard(lock);
+#ifdef NO_INSTRUMENT
+    static const bool instrumented = false;
+#else
+    static const bool instrumented = true;
+#endif
+    out << "{" << std::endl
+        << "  \"program\": \"" << escape(program) << "\"," << std::endl
+        << "  \"instrumented\": " << (instrumented ? "true" : "false")
+        << "," << std::endl
+        << "  \"wall_seconds\": " << wall_seconds() - start_wall << ","
+        << std::endl
+        << "  \"cpu_seconds\": " << cpu_seconds() - start_cpu << ","
+        << std::endl
+        << "  \"peak_rss_kb\": " << peak_rss_kb() << "," << std::endl
+        << "  \"phases\": [" << std::endl;
+    for (size_t i = 0; i < phases.size(); ++i) {
+      const Phase &p = phases[i];
+      out << "    {\"name\": \"" << escape(p.name) << "\", "
+          << "\"calls\": " << p.calls << ", "
+          << "\"wall_seconds\": " << p.wall << ", "
+          << "\"cpu_seconds\": " << p.cpu << ", "
+          << "\"items\": " << p.items << ", "
+          << "\"items_per_second\": " << (p.wall > 0 ? p.items/p.wall : 0)
+          << ", \"peak_rss_kb\": " << p.peak_rss_kb << "}"
+          << (i + 1 < phases.size() ? "," : "") << std::endl;
+    }
+    out << "  ]," << std::endl
+        << "  \"counters\": {";
+    for (size_t i = 0; i < counters.size(); ++i)
+      out << (i > 0 ? "," : "") << std::endl
+          << "    \"" << escape(counters[i].name) << "\": "
+          << counters[i].items;
+    out << (counters.empty() ? "" : "\n  ") << "}" << std::endl
+        << "}" << std::endl;
+  }
+
+  static double
+  wall_seconds() {
+    return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+  static double
+  cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+      1e-6*(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+  }
+  // high-water mark of the resident set so far
+  static size_t
+  peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss/1024;
+#else
+    return usage.ru_maxrss;
+#endif
+  }
+
+private:
+  Profile() : enabled(false), start_wall(0), start_cpu(0) {}
+  Profile(const Profile &);
+  Profile &operator=(const Profile &);
+
+  // counters use only name and items
+  struct Phase {
+    Phase(const char *n) : name(n), calls(0), wall(0), cpu(0), items(0),
+                           peak_rss_kb(0) {}
+    std::string name;
+    size_t calls;
+    double wall;
+    double cpu;
+    size_t items;
+    size_t peak_rss_kb;
+  };
+
+  // entries are kept in the order they first appear
+  static Phase &
+  find(std::vector<Phase> &v, const char *name) {
+    for (size_t i = 0; i < v.size(); ++i)
+      if (strcmp(v[i].name.c_str(), name) == 0)
+        return v[i];
+    v.push_back(Phase(name));
+    return v.back();
+  }
+
+  static std::string
+  escape(const std::string &s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (s[i] == '"' || s[i] == '\\') out += '\\';
+      out += s[i];
+    }
+    return out;
+  }
+
+  bool enabled;
+  double start_wall;
+  double start_cpu;
+  std::vector<Phase> phases;
+  std::vector<Phase> counters;
+  mutable std::mutex lock;
+};
+
+
+#ifndef NO_INSTRUMENT
+
+class ProfileTimer {
+public:
+  explicit ProfileTimer(const char *n, const size_t i = 0) :
+    name(n), items(i), running(Profile::get().is_enabled()),
+    start_wall(running ? Profile::wall_seconds() : 0),
+    start_cpu(running ? Profile::cpu_seconds() : 0) {}
+  ~ProfileTimer() {stop();}
+
+  void
+  add_items(const size_t n) {items += n;}
+
+  // records the phase now instead of at the end of the scope
+  void
+  stop() {
+    if (!running)
+      return;
+    running = false;
+    Profile::get().add_phase(name, Profile::wall_seconds() - start_wall,
+                             Profile::cpu_seconds() - start_cpu, items);
+  }
+
+private:
+  ProfileTimer(const ProfileTimer &);
+  ProfileTimer &operator=(const ProfileTimer &);
+
+  const char *name;
+  size_t items;
+  bool running;
+  double start_wall;
+  double start_cpu;
+};
+
+inline void
+profile_count(const char *name, const size_t n) {
+  if (Profile::get().is_enabled())
+    Profile::get().add_count(name, n);
+}
+
+#else
+
+class ProfileTimer {
+public:
+  explicit ProfileTimer(const char *, const size_t = 0) {}
+  void add_items(const size_t) {}
+  void stop() {}
+};
+
+inline void
+profile_count(const char *, const size_t) {}
+
+#endif
+
+#endif
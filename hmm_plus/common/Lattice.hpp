@@ -0,0 +1,101 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Xiaojing Ji and Andrew D. Smith
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef LATTICE_HPP
+#define LATTICE_HPP
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// Position-major table of n_pos rows by n_cols columns for the
+// forward/backward lattices and per-position tables of the HMMs: all
+// states of one position are adjacent, so a recursion step touches a
+// single cache line. Storage is 64-byte aligned and only ever grows,
+// so one buffer serves every EM iteration, decoding pass and shuffle.
+// Contents are unspecified after resize(). T must be trivially
+// copyable.
+template <class T>
+class Lattice {
+public:
+  Lattice() : n_pos(0), n_cols(0), capacity(0), data(0) {}
+  Lattice(const size_t p, const size_t c) :
+    n_pos(0), n_cols(0), capacity(0), data(0) {resize(p, c);}
+  Lattice(const Lattice &other) :
+    n_pos(0), n_cols(0), capacity(0), data(0) {*this = other;}
+  ~Lattice() {free(data);}
+
+  Lattice &
+  operator=(const Lattice &other) {
+    if (this != &other) {
+      resize(other.n_pos, other.n_cols);
+      if (n_pos*n_cols > 0)
+        memcpy(data, other.data, n_pos*n_cols*sizeof(T));
+    }
+    return *this;
+  }
+
+  void
+  resize(const size_t p, const size_t c) {
+    if (p*c > capacity) {
+      void *buf = 0;
+      if (posix_memalign(&buf, ALIGNMENT, p*c*sizeof(T)) != 0)
+        throw std::bad_alloc();
+      free(data);
+      data = static_cast<T*>(buf);
+      capacity = p*c;
+    }
+    n_pos = p;
+    n_cols = c;
+  }
+
+  // return the memory, e.g. before a long phase that does not need it
+  void
+  release() {
+    free(data);
+    data = 0;
+    n_pos = n_cols = capacity = 0;
+  }
+
+  void
+  fill(const T &val) {
+    for (size_t i = 0; i < n_pos*n_cols; ++i)
+      data[i] = val;
+  }
+
+  size_t size() const {return n_pos;}
+  size_t width() const {return n_cols;}
+  bool empty() const {return n_pos == 0;}
+
+  T *operator[](const size_t i) {return data + i*n_cols;}
+  const T *operator[](const size_t i) const {return data + i*n_cols;}
+
+  T *back() {return data + (n_pos - 1)*n_cols;}
+  const T *back() const {return data + (n_pos - 1)*n_cols;}
+
+private:
+  static const size_t ALIGNMENT = 64;
+
+  size_t n_pos;
+  size_t n_cols;
+  size_t capacity;
+  T *data;
+};
+
+#endif
@@ -0,0 +1,209 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "LocalServer.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+
+// a client that connects but sends nothing cannot hold the server
+static const time_t CLIENT_TIMEOUT_SECONDS = 10;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void
+request_stop(int) {
+  stop_requested = 1;
+}
+
+// without SA_RESTART, so a signal interrupts the wait for a client
+static void
+install_signal_handlers() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_stop;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  signal(SIGPIPE, SIG_IGN);
+}
+
+static void
+fill_address(const string &path, struct sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path))
+    throw SMITHLABException("bad socket path (at most " +
+                            smithlab::toa(sizeof(addr.sun_path) - 1) +
+                            " characters): " + path);
+  memcpy(addr.sun_path, path.data(), path.size());
+}
+
+// a socket file left by a server that has exited can be replaced, but
+// not one a server still listens on or a file that is not a socket
+static void
+remove_stale_socket(const string &path, const struct sockaddr_un &addr) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0)
+    return;
+  if (!S_ISSOCK(st.st_mode))
+    throw SMITHLABException("file exists and is not a socket: " + path);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    throw SMITHLABException("cannot create socket: " + string(strerror(errno)));
+  const bool live =
+    connect(fd, reinterpret_cast<const struct sockaddr *>(&addr),
+            sizeof(addr)) == 0;
+  close(fd);
+  if (live)
+    throw SMITHLABException("a server is already listening on " + path);
+  unlink(path.c_str());
+}
+
+
+LocalServer::LocalServer(const string &socket_path) :
+  path(socket_path), listen_fd(-1), client_fd(-1) {
+  struct sockaddr_un addr;
+  fill_address(path, addr);
+  remove_stale_socket(path, addr);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    throw SMITHLABException("cannot create socket: " + string(strerror(errno)));
+  if (bind(listen_fd, reinterpret_cast<const struct sockaddr *>(&addr),
+           sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+    const string error = strerror(errno);
+    close(listen_fd);
+    throw SMITHLABException("cannot listen on " + path + ": " + error);
+  }
+  stop_requested = 0;
+}
+
+
+LocalServer::~LocalServer() {
+  close_client();
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(path.c_str());
+  }
+}
+
+
+void
+LocalServer::close_client() {
+  if (client_fd >= 0) {
+    close(client_fd);
+    client_fd = -1;
+  }
+}
+
+
+bool
+LocalServer::next_request(string &request) {
+  close_client();
+  install_signal_handlers();
+  while (!stop_requested) {
+    client_fd = accept(listen_fd, 0, 0);
+    if (client_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      throw SMITHLABException("cannot accept on " + path + ": " +
+                              strerror(errno));
+    }
+    struct timeval timeout;
+    timeout.tv_sec = CLIENT_TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // up to the first newline, or all the client sends before closing
+    request.clear();
+    char buffer[4096];
+    bool complete = false;
+    bool closed = false;
+    while (!complete && request.size() <= MAX_REQUEST) {
+      const ssize_t n = read(client_fd, buffer, sizeof(buffer));
+      if (n < 0 && errno == EINTR && !stop_requested)
+        continue;
+      closed = (n == 0);
+      if (n <= 0)
+        break;
+      const char *newline =
+        static_cast<const char *>(memchr(buffer, '\n', n));
+      request.append(buffer, newline ? newline - buffer : n);
+      complete = (newline != 0);
+    }
+    // rejected, as a truncated request could read as a different one;
+    // the rest of the line is read first, as closing the connection
+    // with input unread resets it before the client reads the reply
+    if (request.size() > MAX_REQUEST) {
+      while (!complete) {
+        const ssize_t n = read(client_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR && !stop_requested)
+          continue;
+        if (n <= 0)
+          break;
+        complete = (memchr(buffer, '\n', n) != 0);
+      }
+      respond("ERROR\trequest longer than " + smithlab::toa(MAX_REQUEST) +
+              " bytes\n");
+      continue;
+    }
+    // without a newline, only a client that closed has sent all of it;
+    // after a timeout or an error the line may be cut short
+    if (!complete && !closed && !request.empty()) {
+      respond("ERROR\trequest not ended by a newline within " +
+              smithlab::toa(CLIENT_TIMEOUT_SECONDS) + " seconds\n");
+      continue;
+    }
+    if (complete || !request.empty()) {
+      if (!request.empty() && request[request.size() - 1] == '\r')
+        request.erase(request.size() - 1);
+      return true;
+    }
+    close_client();
+  }
+  return false;
+}
+
+
+void
+LocalServer::respond(const string &response) {
+  size_t written = 0;
+  while (client_fd >= 0 && written < response.size()) {
+    const ssize_t n = write(client_fd, response.data() + written,
+                            response.size() - written);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    written += n;
+  }
+  close_client();
+}
@@ -0,0 +1,67 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef LOCAL_SERVER_HPP
+#define LOCAL_SERVER_HPP
+
+#include <string>
+
+/* A server on a Unix domain socket, for clients on the same machine.
+ * Each client connects, sends one request line and reads the response
+ * until the server closes the connection, e.g.
+ *
+ *   echo "fdr=0.05" | socat - UNIX-CONNECT:<socket>
+ *
+ * Requests are answered one at a time, in the order they arrive;
+ * clients that connect before the first next_request wait for it. A
+ * request without a newline counts only if the client then closes its
+ * side. Requests longer than MAX_REQUEST bytes, and partial lines the
+ * client stops sending, are answered with an ERROR line by
+ * next_request itself. The socket file is removed when the server is
+ * destroyed. Once serving, SIGINT and SIGTERM make next_request return
+ * false, so that the caller can stop and destroy the server.
+ */
+class LocalServer {
+public:
+  explicit LocalServer(const std::string &socket_path);
+  ~LocalServer();
+
+  const std::string &get_path() const {return path;}
+
+  // waits for the next client and reads its request without the
+  // newline; false once the server is told to stop by a signal
+  bool next_request(std::string &request);
+  // sends the response to the current client and closes the
+  // connection; a client that has gone away is not an error
+  void respond(const std::string &response);
+
+private:
+  LocalServer(const LocalServer &) = delete;
+  LocalServer &operator=(const LocalServer &) = delete;
+
+  static const size_t MAX_REQUEST = 65536;
+
+  void close_client();
+
+  std::string path;
+  int listen_fd;
+  int client_fd;
+};
+
+#endif
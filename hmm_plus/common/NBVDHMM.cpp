@@ -20,6 +20,7 @@
 */
 
 #include "NBVDHMM.hpp"
+#include "Instrument.hpp"
 
 #include <algorithm>
 #include <iomanip>
@@ -30,8 +31,6 @@
 #include <gsl/gsl_sf_psi.h>
 #include <gsl/gsl_sf_gamma.h>
 
-// #pragma omp <rest of pragma>
-
 using std::vector;
 using std::pair;
 using std::setw;
@@ -59,17 +58,20 @@ TwoVarHMM::update_emission_matrix() {
   }
 }
 
+// The states form a ring 0 -> 1 -> ... -> num_states-1 -> 0 (first the
+// foreground states, then the background states), so only the self
+// and next transition probabilities of each state are stored.
 void
 TwoVarHMM::update_transition_matrix() {
-  trans = matrix(num_states, vector<double>(num_states, 0));
+  stay_trans = vector<double>(num_states, 0);
+  next_trans = vector<double>(num_states, 0);
   for (size_t i = 0; i < fg_mode; ++i) {
-    trans[i][i] = 1 - fg_p;
-    trans[i][i+1] = fg_p;
+    stay_trans[i] = 1 - fg_p;
+    next_trans[i] = fg_p;
   }
   for (size_t j = 0; j < bg_mode; ++j) {
-    trans[fg_mode+j][fg_mode+j] = 1 - bg_p;
-    size_t bf = j == (bg_mode - 1) ? 0 : fg_mode+j+1;
-    trans[fg_mode+j][bf] = bg_p;
+    stay_trans[fg_mode+j] = 1 - bg_p;
+    next_trans[fg_mode+j] = bg_p;
   }
 
   start_trans = vector<double>(num_states, 0);
@@ -108,116 +110,65 @@ TwoVarHMM::set_parameters(const BetaBin _fg_emission,
 }
 
 
-inline double
-TwoVarHMM::log_sum_log(const double p, const double q) const {
-  if (p == 0) {return q;}
-  else if (q == 0) {return p;}
-  if (!isfinite(p) && !isfinite(q)) {return p;}
-  const double larger = (p > q) ? p : q;
-  const double smaller = (p > q) ? q : p;
-  return larger + log(1.0 + exp(smaller - larger));
+// members copied one by one so that the lattices are never duplicated;
+// the transitions are taken as trained, not rebuilt from fg_p and bg_p
+TwoVarHMM
+TwoVarHMM::parameter_copy() const {
+  TwoVarHMM h(MIN_PROB, tolerance, max_iterations, VERBOSE, DEBUG);
+  h.CHECKPOINT = CHECKPOINT;
+  h.ACCELERATE = ACCELERATE;
+  h.num_states = num_states;
+  h.fg_mode = fg_mode;
+  h.bg_mode = bg_mode;
+  h.fg_emission = fg_emission;
+  h.bg_emission = bg_emission;
+  h.emission = emission;
+  h.fg_p = fg_p;
+  h.bg_p = bg_p;
+  h.p_sf = p_sf;
+  h.p_sb = p_sb;
+  h.p_ft = p_ft;
+  h.p_bt = p_bt;
+  h.stay_trans = stay_trans;
+  h.next_trans = next_trans;
+  h.start_trans = start_trans;
+  h.end_trans = end_trans;
+  return h;
 }
 
 
 double
-TwoVarHMM::log_sum_log_vec(const vector<double> &vals, size_t limit) const {
-  const vector<double>::const_iterator x =
-    std::max_element(vals.begin(), vals.begin() + limit);
-  const double max_val = *x;
-  if (!isfinite(max_val)) {return vals[0];}
-  const size_t max_idx = x - vals.begin();
-  double sum = 1.0;
-  for (size_t i = 0; i < limit; ++i) {
-    if (i != max_idx) {
-      sum += exp(vals[i] - max_val);
-#ifdef DEBUG
-      assert(isfinite(sum));
-#endif
-    }
-  }
-  return max_val + log(sum);
+TwoVarHMM::forward_algorithm(const size_t start, const size_t end,
+                             const ClassEmissions &e,
+                             const RingTransitions &t) {
+  return ::forward_algorithm(e, t, start, end, forward);
 }
 
 
 double
-TwoVarHMM::forward_algorithm(const vector<pair<double, double> > &meth,
-				const size_t start, const size_t end,
-        const vector<double> &lp_s, const vector<double> &lp_t,
-        const vector< vector<double> > &lp_trans) {
-
-
-  for (size_t i = 0; i < num_states; ++i) {
-    forward[i][start] = emission[i](meth[start]) + lp_s[i];
-  }
-
-  for (size_t i = start + 1; i < end; ++i) {
-    const size_t k = i - 1;
-    // calculate forward score
-    for (size_t s2 = 0; s2 < num_states; ++s2) {
-      forward[s2][i] = forward[0][k] + lp_trans[0][s2] + emission[s2](meth[i]);
-      for (size_t s1 = 1; s1 < num_states; ++s1) {
-        forward[s2][i] = log_sum_log(forward[s2][i],
-                                     forward[s1][k] + lp_trans[s1][s2] + emission[s2](meth[i]));
-
-      }
-    }
-  }
-  double forward_score = forward[0][end - 1] + lp_t[0];
-  for (size_t s = 1; s < num_states; ++s) {
-    forward_score = log_sum_log(forward_score, forward[s][end-1] + lp_t[s]);
-  }
-  return forward_score;
-}
-
-
-double
-TwoVarHMM::backward_algorithm(const vector<pair<double, double> > &meth,
-				const size_t start, const size_t end,
-				const vector<double> &lp_s, const vector<double> &lp_t,
-				const vector< vector<double> > &lp_trans) {
-
-  for (size_t i = 0; i < num_states; ++i) {
-    backward[i][end - 1] = lp_t[i];
-  }
-
-  for (size_t k = end - 1; k > start; --k) {
-    size_t i = k - 1;
-    // calculate backward score
-    for (size_t s1 = 0; s1 < num_states; ++s1) {
-      backward[s1][i] = backward[0][k] + lp_trans[s1][0] + emission[0](meth[k]);
-      for (size_t s2 = 1; s2 < num_states; ++s2) {
-        backward[s1][i] = log_sum_log(backward[s1][i],
-                                      backward[s2][k] + lp_trans[s1][s2] +
-                                      emission[s2](meth[k]));
-      }
-
-    }
-  }
-  double backward_score = backward[0][start] + emission[0](meth[start])+lp_s[0];
-
-  for (size_t s = 1; s < num_states; ++s) {
-    backward_score = log_sum_log(backward_score, backward[s][start] +
-                                 emission[s](meth[start])+lp_s[s]);
-  }
-
-  return backward_score;
+TwoVarHMM::backward_algorithm(const size_t start, const size_t end,
+                              const ClassEmissions &e,
+                              const RingTransitions &t) {
+  return ::backward_algorithm(e, t, start, end, backward);
 }
 
 
 
 void
-TwoVarHMM::update_trans_estimator(const vector<pair<double, double> > &meth,
-                                const size_t start, const size_t end,
-                                const double total, vector<matrix> &te,
-                                const vector<vector<double> > &lp_trans) const {
+TwoVarHMM::update_trans_estimator(const size_t start, const size_t end,
+                                  const double total,
+                                  matrix &te_stay, matrix &te_next,
+                                  const vector<double> &lp_stay,
+                                  const vector<double> &lp_next) const {
 
   for (size_t i = start + 1; i < end; ++i) {
     const size_t k = i - 1;
     for(size_t x = 0; x < num_states; ++x) {
-      for (size_t y = 0; y < num_states; ++y) {
-        te[x][y][k] = forward[x][k] + lp_trans[x][y] + emission[y](meth[i])
-                      + backward[y][i] - total;
-      }
+      const size_t y = next_state(x);
+      te_stay[x][k] = forward[k][x] + lp_stay[x] + state_lemit(x)[i]
+                      + backward[i][x] - total;
+      te_next[x][k] = forward[k][x] + lp_next[x] + state_lemit(y)[i]
+                      + backward[i][y] - total;
     }
   }
 }
@@ -225,18 +176,18 @@ TwoVarHMM::update_trans_estimator(const vector<pair<double, double> > &meth,
 
 
 void
-TwoVarHMM::update_transitions(const vector<matrix> &te) {
-  size_t T = te[0][0].size();
+TwoVarHMM::update_transitions(const matrix &te_stay, const matrix &te_next) {
+  size_t T = te_stay[0].size();
 
   // Subtracting 1 from the limit of the summation because the final
   // term has no meaning since there is no transition to be counted
   // from the final observation (they all must go to terminal state)
 
-  double fg_in = log_sum_log_vec(te[0][0], T - 1);
-  double fg_out = log_sum_log_vec(te[0][1], T - 1);
+  double fg_in = log_sum_log_vec(te_stay[0], T - 1);
+  double fg_out = log_sum_log_vec(te_next[0], T - 1);
   for(size_t i = 1; i < fg_mode; ++i) {
-    fg_in = log_sum_log(fg_in, log_sum_log_vec(te[i][i], T - 1));
-    fg_out = log_sum_log(fg_out, log_sum_log_vec(te[i][i+1], T - 1));
+    fg_in = log_sum_log(fg_in, log_sum_log_vec(te_stay[i], T - 1));
+    fg_out = log_sum_log(fg_out, log_sum_log_vec(te_next[i], T - 1));
   }
 
   double p_fg_in = exp(fg_in);
@@ -246,11 +197,11 @@ TwoVarHMM::update_transitions(const vector<matrix> &te) {
          std::accumulate(end_trans.begin(), end_trans.begin()+fg_mode, 0) / 2;
 
 
-  double bg_in = log_sum_log_vec(te[num_states-1][num_states-1], T - 1);
-  double bg_out = log_sum_log_vec(te[num_states-1][0], T - 1);
-  for(size_t j = num_states-2; j >= fg_mode; ++j) {
-    bg_in = log_sum_log(bg_in, log_sum_log_vec(te[j][j], T - 1));
-    bg_out = log_sum_log(bg_out, log_sum_log_vec(te[j][j+1], T - 1));
+  double bg_in = log_sum_log_vec(te_stay[num_states-1], T - 1);
+  double bg_out = log_sum_log_vec(te_next[num_states-1], T - 1);
+  for(size_t j = num_states - 1; j-- > fg_mode; ) {
+    bg_in = log_sum_log(bg_in, log_sum_log_vec(te_stay[j], T - 1));
+    bg_out = log_sum_log(bg_out, log_sum_log_vec(te_next[j], T - 1));
   }
 
   double p_bg_in = exp(bg_in);
@@ -265,25 +216,34 @@ TwoVarHMM::update_transitions(const vector<matrix> &te) {
 }
 
 
+void
+TwoVarHMM::update_log_emissions(const vector<pair<double, double> > &meth) {
+  vector<EmissionRun> runs;
+  split_emission_runs(meth, runs);
+  fill_log_emissions(fg_emission, meth, runs, fg_lemit);
+  fill_log_emissions(bg_emission, meth, runs, bg_lemit);
+}
+
+
 void
 TwoVarHMM::estimate_emissions(const vector<double> &meth_lp,
                               const vector<double> &unmeth_lp) {
   vector<double> fg_probs(meth_lp.size());
   vector<double> bg_probs(meth_lp.size());
 
-  for (size_t i = 0; i < forward[0].size(); ++i) {
+  for (size_t i = 0; i < forward.size(); ++i) {
 
-    double fg = forward[0][i] + backward[0][i];
+    double fg = forward[i][0] + backward[i][0];
     double denom = fg;
     for(size_t k = 1; k < fg_mode; ++k) {
-      fg = log_sum_log(fg, forward[k][i] + backward[k][i]);
+      fg = log_sum_log(fg, forward[i][k] + backward[i][k]);
       denom = log_sum_log(denom, fg);
     }
 
-    double bg = forward[fg_mode][i] + backward[fg_mode][i];
+    double bg = forward[i][fg_mode] + backward[i][fg_mode];
     denom = log_sum_log(denom, bg);
     for(size_t k = fg_mode+1; k < num_states; ++k) {
-      bg = log_sum_log(bg, forward[k][i] + backward[k][i]);
+      bg = log_sum_log(bg, forward[i][k] + backward[i][k]);
       denom = log_sum_log(denom, bg);
     }
 
@@ -297,6 +257,87 @@ TwoVarHMM::estimate_emissions(const vector<double> &meth_lp,
 
 
 
+void
+TwoVarHMM::get_log_transitions(vector<double> &lp_s, vector<double> &lp_t,
+                               vector<double> &lp_stay,
+                               vector<double> &lp_next) const {
+  lp_s.resize(num_states);
+  lp_t.resize(num_states);
+  lp_stay.resize(num_states);
+  lp_next.resize(num_states);
+  for (size_t i = 0; i < num_states; ++i) {
+    lp_s[i] = log(start_trans[i]);
+    lp_t[i] = log(end_trans[i]);
+    lp_stay[i] = log(stay_trans[i]);
+    lp_next[i] = log(next_trans[i]);
+  }
+}
+
+
+// Segments in decreasing order of length, so the longest ones are
+// started first and the short tail evens out the load across threads
+void
+TwoVarHMM::segment_order(const vector<size_t> &reset_points,
+                         vector<size_t> &order) const {
+  order.resize(reset_points.size() - 1);
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(),
+                   [&reset_points](const size_t x, const size_t y) {
+                     return (reset_points[x + 1] - reset_points[x]) >
+                       (reset_points[y + 1] - reset_points[y]);
+                   });
+}
+
+
+// Runs forward/backward over every segment, in parallel when built
+// with OpenMP. Segments occupy disjoint ranges of the lattice and of
+// te, and the segment likelihoods are added in genome order, so the
+// result does not depend on the number of threads.
+double
+TwoVarHMM::forward_backward_segments(const vector<size_t> &reset_points,
+                                     const vector<double> &lp_s,
+                                     const vector<double> &lp_t,
+                                     const vector<double> &lp_stay,
+                                     const vector<double> &lp_next,
+                                     matrix *te_stay, matrix *te_next) {
+  vector<size_t> order;
+  segment_order(reset_points, order);
+
+  const ClassEmissions e(fg_lemit, bg_lemit, fg_mode, num_states);
+  const RingTransitions t(lp_s, lp_t, lp_stay, lp_next);
+
+  vector<double> segment_scores(order.size(), 0);
+#pragma omp parallel for schedule(dynamic)
+  for (size_t j = 0; j < order.size(); ++j) {
+    const size_t i = order[j];
+    const double forward_score =
+        forward_algorithm(reset_points[i], reset_points[i + 1], e, t);
+    const double backward_score =
+        backward_algorithm(reset_points[i], reset_points[i + 1], e, t);
+
+    if (DEBUG && (fabs(forward_score - backward_score) /
+                  max(forward_score, backward_score)) > 1e-10) {
+#pragma omp critical
+      cerr << "fabs(forward_score - backward_score)/"
+           << "max(forward_score, backward_score) > 1e-10" << endl;
+    }
+
+    if (te_stay)
+      update_trans_estimator(reset_points[i], reset_points[i + 1],
+                             forward_score, *te_stay, *te_next,
+                             lp_stay, lp_next);
+
+    segment_scores[i] = forward_score;
+  }
+
+  double total_score = 0;
+  for (size_t i = 0; i < segment_scores.size(); ++i)
+    total_score += segment_scores[i];
+  return total_score;
+}
+
+
 double
 TwoVarHMM::single_iteration(const vector<pair<double, double> > &meth,
                             const vector<size_t> &reset_points,
@@ -307,64 +348,91 @@ TwoVarHMM::single_iteration(const vector<pair<double, double> > &meth,
 
   // prepare forward/backward vectors
   size_t data_size = meth.size();
-  forward.resize(num_states);
-  backward.resize(num_states);
-  for (size_t i = 0; i < num_states; ++i) {
-    forward[i].resize(data_size);
-    backward[i].resize(data_size);
-  }
+  forward.resize(data_size, num_states);
+  backward.resize(data_size, num_states);
 
   // get log transition probability
-  vector<double> lp_start_trans = vector<double>(num_states, 0);
-  vector<double> lp_end_trans = vector<double>(num_states, 0);
-  vector< vector<double> > lp_trans =
-      vector< vector<double> >(num_states, vector<double>(num_states, 0));
-
-  for (size_t i = 0; i < lp_start_trans.size(); ++i) {
-    lp_start_trans[i] = log(start_trans[i]);
-  }
-  for (size_t i = 0; i < lp_end_trans.size(); ++i) {
-    lp_end_trans[i] = log(end_trans[i]);
-  }
-  for (size_t i = 0; i < lp_trans.size(); ++i) {
-    lp_trans.resize(trans[i].size());
-    for (size_t j = 0; j < trans[i].size(); ++j) {
-      lp_trans[i][j] = log(trans[i][j]);
-    }
-  }
+  vector<double> lp_start_trans, lp_end_trans, lp_stay, lp_next;
+  get_log_transitions(lp_start_trans, lp_end_trans, lp_stay, lp_next);
 
   // for estimating transitions
-  vector<matrix> te(num_states,
-                    matrix(num_states, vector<double> (meth.size(), 0)));
-
-  // forward/backward algorithm
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double forward_score =
-        forward_algorithm(meth, reset_points[i], reset_points[i + 1],
-                          lp_start_trans, lp_end_trans, lp_trans);
-    const double backward_score =
-        backward_algorithm(meth, reset_points[i], reset_points[i + 1],
-                           lp_start_trans, lp_end_trans, lp_trans);
+  matrix te_stay(num_states, vector<double>(meth.size(), 0));
+  matrix te_next(num_states, vector<double>(meth.size(), 0));
 
+  ProfileTimer e_step("em_e_step", meth.size());
+  update_log_emissions(meth);
 
-    if (DEBUG && (fabs(forward_score - backward_score) /
-                  max(forward_score, backward_score)) > 1e-10)
-      cerr << "fabs(forward_score - backward_score)/"
-           << "max(forward_score, backward_score) > 1e-10" << endl;
-
-    update_trans_estimator(meth, reset_points[i], reset_points[i + 1],
-                           forward_score, te, lp_trans);
-
-    total_score += forward_score;
-  }
+  // forward/backward algorithm
+  total_score = forward_backward_segments(reset_points, lp_start_trans,
+                                          lp_end_trans, lp_stay, lp_next,
+                                          &te_stay, &te_next);
+  e_step.stop();
 
-  update_transitions(te);
+  ProfileTimer m_step("em_m_step", meth.size());
+  update_transitions(te_stay, te_next);
 
   estimate_emissions(meth_lp, unmeth_lp);
 
   return total_score;
 }
 
+
+/* The EM map of single_iteration for squarem_training, extrapolated
+ * over the emissions and the ring transition probabilities; p_sf and
+ * p_sb follow from fg_p and bg_p as in update_transitions.
+ */
+struct TwoVarHMM::EMModel {
+  EMModel(TwoVarHMM &h, const vector<pair<double, double> > &m,
+          const vector<size_t> &r, const vector<double> &mlp,
+          const vector<double> &ulp) :
+    hmm(h), meth(m), reset_points(r), meth_lp(mlp), unmeth_lp(ulp) {}
+
+  double
+  pass(const size_t) {
+    const double score =
+      hmm.single_iteration(meth, reset_points, meth_lp, unmeth_lp);
+    hmm.update_emission_matrix();
+    hmm.update_transition_matrix();
+    return score;
+  }
+  bool
+  converged(const double score, const double prev_score) const {
+    return (score - prev_score) < hmm.tolerance;
+  }
+
+  void
+  get(vector<double> &theta) const {
+    theta.resize(6);
+    theta[0] = log(hmm.fg_emission.alpha);
+    theta[1] = log(hmm.fg_emission.beta);
+    theta[2] = log(hmm.bg_emission.alpha);
+    theta[3] = log(hmm.bg_emission.beta);
+    theta[4] = em_logit(hmm.fg_p);
+    theta[5] = em_logit(hmm.bg_p);
+  }
+  void
+  set(const vector<double> &theta) {
+    hmm.fg_emission = BetaBin(exp(theta[0]), exp(theta[1]),
+                              hmm.fg_emission.tolerance);
+    hmm.bg_emission = BetaBin(exp(theta[2]), exp(theta[3]),
+                              hmm.bg_emission.tolerance);
+    const double max_prob = 1.0 - hmm.MIN_PROB;
+    hmm.fg_p = min(max(em_expit(theta[4]), hmm.MIN_PROB), max_prob);
+    hmm.bg_p = min(max(em_expit(theta[5]), hmm.MIN_PROB), max_prob);
+    hmm.p_sf = (hmm.bg_p + 1 - hmm.fg_p)/2.0;
+    hmm.p_sb = (1 - hmm.bg_p + hmm.fg_p)/2.0;
+    hmm.update_emission_matrix();
+    hmm.update_transition_matrix();
+  }
+
+  TwoVarHMM &hmm;
+  const vector<pair<double, double> > &meth;
+  const vector<size_t> &reset_points;
+  const vector<double> &meth_lp;
+  const vector<double> &unmeth_lp;
+};
+
+
 double
 TwoVarHMM::BaumWelchTraining(const vector<pair<double, double> > &meth,
                              const vector<size_t> &reset_points) {
@@ -407,11 +475,19 @@ TwoVarHMM::BaumWelchTraining(const vector<pair<double, double> > &meth,
   << endl;
 
 
-  for(size_t i = 0; i < max_iterations; ++i) {
+  em_trace.clear();
+  if (ACCELERATE) {
+    EMModel model(*this, meth, reset_points, meth_lp, unmeth_lp);
+    prev_score = squarem_training(model, max_iterations, em_trace);
+  }
+
+  for(size_t i = 0; i < max_iterations && !ACCELERATE; ++i) {
 
+    const double start = em_seconds();
     double score = single_iteration(meth, reset_points, meth_lp, unmeth_lp);
     update_emission_matrix();
     update_transition_matrix();
+    em_trace.add(score, em_seconds() - start, 'E');
 
     if (VERBOSE) {
       cerr << setw(5) << i + 1
@@ -434,87 +510,166 @@ TwoVarHMM::BaumWelchTraining(const vector<pair<double, double> > &meth,
     prev_score = score;
   }
 
+  if (VERBOSE)
+    em_trace.report(cerr);
+
   return prev_score;
 }
 
 
-double
-TwoVarHMM::PosteriorDecoding(const vector<pair<double, double> > &meth,
-                             const vector<size_t> &reset_points,
-                             vector<int> &classes, vector<double> &llr_scores){
-
-
-  size_t data_size = meth.size();
-  forward.resize(num_states);
-  backward.resize(num_states);
-  for (size_t i = 0; i < num_states; ++i) {
-    forward[i].resize(data_size);
-    backward[i].resize(data_size);
+// posterior of site i from its forward and backward rows: the
+// foreground states are pooled against state fg_mode
+void
+TwoVarHMM::site_posterior(const double *f, const double *b, int &cls,
+                          double &llr, vector<double> *class_scores) const {
+  double fscore = f[0] + b[0];
+  for (size_t s = 1; s < fg_mode; ++s) {
+    fscore = log_sum_log(fscore, f[s] + b[s]);
+  }
+  double bscore = f[fg_mode] + b[fg_mode];
+  double total_state_score = log_sum_log(fscore, bscore);
+
+  if (fscore > bscore) {
+    cls = 0;
+    llr = exp(fscore - total_state_score);
+  } else {
+    cls = fg_mode;
+    llr = exp(bscore - total_state_score);
+  }
+
+  if (class_scores) {
+    for (size_t s = 0; s <= fg_mode; ++s) {
+      (*class_scores)[s] = exp(f[s] + b[s] - total_state_score);
+    }
   }
+}
 
-  // get log transition probability
-  vector<double> lp_start_trans = vector<double>(num_states, 0);
-  vector<double> lp_end_trans = vector<double>(num_states, 0);
-  vector< vector<double> > lp_trans =
-  vector< vector<double> >(num_states, vector<double>(num_states, 0));
 
-  for (size_t i = 0; i < lp_start_trans.size(); ++i) {
-    lp_start_trans[i] = log(start_trans[i]);
-  }
-  for (size_t i = 0; i < lp_end_trans.size(); ++i) {
-    lp_end_trans[i] = log(end_trans[i]);
-  }
-  for (size_t i = 0; i < lp_trans.size(); ++i) {
-    lp_trans.resize(trans[i].size());
-    for (size_t j = 0; j < trans[i].size(); ++j) {
-      lp_trans[i][j] = log(trans[i][j]);
+/* Posterior decoding of each segment with the forward rows kept only
+ * every block-th site, block = ceil(sqrt(segment length)). The
+ * backward pass runs over the blocks from the last, recomputing each
+ * block's forward rows from its checkpoint, and keeps one backward
+ * row. Values are computed as in forward_algorithm and
+ * backward_algorithm, so the results are identical. Buffers are per
+ * thread and sized by the longest segment it takes.
+ */
+double
+TwoVarHMM::checkpointed_posteriors(const vector<size_t> &reset_points,
+                                   const vector<double> &lp_s,
+                                   const vector<double> &lp_t,
+                                   const vector<double> &lp_stay,
+                                   const vector<double> &lp_next,
+                                   vector<int> &classes,
+                                   vector<double> &llr_scores,
+                                   vector<vector<double> > *class_scores) {
+  vector<size_t> order;
+  segment_order(reset_points, order);
+  vector<double> segment_scores(order.size(), 0);
+  const ClassEmissions e(fg_lemit, bg_lemit, fg_mode, num_states);
+  const RingTransitions t(lp_s, lp_t, lp_stay, lp_next);
+
+#pragma omp parallel
+  {
+  Lattice<double> checkpoints, rows;
+  vector<double> bk(num_states), next_bk(num_states), prev(num_states);
+  vector<double> curr(num_states);
+
+#pragma omp for schedule(dynamic)
+  for (size_t j = 0; j < order.size(); ++j) {
+    const size_t seg = order[j];
+    const size_t start = reset_points[seg];
+    const size_t end = reset_points[seg + 1];
+    const size_t len = end - start;
+    const size_t block = std::max(static_cast<size_t>(1),
+                   static_cast<size_t>(ceil(sqrt(static_cast<double>(len)))));
+    const size_t n_blocks = (len + block - 1)/block;
+    checkpoints.resize(n_blocks, num_states);
+    rows.resize(block, num_states);
+
+    // forward
+    for (size_t s = 0; s < num_states; ++s)
+      curr[s] = e(start, s) + t.start(s);
+    std::copy(curr.begin(), curr.end(), checkpoints[0]);
+    for (size_t i = start + 1; i < end; ++i) {
+      prev.swap(curr);
+      t.forward(e, i, &prev[0], &curr[0]);
+      if ((i - start) % block == 0)
+        std::copy(curr.begin(), curr.end(), checkpoints[(i - start)/block]);
     }
+    const double forward_score = end_score(t, &curr[0]);
+
+    // backward, recomputing one block of forward rows at a time
+    for (size_t s = 0; s < num_states; ++s)
+      bk[s] = lp_t[s];
+    for (size_t b = n_blocks; b-- > 0; ) {
+      const size_t lo = start + b*block;
+      const size_t hi = std::min(end, lo + block);
+      std::copy(checkpoints[b], checkpoints[b] + num_states, rows[0]);
+      for (size_t i = lo + 1; i < hi; ++i)
+        t.forward(e, i, rows[i - 1 - lo], rows[i - lo]);
+
+      for (size_t k = hi; k-- > lo; ) {
+        site_posterior(rows[k - lo], &bk[0], classes[k], llr_scores[k],
+                       class_scores ? &(*class_scores)[k] : 0);
+        if (k > start) {
+          t.backward(e, k, &bk[0], &next_bk[0]);
+          bk.swap(next_bk);
+        }
+      }
+    }
+    const double backward_score = start_score(e, t, start, &bk[0]);
+
+    if (DEBUG && (fabs(forward_score - backward_score) /
+                  max(forward_score, backward_score)) > 1e-10) {
+#pragma omp critical
+      cerr << "fabs(forward_score - backward_score)/"
+           << "max(forward_score, backward_score) > 1e-10" << endl;
+    }
+    segment_scores[seg] = forward_score;
+  }
   }
 
   double total_score = 0;
+  for (size_t i = 0; i < segment_scores.size(); ++i)
+    total_score += segment_scores[i];
+  return total_score;
+}
 
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-
-    const double forward_score =
-    forward_algorithm(meth, reset_points[i], reset_points[i + 1],
-                      lp_start_trans, lp_end_trans, lp_trans);
-    const double backward_score =
-    backward_algorithm(meth, reset_points[i], reset_points[i + 1],
-                       lp_start_trans, lp_end_trans, lp_trans);
 
-    if (DEBUG && (fabs(forward_score - backward_score) /
-                  max(forward_score, backward_score)) > 1e-10)
-      cerr << "fabs(forward_score - backward_score)/"
-      << "max(forward_score, backward_score) > 1e-10" << endl;
+double
+TwoVarHMM::PosteriorDecoding(const vector<pair<double, double> > &meth,
+                             const vector<size_t> &reset_points,
+                             vector<int> &classes, vector<double> &llr_scores){
 
-    total_score += forward_score;
-  }
 
-  classes.resize(data_size);
+  size_t data_size = meth.size();
 
-  llr_scores.resize(data_size);
+  // get log transition probability
+  vector<double> lp_start_trans, lp_end_trans, lp_stay, lp_next;
+  get_log_transitions(lp_start_trans, lp_end_trans, lp_stay, lp_next);
 
+  update_log_emissions(meth);
 
-  for (size_t i = 0; i < data_size; ++i) {
+  classes.resize(data_size);
 
-    double fscore = forward[0][i] + backward[0][i];
-    for (int s = 1; s < fg_mode; ++s) {
-      fscore = log_sum_log(fscore,
-                           forward[s][i] + backward[s][i]);
-    }
-    double bscore = forward[fg_mode][i] + backward[fg_mode][i];
-    double total_state_score = log_sum_log(fscore, bscore);
+  llr_scores.resize(data_size);
 
+  if (CHECKPOINT) {
+    forward.release();
+    backward.release();
+    return checkpointed_posteriors(reset_points, lp_start_trans,
+                                   lp_end_trans, lp_stay, lp_next,
+                                   classes, llr_scores, 0);
+  }
 
-    if (fscore > bscore) {
-      classes[i] = 0;
-      llr_scores[i] = exp(fscore - total_state_score);
-    } else {
-      classes[i] = fg_mode;
-      llr_scores[i] = exp(bscore - total_state_score);
-    }
+  forward.resize(data_size, num_states);
+  backward.resize(data_size, num_states);
+  const double total_score =
+    forward_backward_segments(reset_points, lp_start_trans, lp_end_trans,
+                              lp_stay, lp_next, 0, 0);
 
-  }
+  for (size_t i = 0; i < data_size; ++i)
+    site_posterior(forward[i], backward[i], classes[i], llr_scores[i], 0);
 
   return total_score;
 }
@@ -528,86 +683,71 @@ TwoVarHMM::PosteriorDecoding(const vector<pair<double, double> > &meth,
                              vector<vector<double> > &class_scores) {
 
   size_t data_size = meth.size();
-  forward.resize(num_states);
-  backward.resize(num_states);
-  for (size_t i = 0; i < num_states; ++i) {
-    forward[i].resize(data_size);
-    backward[i].resize(data_size);
-  }
 
   // get log transition probability
-  vector<double> lp_start_trans = vector<double>(num_states, 0);
-  vector<double> lp_end_trans = vector<double>(num_states, 0);
-  vector< vector<double> > lp_trans =
-  vector< vector<double> >(num_states, vector<double>(num_states, 0));
+  vector<double> lp_start_trans, lp_end_trans, lp_stay, lp_next;
+  get_log_transitions(lp_start_trans, lp_end_trans, lp_stay, lp_next);
 
-  for (size_t i = 0; i < lp_start_trans.size(); ++i) {
-    lp_start_trans[i] = log(start_trans[i]);
-  }
-  for (size_t i = 0; i < lp_end_trans.size(); ++i) {
-    lp_end_trans[i] = log(end_trans[i]);
-  }
-  for (size_t i = 0; i < lp_trans.size(); ++i) {
-    lp_trans.resize(trans[i].size());
-    for (size_t j = 0; j < trans[i].size(); ++j) {
-      lp_trans[i][j] = log(trans[i][j]);
-    }
-  }
-
-  double total_score = 0;
-
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-
-    const double forward_score =
-    forward_algorithm(meth, reset_points[i], reset_points[i + 1],
-                      lp_start_trans, lp_end_trans, lp_trans);
-    const double backward_score =
-    backward_algorithm(meth, reset_points[i], reset_points[i + 1],
-                       lp_start_trans, lp_end_trans, lp_trans);
-
-    if (DEBUG && (fabs(forward_score - backward_score) /
-                  max(forward_score, backward_score)) > 1e-10)
-      cerr << "fabs(forward_score - backward_score)/"
-      << "max(forward_score, backward_score) > 1e-10" << endl;
-
-    total_score += forward_score;
-  }
+  update_log_emissions(meth);
 
   classes.resize(data_size);
 
   llr_scores.resize(data_size);
 
+  if (CHECKPOINT) {
+    forward.release();
+    backward.release();
+    return checkpointed_posteriors(reset_points, lp_start_trans,
+                                   lp_end_trans, lp_stay, lp_next,
+                                   classes, llr_scores, &class_scores);
+  }
 
-  for (size_t i = 0; i < data_size; ++i) {
+  forward.resize(data_size, num_states);
+  backward.resize(data_size, num_states);
+  const double total_score =
+    forward_backward_segments(reset_points, lp_start_trans, lp_end_trans,
+                              lp_stay, lp_next, 0, 0);
 
-    double fscore = forward[0][i] + backward[0][i];
-    for (int s = 1; s < fg_mode; ++s) {
-      fscore = log_sum_log(fscore,
-                           forward[s][i] + backward[s][i]);
-    }
-    double bscore = forward[fg_mode][i] + backward[fg_mode][i];
-    double total_state_score = log_sum_log(fscore, bscore);
+  for (size_t i = 0; i < data_size; ++i)
+    site_posterior(forward[i], backward[i], classes[i], llr_scores[i],
+                   &class_scores[i]);
 
+  return total_score;
+}
 
-    if (fscore > bscore) {
-      classes[i] = 0;
-      llr_scores[i] = exp(fscore - total_state_score);
-    } else {
-      classes[i] = fg_mode;
-      llr_scores[i] = exp(bscore - total_state_score);
-    }
 
-    for (int s = 0; s <= fg_mode; ++s) {
-      class_scores[i][s] = exp(forward[s][i] + backward[s][i]
-                               - total_state_score);
+// Viterbi column of site i from that of site i - 1, with the state
+// each one was entered from
+void
+TwoVarHMM::viterbi_step(const vector<double> &fg_le,
+                        const vector<double> &bg_le,
+                        const vector<double> &lp_stay,
+                        const vector<double> &lp_next, const size_t i,
+                        const double *prev, double *curr,
+                        size_t *trace) const {
+  for (size_t s2 = 0; s2 < num_states; ++s2) {
+    const size_t s1 = prev_state(s2);
+    const double emit = (s2 < fg_mode ? fg_le : bg_le)[i];
+    const double stay_score = prev[s2] + lp_stay[s2] + emit;
+    const double next_score = prev[s1] + lp_next[s1] + emit;
+    // ties go to the higher-numbered state
+    if (s1 > s2 ? next_score >= stay_score : next_score > stay_score) {
+      curr[s2] = next_score;
+      trace[s2] = s1;
+    }
+    else {
+      curr[s2] = stay_score;
+      trace[s2] = s2;
     }
-
   }
-
-  return total_score;
 }
 
 
+/* With CHECKPOINT, the Viterbi column of every block-th site is kept
+ * and the traceback recomputes one block of columns and back pointers
+ * at a time from the checkpoint before it; blocks share their first
+ * site so each back pointer is rebuilt once.
+ */
 double
 TwoVarHMM::ViterbiDecoding(const vector<pair<double, double> > &meth,
                            const vector<size_t> &reset_points,
@@ -616,72 +756,99 @@ TwoVarHMM::ViterbiDecoding(const vector<pair<double, double> > &meth,
   cerr << "[ENTER VITERBI DECODING]" << endl;
 
   // get log transition probability
-  vector<double> lp_start_trans = vector<double>(num_states, 0);
-  vector<double> lp_end_trans = vector<double>(num_states, 0);
-  vector< vector<double> > lp_trans =
-  vector< vector<double> >(num_states, vector<double>(num_states, 0));
-
-  for (size_t i = 0; i < lp_start_trans.size(); ++i) {
-    lp_start_trans[i] = log(start_trans[i]);
-  }
-  for (size_t i = 0; i < lp_end_trans.size(); ++i) {
-    lp_end_trans[i] = log(end_trans[i]);
-  }
-  for (size_t i = 0; i < lp_trans.size(); ++i) {
-    lp_trans.resize(trans[i].size());
-    for (size_t j = 0; j < trans[i].size(); ++j) {
-      lp_trans[i][j] = log(trans[i][j]);
-    }
-  }
+  vector<double> lp_start_trans, lp_end_trans, lp_stay, lp_next;
+  get_log_transitions(lp_start_trans, lp_end_trans, lp_stay, lp_next);
 
   classes.resize(meth.size());
-  double total_score = 0;
 
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
+  vector<EmissionRun> runs;
+  split_emission_runs(meth, runs);
+  vector<double> fg_le, bg_le;
+  fill_log_emissions(fg_emission, meth, runs, fg_le);
+  fill_log_emissions(bg_emission, meth, runs, bg_le);
+
+  vector<size_t> order;
+  segment_order(reset_points, order);
+  vector<double> segment_scores(order.size(), 0);
+
+#pragma omp parallel
+  {
+  // one set of buffers per thread, grown to its longest segment
+  Lattice<double> v;
+  Lattice<size_t> trace;
+  Lattice<double> checkpoints;
+
+#pragma omp for schedule(dynamic)
+  for (size_t k = 0; k < order.size(); ++k) {
 
+    const size_t i = order[k];
     const size_t start = reset_points[i];
     const size_t lim = reset_points[i + 1] - start;
 
-    matrix v(lim, vector<double> (num_states, 0));
-    vector<vector<size_t> > trace(lim, vector<size_t>(num_states, 0));
+    // every column with CHECKPOINT is stored at (j - lo) of a block
+    const size_t block = !CHECKPOINT ? lim : std::max(static_cast<size_t>(1),
+                   static_cast<size_t>(ceil(sqrt(static_cast<double>(lim)))));
+    const size_t n_blocks = (lim + block - 1)/block;
+    v.resize(CHECKPOINT ? block + 1 : lim, num_states);
+    trace.resize(CHECKPOINT ? block + 1 : lim, num_states);
+    if (CHECKPOINT)
+      checkpoints.resize(n_blocks, num_states);
 
     for (size_t s = 0; s < num_states; ++s) {
-      v[0][s] = emission[s](meth[start]) + lp_start_trans[s];
+      v[0][s] = (s < fg_mode ? fg_le : bg_le)[start] + lp_start_trans[s];
     }
 
-
-    for (size_t j = 1; j < lim; ++j) {
-
-      for (size_t s2 = 0; s2 < num_states; ++s2) {
-        trace[j][s2] = 0;
-        v[j][s2] = v[j-1][0] + lp_trans[0][s2] + emission[s2](meth[start+j]);
-
-        for (size_t s1 = 1; s1 < num_states; ++s1) {
-          double new_score = v[j - 1][s1] + lp_trans[s1][s2] +
-                             emission[s2](meth[start + j]);
-          if (new_score >=  v[j][s2]) {
-            v[j][s2] = new_score;
-            trace[j][s2] = s1;
-          }
-        }
+    size_t last = 0; // the row of v holding the last column
+    if (!CHECKPOINT) {
+      for (size_t j = 1; j < lim; ++j)
+        viterbi_step(fg_le, bg_le, lp_stay, lp_next, start + j,
+                     v[j - 1], v[j], trace[j]);
+      last = lim - 1;
+    }
+    else {
+      std::copy(v[0], v[0] + num_states, checkpoints[0]);
+      for (size_t j = 1; j < lim; ++j) {
+        viterbi_step(fg_le, bg_le, lp_stay, lp_next, start + j,
+                     v[(j - 1) % 2], v[j % 2], trace[0]);
+        if (j % block == 0)
+          std::copy(v[j % 2], v[j % 2] + num_states, checkpoints[j/block]);
       }
+      last = (lim - 1) % 2;
     }
 
     for (size_t s = 0; s < num_states; ++s) {
-      v[lim - 1][s] += lp_end_trans[s];
+      v[last][s] += lp_end_trans[s];
     }
 
     // do the traceback
-    vector<double>::iterator max_iter;
-    max_iter = std::max_element(v[lim - 1].begin(), v[lim - 1].end());
-    classes[start + lim - 1] = std::distance(v[lim - 1].begin(), max_iter);
-    for (size_t j = lim - 1; j > 0; --j) {
-      classes[start + j - 1] = trace[j][classes[start + j]];
+    const double *max_iter =
+      std::max_element(v[last], v[last] + num_states);
+    classes[start + lim - 1] = max_iter - v[last];
+    segment_scores[i] = *max_iter;
+
+    if (!CHECKPOINT) {
+      for (size_t j = lim - 1; j > 0; --j) {
+        classes[start + j - 1] = trace[j][classes[start + j]];
+      }
+      continue;
     }
-
-    total_score += *max_iter;
+    for (size_t b = n_blocks; b-- > 0; ) {
+      const size_t lo = b*block;
+      const size_t hi = std::min(lo + block, lim - 1);
+      std::copy(checkpoints[b], checkpoints[b] + num_states, v[0]);
+      for (size_t j = lo + 1; j <= hi; ++j)
+        viterbi_step(fg_le, bg_le, lp_stay, lp_next, start + j,
+                     v[j - 1 - lo], v[j - lo], trace[j - lo]);
+      for (size_t j = hi; j > lo; --j)
+        classes[start + j - 1] = trace[j - lo][classes[start + j]];
+    }
+  }
   }
 
+  double total_score = 0;
+  for (size_t i = 0; i < segment_scores.size(); ++i)
+    total_score += segment_scores[i];
+
   cerr << "path likelihood: " << total_score << endl;
   return total_score;
 }
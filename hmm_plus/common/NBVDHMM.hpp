@@ -24,6 +24,9 @@
 
 #include "smithlab_utils.hpp"
 #include "distribution.hpp"
+#include "Lattice.hpp"
+#include "HMMCore.hpp"
+#include "EMAccel.hpp"
 #include <memory>
 
 using std::vector;
@@ -38,7 +41,7 @@ public:
   TwoVarHMM(const double mp, const double tol, const size_t max_itr,
             const bool v, bool d = false) :
     MIN_PROB(mp), tolerance(tol), max_iterations(max_itr),
-    VERBOSE(v), DEBUG(d) {}
+    VERBOSE(v), DEBUG(d), CHECKPOINT(false), ACCELERATE(false) {}
   
   
   void
@@ -47,6 +50,11 @@ public:
                  const double _fg_p, const double _bg_p,
                  const double _p_sf, const double _p_sb,
                  const double _p_ft, const double _p_bt);
+
+  // the parameters and settings without the lattices and buffers of
+  // the last training or decoding, for workers that decode other data
+  TwoVarHMM
+  parameter_copy() const;
   
   void
   update_emission_matrix();
@@ -75,6 +83,23 @@ public:
   ViterbiDecoding(const vector<pair<double, double> > &meth,
                   const vector<size_t> &reset_points,
                   vector<int> &classes) const;
+
+  // decode with checkpointed lattices: O(num_states*sqrt(n)) lattice
+  // memory per segment for about twice the work, and the same results
+  void
+  set_checkpointing(const bool c) {CHECKPOINT = c;}
+
+  // train with SQUAREM steps between EM passes (see EMAccel.hpp)
+  void
+  set_acceleration(const bool a) {ACCELERATE = a;}
+
+  // passes of later BaumWelchTraining calls
+  void
+  set_max_iterations(const size_t m) {max_iterations = m;}
+
+  // likelihood and time of each pass of the last training
+  const EMTrace &
+  get_trace() const {return em_trace;}
     
   BetaBin
   get_fg_emission() const {return fg_emission;}
@@ -84,6 +109,9 @@ public:
   
   size_t
   get_fg_mode() const {return fg_mode;}
+
+  size_t
+  get_bg_mode() const {return bg_mode;}
   
   double
   get_fg_p() const {return fg_p;}
@@ -104,6 +132,8 @@ public:
   get_p_bt() const {return p_bt;}
   
 private:
+
+  struct EMModel;
   
   double
   single_iteration(const vector<pair<double, double> > &meth,
@@ -116,42 +146,80 @@ private:
                      const vector<double> &meth_lp,
                      const vector<double> &unmeth_lp);
 
+  void
+  get_log_transitions(vector<double> &lp_s, vector<double> &lp_t,
+                      vector<double> &lp_stay, vector<double> &lp_next) const;
+
+  size_t
+  prev_state(const size_t s) const {return s == 0 ? num_states - 1 : s - 1;}
+
+  size_t
+  next_state(const size_t s) const {return s + 1 == num_states ? 0 : s + 1;}
+
+  void
+  segment_order(const vector<size_t> &reset_points,
+                vector<size_t> &order) const;
+
   double
-  forward_algorithm(const vector<pair<double, double> > &meth,
-                    const size_t start, const size_t end,
-                    const vector<double> &lp_s, const vector<double> &lp_t,
-                    const vector< vector<double> > &lp_trans);
-  double 
-  backward_algorithm(const vector<pair<double, double> > &meth,
-                     const size_t start, const size_t end,
-                     const vector<double> &lp_s, const vector<double> &lp_t,
-                     const vector< vector<double> > &lp_trans);
+  forward_backward_segments(const vector<size_t> &reset_points,
+                            const vector<double> &lp_s,
+                            const vector<double> &lp_t,
+                            const vector<double> &lp_stay,
+                            const vector<double> &lp_next,
+                            matrix *te_stay, matrix *te_next);
+
+  double
+  forward_algorithm(const size_t start, const size_t end,
+                    const ClassEmissions &e, const RingTransitions &t);
+  double
+  backward_algorithm(const size_t start, const size_t end,
+                     const ClassEmissions &e, const RingTransitions &t);
+  
+  void
+  site_posterior(const double *f, const double *b, int &cls, double &llr,
+                 vector<double> *class_scores) const;
+
+  double
+  checkpointed_posteriors(const vector<size_t> &reset_points,
+                          const vector<double> &lp_s,
+                          const vector<double> &lp_t,
+                          const vector<double> &lp_stay,
+                          const vector<double> &lp_next,
+                          vector<int> &classes, vector<double> &llr_scores,
+                          vector<vector<double> > *class_scores);
+
+  void
+  viterbi_step(const vector<double> &fg_le, const vector<double> &bg_le,
+               const vector<double> &lp_stay, const vector<double> &lp_next,
+               const size_t i, const double *prev, double *curr,
+               size_t *trace) const;
+
+  void
+  update_trans_estimator(const size_t start, const size_t end,
+                         const double total,
+                         matrix &te_stay, matrix &te_next,
+                         const vector<double> &lp_stay,
+                         const vector<double> &lp_next) const;
   
   void
-  update_trans_estimator(const vector<pair<double, double> > &meth,
-                         const size_t start, const size_t end,
-                         const double total, vector<matrix> &et,
-                         const vector<vector<double> > &lp_trans) const;
+  update_transitions(const matrix &te_stay, const matrix &te_next);
   
   void
-  update_transitions(const vector<matrix> &te);
+  update_log_emissions(const vector<pair<double, double> > &meth);
+  
+  const vector<double> &
+  state_lemit(const size_t s) const {return s < fg_mode ? fg_lemit : bg_lemit;}
   
   void
   estimate_emissions(const vector<double> &meth_lp,
                      const vector<double> &unmeth_lp);
   
   
-  double
-  log_sum_log(const double p, const double q) const;
-  
-  double
-  log_sum_log_vec(const std::vector<double> &vals, size_t limit) const;
-  
 
-  //  HMM internal data
+  //  HMM internal data, indexed [position][state]
   
-  vector< vector<double> > forward;
-  vector< vector<double> > backward;
+  Lattice<double> forward;
+  Lattice<double> backward;
   
   ////////  model structure  ////////
   size_t num_states;
@@ -160,12 +228,14 @@ private:
   
   BetaBin fg_emission, bg_emission;
   vector<BetaBin> emission;
+  vector<double> fg_lemit, bg_lemit; // log emissions for current parameters
   
   double fg_p, bg_p; // failure probability (transition probability)
   double p_sf, p_sb;
   double p_ft, p_bt;
   
-  matrix trans;
+  // self and next-state transition probabilities around the ring
+  vector<double> stay_trans, next_trans;
   vector<double> start_trans, end_trans;
   
   //  parameters
@@ -174,8 +244,10 @@ private:
   size_t max_iterations;
   bool VERBOSE;
   bool DEBUG;
-  
-  mutable size_t emission_correction_count;
+  bool CHECKPOINT;
+  bool ACCELERATE;
+
+  EMTrace em_trace;
 };
 
 
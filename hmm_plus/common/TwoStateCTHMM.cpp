@@ -18,6 +18,7 @@
 */
 
 #include "TwoStateCTHMM.hpp"
+#include "Instrument.hpp"
 
 #include <algorithm>
 #include <iomanip>
@@ -79,137 +80,65 @@ TwoVarHMM::set_parameters(const BetaBin _fg_emission,
 }
 
 
-inline double
-TwoVarHMM::log_sum_log(const double p, const double q) const {
-  if (p == 0) {return q;}
-  else if (q == 0) {return p;}
-  if (!isfinite(p) && !isfinite(q)) {return p;}
-  const double larger = (p > q) ? p : q;
-  const double smaller = (p > q) ? q : p;
-  return larger + log(1.0 + exp(smaller - larger));
+// members copied one by one so that the lattices are never duplicated
+TwoVarHMM
+TwoVarHMM::parameter_copy() const {
+  TwoVarHMM h(tolerance, MIN_PROB, max_iterations, VERBOSE, NO_RATE_EST,
+              method, DEBUG);
+  h.CHECKPOINT = CHECKPOINT;
+  h.ACCELERATE = ACCELERATE;
+  h.set_parameters(fg_emission, bg_emission, fg_rate, bg_rate,
+                   p_sf, p_sb, p_ft, p_bt);
+  return h;
 }
 
 
 double
-TwoVarHMM::log_sum_log_vec(const vector<double> &vals, size_t limit) const {
-  const vector<double>::const_iterator x = 
-    std::max_element(vals.begin(), vals.begin() + limit);
-  const double max_val = *x;
-  if (!isfinite(max_val)) {return vals[0];}
-  const size_t max_idx = x - vals.begin();
-  double sum = 1.0;
-  for (size_t i = 0; i < limit; ++i) {
-    if (i != max_idx) {
-      sum += exp(vals[i] - max_val);
-#ifdef DEBUG
-      assert(isfinite(sum));
-#endif
-    }
-  }
-  return max_val + log(sum);
-}
-
-
-double
-TwoVarHMM::forward_algorithm(const vector<pair<double, double> > &meth,
-                             const vector<size_t> &time,
+TwoVarHMM::forward_algorithm(const vector<size_t> &time,
                              const double lp_sf, const double lp_sb,
                              const double lp_ft, const double lp_bt,
-                             matrix &ltp) {
-  
-  const size_t end = forward[0].size();
-  
-  forward[0][0] = bg_emission(meth[0]) + lp_sb; // background
-  forward[1][0] = fg_emission(meth[0]) + lp_sf; // foreground
-  
-  for (size_t i = 1; i < end; ++i) {
-
-    const size_t k = i - 1;
-    
-    const double ff = a + (1 - a) * exp(-(b * time[k]));
-    const double bb = 1 - a + a * exp(-(b * time[k]));
-    
-    const double lp_ff = log(ff);
-    const double lp_fb = log(1 - ff);
-    const double lp_bf = log(1 - bb);
-    const double lp_bb = log(bb);
-    ltp[0][k] = lp_bb;
-    ltp[1][k] = lp_bf;
-    ltp[2][k] = lp_fb;
-    ltp[3][k] = lp_ff;
-    
-    // background
-    forward[0][i] = (bg_emission(meth[i]) +
-                     log_sum_log(forward[0][k] + lp_bb, forward[1][k] + lp_fb));
-    // foreground
-    forward[1][i] = (fg_emission(meth[i]) +
-                     log_sum_log(forward[0][k] + lp_bf, forward[1][k] + lp_ff));
-
-  }
-  
-  return log_sum_log(forward[0][end - 1] + lp_bt, forward[1][end - 1] + lp_ft);
-  
+                             Lattice<double> &ltp) {
+  ExpTransitions(a, b, time, lp_sb, lp_sf, lp_bt, lp_ft).fill(ltp);
+  return ::forward_algorithm(TwoStateEmissions(bg_lemit, fg_lemit),
+                             TabledTransitions(ltp, lp_sb, lp_sf, lp_bt, lp_ft),
+                             0, forward.size(), forward);
 }
 
 
 
 double
-TwoVarHMM::backward_algorithm(const vector<pair<double, double> > &meth,
-                              const vector<size_t> &time,
-                              const double lp_sf, const double lp_sb,
+TwoVarHMM::backward_algorithm(const double lp_sf, const double lp_sb,
                               const double lp_ft, const double lp_bt,
-                              const matrix &ltp) {
-  
-  const size_t end = backward[0].size();
-  
-  backward[0][end - 1] = lp_bt; // background
-  backward[1][end - 1] = lp_ft; // foreground
-  
-  
-  for (size_t k = end - 1; k > 0; --k) {
-    const size_t i = k - 1;
-    
-    const double lp_bb = ltp[0][i];
-    const double lp_bf = ltp[1][i];
-    const double lp_fb = ltp[2][i];
-    const double lp_ff = ltp[3][i];
-    
-    const double bg_emi = bg_emission(meth[k]) + backward[0][k];
-    const double fg_emi = fg_emission(meth[k]) + backward[1][k];
-    
-    // background
-    backward[0][i] = log_sum_log(bg_emi + lp_bb, fg_emi + lp_bf);
-    // foreground
-    backward[1][i] = log_sum_log(bg_emi + lp_fb, fg_emi + lp_ff);
-  }
-  
-  return log_sum_log(backward[0][0] + bg_emission(meth[0]) + lp_sb,
-                     backward[1][0] + fg_emission(meth[0]) + lp_sf);
+                              const Lattice<double> &ltp) {
+  return ::backward_algorithm(TwoStateEmissions(bg_lemit, fg_lemit),
+                              TabledTransitions(ltp, lp_sb, lp_sf,
+                                                lp_bt, lp_ft),
+                              0, backward.size(), backward);
 }
 
 
 void
-TwoVarHMM::update_trans_estimator(const vector<pair<double, double> > &meth,
-                                  const double total, matrix &te,
-                                  matrix &r, const matrix &ltp) const {
+TwoVarHMM::update_trans_estimator(const double total, matrix &te,
+                                  matrix &r,
+                                  const Lattice<double> &ltp) const {
   
   for (size_t i = 0; i < te[0].size() - 1; ++i) {
     const size_t j = i + 1;
-    te[0][i] = forward[0][i] + ltp[0][i] + bg_emission(meth[j])
-               + backward[0][j] - total;
+    te[0][i] = forward[i][0] + ltp[i][0] + bg_lemit[j]
+               + backward[j][0] - total;
     double denom = te[0][i];
     
-    te[1][i] = forward[0][i] + ltp[1][i] + fg_emission(meth[j])
-               + backward[1][j] - total;
+    te[1][i] = forward[i][0] + ltp[i][1] + fg_lemit[j]
+               + backward[j][1] - total;
     denom = log_sum_log(denom, te[1][i]);
     
-    te[2][i] = forward[1][i] + ltp[2][i] + bg_emission(meth[j])
-               + backward[0][j] - total;
+    te[2][i] = forward[i][1] + ltp[i][2] + bg_lemit[j]
+               + backward[j][0] - total;
     denom = log_sum_log(denom, te[2][i]);
 
     
-    te[3][i] = forward[1][i] + ltp[3][i] + fg_emission(meth[j])
-               + backward[1][j] - total;
+    te[3][i] = forward[i][1] + ltp[i][3] + fg_lemit[j]
+               + backward[j][1] - total;
     denom = log_sum_log(denom, te[3][i]);
 
     r[0][i] = exp(te[0][i] - denom);
@@ -247,6 +176,15 @@ TwoVarHMM::update_endprob(matrix &te) {
 }
 
 
+void
+TwoVarHMM::update_log_emissions(const vector<pair<double, double> > &meth) {
+  vector<EmissionRun> runs;
+  split_emission_runs(meth, runs);
+  fill_log_emissions(fg_emission, meth, runs, fg_lemit);
+  fill_log_emissions(bg_emission, meth, runs, bg_lemit);
+}
+
+
 void
 TwoVarHMM::update_imputed_methylv(vector<pair<double, double> > &meth,
                                   const vector<double> &fg_probs,
@@ -269,9 +207,9 @@ TwoVarHMM::estimate_emissions(vector<pair<double, double> > &meth,
   vector<double> fg_probs(meth_lp.size(), 0);
   vector<double> bg_probs(unmeth_lp.size(), 0);
   
-  for (size_t i = 0; i < forward[0].size(); ++i) {
-    const double bg = (forward[0][i] + backward[0][i]);
-    const double fg = (forward[1][i] + backward[1][i]);
+  for (size_t i = 0; i < forward.size(); ++i) {
+    const double bg = (forward[i][0] + backward[i][0]);
+    const double fg = (forward[i][1] + backward[i][1]);
     const double denom = log_sum_log(fg, bg);
     bg_probs[i] = exp(bg - denom);
     fg_probs[i] = exp(fg - denom);
@@ -296,12 +234,15 @@ TwoVarHMM::single_iteration(vector<pair<double, double> > &meth,
   const double lp_ft = log(p_ft);
   const double lp_bt = log(p_bt);
   
+  ProfileTimer e_step("em_e_step", meth.size());
+  update_log_emissions(meth);
+  
   // forward/backward algorithm
   const double forward_score =
-      forward_algorithm(meth, time, lp_sf, lp_sb, lp_ft, lp_bt, ltp);
+      forward_algorithm(time, lp_sf, lp_sb, lp_ft, lp_bt, ltp);
   
   const double backward_score =
-      backward_algorithm(meth, time, lp_sf, lp_sb, lp_ft, lp_bt, ltp);
+      backward_algorithm(lp_sf, lp_sb, lp_ft, lp_bt, ltp);
   
     
   if (DEBUG && (fabs(forward_score - backward_score) /
@@ -311,15 +252,18 @@ TwoVarHMM::single_iteration(vector<pair<double, double> > &meth,
   
   double
   total_score = forward_score;
+  e_step.stop();
   
+  ProfileTimer m_step("em_m_step", meth.size());
   // update emission
   estimate_emissions(meth, meth_lp, unmeth_lp);
+  update_log_emissions(meth);
   
   
   // update transition parameters
   matrix te(4, vector<double> (meth.size(), 0));
   matrix r(4, vector<double> (meth.size(), 0));
-  update_trans_estimator(meth, forward_score, te, r, ltp);
+  update_trans_estimator(forward_score, te, r, ltp);
   
   if (!NO_RATE_EST) {
     bool BB = (method == 1) ? true : false;
@@ -347,6 +291,60 @@ TwoVarHMM::single_iteration(vector<pair<double, double> > &meth,
 
 
 
+/* The EM map of single_iteration for squarem_training. Extrapolated
+ * over the emissions, a, b and the start probabilities; p_ft and p_bt
+ * are fixed during training.
+ */
+struct TwoVarHMM::EMModel {
+  EMModel(TwoVarHMM &h, vector<pair<double, double> > &m,
+          const vector<size_t> &t, const vector<double> &mlp,
+          const vector<double> &ulp) :
+    hmm(h), meth(m), time(t), meth_lp(mlp), unmeth_lp(ulp) {}
+
+  double
+  pass(const size_t n) {
+    return hmm.single_iteration(meth, time, meth_lp, unmeth_lp, n);
+  }
+  bool
+  converged(const double score, const double prev_score) const {
+    return fabs(score - prev_score) < hmm.tolerance;
+  }
+
+  void
+  get(vector<double> &theta) const {
+    theta.resize(8);
+    theta[0] = log(hmm.fg_emission.alpha);
+    theta[1] = log(hmm.fg_emission.beta);
+    theta[2] = log(hmm.bg_emission.alpha);
+    theta[3] = log(hmm.bg_emission.beta);
+    theta[4] = em_logit(hmm.a);
+    theta[5] = log(hmm.b);
+    theta[6] = em_logit(hmm.p_sf);
+    theta[7] = em_logit(hmm.p_sb);
+  }
+  void
+  set(const vector<double> &theta) {
+    hmm.fg_emission = BetaBin(exp(theta[0]), exp(theta[1]),
+                              hmm.fg_emission.tolerance);
+    hmm.bg_emission = BetaBin(exp(theta[2]), exp(theta[3]),
+                              hmm.bg_emission.tolerance);
+    hmm.a = em_expit(theta[4]);
+    hmm.b = exp(theta[5]);
+    hmm.bg_rate = hmm.a*hmm.b;
+    hmm.fg_rate = hmm.b - hmm.bg_rate;
+    const double max_prob = 1.0 - hmm.MIN_PROB;
+    hmm.p_sf = min(max(em_expit(theta[6]), hmm.MIN_PROB), max_prob);
+    hmm.p_sb = min(max(em_expit(theta[7]), hmm.MIN_PROB), max_prob);
+  }
+
+  TwoVarHMM &hmm;
+  vector<pair<double, double> > &meth;
+  const vector<size_t> &time;
+  const vector<double> &meth_lp;
+  const vector<double> &unmeth_lp;
+};
+
+
 double
 TwoVarHMM::BaumWelchTraining(vector<pair<double, double> > &meth,
                              const vector<size_t> &time) {
@@ -364,17 +362,9 @@ TwoVarHMM::BaumWelchTraining(vector<pair<double, double> > &meth,
   }
   
   size_t data_size = meth.size();
-  forward.resize(2);
-  backward.resize(2);
-  for (size_t i = 0; i < 2; ++i) {
-    forward[i].resize(data_size, 0);
-    backward[i].resize(data_size, 0);
-  }
-  
-  ltp.resize(4);
-  for (int i = 0; i < 4; ++i) {
-    ltp[i].resize(data_size - 1, 0);
-  }
+  forward.resize(data_size, 2);
+  backward.resize(data_size, 2);
+  ltp.resize(data_size - 1, 4);
   
   if (VERBOSE)
     cerr << setw(5)  << "ITR"
@@ -399,10 +389,18 @@ TwoVarHMM::BaumWelchTraining(vector<pair<double, double> > &meth,
   << endl;
   
   
-  for(size_t i = 0; i < max_iterations; ++i) {
+  em_trace.clear();
+  if (ACCELERATE) {
+    EMModel model(*this, meth, time, meth_lp, unmeth_lp);
+    prev_score = squarem_training(model, max_iterations, em_trace);
+  }
+  
+  for(size_t i = 0; i < max_iterations && !ACCELERATE; ++i) {
     
+    const double start = em_seconds();
     double score = single_iteration(meth, time, meth_lp, unmeth_lp,
                                     i+1);
+    em_trace.add(score, em_seconds() - start, 'E');
     
     if (VERBOSE) {
       cerr << setw(5) << i + 1
@@ -425,6 +423,9 @@ TwoVarHMM::BaumWelchTraining(vector<pair<double, double> > &meth,
     
   }
   
+  if (VERBOSE)
+    em_trace.report(cerr);
+  
   return prev_score;
 }
 
@@ -435,29 +436,26 @@ TwoVarHMM::PosteriorDecoding(vector<pair<double, double> > &meth,
                              vector<int> &classes, vector<double> &llr_scores,
                              bool IMPUT){
   
+  if (CHECKPOINT)
+    return checkpointed_decoding(meth, time, classes, llr_scores, IMPUT);
+
   size_t data_size = meth.size();
-  forward.resize(2);
-  backward.resize(2);
-  for (size_t i = 0; i < 2; ++i) {
-    forward[i].resize(data_size);
-    backward[i].resize(data_size);
-  }
-  
-  ltp.resize(4);
-  for (int i = 0; i < 4; ++i) {
-    ltp[i].resize(data_size - 1);
-  }
+  forward.resize(data_size, 2);
+  backward.resize(data_size, 2);
+  ltp.resize(data_size - 1, 4);
   
   const double lp_sf = log(p_sf);
   const double lp_sb = log(p_sb);
   const double lp_ft = log(p_ft);
   const double lp_bt = log(p_bt);
   
+  update_log_emissions(meth);
+  
   const double forward_score =
-      forward_algorithm(meth, time, lp_sf, lp_sb, lp_ft, lp_bt, ltp);
+      forward_algorithm(time, lp_sf, lp_sb, lp_ft, lp_bt, ltp);
   
   const double backward_score =
-      backward_algorithm(meth, time, lp_sf, lp_sb, lp_ft, lp_bt, ltp);
+      backward_algorithm(lp_sf, lp_sb, lp_ft, lp_bt, ltp);
 
   
   if (DEBUG && (fabs(forward_score - backward_score) /
@@ -476,8 +474,8 @@ TwoVarHMM::PosteriorDecoding(vector<pair<double, double> > &meth,
   
   for (size_t i = 0; i < data_size; ++i) {
     
-    const double bscore = forward[0][i] + backward[0][i];
-    const double fscore = forward[1][i] + backward[1][i];
+    const double bscore = forward[i][0] + backward[i][0];
+    const double fscore = forward[i][1] + backward[i][1];
     const double denom = log_sum_log(bscore, fscore);
     bg_probs[i] = exp(bscore - denom);
     fg_probs[i] = exp(fscore - denom);
@@ -512,3 +510,270 @@ TwoVarHMM::PosteriorDecoding(vector<pair<double, double> > &meth,
   return total_score;
 }
 
+
+
+/* The forward pass keeps every block-th row, block = ceil(sqrt(n)).
+ * The backward pass runs over the blocks from the last, recomputing
+ * the forward rows of each block from its checkpoint, and holds only
+ * the current backward row. Every value is computed as in the
+ * unchecked decoding, so the results are identical; transitions are
+ * recomputed rather than stored.
+ */
+double
+TwoVarHMM::checkpointed_decoding(vector<pair<double, double> > &meth,
+                                 const vector<size_t> &time,
+                                 vector<int> &classes,
+                                 vector<double> &llr_scores,
+                                 const bool IMPUT) {
+  const size_t data_size = meth.size();
+  classes.resize(data_size);
+  llr_scores.resize(data_size);
+  if (data_size == 0)
+    return 0;
+  // training lattices are not needed again
+  forward.release();
+  backward.release();
+  ltp.release();
+
+  const double lp_sf = log(p_sf);
+  const double lp_sb = log(p_sb);
+  const double lp_ft = log(p_ft);
+  const double lp_bt = log(p_bt);
+
+  update_log_emissions(meth);
+
+  const size_t block = std::max(static_cast<size_t>(1),
+               static_cast<size_t>(ceil(sqrt(static_cast<double>(data_size)))));
+  const size_t n_blocks = (data_size + block - 1)/block;
+  Lattice<double> checkpoints(n_blocks, 2);
+  Lattice<double> rows(block, 2);
+  const TwoStateEmissions e(bg_lemit, fg_lemit);
+  const ExpTransitions t(a, b, time, lp_sb, lp_sf, lp_bt, lp_ft);
+
+  double curr[2] = {e(0, 0) + t.start(0), e(0, 1) + t.start(1)};
+  std::copy(curr, curr + 2, checkpoints[0]);
+  for (size_t i = 1; i < data_size; ++i) {
+    t.forward(e, i, curr, curr);
+    if (i % block == 0)
+      std::copy(curr, curr + 2, checkpoints[i/block]);
+  }
+  const double forward_score = end_score(t, curr);
+
+  const double mean_fg_meth =
+    fg_emission.alpha / (fg_emission.alpha + fg_emission.beta);
+  const double mean_bg_meth =
+    bg_emission.alpha / (bg_emission.alpha + bg_emission.beta);
+
+  double bk[2] = {lp_bt, lp_ft}; // backward row of site i
+  for (size_t j = n_blocks; j-- > 0; ) {
+    const size_t lo = j*block;
+    const size_t hi = std::min(data_size, lo + block);
+    std::copy(checkpoints[j], checkpoints[j] + 2, rows[0]);
+    for (size_t i = lo + 1; i < hi; ++i)
+      t.forward(e, i, rows[i - 1 - lo], rows[i - lo]);
+
+    for (size_t i = hi; i-- > lo; ) {
+      const double *fw = rows[i - lo];
+      const double bscore = fw[0] + bk[0];
+      const double fscore = fw[1] + bk[1];
+      const double denom = log_sum_log(bscore, fscore);
+      const double bg_prob = exp(bscore - denom);
+      const double fg_prob = exp(fscore - denom);
+      llr_scores[i] = fg_prob;
+      classes[i] = bscore > fscore ? 0 : 1;
+      if (IMPUT && meth[i].second < 0) // not-covered sites
+        meth[i].first = mean_fg_meth*fg_prob + mean_bg_meth*bg_prob;
+
+      if (i > 0)
+        t.backward(e, i, bk, bk);
+    }
+  }
+  const double backward_score = start_score(e, t, 0, bk);
+
+  if (DEBUG && (fabs(forward_score - backward_score) /
+                max(forward_score, backward_score)) > 1e-10)
+    cerr << "fabs(forward_score - backward_score)/"
+         << "max(forward_score, backward_score) > 1e-10" << endl;
+
+  return forward_score;
+}
+
+
+void
+TwoVarHMM::transition_probs(const size_t t, double &ff, double &fb,
+                            double &bf, double &bb) const {
+  ff = a + (1 - a) * exp(-(b * t));
+  bb = 1 - a + a * exp(-(b * t));
+  fb = 1 - ff;
+  bf = 1 - bb;
+}
+
+
+/* Each lane holds one sample. Emissions are shifted so the larger of
+ * the two is 1 at each site, and the per-site sums of the forward
+ * (resp. backward) values are divided out, so no cell leaves a safe
+ * floating point range. The forward normalizers are multiplied
+ * together for RESCALE_INTERVAL sites before their log is added to
+ * the likelihood. The backward pass is stored and the forward pass
+ * streams, giving posteriors as it goes.
+ */
+void
+TwoVarHMM::decode_lanes(vector<vector<pair<double, double> > > &meths,
+                        const Lattice<double> &table,
+                        const size_t first, const size_t n_lanes,
+                        Lattice<double> &emit,
+                        vector<vector<int> > &classes,
+                        vector<vector<double> > &llr_scores,
+                        vector<double> &scores, const bool IMPUT) {
+  
+  const size_t data_size = meths[first].size();
+  const size_t L = n_lanes;
+  
+  // columns [0, L) are background, [L, 2L) foreground
+  emit.resize(data_size, 2*L);
+  backward.resize(data_size, 2*L);
+  
+  vector<double> log_norm(L, 0.0);
+  vector<double> fg_le, bg_le;
+  vector<EmissionRun> runs;
+  for (size_t s = 0; s < L; ++s) {
+    split_emission_runs(meths[first + s], runs);
+    fill_log_emissions(fg_emission, meths[first + s], runs, fg_le);
+    fill_log_emissions(bg_emission, meths[first + s], runs, bg_le);
+    double shift = 0.0;
+    for (size_t i = 0; i < data_size; ++i) {
+      const double m = max(fg_le[i], bg_le[i]);
+      emit[i][s] = exp(bg_le[i] - m);
+      emit[i][L + s] = exp(fg_le[i] - m);
+      shift += m;
+    }
+    log_norm[s] = shift;
+  }
+  
+  double ff = 0.0, fb = 0.0, bf, bb;
+  
+  // backward
+  double *beta = backward.back();
+  for (size_t s = 0; s < L; ++s) {
+    beta[s] = p_bt;
+    beta[L + s] = p_ft;
+  }
+  for (size_t k = data_size - 1; k > 0; --k) {
+    const size_t i = k - 1;
+    table_probs(table[i], ff, fb, bf, bb);
+    const double *bk = backward[k];
+    const double *ek = emit[k];
+    double *bi = backward[i];
+#pragma omp simd
+    for (size_t s = 0; s < L; ++s) {
+      const double bg_emi = ek[s]*bk[s];
+      const double fg_emi = ek[L + s]*bk[L + s];
+      const double bg = bb*bg_emi + bf*fg_emi;
+      const double fg = fb*bg_emi + ff*fg_emi;
+      const double scale = 1.0/(bg + fg);
+      bi[s] = bg*scale;
+      bi[L + s] = fg*scale;
+    }
+  }
+  
+  // forward, with posteriors
+  for (size_t s = 0; s < L; ++s) {
+    classes[first + s].resize(data_size);
+    llr_scores[first + s].resize(data_size);
+  }
+  const double mean_fg_meth =
+    fg_emission.alpha / (fg_emission.alpha + fg_emission.beta);
+  const double mean_bg_meth =
+    bg_emission.alpha / (bg_emission.alpha + bg_emission.beta);
+  
+  vector<double> alpha(2*L), norm_prod(L, 1.0), post(L);
+  double *al = &alpha[0];
+  double *np = &norm_prod[0];
+  double *fg_post = &post[0];
+  // the first site is entered from a background state whose
+  // transitions are the start probabilities
+  for (size_t s = 0; s < L; ++s) {
+    al[s] = 1.0;
+    al[L + s] = 0.0;
+  }
+  bb = p_sb;
+  bf = p_sf;
+  for (size_t i = 0; i < data_size; ++i) {
+    const double *ei = emit[i];
+    const double *bi = backward[i];
+    if (i > 0)
+      table_probs(table[i - 1], ff, fb, bf, bb);
+#pragma omp simd
+    for (size_t s = 0; s < L; ++s) {
+      const double bg = ei[s]*(bb*al[s] + fb*al[L + s]);
+      const double fg = ei[L + s]*(bf*al[s] + ff*al[L + s]);
+      const double c = bg + fg;
+      al[s] = bg/c;
+      al[L + s] = fg/c;
+      np[s] *= c;
+      const double bscore = al[s]*bi[s];
+      const double fscore = al[L + s]*bi[L + s];
+      fg_post[s] = fscore/(bscore + fscore);
+    }
+    for (size_t s = 0; s < L; ++s) {
+      llr_scores[first + s][i] = fg_post[s];
+      classes[first + s][i] = (fg_post[s] < 0.5) ? 0 : 1;
+      if (IMPUT && meths[first + s][i].second < 0)
+        meths[first + s][i].first = mean_fg_meth*fg_post[s] +
+          mean_bg_meth*(1.0 - fg_post[s]);
+    }
+    if ((i + 1) % RESCALE_INTERVAL == 0)
+      for (size_t s = 0; s < L; ++s) {
+        log_norm[s] += log(np[s]);
+        np[s] = 1.0;
+      }
+  }
+  for (size_t s = 0; s < L; ++s)
+    scores[first + s] = log_norm[s] + log(np[s]) +
+      log(al[s]*p_bt + al[L + s]*p_ft);
+}
+
+
+void
+TwoVarHMM::transition_table(const vector<size_t> &time,
+                            Lattice<double> &table) const {
+  table.resize(time.size(), 4);
+  for (size_t i = 0; i < time.size(); ++i)
+    transition_probs(time[i], table[i][0], table[i][1],
+                     table[i][2], table[i][3]);
+}
+
+
+void
+TwoVarHMM::PosteriorDecoding(vector<vector<pair<double, double> > > &meths,
+                             const vector<size_t> &time,
+                             vector<vector<int> > &classes,
+                             vector<vector<double> > &llr_scores,
+                             vector<double> &scores, bool IMPUT) {
+  Lattice<double> table;
+  transition_table(time, table);
+  PosteriorDecoding(meths, table, classes, llr_scores, scores, IMPUT);
+}
+
+
+void
+TwoVarHMM::PosteriorDecoding(vector<vector<pair<double, double> > > &meths,
+                             const Lattice<double> &table,
+                             vector<vector<int> > &classes,
+                             vector<vector<double> > &llr_scores,
+                             vector<double> &scores, bool IMPUT) {
+  
+  for (size_t i = 0; i < meths.size(); ++i)
+    if (meths[i].size() != table.size() + 1)
+      throw SMITHLABException("sample " + smithlab::toa(i) +
+                              " does not match the sites being decoded");
+  
+  classes.resize(meths.size());
+  llr_scores.resize(meths.size());
+  scores.resize(meths.size());
+  
+  Lattice<double> emit;
+  for (size_t i = 0; i < meths.size(); i += DECODE_LANES)
+    decode_lanes(meths, table, i, min(DECODE_LANES, meths.size() - i), emit,
+                 classes, llr_scores, scores, IMPUT);
+}
@@ -22,6 +22,9 @@
 
 #include "smithlab_utils.hpp"
 #include "distribution.hpp"
+#include "Lattice.hpp"
+#include "HMMCore.hpp"
+#include "EMAccel.hpp"
 #include <memory>
 
 using std::vector;
@@ -43,13 +46,36 @@ public:
   TwoVarHMM(const double tol, const double minprob, const size_t max_itr,
             const bool v, const bool e, int m = 0, bool d = false) :
     tolerance(tol), MIN_PROB(minprob), max_iterations(max_itr),
-    VERBOSE(v), NO_RATE_EST(e), method(m), DEBUG(d) {}
+    VERBOSE(v), NO_RATE_EST(e), method(m), DEBUG(d), CHECKPOINT(false),
+    ACCELERATE(false) {}
   
   void
   set_parameters(const BetaBin _fg_emission, const BetaBin _bg_emission,
                  const double _fg_rate, const double _bg_rate,
                  const double _p_sf, const double _p_sb,
                  const double _p_ft, const double _p_bt);
+
+  // the parameters and settings without the lattices and buffers of
+  // the last training or decoding, for workers that decode other data
+  TwoVarHMM
+  parameter_copy() const;
+
+  BetaBin
+  get_fg_emission() const {return fg_emission;}
+  BetaBin
+  get_bg_emission() const {return bg_emission;}
+  double
+  get_fg_rate() const {return fg_rate;}
+  double
+  get_bg_rate() const {return bg_rate;}
+  double
+  get_p_sf() const {return p_sf;}
+  double
+  get_p_sb() const {return p_sb;}
+
+  // passes of later BaumWelchTraining calls
+  void
+  set_max_iterations(const size_t m) {max_iterations = m;}
   
   
   double
@@ -61,9 +87,45 @@ public:
   PosteriorDecoding(vector<pair<double, double> > &meth,
                     const vector<size_t> &time, vector<int> &classes,
                     vector<double> &llr_scores, bool IMPUT = false);
+
+  // decode with checkpointed lattices: O(sqrt(n)) lattice memory for
+  // about twice the work, and the same results
+  void
+  set_checkpointing(const bool c) {CHECKPOINT = c;}
+
+  // train with SQUAREM steps between EM passes (see EMAccel.hpp)
+  void
+  set_acceleration(const bool a) {ACCELERATE = a;}
+
+  // likelihood and time of each pass of the last training
+  const EMTrace &
+  get_trace() const {return em_trace;}
+
+  // decode many samples observed at the same sites; samples are run in
+  // lockstep, one per SIMD lane, in scaled linear space
+  void
+  PosteriorDecoding(vector<vector<pair<double, double> > > &meths,
+                    const vector<size_t> &time,
+                    vector<vector<int> > &classes,
+                    vector<vector<double> > &llr_scores,
+                    vector<double> &scores, bool IMPUT = false);
+
+  // the transition probabilities of every interval in time, for
+  // decoding many sample batches at the same sites: ff, fb, bf, bb
+  void
+  transition_table(const vector<size_t> &time, Lattice<double> &table) const;
+
+  void
+  PosteriorDecoding(vector<vector<pair<double, double> > > &meths,
+                    const Lattice<double> &table,
+                    vector<vector<int> > &classes,
+                    vector<vector<double> > &llr_scores,
+                    vector<double> &scores, bool IMPUT = false);
  
   
 private:
+
+  struct EMModel;
   
   double
   single_iteration(vector<pair<double, double> > &meth,
@@ -71,27 +133,26 @@ private:
                    const vector<double> &unmeth_lp, const size_t curr_itr);
 
   double
-  forward_algorithm(const vector<pair<double, double> > &meth,
-                    const vector<size_t> &time,
+  forward_algorithm(const vector<size_t> &time,
                     const double lp_sf, const double lp_sb,
                     const double lp_ft, const double lp_bt,
-                    matrix &ltp);
+                    Lattice<double> &ltp);
   double
-  backward_algorithm(const vector<pair<double, double> > &meth,
-                     const vector<size_t> &time,
-                     const double lp_sf, const double lp_sb,
+  backward_algorithm(const double lp_sf, const double lp_sb,
                      const double lp_ft, const double lp_bt,
-                     const matrix &ltp);
+                     const Lattice<double> &ltp);
   
   
   void
-  update_trans_estimator(const vector<pair<double, double> > &meth,
-                         const double total, matrix &te, matrix &r,
-                         const matrix &ltp) const;
+  update_trans_estimator(const double total, matrix &te, matrix &r,
+                         const Lattice<double> &ltp) const;
   
   void
   update_endprob(matrix &te);
   
+  void
+  update_log_emissions(const vector<pair<double, double> > &meth);
+  
   
   void
   update_imputed_methylv(vector<pair<double, double> > &meth,
@@ -104,17 +165,40 @@ private:
                      const vector<double> &unmeth_lp);
   
   
+  void
+  decode_lanes(vector<vector<pair<double, double> > > &meths,
+               const Lattice<double> &table,
+               const size_t first, const size_t n_lanes,
+               Lattice<double> &emit,
+               vector<vector<int> > &classes,
+               vector<vector<double> > &llr_scores,
+               vector<double> &scores, const bool IMPUT);
+
   double
-  log_sum_log(const double p, const double q) const;
+  checkpointed_decoding(vector<pair<double, double> > &meth,
+                        const vector<size_t> &time, vector<int> &classes,
+                        vector<double> &llr_scores, const bool IMPUT);
+
+  void
+  transition_probs(const size_t t, double &ff, double &fb,
+                   double &bf, double &bb) const;
+
+  static void
+  table_probs(const double *row, double &ff, double &fb,
+              double &bf, double &bb) {
+    ff = row[0];
+    fb = row[1];
+    bf = row[2];
+    bb = row[3];
+  }
   
-  double
-  log_sum_log_vec(const std::vector<double> &vals, size_t limit) const;
   
 
-  //  HMM internal data
-  matrix forward;
-  matrix backward;
-  matrix ltp; // store the calculated transition probabilities across CpGs
+  //  HMM internal data, indexed [position][state]
+  Lattice<double> forward;
+  Lattice<double> backward;
+  Lattice<double> ltp; // log transition probabilities: bb, bf, fb, ff
+  vector<double> fg_lemit, bg_lemit; // log emissions for current parameters
   
   ////////  model structure  ////////
   BetaBin fg_emission, bg_emission;
@@ -125,6 +209,11 @@ private:
   double p_ft, p_bt;
   
   
+  // samples decoded together by the batched PosteriorDecoding
+  static const size_t DECODE_LANES = 8;
+  // positions between folding the scaled normalizers into log space
+  static const size_t RESCALE_INTERVAL = 16;
+  
   //  parameters
   double tolerance;
   double MIN_PROB;
@@ -133,5 +222,9 @@ private:
   bool NO_RATE_EST;
   int method;
   bool DEBUG;
+  bool CHECKPOINT;
+  bool ACCELERATE;
+
+  EMTrace em_trace;
 };
 #endif
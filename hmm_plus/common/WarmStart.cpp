@@ -0,0 +1,99 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "WarmStart.hpp"
+
+#include <fstream>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+
+#include "smithlab_utils.hpp"
+
+using std::string;
+using std::vector;
+
+
+uint64_t
+fnv1a(const void *data, const size_t n, uint64_t h) {
+  const unsigned char *c = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < n; ++i) {
+    h ^= c[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+
+uint64_t
+file_fingerprint(const string &filename) {
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if (!in)
+    throw SMITHLABException("cannot open input file " + filename);
+  static const size_t BUFFER_SIZE = 1 << 20;
+  vector<char> buffer(BUFFER_SIZE);
+  uint64_t h = fnv1a(0, 0);
+  while (in) {
+    in.read(&buffer[0], BUFFER_SIZE);
+    h = fnv1a(&buffer[0], in.gcount(), h);
+  }
+  if (!in.eof())
+    throw SMITHLABException("error reading input file " + filename);
+  return h;
+}
+
+
+string
+param_cache_file(const string &cache_dir, const string &program,
+                 const string &input_file, const string &settings) {
+  const uint64_t h = fnv1a(settings.data(), settings.size(),
+                           file_fingerprint(input_file));
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(h));
+  return cache_dir + "/" + program + "." + hex + ".params";
+}
+
+
+void
+select_training_blocks(const vector<size_t> &starts,
+                       const vector<size_t> &strata,
+                       const double fraction, vector<size_t> &chosen) {
+  // fixed seed: the same input always gives the same blocks
+  std::mt19937 gen(1);
+  chosen.clear();
+  vector<size_t> stratum;
+  for (size_t i = 0; i + 1 < starts.size(); ) {
+    stratum.clear();
+    const size_t s = strata[i];
+    for (; i + 1 < starts.size() && strata[i] == s; ++i)
+      stratum.push_back(i);
+    const size_t n = stratum.size();
+    const size_t k = std::min(n, std::max(static_cast<size_t>(1),
+      static_cast<size_t>(std::round(fraction*n))));
+    // partial Fisher-Yates, which unlike std::shuffle gives the same
+    // blocks with every standard library
+    for (size_t j = 0; j < k; ++j) {
+      const size_t r = j + gen() % (n - j);
+      std::swap(stratum[j], stratum[r]);
+      chosen.push_back(stratum[j]);
+    }
+  }
+  std::sort(chosen.begin(), chosen.end());
+}
@@ -0,0 +1,57 @@
+/*
+  Copyright (C) 2020-2021 University of Southern California
+  Authors: Andrew D. Smith and Xiaojing Ji
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WARM_START_HPP
+#define WARM_START_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/* Support for training on part of the data and for reusing fitted
+ * parameters. Training blocks are drawn per chromosome so every
+ * chromosome is represented, and with a fixed generator, so a given
+ * input always gives the same subsample. Cached parameter files are
+ * named by a hash of the input contents and the training settings.
+ */
+
+// 64-bit FNV-1a, continuing from h
+uint64_t
+fnv1a(const void *data, const size_t n,
+      uint64_t h = 14695981039346656037ull);
+
+// FNV-1a of the contents of a file
+uint64_t
+file_fingerprint(const std::string &filename);
+
+// DIR/<program>.<hash>.params, for the input file and a string
+// holding every setting that changes the fitted parameters
+std::string
+param_cache_file(const std::string &cache_dir, const std::string &program,
+                 const std::string &input_file, const std::string &settings);
+
+// Block i holds sites [starts[i], starts[i+1]) and lies in stratum
+// strata[i]. Chooses at random a fraction, and at least one, of the
+// blocks in each stratum; chosen is sorted.
+void
+select_training_blocks(const std::vector<size_t> &starts,
+                       const std::vector<size_t> &strata,
+                       const double fraction, std::vector<size_t> &chosen);
+
+#endif
@@ -23,8 +23,12 @@
 #include <numeric>
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
+#include <algorithm>
+#include <cassert>
 
 #include "distribution.hpp"
+#include "Instrument.hpp"
 
 #include <gsl/gsl_sf_psi.h>
 #include <gsl/gsl_sf_gamma.h>
@@ -51,23 +55,23 @@ typedef vector< vector<double> > matrix;
 //////       numeric compute            //////
 //////////////////////////////////////////////
 
-inline double
-log_sum_log(const double p, const double q) {
-  if (p == 0) {return q;}
-  else if (q == 0) {return p;}
-  if (!isfinite(p) && !isfinite(q)) {return p;}
-  const double larger = (p > q) ? p : q;
-  const double smaller = (p > q) ? q : p;
-  return larger + log(1.0 + exp(smaller - larger));
-}
-
-
-inline double
-log_sub_log(const double p, const double q) {
-  if (p == 0) {return q;}
-  else if (q == 0) {return p;}
-  if (!isfinite(p) && !isfinite(q)) {return p;}
-  return p + log(1.0 - exp(q - p));
+double
+log_sum_log_vec(const vector<double> &vals, const size_t limit) {
+  const vector<double>::const_iterator x =
+    std::max_element(vals.begin(), vals.begin() + limit);
+  const double max_val = *x;
+  if (!isfinite(max_val)) {return vals[0];}
+  const size_t max_idx = x - vals.begin();
+  double sum = 1.0;
+  for (size_t i = 0; i < limit; ++i) {
+    if (i != max_idx) {
+      sum += exp(vals[i] - max_val);
+#ifdef DEBUG
+      assert(isfinite(sum));
+#endif
+    }
+  }
+  return max_val + log(sum);
 }
 
 
@@ -103,23 +107,38 @@ BetaBin::tostring() const {
   return os.str();
 }
 
+// imputed levels are kept this far from 0 and 1
+static const double IMPUTED_SMOOTHING = 1e-2;
+
+// the log emission of a site without information
+static const double NEUTRAL_LOG_EMISSION = 1;
+
 double
 BetaBin::operator()(const pair<double, double> &val) const
 {
-  double y;
-  if (val.second == -1) { // imputated CpG -- beta distribution
-    const double v_smooth = min(max(val.first, 1e-2), 1.0 - 1e-2);
-    y = (alpha - 1) * log(v_smooth) + (beta - 1) * log(1 - v_smooth)
-        - lnbeta_helper;
-  } else if (val.second == -2) {
-    y = 1;
-  } else {
-    const size_t x = static_cast<size_t>(val.first);
-    const size_t n = static_cast<size_t>(x + val.second);
-    y = gsl_sf_lnchoose(n, x) + gsl_sf_lnbeta(alpha + x, beta + val.second)
-        - lnbeta_helper;
-  }
-  return y;
+  if (val.second == -1) // imputated CpG -- beta distribution
+    return imputed(val.first);
+  else if (val.second == -2)
+    return NEUTRAL_LOG_EMISSION;
+  return observed(val);
+}
+
+
+double
+BetaBin::observed(const pair<double, double> &val) const {
+  const size_t x = static_cast<size_t>(val.first);
+  const size_t n = static_cast<size_t>(x + val.second);
+  return gsl_sf_lnchoose(n, x) + gsl_sf_lnbeta(alpha + x, beta + val.second)
+    - lnbeta_helper;
+}
+
+
+double
+BetaBin::imputed(const double level) const {
+  const double v_smooth = min(max(level, IMPUTED_SMOOTHING),
+                              1.0 - IMPUTED_SMOOTHING);
+  return (alpha - 1) * log(v_smooth) + (beta - 1) * log(1 - v_smooth)
+    - lnbeta_helper;
 }
 
 
@@ -144,69 +163,205 @@ BetaBin::fit(const vector<double> &vals_a, const vector<double> &vals_b,
 }
 
 
-//////////////////////////////////////////////
-//////       struct CTHMM duration      //////
-//////////////////////////////////////////////
+// sites deeper than this are rare and are evaluated directly
+static const size_t MAX_CACHED_COVERAGE = 512;
 
+void
+split_emission_runs(const vector<pair<double, double> > &meth,
+                    vector<EmissionRun> &runs) {
+  runs.clear();
+  for (size_t i = 0; i < meth.size(); ++i) {
+    const EmissionRun::Kind kind =
+      meth[i].second == -1 ? EmissionRun::IMPUTED :
+      (meth[i].second == -2 ? EmissionRun::NEUTRAL : EmissionRun::OBSERVED);
+    if (runs.empty() || runs.back().kind != kind)
+      runs.push_back(EmissionRun(i, i + 1, kind));
+    else runs.back().end = i + 1;
+  }
+}
 
-void ExpTransEstimator::calc_internal_data(const vector<size_t> &t,
-                                           const double v,
-                                           vector<double> &ebt) const {
-  // store ebt for the computation convenience
-  for (size_t i = 0; i < t.size(); ++i) {
-    ebt[i] = exp(- v * t[i]);
+
+void
+fill_log_emissions(const BetaBin &distr,
+                   const vector<pair<double, double> > &meth,
+                   const vector<EmissionRun> &runs, vector<double> &lemit) {
+  // entry n*(n+1)/2 + x holds the value for x methylated out of n
+  vector<double> table;
+  lemit.resize(meth.size());
+  size_t n_evaluated = 0, n_corrected = 0;
+  for (size_t r = 0; r < runs.size(); ++r) {
+    const size_t start = runs[r].start, end = runs[r].end;
+    if (runs[r].kind == EmissionRun::IMPUTED) {
+      for (size_t i = start; i < end; ++i) {
+        const double level = meth[i].first;
+        lemit[i] = distr.imputed(level);
+        // imputed levels moved in from 0 or 1 by the smoothing
+        n_corrected += (level < IMPUTED_SMOOTHING ||
+                        level > 1.0 - IMPUTED_SMOOTHING);
+      }
+      n_evaluated += end - start;
+    }
+    else if (runs[r].kind == EmissionRun::NEUTRAL) {
+      std::fill(lemit.begin() + start, lemit.begin() + end,
+                NEUTRAL_LOG_EMISSION);
+      n_evaluated += end - start;
+    }
+    else for (size_t i = start; i < end; ++i) {
+      const pair<double, double> &val = meth[i];
+      if (val.second >= 0 && val.first + val.second <= MAX_CACHED_COVERAGE &&
+          val.first == floor(val.first) && val.second == floor(val.second)) {
+        const size_t x = static_cast<size_t>(val.first);
+        const size_t n = static_cast<size_t>(x + val.second);
+        const size_t idx = n*(n + 1)/2 + x;
+        if (idx >= table.size())
+          table.resize((n + 1)*(n + 2)/2,
+                       std::numeric_limits<double>::quiet_NaN());
+        if (std::isnan(table[idx])) {
+          table[idx] = distr.observed(val);
+          ++n_evaluated;
+        }
+        lemit[i] = table[idx];
+      }
+      else {
+        lemit[i] = distr.observed(val);
+        ++n_evaluated;
+      }
+    }
   }
+  profile_count("emissions", meth.size());
+  profile_count("emissions_evaluated", n_evaluated);
+  profile_count("emission_corrections", n_corrected);
 }
 
 
+void
+fill_log_emissions(const BetaBin &distr,
+                   const vector<pair<double, double> > &meth,
+                   vector<double> &lemit) {
+  vector<EmissionRun> runs;
+  split_emission_runs(meth, runs);
+  fill_log_emissions(distr, meth, runs, lemit);
+}
 
-double ExpTransEstimator::calc_llh(const matrix &r, const double u,
-                                   const vector<double> &ebt) const {
 
-  double val = 0;
-  for (size_t i = 0; i < ebt.size(); ++i) {
-    const double d = r[0][i]*log(1 - u + u * ebt[i])
-                     + r[1][i]*log(u - u * ebt[i])
-                     + r[2][i]*log(1 - u - (1 - u) * ebt[i])
-                     + r[3][i]*log(u + (1 - u) * ebt[i]);
+//////////////////////////////////////////////
+//////       struct CTHMM duration      //////
+//////////////////////////////////////////////
 
-    val += d;
+
+// Summed posteriors of the intervals, one entry per distinct
+// distance: the kernels below loop over these instead of all sites
+struct TransHistogram {
+  size_t n;
+  const double *t, *bb, *bf, *fb, *ff;
+};
+
+
+static double
+trans_llh(const TransHistogram &h, const double u, const double v) {
+  double val = 0;
+#pragma omp simd reduction(+:val)
+  for (size_t i = 0; i < h.n; ++i) {
+    const double ebt = exp(- v * h.t[i]);
+    val += h.bb[i]*log(1 - u + u * ebt)
+           + h.bf[i]*log(u - u * ebt)
+           + h.fb[i]*log(1 - u - (1 - u) * ebt)
+           + h.ff[i]*log(u + (1 - u) * ebt);
   }
   return val;
 }
 
 
-double ExpTransEstimator::llh_grad_a(const matrix &r,
-                                     const vector<double> &ebt) const {
-  double val = 0;
-  for (size_t i = 0; i < ebt.size(); ++i) {
-    val += r[0][i]*( (-1+ebt[i]) / (1-a+a*ebt[i]) )
-           + r[1][i]*( (1) / (a) )
-           + r[2][i]*( (1) / (a-1) )
-           + r[3][i]*( (1-ebt[i]) / (a+(1-a)*ebt[i]) );
+// the likelihood and both partial derivatives in one pass
+static double
+trans_llh_grad(const TransHistogram &h, const double u, const double v,
+               double &grad_u, double &grad_v) {
+  double val = 0, gu = 0, gv = 0;
+#pragma omp simd reduction(+:val,gu,gv)
+  for (size_t i = 0; i < h.n; ++i) {
+    const double t = h.t[i];
+    const double ebt = exp(- v * t);
+    const double p_bb = 1 - u + u * ebt;
+    const double p_ff = u + (1 - u) * ebt;
+    val += h.bb[i]*log(p_bb)
+           + h.bf[i]*log(u - u * ebt)
+           + h.fb[i]*log(1 - u - (1 - u) * ebt)
+           + h.ff[i]*log(p_ff);
+    gu += h.bb[i]*( (-1+ebt) / p_bb )
+          + h.bf[i]*( (1) / (u) )
+          + h.fb[i]*( (1) / (u-1) )
+          + h.ff[i]*( (1-ebt) / p_ff );
+    gv += h.bb[i]*( (-u*t*ebt) / p_bb )
+          + (h.bf[i] + h.fb[i]) * ( (t*ebt) / (1-ebt) )
+          + h.ff[i]*( (-(1-u)*t*ebt) / p_ff );
   }
+  grad_u = gu;
+  grad_v = gv;
   return val;
 }
 
 
-double ExpTransEstimator::llh_grad_b(const matrix &r,
-                                     const vector<double> &ebt,
-                                     const vector<size_t> &t) const {
-  double val = 0;
-  for (size_t i = 0; i < ebt.size(); ++i) {
-    val += r[0][i]*( (-a*t[i]*ebt[i]) / (1-a+a*ebt[i]) )
-           + (r[1][i] + r[2][i]) * ( (t[i]*ebt[i]) / (1-ebt[i]) )
-           + r[3][i]*( (-(1-a)*t[i]*ebt[i]) / (a+(1-a)*ebt[i]) );
+void
+ExpTransEstimator::compress(const matrix &r, const vector<size_t> &t) {
+  // most distances are short, so those get a direct lookup table
+  static const size_t DIRECT_LIMIT = 1 << 16;
+  static const size_t NO_SLOT = std::numeric_limits<size_t>::max();
+  vector<size_t> direct(std::min(DIRECT_LIMIT, t.size() + 1), NO_SLOT);
+  std::unordered_map<size_t, size_t> far;
+
+  hist_t.clear();
+  hist_bb.clear();
+  hist_bf.clear();
+  hist_fb.clear();
+  hist_ff.clear();
+  for (size_t i = 0; i < t.size(); ++i) {
+    size_t slot = NO_SLOT;
+    if (t[i] < direct.size()) {
+      if (direct[t[i]] == NO_SLOT)
+        direct[t[i]] = hist_t.size();
+      slot = direct[t[i]];
+    }
+    else {
+      std::unordered_map<size_t, size_t>::iterator j =
+        far.insert(std::make_pair(t[i], hist_t.size())).first;
+      slot = j->second;
+    }
+    if (slot == hist_t.size()) {
+      hist_t.push_back(t[i]);
+      hist_bb.push_back(0.0);
+      hist_bf.push_back(0.0);
+      hist_fb.push_back(0.0);
+      hist_ff.push_back(0.0);
+    }
+    hist_bb[slot] += r[0][i];
+    hist_bf[slot] += r[1][i];
+    hist_fb[slot] += r[2][i];
+    hist_ff[slot] += r[3][i];
   }
-  return val;
+}
+
+
+double
+ExpTransEstimator::calc_llh(const double u, const double v) const {
+  const TransHistogram h = {hist_t.size(), hist_t.data(), hist_bb.data(),
+                            hist_bf.data(), hist_fb.data(), hist_ff.data()};
+  return trans_llh(h, u, v);
+}
+
+
+double
+ExpTransEstimator::calc_llh_grad(const double u, const double v,
+                                 double &grad_a, double &grad_b) const {
+  const TransHistogram h = {hist_t.size(), hist_t.data(), hist_bb.data(),
+                            hist_bf.data(), hist_fb.data(), hist_ff.data()};
+  return trans_llh_grad(h, u, v, grad_a, grad_b);
 }
 
 
 void ExpTransEstimator::GA_stepforward(const double grad_a,
                                        const double grad_b,
-                                       const double &old_llh, double &new_llh,
-                                       const matrix &r,
-                                       const vector<size_t> &t)  {
+                                       const double &old_llh,
+                                       double &new_llh) {
 
   double try_step = step_size;
 
@@ -214,11 +369,8 @@ void ExpTransEstimator::GA_stepforward(const double grad_a,
   double new_b = b + try_step * grad_b;
 
   double moving_llh = - std::numeric_limits<double>::max();
-  vector<double> ebt (t.size(), 0);
-  if (new_a > 0 && new_a < 1 && new_b > 0) {
-    calc_internal_data(t, new_b, ebt);
-    moving_llh = calc_llh(r, new_a, ebt);
-  }
+  if (new_a > 0 && new_a < 1 && new_b > 0)
+    moving_llh = calc_llh(new_a, new_b);
 
   size_t itr = 1;
 
@@ -228,10 +380,8 @@ void ExpTransEstimator::GA_stepforward(const double grad_a,
     new_a = a + try_step * grad_a;
     new_b = b + try_step * grad_b;
 
-    if (new_a > 0 && new_a < 1 && new_b > 0) {
-      calc_internal_data(t, new_b, ebt);
-      moving_llh = calc_llh(r, new_a, ebt);
-    }
+    if (new_a > 0 && new_a < 1 && new_b > 0)
+      moving_llh = calc_llh(new_a, new_b);
     ++itr;
   }
 
@@ -251,9 +401,7 @@ ExpTransEstimator::GA_stepforward_BB(const double grad_a, const double grad_b,
                                      const double d_grad_a,
                                      const double d_grad_b,
                                      double &d_a, double &d_b,
-                                     const double &old_llh, double &new_llh,
-                                     const matrix &r,
-                                     const vector<size_t> &t) {
+                                     const double &old_llh, double &new_llh) {
 
   double try_step = fabs(d_grad_a * d_a + d_grad_b * d_b) /
   (d_grad_a * d_grad_a + d_grad_b * d_grad_b);
@@ -263,11 +411,8 @@ ExpTransEstimator::GA_stepforward_BB(const double grad_a, const double grad_b,
 
   double moving_llh = - std::numeric_limits<double>::max();
 
-  vector<double> ebt (t.size(), 0);
-  if (new_a > 0 && new_a < 1 && new_b > 0) {
-    calc_internal_data(t, new_b, ebt);
-    moving_llh = calc_llh(r, new_a, ebt);
-  }
+  if (new_a > 0 && new_a < 1 && new_b > 0)
+    moving_llh = calc_llh(new_a, new_b);
   size_t itr = 1;
 
   while (moving_llh <= old_llh && abs(moving_llh - old_llh) > tolerance
@@ -276,10 +421,8 @@ ExpTransEstimator::GA_stepforward_BB(const double grad_a, const double grad_b,
     new_a = a + try_step * grad_a;
     new_b = b + try_step * grad_b;
 
-    if (new_a > 0 && new_a < 1 && new_b > 0) {
-      calc_internal_data(t, new_b, ebt);
-      moving_llh = calc_llh(r, new_a, ebt);
-    }
+    if (new_a > 0 && new_a < 1 && new_b > 0)
+      moving_llh = calc_llh(new_a, new_b);
     ++itr;
   }
 
@@ -298,18 +441,15 @@ ExpTransEstimator::GA_stepforward_BB(const double grad_a, const double grad_b,
 
 void ExpTransEstimator::mle_GradAscent(const matrix &r,
                                        const vector<size_t> &t) {
-  vector<double> ebt (t.size(), 0);
-  calc_internal_data(t, b, ebt);
-  double curr_llh = calc_llh(r, a, ebt);
+  compress(r, t);
 
-  double a_old = a, b_old = b;
   double grad_a, grad_b;
-  grad_a = llh_grad_a(r, ebt);
-  grad_b = llh_grad_b(r, ebt, t);
+  double curr_llh = calc_llh_grad(a, b, grad_a, grad_b);
+  double a_old = a, b_old = b;
 
   // first iteration
   double new_llh;
-  GA_stepforward(grad_a, grad_b, curr_llh, new_llh, r, t);
+  GA_stepforward(grad_a, grad_b, curr_llh, new_llh);
 
   double d_a = a - a_old;
   double d_b = b - b_old;
@@ -320,20 +460,17 @@ void ExpTransEstimator::mle_GradAscent(const matrix &r,
 
   while (abs(new_llh - curr_llh) > tolerance && itr < max_iteration) {
     curr_llh = new_llh;
-    calc_internal_data(t, b, ebt);
     if (BB) {
-      new_grad_a = llh_grad_a(r, ebt);
-      new_grad_b = llh_grad_b(r, ebt, t);
+      calc_llh_grad(a, b, new_grad_a, new_grad_b);
       d_grad_a = new_grad_a - grad_a;
       d_grad_b = new_grad_b - grad_b;
       GA_stepforward_BB(new_grad_a, new_grad_b, d_grad_a, d_grad_b,
-                        d_a, d_b, curr_llh, new_llh, r, t);
+                        d_a, d_b, curr_llh, new_llh);
       grad_a = new_grad_a;
       grad_b = new_grad_b;
     } else {
-      grad_a = llh_grad_a(r, ebt);
-      grad_b = llh_grad_b(r, ebt, t);
-      GA_stepforward(grad_a, grad_b, curr_llh, new_llh, r, t);
+      calc_llh_grad(a, b, grad_a, grad_b);
+      GA_stepforward(grad_a, grad_b, curr_llh, new_llh);
     }
     ++itr;
   }
@@ -341,84 +478,49 @@ void ExpTransEstimator::mle_GradAscent(const matrix &r,
 }
 
 // CONJUGATE GRADIENT METHOD
+// params points to the TransHistogram of the estimator
 
 double
 f(const gsl_vector *x, void *params) {
-  double *par = (double *) params;
-  size_t n = par[0];
-  double u = gsl_vector_get(x, 0);
-  double v = gsl_vector_get(x, 1);
-
-  double val = 0;
-  for (size_t i = 0; i < n; ++i) {
-    size_t s = i * 5;
-    const double ebt = exp(- v * par[s+5]);
-    const double d = par[s+1]*log(1 - u + u * ebt)
-                     + par[s+2]*log(u - u * ebt)
-                     + par[s+3]*log(1 - u - (1 - u) * ebt)
-                     + par[s+4]*log(u + (1 - u) * ebt);
-    val -= d;
-  }
-  return val;
+  const TransHistogram *h = static_cast<const TransHistogram *>(params);
+  return -trans_llh(*h, gsl_vector_get(x, 0), gsl_vector_get(x, 1));
 }
 
 void
 df(const gsl_vector *x, void *params, gsl_vector *d) {
-  double *par = (double *) params;
-  size_t n = par[0];
-  double u = gsl_vector_get(x, 0);
-  double v = gsl_vector_get(x, 1);
-
+  const TransHistogram *h = static_cast<const TransHistogram *>(params);
   double da = 0;
   double db = 0;
-  for (size_t i = 0; i < n; ++i) {
-    const size_t s = i * 5;
-    const double t = par[s+5];
-    const double ebt = exp(- v * t);
-    da -= par[s+1]*( (-1+ebt) / (1-u+u*ebt) )
-          + par[s+2]*( (1) / (u) )
-          + par[s+3]*( (1) / (u-1) )
-          + par[s+4]*( (1-ebt) / (u+(1-u)*ebt) );
-
-    db -= par[s+1]*( (-u*t*ebt) / (1-u+u*ebt) )
-          + (par[s+2] + par[s+3]) * ( (t*ebt) / (1-ebt) )
-          + par[s+4]*( (-(1-u)*t*ebt) / (u+(1-u)*ebt) );
-  }
-  //cerr << "da: " << da  << ", db: " << db << endl;
-  gsl_vector_set(d, 0, da);
-  gsl_vector_set(d, 1, db);
+  trans_llh_grad(*h, gsl_vector_get(x, 0), gsl_vector_get(x, 1), da, db);
+  gsl_vector_set(d, 0, -da);
+  gsl_vector_set(d, 1, -db);
 }
 
 void
 fdf(const gsl_vector *x, void *params, double *fp,
                        gsl_vector *d) {
-  *fp = f(x, params);
-  df(x, params, d);
+  const TransHistogram *h = static_cast<const TransHistogram *>(params);
+  double da = 0;
+  double db = 0;
+  *fp = -trans_llh_grad(*h, gsl_vector_get(x, 0), gsl_vector_get(x, 1),
+                        da, db);
+  gsl_vector_set(d, 0, -da);
+  gsl_vector_set(d, 1, -db);
 }
 
 
 void ExpTransEstimator::mle_CG(const matrix &r, const vector<size_t> &t) {
 
-  // build up parameter list
-  size_t n = t.size();
-  double params[5*n+1];
-
-  params[0] = n;  // the first parameter is the length of sequence
-  for (size_t i = 0; i < n; ++i) {
-    const size_t s = i * 5;
-    params[s+1] = r[0][i];
-    params[s+2] = r[1][i];
-    params[s+3] = r[2][i];
-    params[s+4] = r[3][i];
-    params[s+5] = t[i];
-  }
+  compress(r, t);
+  TransHistogram hist = {hist_t.size(), hist_t.data(), hist_bb.data(),
+                         hist_bf.data(), hist_fb.data(), hist_ff.data()};
 
   gsl_multimin_function_fdf func;
   func.f = &f;
   func.df = &df;
   func.fdf = &fdf;
   func.n = 2;
-  func.params = &params;
+  func.params = &hist;
 
   // set starting point
   gsl_vector *x = gsl_vector_alloc(2);
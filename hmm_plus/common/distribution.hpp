@@ -42,7 +42,12 @@ struct BetaBin
   BetaBin(const double a, const double b, const double t) :
   alpha(a), beta(b), lnbeta_helper(gsl_sf_lnbeta(a, b)), tolerance(t) {}
   
+  // a site with val.second == -1 holds an imputed level in
+  // val.first and one with -2 carries no information
   double operator()(const std::pair<double, double> &val) const;
+  // val.first methylated and val.second unmethylated reads
+  double observed(const std::pair<double, double> &val) const;
+  double imputed(const double level) const;
   
   void fit(const std::vector<double> &vals_a,
            const std::vector<double> &vals_b,
@@ -55,6 +60,36 @@ struct BetaBin
   double tolerance;
 };
 
+// consecutive sites [start, end) holding one kind of observation
+struct EmissionRun {
+  enum Kind {OBSERVED, IMPUTED, NEUTRAL};
+  EmissionRun(const size_t s, const size_t e, const Kind k) :
+    start(s), end(e), kind(k) {}
+  size_t start;
+  size_t end;
+  Kind kind;
+};
+
+// splits the sites by the kind of observation, once for all the
+// emission tables filled from them
+void
+split_emission_runs(const vector<std::pair<double, double> > &meth,
+                    vector<EmissionRun> &runs);
+
+// Evaluates distr at every observation in meth, one run at a time
+// with the formula for its kind. Integer observations are looked up
+// in a table keyed by (coverage, methylated count), so each distinct
+// pair costs one call to the special functions.
+void
+fill_log_emissions(const BetaBin &distr,
+                   const vector<std::pair<double, double> > &meth,
+                   const vector<EmissionRun> &runs, vector<double> &lemit);
+
+void
+fill_log_emissions(const BetaBin &distr,
+                   const vector<std::pair<double, double> > &meth,
+                   vector<double> &lemit);
+
 
 //////////////////////////////////////////////
 //////       struct CTHMM duration      //////
@@ -88,25 +123,25 @@ public:
   // GRADIENT ASCENT METHOD
   void mle_GradAscent(const matrix &r, const vector<size_t> &t);
   void GA_stepforward(const double grad_a, const double grad_b,
-                      const double &old_llh, double &new_llh,
-                      const matrix &r, const vector<size_t> &t);
+                      const double &old_llh, double &new_llh);
   void GA_stepforward_BB(const double grad_a, const double grad_b,
                          const double d_grad_a, const double d_grad_b,
                          double &d_a, double &d_b,
-                         const double &old_llh, double &new_llh,
-                         const matrix &r, const vector<size_t> &t);
+                         const double &old_llh, double &new_llh);
   // CONJUGATE GRADIENT METHOD
   void mle_CG(const matrix &r, const vector<size_t> &t);
 
 private:
   
-  void calc_internal_data(const vector<size_t> &t, const double v,
-                          vector<double> &ebt) const;
-  double calc_llh(const matrix &r, const double u,
-                  const vector<double> &ebt) const;
-  double llh_grad_a(const matrix &r, const vector<double> &ebt) const;
-  double llh_grad_b(const matrix &r, const vector<double> &ebt,
-                    const vector<size_t> &t) const;
+  void compress(const matrix &r, const vector<size_t> &t);
+  double calc_llh(const double u, const double v) const;
+  double calc_llh_grad(const double u, const double v,
+                       double &grad_a, double &grad_b) const;
+
+  // distinct distances with the transition posteriors summed over all
+  // intervals of that length; the M-step only depends on these sums
+  vector<double> hist_t;
+  vector<double> hist_bb, hist_bf, hist_fb, hist_ff;
 
   //  parameters
   double a, b;
@@ -121,10 +156,8 @@ private:
 //////       numerical                  //////
 //////////////////////////////////////////////
 
-inline double
-log_sum_log(const double p, const double q);
-
-inline double
-log_sub_log(const double p, const double q);
+// log of the sum of exp(vals[i]) over the first limit values
+double
+log_sum_log_vec(const vector<double> &vals, const size_t limit);
 
 #endif
@@ -0,0 +1,120 @@
+/*
+ * Convert a methcounts file to the binary columnar CpG format read by
+ * cthmm, vdhmr, BinarizeCpG and AssignCpGs
+ *
+ * Copyright (C) 2020-2021 University of Southern California
+ *                         Andrew D Smith
+ *
+ * Author: Andrew D. Smith, Xiaojing Ji
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <cmath>
+#include <fstream>
+
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+#include "OptionParser.hpp"
+#include "CpGBinary.hpp"
+
+using std::string;
+using std::vector;
+using std::endl;
+using std::cerr;
+
+
+static size_t
+convert_cpgs(const string &cpgs_file, CpGBinaryWriter &out) {
+  string chrom, strand, seq;
+  size_t pos;
+  double level;
+  size_t coverage;
+
+  std::ifstream in(cpgs_file.c_str());
+  if (!in)
+    throw SMITHLABException("cannot open input file " + cpgs_file);
+
+  size_t n_sites = 0;
+  while (in >> chrom >> pos >> strand >> seq >> level >> coverage) {
+    if (chrom.empty() || strand.empty() || seq.empty()
+        || level < 0.0 || level > 1.0) {
+      std::ostringstream oss;
+      oss << chrom << "\t" << pos << "\t" << strand << "\t"
+          << seq << "\t" << level << "\t" << coverage << "\n";
+      throw SMITHLABException("Invalid input line:" + oss.str());
+    }
+    const size_t meth = static_cast<size_t>(round(level * coverage));
+    out.add(chrom, pos, meth, coverage - meth);
+    ++n_sites;
+  }
+  return n_sites;
+}
+
+
+int
+main(int argc, const char **argv) {
+
+  try {
+
+    bool VERBOSE = false;
+    string outfile;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), "Convert a sorted "
+                           "methcounts file to binary CpG format",
+                           "<cpg-BED-file>");
+    opt_parse.add_opt("out", 'o', "output binary file", true, outfile);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.empty()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const string cpgs_file = leftover_args.front();
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    CpGBinaryWriter out(outfile);
+    const size_t n_sites = convert_cpgs(cpgs_file, out);
+    out.close();
+    if (VERBOSE)
+      cerr << "WROTE " << n_sites << " CPGS TO " << outfile << endl;
+  }
+  catch (SMITHLABException &e) {
+    cerr << "ERROR:\t" << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
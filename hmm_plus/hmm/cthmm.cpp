@@ -26,14 +26,30 @@
 #include <cmath>
 #include <fstream>
 #include <iomanip>
+#include <random>
+#include <algorithm>
+#include <sstream>
+#include <map>
+#include <list>
 
 #include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "OptionParser.hpp"
 #include "TwoStateCTHMM.hpp"
+#include "CpGBinary.hpp"
+#include "CpGStream.hpp"
+#include "WarmStart.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
+#include "LocalServer.hpp"
 #include "distribution.hpp"
 
 
@@ -57,11 +73,35 @@ select_vector_elements(const vector<T> &fullset, vector<T> &subset,
   }
 }
 
+static void
+load_cpgs_binary(const string &cpgs_file, vector<SimpleGenomicRegion> &cpgs,
+                 vector<pair<double, double> > &meth, vector<size_t> &reads) {
+  const CpGBinaryReader in(cpgs_file);
+  const uint32_t *pos = in.positions();
+  const uint16_t *n_meth = in.meth();
+  const uint16_t *n_unmeth = in.unmeth();
+  cpgs.reserve(in.size());
+  meth.reserve(in.size());
+  reads.reserve(in.size());
+  for (size_t c = 0; c < in.n_chroms(); ++c)
+    for (size_t i = in.chrom_begin(c); i < in.chrom_end(c); ++i) {
+      cpgs.push_back(SimpleGenomicRegion(in.chrom_name(c), pos[i], pos[i] + 1));
+      reads.push_back(n_meth[i] + n_unmeth[i]);
+      meth.push_back(std::make_pair(n_meth[i], n_unmeth[i]));
+    }
+}
+
+
 static void
 load_cpgs(const string &cpgs_file, vector<SimpleGenomicRegion> &cpgs,
           vector<pair<double, double> > &meth, vector<size_t> &reads)
 {
 
+  if (CpGBinaryReader::is_cpg_binary(cpgs_file)) {
+    load_cpgs_binary(cpgs_file, cpgs, meth, reads);
+    return;
+  }
+
   string chrom, prev_chrom;
   size_t pos, prev_pos = 0;
   string strand, seq;
@@ -95,6 +135,58 @@ load_cpgs(const string &cpgs_file, vector<SimpleGenomicRegion> &cpgs,
   }
 }
 
+// Loads the counts of a cohort sample, which must hold the same sites
+// as the reference cpgs; the coordinates themselves are not kept
+static void
+load_cohort_sample(const string &cpgs_file,
+                   const vector<SimpleGenomicRegion> &cpgs,
+                   vector<pair<double, double> > &meth, vector<size_t> &reads) {
+  const string mismatch("sites of " + cpgs_file +
+                        " differ from those of the first sample");
+  meth.clear();
+  reads.clear();
+  meth.reserve(cpgs.size());
+  reads.reserve(cpgs.size());
+
+  if (CpGBinaryReader::is_cpg_binary(cpgs_file)) {
+    const CpGBinaryReader in(cpgs_file);
+    const uint32_t *pos = in.positions();
+    const uint16_t *n_meth = in.meth();
+    const uint16_t *n_unmeth = in.unmeth();
+    if (in.size() != cpgs.size())
+      throw SMITHLABException(mismatch);
+    for (size_t c = 0; c < in.n_chroms(); ++c) {
+      const string chrom(in.chrom_name(c));
+      for (size_t i = in.chrom_begin(c); i < in.chrom_end(c); ++i) {
+        if (cpgs[i].get_start() != pos[i] || cpgs[i].get_chrom() != chrom)
+          throw SMITHLABException(mismatch);
+        reads.push_back(n_meth[i] + n_unmeth[i]);
+        meth.push_back(std::make_pair(n_meth[i], n_unmeth[i]));
+      }
+    }
+    return;
+  }
+
+  std::ifstream in(cpgs_file.c_str());
+  if (!in)
+    throw SMITHLABException("cannot open input file " + cpgs_file);
+  string chrom, strand, seq;
+  size_t pos, coverage;
+  double level;
+  while (in >> chrom >> pos >> strand >> seq >> level >> coverage) {
+    const size_t i = meth.size();
+    if (i == cpgs.size() || cpgs[i].get_start() != pos ||
+        cpgs[i].get_chrom() != chrom)
+      throw SMITHLABException(mismatch);
+    reads.push_back(coverage);
+    meth.push_back(std::make_pair(0.0, 0.0));
+    meth.back().first = static_cast<size_t>(round(level * coverage));
+    meth.back().second = static_cast<size_t>(coverage  - meth.back().first);
+  }
+  if (meth.size() != cpgs.size())
+    throw SMITHLABException(mismatch);
+}
+
 /*
 static void
 load_coordinates(const string &interp_coord_file,
@@ -189,22 +281,89 @@ static void
 read_params_file(const bool VERBOSE, const string &params_file,
                  double &fg_rate, double &bg_rate,
                  double &fg_alpha, double &fg_beta,
-                 double &bg_alpha, double &bg_beta) {
+                 double &bg_alpha, double &bg_beta,
+                 double &p_sf, double &p_sb) {
   string jnk;
   std::ifstream in(params_file.c_str());
+  if (!in)
+    throw SMITHLABException("cannot open params file " + params_file);
   in >> jnk >> fg_rate
      >> jnk >> bg_rate
      >> jnk >> fg_alpha
      >> jnk >> fg_beta
      >> jnk >> bg_alpha
      >> jnk >> bg_beta;
+  if (!in)
+    throw SMITHLABException("bad params file " + params_file);
+  // older files end before the start probabilities
+  double sf = 0, sb = 0;
+  if (in >> jnk >> sf >> jnk >> sb) {
+    p_sf = sf;
+    p_sb = sb;
+  }
   if (VERBOSE)
     cerr << "F_RATE\t" << fg_rate << endl
          << "B_RATE\t" << bg_rate << endl
          << "F_ALPHA\t" << fg_alpha << endl
          << "F_BETA\t" << fg_beta << endl
          << "B_ALPHA\t" << bg_alpha << endl
-         << "B_BETA\t" << bg_beta << endl;
+         << "B_BETA\t" << bg_beta << endl
+         << "S_F\t" << p_sf << endl
+         << "S_B\t" << p_sb << endl;
+}
+
+
+static void
+write_params_file(const string &outfile, const TwoVarHMM &hmm) {
+  std::ofstream out(outfile.c_str());
+  if (!out)
+    throw SMITHLABException("cannot open params file " + outfile);
+  out.precision(30);
+  out << "F_RATE\t" << hmm.get_fg_rate() << endl
+      << "B_RATE\t" << hmm.get_bg_rate() << endl
+      << "F_ALPHA\t" << hmm.get_fg_emission().alpha << endl
+      << "F_BETA\t" << hmm.get_fg_emission().beta << endl
+      << "B_ALPHA\t" << hmm.get_bg_emission().alpha << endl
+      << "B_BETA\t" << hmm.get_bg_emission().beta << endl
+      << "S_F\t" << hmm.get_p_sf() << endl
+      << "S_B\t" << hmm.get_p_sb() << endl;
+  if (!out)
+    throw SMITHLABException("error writing params file " + outfile);
+}
+
+
+// Cuts each chromosome of the covered sites into blocks of block_size
+// and keeps a stratified fraction of the blocks, joined as if each
+// were its own chromosome
+static void
+subsample_blocks(const vector<pair<double, double> > &meth,
+                 const vector<size_t> &time, const double fraction,
+                 const size_t block_size,
+                 vector<pair<double, double> > &smeth,
+                 vector<size_t> &stime) {
+  vector<size_t> starts(1, 0), strata(1, 0);
+  size_t chrom = 0;
+  for (size_t i = 1; i < meth.size(); ++i) {
+    const bool new_chrom = (time[i - 1] == numeric_limits<size_t>::max());
+    if (new_chrom || i - starts.back() == block_size) {
+      chrom += new_chrom;
+      starts.push_back(i);
+      strata.push_back(chrom);
+    }
+  }
+  starts.push_back(meth.size());
+
+  vector<size_t> chosen;
+  select_training_blocks(starts, strata, fraction, chosen);
+  smeth.clear();
+  stime.clear();
+  for (size_t j = 0; j < chosen.size(); ++j) {
+    const size_t first = starts[chosen[j]], last = starts[chosen[j] + 1];
+    if (!smeth.empty())
+      stime.push_back(numeric_limits<size_t>::max());
+    smeth.insert(smeth.end(), meth.begin() + first, meth.begin() + last);
+    stime.insert(stime.end(), time.begin() + first, time.begin() + last - 1);
+  }
 }
 
 
@@ -234,22 +393,66 @@ get_domain_scores(const vector<int> &classes,
       score = 0;
     }
   }
+  if (in_domain)
+    scores.push_back(score);
 }
 
 
+// a shuffle replicate as decoded, kept to rebuild its domains at
+// another posterior threshold
+struct NullReplicate {
+  vector<pair<double, double> > meth;
+  vector<double> post;
+};
+
+// Decode n_shuffles random permutations of the data in parallel. Each
+// thread owns a copy of the trained parameters, without the lattices
+// of training, and a scratch array, so their buffers are reused across
+// replicates. Replicate r draws from its own stream seeded by
+// (rng_seed, r), and the sorted replicate scores are merged in
+// replicate order, so results do not depend on the threads. Without
+// PARALLEL the replicates are decoded by the calling thread alone, for
+// callers that are already spread over the threads. With kept, the
+// replicates themselves are also returned.
 static void
-shuffle_cpgs(TwoVarHMM &hmm, vector<pair<double, double> > meth,
+shuffle_cpgs(const TwoVarHMM &hmm, const vector<pair<double, double> > &meth,
              const vector<size_t> &mytime, vector<double> &domain_scores,
-             const vector<size_t> &cov_idx) {
-
-  srand(time(0) + getpid());
-  random_shuffle(meth.begin(), meth.end());
+             const vector<size_t> &cov_idx, const size_t n_shuffles,
+             const size_t rng_seed, const bool PARALLEL,
+             vector<NullReplicate> *kept = 0) {
+
+  vector<vector<double> > replicate_scores(n_shuffles);
+  if (kept)
+    kept->resize(n_shuffles);
+#pragma omp parallel if (PARALLEL)
+  {
+    TwoVarHMM worker(hmm.parameter_copy());
+    vector<pair<double, double> > shuffled;
+    vector<int> classes;
+    vector<double> scores;
+#pragma omp for schedule(dynamic)
+    for (size_t r = 0; r < n_shuffles; ++r) {
+      std::seed_seq seeds{rng_seed, r};
+      std::mt19937 gen(seeds);
+      shuffled.assign(meth.begin(), meth.end());
+      std::shuffle(shuffled.begin(), shuffled.end(), gen);
+      worker.PosteriorDecoding(shuffled, mytime, classes, scores);
+      get_domain_scores(classes, shuffled, replicate_scores[r], cov_idx);
+      sort(replicate_scores[r].begin(), replicate_scores[r].end());
+      if (kept) {
+        (*kept)[r].meth.swap(shuffled);
+        (*kept)[r].post.swap(scores);
+      }
+    }
+  }
 
-  vector<int> classes;
-  vector<double> scores;
-  hmm.PosteriorDecoding(meth, mytime, classes, scores);
-  get_domain_scores(classes, meth, domain_scores, cov_idx);
-  sort(domain_scores.begin(), domain_scores.end());
+  for (size_t r = 0; r < n_shuffles; ++r) {
+    const size_t n_merged = domain_scores.size();
+    domain_scores.insert(domain_scores.end(), replicate_scores[r].begin(),
+                         replicate_scores[r].end());
+    std::inplace_merge(domain_scores.begin(), domain_scores.begin() + n_merged,
+                       domain_scores.end());
+  }
 }
 
 
@@ -327,6 +530,540 @@ build_domains(const bool VERBOSE,
     }
     prev_end = cpgs[cov_idx[i]].get_end();
   }
+  if (in_domain) {
+    domains.back().set_end(prev_end);
+    domains.back().set_score(n_cpgs);
+  }
+}
+
+
+// Decode one chromosome at a time, writing the per-site outputs as
+// they are produced. Only the domains and their p-values are kept,
+// since the FDR cutoff needs all of them.
+static void
+decode_chromosomes(const bool VERBOSE, const bool IMPUT,
+                   const string &cpgs_file, TwoVarHMM &hmm,
+                   const vector<double> &random_scores,
+                   const string &scores_file, const string &compled_cpgs_file,
+                   vector<GenomicRegion> &domains, vector<double> &p_values) {
+
+  BufferedWriter *out_scores = scores_file.empty() ?
+    0 : new BufferedWriter(scores_file);
+  BufferedWriter *out_cpgs = (IMPUT && !compled_cpgs_file.empty()) ?
+    new BufferedWriter(compled_cpgs_file) : 0;
+
+  CpGChromStream in(cpgs_file);
+  CpGBlock chrom;
+  while (in.next(chrom)) {
+    vector<size_t> cov_idx;
+    mark_missing_cpg(false, chrom.reads, chrom.meth, cov_idx);
+    if (cov_idx.empty())
+      continue;
+    if (VERBOSE)
+      cerr << "[DECODING " << chrom.cpgs.front().get_chrom() << ": "
+           << cov_idx.size() << " COVERED CPGS]" << endl;
+
+    vector< pair<double, double> > cmeth;
+    select_vector_elements(chrom.meth, cmeth, cov_idx);
+    vector<size_t> ctime;
+    time_between_cpgs(chrom.cpgs, ctime, cov_idx);
+
+    vector<int> classes;
+    vector<double> scores;
+    ProfileTimer decode_timer("decode", IMPUT ? chrom.size() : cov_idx.size());
+    if (IMPUT) {
+      vector<size_t> time;
+      time_between_cpgs(chrom.cpgs, time);
+      hmm.PosteriorDecoding(chrom.meth, time, classes, scores, IMPUT);
+    } else {
+      hmm.PosteriorDecoding(cmeth, ctime, classes, scores);
+    }
+
+    vector<double> domain_scores;
+    get_domain_scores(classes, cmeth, domain_scores, cov_idx);
+    assign_p_values(random_scores, domain_scores, p_values);
+    build_domains(VERBOSE, chrom.cpgs, scores, classes, domains, cov_idx);
+    decode_timer.stop();
+
+    ProfileTimer output_timer("output", chrom.size());
+    if (out_scores)
+      for (size_t i = 0; i < cov_idx.size(); ++i)
+        *out_scores << chrom.cpgs[cov_idx[i]] << '\t' << scores[i] << '\n';
+
+    if (out_cpgs)
+      for (size_t i = 0; i < chrom.size(); ++i) {
+        const double denom = (chrom.meth[i].second < 0) ?
+          1 : (chrom.meth[i].first + chrom.meth[i].second);
+        *out_cpgs << chrom.cpgs[i] << '\t' << chrom.meth[i].first / denom
+                  << '\t' << chrom.reads[i] << '\n';
+      }
+  }
+  if (out_scores) {
+    out_scores->close();
+    delete out_scores;
+  }
+  if (out_cpgs) {
+    out_cpgs->close();
+    delete out_cpgs;
+  }
+}
+
+
+static void
+write_profile(const string &profile_file) {
+  if (profile_file.empty())
+    return;
+  std::ofstream profile_out(profile_file.c_str());
+  if (!profile_out)
+    throw SMITHLABException("cannot open profile file " + profile_file);
+  Profile::get().write_json(profile_out, "cthmm");
+}
+
+
+static const double DEFAULT_FDR = 0.01;
+
+// The indices of the domains reported at FDR level fdr: those below
+// the cutoff of the p-values, or all of them with NOFDR
+static void
+select_domains(const vector<double> &p_values, const double fdr,
+               const bool NOFDR, vector<size_t> &selected) {
+  const double fdr_cutoff = p_values.empty() ?
+    numeric_limits<double>::max() : get_fdr_cutoff(p_values, fdr);
+  selected.clear();
+  for (size_t i = 0; i < p_values.size(); ++i)
+    if (p_values[i] < fdr_cutoff || NOFDR)
+      selected.push_back(i);
+}
+
+// Writes the selected domains, numbered in order
+static void
+write_domains(const string &outfile, vector<GenomicRegion> &domains,
+              const vector<double> &p_values, const bool NOFDR) {
+  vector<size_t> selected;
+  select_domains(p_values, DEFAULT_FDR, NOFDR, selected);
+
+  BufferedWriter out(outfile);
+  for (size_t k = 0; k < selected.size(); ++k) {
+    const size_t i = selected[k];
+    domains[i].set_name("HYPO" + smithlab::toa(k));
+    out << domains[i] << '\t' << p_values[i] << '\n';
+  }
+  out.close();
+}
+
+
+/* Cohort mode: samples measured at the sites of the first sample are
+ * trained by group and decoded in one process. Each line of the
+ * cohort file names a sample file and optionally its group; samples
+ * without one are pooled in group "all". The distances between sites
+ * are computed once, and the transition table once per group model,
+ * then shared by every sample of the group. All sites of a sample are
+ * decoded, the uncovered ones with an emission equal in both states,
+ * which leaves the posteriors of its covered sites as when decoding
+ * those alone. Threads take batches of COHORT_BATCH samples, loading,
+ * decoding and writing them in turn, so only the counts of the
+ * batches in flight are held.
+ */
+static const size_t COHORT_BATCH = 8;
+
+struct Cohort {
+  vector<string> files;
+  vector<string> outfiles;
+  vector<string> group_names;
+  vector<vector<size_t> > groups; // samples of each group, in file order
+};
+
+
+static void
+read_cohort(const string &cohort_file, const string &outdir, Cohort &cohort) {
+  std::ifstream in(cohort_file.c_str());
+  if (!in)
+    throw SMITHLABException("cannot open cohort file " + cohort_file);
+  std::map<string, size_t> group_ids, names;
+  string line;
+  while (getline(in, line)) {
+    std::istringstream iss(line);
+    string file, group;
+    if (!(iss >> file))
+      continue;
+    if (!(iss >> group))
+      group = "all";
+    const string name(strip_path_and_suffix(file));
+    if (!names.insert(std::make_pair(name, cohort.files.size())).second)
+      throw SMITHLABException("two cohort samples are named " + name);
+    if (group_ids.find(group) == group_ids.end()) {
+      group_ids[group] = cohort.groups.size();
+      cohort.group_names.push_back(group);
+      cohort.groups.push_back(vector<size_t>());
+    }
+    cohort.groups[group_ids[group]].push_back(cohort.files.size());
+    cohort.files.push_back(file);
+    cohort.outfiles.push_back(path_join(outdir, name + ".hmr"));
+  }
+  if (cohort.files.empty())
+    throw SMITHLABException("no samples in cohort file " + cohort_file);
+}
+
+
+// Trains hmm on the covered sites of the samples of a group, each as
+// its own sequence; below a train fraction of 1 each sample gives a
+// subsample of its blocks
+static void
+train_cohort_group(const Cohort &cohort, const vector<size_t> &members,
+                   const vector<SimpleGenomicRegion> &cpgs,
+                   const double train_fraction, const size_t block_size,
+                   TwoVarHMM &hmm) {
+  vector<pair<double, double> > meth, cmeth, smeth, pooled;
+  vector<size_t> reads, ctime, stime, pooled_time;
+  for (size_t j = 0; j < members.size(); ++j) {
+    load_cohort_sample(cohort.files[members[j]], cpgs, meth, reads);
+    vector<size_t> cov_idx;
+    mark_missing_cpg(false, reads, meth, cov_idx);
+    if (cov_idx.empty())
+      continue;
+    cmeth.clear();
+    ctime.clear();
+    select_vector_elements(meth, cmeth, cov_idx);
+    time_between_cpgs(cpgs, ctime, cov_idx);
+    if (train_fraction < 1.0) {
+      subsample_blocks(cmeth, ctime, train_fraction, block_size, smeth, stime);
+      cmeth.swap(smeth);
+      ctime.swap(stime);
+    }
+    if (!pooled.empty())
+      pooled_time.push_back(numeric_limits<size_t>::max());
+    pooled.insert(pooled.end(), cmeth.begin(), cmeth.end());
+    pooled_time.insert(pooled_time.end(), ctime.begin(), ctime.end());
+  }
+  if (pooled.empty())
+    throw SMITHLABException("no covered sites to train on");
+  hmm.BaumWelchTraining(pooled, pooled_time);
+}
+
+
+// the domains and their p-values of one decoded sample, as in the
+// single sample mode; the shuffles run on the calling thread, as the
+// samples are already decoded in parallel
+static void
+cohort_sample_domains(const TwoVarHMM &hmm,
+                      const vector<SimpleGenomicRegion> &cpgs,
+                      const vector<pair<double, double> > &meth,
+                      const vector<size_t> &cov_idx,
+                      const vector<int> &classes,
+                      const vector<double> &post_scores,
+                      const size_t n_shuffles, const size_t rng_seed,
+                      vector<GenomicRegion> &domains,
+                      vector<double> &p_values) {
+  if (cov_idx.empty())
+    return;
+
+  vector<pair<double, double> > cmeth;
+  select_vector_elements(meth, cmeth, cov_idx);
+  vector<size_t> ctime;
+  time_between_cpgs(cpgs, ctime, cov_idx);
+
+  vector<double> domain_scores, random_scores;
+  get_domain_scores(classes, cmeth, domain_scores, cov_idx);
+  shuffle_cpgs(hmm, cmeth, ctime, random_scores, cov_idx,
+               n_shuffles, rng_seed, false);
+  assign_p_values(random_scores, domain_scores, p_values);
+  build_domains(false, cpgs, post_scores, classes, domains, cov_idx);
+}
+
+
+// Decodes the samples of a group with its trained model and writes
+// the HMRs of each. Sample k draws its shuffles from seed rng_seed + k.
+static void
+decode_cohort_group(const Cohort &cohort, const vector<size_t> &members,
+                    const vector<SimpleGenomicRegion> &cpgs,
+                    const TwoVarHMM &hmm, const Lattice<double> &table,
+                    const size_t n_shuffles, const size_t rng_seed,
+                    const bool NOFDR) {
+  const size_t n_batches = (members.size() + COHORT_BATCH - 1)/COHORT_BATCH;
+  string error;
+#pragma omp parallel
+  {
+    TwoVarHMM worker(hmm.parameter_copy());
+    vector<vector<pair<double, double> > > meths;
+    vector<size_t> reads;
+    vector<vector<size_t> > cov_idx;
+    vector<vector<int> > classes;
+    vector<vector<double> > llr_scores;
+    vector<double> scores;
+#pragma omp for schedule(dynamic)
+    for (size_t b = 0; b < n_batches; ++b) {
+      try {
+        const size_t first = b*COHORT_BATCH;
+        meths.resize(min(COHORT_BATCH, members.size() - first));
+        cov_idx.resize(meths.size());
+        for (size_t j = 0; j < meths.size(); ++j) {
+          load_cohort_sample(cohort.files[members[first + j]], cpgs,
+                             meths[j], reads);
+          cov_idx[j].clear();
+          mark_missing_cpg(false, reads, meths[j], cov_idx[j]);
+        }
+        worker.PosteriorDecoding(meths, table, classes, llr_scores, scores);
+        for (size_t j = 0; j < meths.size(); ++j) {
+          const size_t k = members[first + j];
+          vector<GenomicRegion> domains;
+          vector<double> p_values;
+          cohort_sample_domains(worker, cpgs, meths[j], cov_idx[j],
+                                classes[j], llr_scores[j], n_shuffles,
+                                rng_seed + k, domains, p_values);
+          write_domains(cohort.outfiles[k], domains, p_values, NOFDR);
+        }
+      }
+      catch (SMITHLABException &e) {
+#pragma omp critical
+        if (error.empty()) error = e.what();
+      }
+      catch (std::exception &e) {
+#pragma omp critical
+        if (error.empty()) error = e.what();
+      }
+    }
+  }
+  if (!error.empty())
+    throw SMITHLABException(error);
+}
+
+
+static void
+run_cohort(const bool VERBOSE, const Cohort &cohort, const string &outdir,
+           const vector<SimpleGenomicRegion> &cpgs, const TwoVarHMM &hmm,
+           const bool TRAIN, const double train_fraction,
+           const size_t block_size, const size_t n_shuffles,
+           const size_t rng_seed, const bool NOFDR) {
+  vector<size_t> time;
+  time_between_cpgs(cpgs, time);
+
+  for (size_t g = 0; g < cohort.groups.size(); ++g) {
+    const vector<size_t> &members = cohort.groups[g];
+    if (VERBOSE)
+      cerr << "[COHORT GROUP " << cohort.group_names[g] << ": "
+           << members.size() << " SAMPLES]" << endl;
+    TwoVarHMM group_hmm(hmm.parameter_copy());
+    if (TRAIN) {
+      ProfileTimer train_timer("train", members.size()*cpgs.size());
+      train_cohort_group(cohort, members, cpgs, train_fraction, block_size,
+                         group_hmm);
+      train_timer.stop();
+      write_params_file(path_join(outdir, cohort.group_names[g] + ".params"),
+                        group_hmm);
+    }
+    ProfileTimer decode_timer("decode", members.size()*cpgs.size());
+    Lattice<double> table;
+    group_hmm.transition_table(time, table);
+    decode_cohort_group(cohort, members, cpgs, group_hmm, table,
+                        n_shuffles, rng_seed, NOFDR);
+  }
+}
+
+
+
+/* Serve mode: after the usual run, the sites, the posteriors of the
+ * sample and the shuffle replicates stay in memory, and HMRs at other
+ * settings are answered on a local socket (see LocalServer). A
+ * request is one line of settings,
+ *
+ *   fdr=<level>               FDR level of the p-values (default 0.01)
+ *   nofdr                     every domain, as -f
+ *   posterior=<p>             domains of the sites with a foreground
+ *                             posterior of at least p (default: the
+ *                             decoded classes, as in the output file)
+ *   region=<chrom:start-end>  only the HMRs overlapping the region
+ *
+ * or "shutdown". The response has the lines of the HMR file, numbered
+ * over the whole genome, or one line starting with ERROR. The domains
+ * and p-values of each posterior threshold are built once and cached,
+ * so a request at a known threshold only finds the FDR cutoff; when
+ * the cache is full, the threshold used least recently is dropped,
+ * but never the decoded classes. The
+ * socket is bound before the input is read, so clients that connect
+ * early wait for the run to finish.
+ */
+static const size_t MAX_CACHED_THRESHOLDS = 8;
+// the cache key of the decoded classes, below any threshold
+static const double DECODED_CLASSES = -1.0;
+
+struct HMRRequest {
+  HMRRequest() : fdr(DEFAULT_FDR), NOFDR(false),
+                 posterior(DECODED_CLASSES), start(0),
+                 end(numeric_limits<size_t>::max()), shutdown(false) {}
+  double fdr;
+  bool NOFDR;
+  double posterior;
+  string chrom;
+  size_t start, end;
+  bool shutdown;
+};
+
+struct ThresholdDomains {
+  vector<GenomicRegion> domains;
+  vector<double> p_values;
+  // position in the order of use; unused for the decoded classes
+  std::list<double>::iterator use;
+};
+
+static double
+request_number(const string &key, const string &value) {
+  char *end = 0;
+  const double x = strtod(value.c_str(), &end);
+  if (value.empty() || *end != '\0' || !std::isfinite(x))
+    throw SMITHLABException("bad value for " + key + ": " + value);
+  return x;
+}
+
+static void
+parse_request(const string &line, HMRRequest &req) {
+  std::istringstream iss(line);
+  string token;
+  size_t n_tokens = 0;
+  while (iss >> token) {
+    ++n_tokens;
+    const size_t eq = token.find('=');
+    const string key = token.substr(0, eq);
+    const string value = eq == string::npos ? "" : token.substr(eq + 1);
+    if (key == "shutdown" && eq == string::npos)
+      req.shutdown = true;
+    else if (key == "nofdr" && eq == string::npos)
+      req.NOFDR = true;
+    else if (key == "fdr")
+      req.fdr = request_number(key, value);
+    else if (key == "posterior") {
+      req.posterior = request_number(key, value);
+      if (req.posterior < 0.0 || req.posterior > 1.0)
+        throw SMITHLABException("posterior must be in [0, 1]: " + value);
+    }
+    else if (key == "region") {
+      const size_t colon = value.rfind(':');
+      const size_t dash = value.find('-', colon == string::npos ? 0 : colon);
+      if (colon == string::npos || colon == 0 || dash == string::npos)
+        throw SMITHLABException("bad region, not chrom:start-end: " + value);
+      req.chrom = value.substr(0, colon);
+      req.start = request_number(key, value.substr(colon + 1,
+                                                   dash - colon - 1));
+      req.end = request_number(key, value.substr(dash + 1));
+      if (req.end < req.start)
+        throw SMITHLABException("bad region, end before start: " + value);
+    }
+    else throw SMITHLABException("unknown request setting: " + token);
+  }
+  if (n_tokens == 0)
+    throw SMITHLABException("empty request");
+}
+
+// domains and p-values with classes from thresholding the posteriors
+// of the sample and of each shuffle replicate
+static void
+threshold_domains(const vector<SimpleGenomicRegion> &cpgs,
+                  const vector<pair<double, double> > &cmeth,
+                  const vector<size_t> &cov_idx, const vector<double> &scores,
+                  const vector<NullReplicate> &null, const double posterior,
+                  ThresholdDomains &td) {
+  vector<vector<double> > replicate_scores(null.size());
+#pragma omp parallel
+  {
+    vector<int> classes;
+#pragma omp for schedule(dynamic)
+    for (size_t r = 0; r < null.size(); ++r) {
+      classes.resize(null[r].post.size());
+      for (size_t i = 0; i < classes.size(); ++i)
+        classes[i] = null[r].post[i] >= posterior ? 1 : 0;
+      get_domain_scores(classes, null[r].meth, replicate_scores[r], cov_idx);
+    }
+  }
+  vector<double> random_scores;
+  for (size_t r = 0; r < null.size(); ++r)
+    random_scores.insert(random_scores.end(), replicate_scores[r].begin(),
+                         replicate_scores[r].end());
+  sort(random_scores.begin(), random_scores.end());
+
+  vector<int> classes(scores.size());
+  for (size_t i = 0; i < classes.size(); ++i)
+    classes[i] = scores[i] >= posterior ? 1 : 0;
+  vector<double> domain_scores;
+  get_domain_scores(classes, cmeth, domain_scores, cov_idx);
+  assign_p_values(random_scores, domain_scores, td.p_values);
+  build_domains(false, cpgs, scores, classes, td.domains, cov_idx);
+}
+
+static void
+answer_request(const HMRRequest &req, const ThresholdDomains &td,
+               std::ostream &out) {
+  vector<size_t> selected;
+  select_domains(td.p_values, req.fdr, req.NOFDR, selected);
+  for (size_t k = 0; k < selected.size(); ++k) {
+    GenomicRegion d(td.domains[selected[k]]);
+    if (!req.chrom.empty() &&
+        (d.get_chrom() != req.chrom || d.get_end() <= req.start ||
+         d.get_start() >= req.end))
+      continue;
+    d.set_name("HYPO" + smithlab::toa(k));
+    out << d << '\t' << td.p_values[selected[k]] << '\n';
+  }
+}
+
+static void
+serve_hmrs(const bool VERBOSE, LocalServer &server,
+           const vector<SimpleGenomicRegion> &cpgs,
+           const vector<pair<double, double> > &cmeth,
+           const vector<size_t> &cov_idx, const vector<double> &scores,
+           const vector<NullReplicate> &null,
+           vector<GenomicRegion> &domains, vector<double> &p_values) {
+  std::map<double, ThresholdDomains> cache;
+  // the cached thresholds other than the decoded classes, most
+  // recently used first
+  std::list<double> recent;
+  cache[DECODED_CLASSES].domains.swap(domains);
+  cache[DECODED_CLASSES].p_values.swap(p_values);
+
+  if (VERBOSE)
+    cerr << "[SERVING HMRS ON " << server.get_path() << "]" << endl;
+  string line;
+  bool stop = false;
+  while (!stop && server.next_request(line)) {
+    ProfileTimer request_timer("request");
+    std::ostringstream response;
+    try {
+      HMRRequest req;
+      parse_request(line, req);
+      if (req.shutdown) {
+        response << "OK\n";
+        stop = true;
+      }
+      else {
+        std::map<double, ThresholdDomains>::iterator td =
+          cache.find(req.posterior);
+        if (td == cache.end()) {
+          if (cache.size() >= MAX_CACHED_THRESHOLDS) {
+            cache.erase(recent.back());
+            recent.pop_back();
+          }
+          ThresholdDomains built;
+          threshold_domains(cpgs, cmeth, cov_idx, scores, null,
+                            req.posterior, built);
+          td = cache.insert(std::make_pair(req.posterior,
+                                           ThresholdDomains())).first;
+          td->second.domains.swap(built.domains);
+          td->second.p_values.swap(built.p_values);
+          recent.push_front(req.posterior);
+          td->second.use = recent.begin();
+        }
+        else if (td->first != DECODED_CLASSES)
+          recent.splice(recent.begin(), recent, td->second.use);
+        answer_request(req, td->second, response);
+      }
+    }
+    catch (SMITHLABException &e) {
+      response.str("");
+      response << "ERROR\t" << e.what() << '\n';
+    }
+    server.respond(response.str());
+    request_timer.stop();
+    if (VERBOSE)
+      cerr << "[REQUEST: " << line << "]" << endl;
+  }
 }
 
 
@@ -356,6 +1093,31 @@ main(int argc, const char **argv) {
     string params_in_file;
     string outfile, scores_file, compled_cpgs_file; // outputs
 
+    size_t n_shuffles = 1;
+    size_t rng_seed = time(0) + getpid();
+    size_t n_threads = 1;
+
+    // stream mode: train on a sample, decode a chromosome at a time
+    bool STREAM = false;
+    size_t train_every = 10;
+    static const size_t TRAIN_BLOCK_SIZE = 100000;
+    // keep every sqrt(n)-th lattice row while decoding
+    bool CHECKPOINT = false;
+    // SQUAREM steps between the EM passes of training
+    bool ACCELERATE = false;
+    // train on part of the blocks, then refine on all the data
+    double train_fraction = 1.0;
+    static const size_t SUBSAMPLE_BLOCK_SIZE = 10000;
+    static const size_t REFINE_ITERATIONS = 2;
+    // fitted parameters by input and settings, reused instead of training
+    string param_cache_dir;
+    // JSON report of the time and memory of each phase
+    string profile_file;
+    // samples trained by group and decoded together
+    string cohort_file, cohort_out;
+    // socket on which to answer requests for HMRs after the run
+    string serve_socket;
+
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "Program for identifying "
 			   "HMRs in methylation data", "<cpg-BED-file>");
@@ -379,6 +1141,38 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("bgrate", 'B', "bg rate", false, bg_rate);
     opt_parse.add_opt("itr", 'i', "max iterations", false, max_iterations);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    opt_parse.add_opt("shuffles", 'N', "number of shuffles for the "
+                      "domain score null", false, n_shuffles);
+    opt_parse.add_opt("seed", 'e', "rng seed for the shuffles "
+                      "(default: from time)", false, rng_seed);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("stream", 'w', "decode one chromosome at a time",
+                      false, STREAM);
+    opt_parse.add_opt("train-every", 'k', "in stream mode train on every "
+                      "k-th block of " + toa(TRAIN_BLOCK_SIZE) + " sites "
+                      "of each chromosome",
+                      false, train_every);
+    opt_parse.add_opt("checkpoint", 'L', "decode in O(sqrt(n)) memory, "
+                      "about twice as slow", false, CHECKPOINT);
+    opt_parse.add_opt("accelerate", 'A', "accelerate training with SQUAREM "
+                      "steps", false, ACCELERATE);
+    opt_parse.add_opt("train-fraction", 'T', "train on this fraction of the "
+                      "blocks of each chromosome, then refine on all sites",
+                      false, train_fraction);
+    opt_parse.add_opt("param-cache", 'C', "directory of fitted parameters "
+                      "reused for the same input and settings",
+                      false, param_cache_dir);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, profile_file);
+    opt_parse.add_opt("cohort", '\0', "file of samples at the same sites, "
+                      "one per line with an optional group name, to train "
+                      "by group and decode in one run", false, cohort_file);
+    opt_parse.add_opt("cohort-out", '\0', "directory for the HMRs of each "
+                      "cohort sample and the parameters of each group",
+                      false, cohort_out);
+    opt_parse.add_opt("serve", '\0', "after the run, keep the posteriors "
+                      "and answer requests for HMRs at other settings on "
+                      "this Unix socket", false, serve_socket);
 
 
     vector<string> leftover_args;
@@ -396,14 +1190,48 @@ main(int argc, const char **argv) {
       cerr << opt_parse.option_missing_message() << endl;
       return EXIT_SUCCESS;
     }
-    if (leftover_args.empty()) {
+    if (leftover_args.empty() && cohort_file.empty()) {
       cerr << opt_parse.help_message() << endl;
       return EXIT_SUCCESS;
     }
-    const string cpgs_file = leftover_args.front();
+    if (!cohort_file.empty() &&
+        (cohort_out.empty() || !leftover_args.empty() || !outfile.empty() ||
+         !scores_file.empty() || !compled_cpgs_file.empty() || IMPUT ||
+         STREAM || !param_cache_dir.empty())) {
+      cerr << "cohort mode needs --cohort-out, takes no input file, and "
+           << "cannot be combined with -o, -s, -c, -I, -w or -C" << endl;
+      return EXIT_FAILURE;
+    }
+    if (!serve_socket.empty() && (!cohort_file.empty() || STREAM || IMPUT)) {
+      cerr << "serve mode cannot be combined with --cohort, -w or -I" << endl;
+      return EXIT_FAILURE;
+    }
+    if (!(train_fraction > 0.0 && train_fraction <= 1.0)) {
+      cerr << "train fraction must be in (0, 1]" << endl;
+      return EXIT_FAILURE;
+    }
 
     /****************** END COMMAND LINE OPTIONS *****************/
 
+#ifdef _OPENMP
+    omp_set_num_threads(n_threads);
+#endif
+    if (!profile_file.empty())
+      Profile::get().enable();
+
+
+    // the first sample of a cohort gives the sites of all of them
+    Cohort cohort;
+    if (!cohort_file.empty()) {
+      if (!isdir(cohort_out.c_str()) && mkdir(cohort_out.c_str(), 0755) != 0)
+        throw SMITHLABException("cannot create directory " + cohort_out);
+      read_cohort(cohort_file, cohort_out, cohort);
+    }
+    const string cpgs_file = cohort_file.empty() ?
+      leftover_args.front() : cohort.files.front();
+
+    LocalServer *server = serve_socket.empty() ?
+      0 : new LocalServer(serve_socket);
 
     /***********************************
      * STEP 1: LOAD CPGS AND COORDINATES
@@ -414,9 +1242,20 @@ main(int argc, const char **argv) {
     vector<size_t> reads;
     if (VERBOSE)
       cerr << "[READING CPGS AND METH PROPS]" << endl;
-    load_cpgs(cpgs_file, cpgs, meth, reads);
+    ProfileTimer load_timer("load");
+    if (STREAM) {
+      CpGBlock sample;
+      load_cpg_sample(cpgs_file, train_every, TRAIN_BLOCK_SIZE, sample);
+      cpgs.swap(sample.cpgs);
+      meth.swap(sample.meth);
+      reads.swap(sample.reads);
+    }
+    else load_cpgs(cpgs_file, cpgs, meth, reads);
+    load_timer.add_items(cpgs.size());
+    load_timer.stop();
     if (VERBOSE)
-      cerr << "TOTAL CPGS: " << cpgs.size() << endl
+      cerr << (STREAM ? "TRAINING CPGS: " : "TOTAL CPGS: ")
+      << cpgs.size() << endl
       << "MEAN COVERAGE: "
       << accumulate(reads.begin(), reads.end(), 0.0)/reads.size()
       << endl << endl;
@@ -426,7 +1265,9 @@ main(int argc, const char **argv) {
      * STEP 2: PREPROCESS RAW DATA
      */
     vector<size_t> cov_idx;
+    ProfileTimer preprocess_timer("preprocess", cpgs.size());
     mark_missing_cpg(VERBOSE, reads, meth, cov_idx);
+    preprocess_timer.stop();
 
 
     /***********************************
@@ -446,10 +1287,31 @@ main(int argc, const char **argv) {
       n_reads = accumulate(reads.begin(), reads.end(), 0.0)/cov_idx.size();
     }
 
+    double p_sf = 0.5;
+    double p_sb = 0.5;
+
+    string cache_file;
+    if (params_in_file.empty() && !param_cache_dir.empty()) {
+      std::ostringstream settings;
+      settings << "F_RATE " << fg_rate << " B_RATE " << bg_rate
+               << " ITR " << max_iterations << " METHOD " << rate_est_method
+               << " NO_RATE_EST " << NO_RATE_EST
+               << " ACCELERATE " << ACCELERATE
+               << " TRAIN_FRACTION " << train_fraction
+               << " STREAM " << STREAM << " TRAIN_EVERY " << train_every;
+      cache_file = param_cache_file(param_cache_dir, "cthmm", cpgs_file,
+                                    settings.str());
+      if (std::ifstream(cache_file.c_str())) {
+        if (VERBOSE)
+          cerr << "[CACHED PARAMETERS: " << cache_file << "]" << endl;
+        params_in_file = cache_file;
+      }
+    }
+
     if (!params_in_file.empty()) {
       // READ THE PARAMETERS FILE
       read_params_file(VERBOSE, params_in_file, fg_rate, bg_rate,
-                       fg_alpha, fg_beta, bg_alpha, bg_beta);
+                       fg_alpha, fg_beta, bg_alpha, bg_beta, p_sf, p_sb);
     } else {
       fg_alpha = 0.33*n_reads;
       fg_beta = 0.67*n_reads;
@@ -460,19 +1322,29 @@ main(int argc, const char **argv) {
     BetaBin fg_emission = BetaBin(fg_alpha, fg_beta);
     BetaBin bg_emission = BetaBin(bg_alpha, bg_beta);
 
-    double p_sf = 0.5;
-    double p_sb = 0.5;
-
     double p_ft = 1e-10;
     double p_bt = 1e-10;
 
     // HMM initialization & setup
     TwoVarHMM hmm(tolerance, min_prob, max_iterations, VERBOSE, NO_RATE_EST,
                   rate_est_method);
+    hmm.set_checkpointing(CHECKPOINT);
+    hmm.set_acceleration(ACCELERATE);
 
     hmm.set_parameters(fg_emission, bg_emission, fg_rate, bg_rate,
                        p_sf, p_sb, p_ft, p_bt);
 
+    if (!cohort_file.empty()) {
+      vector<pair<double, double> >().swap(meth);
+      vector<size_t>().swap(reads);
+      run_cohort(VERBOSE, cohort, cohort_out, cpgs, hmm,
+                 params_in_file.empty() && max_iterations >= 1,
+                 train_fraction, SUBSAMPLE_BLOCK_SIZE, n_shuffles,
+                 rng_seed, NOFDR);
+      write_profile(profile_file);
+      return EXIT_SUCCESS;
+    }
+
     /***********************************
      * STEP 4: HMM MODEL TRAINING
      */
@@ -485,8 +1357,28 @@ main(int argc, const char **argv) {
     time_between_cpgs(cpgs, time);
     time_between_cpgs(cpgs, ctime, cov_idx);
 
-    if (max_iterations >= 1) {
+    if (params_in_file.empty() && max_iterations >= 1) {
+      ProfileTimer train_timer("train", cmeth.size());
+      if (train_fraction < 1.0) {
+        vector<pair<double, double> > smeth;
+        vector<size_t> stime;
+        subsample_blocks(cmeth, ctime, train_fraction, SUBSAMPLE_BLOCK_SIZE,
+                         smeth, stime);
+        if (VERBOSE)
+          cerr << "SUBSAMPLE CPGS: " << smeth.size() << endl;
+        hmm.BaumWelchTraining(smeth, stime);
+        hmm.set_max_iterations(REFINE_ITERATIONS);
+      }
       hmm.BaumWelchTraining(cmeth, ctime);
+      if (!cache_file.empty()) {
+        // renamed into place so a reader never sees part of a file
+        const string partial = cache_file + ".tmp." + toa(getpid());
+        write_params_file(partial, hmm);
+        if (rename(partial.c_str(), cache_file.c_str()) != 0) {
+          unlink(partial.c_str());
+          throw SMITHLABException("cannot write params file " + cache_file);
+        }
+      }
     }
 
     /***********************************
@@ -496,71 +1388,98 @@ main(int argc, const char **argv) {
     if (VERBOSE)
        cerr << "[ENTER POSTERIOR DECODING]" << endl;
 
-    vector<int> classes;
+    vector<GenomicRegion> domains;
+    vector<double> p_values;
+    // what serve mode keeps of the decoding
     vector<double> scores;
-
-    if (IMPUT) { // decode all sites
-      hmm.PosteriorDecoding(meth, time, classes, scores, IMPUT);
-    } else { // decode only covered sites
-      hmm.PosteriorDecoding(cmeth, ctime, classes, scores);
+    vector<NullReplicate> null_replicates;
+
+    if (STREAM) {
+      // the null is drawn from the training sample
+      vector<double> random_scores;
+      ProfileTimer shuffle_timer("shuffle", n_shuffles*cmeth.size());
+      shuffle_cpgs(hmm, cmeth, ctime, random_scores, cov_idx,
+                   n_shuffles, rng_seed, true);
+      shuffle_timer.stop();
+      vector<SimpleGenomicRegion>().swap(cpgs);
+      vector<pair<double, double> >().swap(meth);
+      vector<pair<double, double> >().swap(cmeth);
+      decode_chromosomes(VERBOSE, IMPUT, cpgs_file, hmm, random_scores,
+                         scores_file, compled_cpgs_file, domains, p_values);
     }
+    else {
+      vector<int> classes;
+
+      ProfileTimer decode_timer("decode", IMPUT ? meth.size() : cmeth.size());
+      if (IMPUT) { // decode all sites
+        hmm.PosteriorDecoding(meth, time, classes, scores, IMPUT);
+      } else { // decode only covered sites
+        hmm.PosteriorDecoding(cmeth, ctime, classes, scores);
+      }
 
-    // decode the domains
-    vector<double> domain_scores;
-    get_domain_scores(classes, cmeth, domain_scores, cov_idx);
+      // decode the domains
+      vector<double> domain_scores;
+      get_domain_scores(classes, cmeth, domain_scores, cov_idx);
+      decode_timer.stop();
 
-    vector<double> random_scores;
-    shuffle_cpgs(hmm, cmeth, ctime, random_scores, cov_idx);
+      vector<double> random_scores;
+      ProfileTimer shuffle_timer("shuffle", n_shuffles*cmeth.size());
+      shuffle_cpgs(hmm, cmeth, ctime, random_scores, cov_idx,
+                   n_shuffles, rng_seed, true,
+                   server ? &null_replicates : 0);
+      shuffle_timer.stop();
 
-    vector<double> p_values;
-    assign_p_values(random_scores, domain_scores, p_values);
+      assign_p_values(random_scores, domain_scores, p_values);
 
-    double fdr_cutoff = numeric_limits<double>::max();
-    if (fdr_cutoff == numeric_limits<double>::max())
-      fdr_cutoff = get_fdr_cutoff(p_values, 0.01);
+      ProfileTimer domain_timer("domains", cov_idx.size());
+      build_domains(VERBOSE, cpgs, scores, classes, domains, cov_idx);
+      domain_timer.stop();
 
-    vector<GenomicRegion> domains;
-    build_domains(VERBOSE, cpgs, scores, classes, domains, cov_idx);
+      ProfileTimer output_timer("output", cpgs.size());
 
-    /***********************************
-     * STEP 6: OUTPUT
-     */
-
-    std::ofstream of;
-    if (!outfile.empty()) of.open(outfile.c_str());
-    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
-
-    size_t good_hmr_count = 0;
-    for (size_t i = 0; i < domains.size(); ++i)
-      if (p_values[i] < fdr_cutoff) {
-        domains[i].set_name("HYPO" + smithlab::toa(good_hmr_count++));
-        out << domains[i] << '\t' << p_values[i] << '\n';
-      } else if (NOFDR) {
-        domains[i].set_name("HYPO" + smithlab::toa(good_hmr_count++));
-        out << domains[i] << '\t' << p_values[i] << '\n';
+      // output posterior probabilities
+      if (!scores_file.empty()) {
+        BufferedWriter out_scores(scores_file);
+        for (size_t i = 0; i < cov_idx.size(); ++i) {
+          out_scores << cpgs[cov_idx[i]] << '\t' << scores[i] << '\n';
+        }
+        out_scores.close();
       }
 
-    // output posterior probabilities
-    if (!scores_file.empty()) {
-      std::ostream *out_scores = new std::ofstream(scores_file.c_str());
-      for (size_t i = 0; i < cov_idx.size(); ++i) {
-        *out_scores << cpgs[cov_idx[i]] << '\t' << scores[i] << endl;
+      // output all cpgs including imputed uncover sites
+      if (IMPUT) {
+        if (!compled_cpgs_file.empty()) {
+          BufferedWriter out_cpgs(compled_cpgs_file);
+          for (size_t i = 0; i < cpgs.size(); ++i) {
+            const double denom = (meth[i].second < 0) ?
+                                  1 : (meth[i].first + meth[i].second);
+            out_cpgs << cpgs[i] << '\t' << meth[i].first / denom << '\t'
+            << reads[i] << '\n';
+          }
+          out_cpgs.close();
+        }
       }
     }
 
-    // output all cpgs including imputed uncover sites
-    if (IMPUT) {
-      if (!compled_cpgs_file.empty()) {
-        std::ostream *out_cpgs = new std::ofstream(compled_cpgs_file.c_str());
-        for (size_t i = 0; i < cpgs.size(); ++i) {
-          const double denom = (meth[i].second < 0) ?
-                                1 : (meth[i].first + meth[i].second);
-          *out_cpgs << cpgs[i] << '\t' << meth[i].first / denom << '\t'
-          << reads[i] << endl;
-        }
-      }
+    /***********************************
+     * STEP 6: OUTPUT
+     */
+
+    ProfileTimer output_timer("output_domains", domains.size());
+    write_domains(outfile, domains, p_values, NOFDR);
+    output_timer.stop();
+
+    if (server) {
+      vector<pair<double, double> >().swap(meth);
+      vector<size_t>().swap(reads);
+      vector<size_t>().swap(time);
+      vector<size_t>().swap(ctime);
+      serve_hmrs(VERBOSE, *server, cpgs, cmeth, cov_idx, scores,
+                 null_replicates, domains, p_values);
+      delete server;
     }
 
+    write_profile(profile_file);
   }
   catch (SMITHLABException &e) {
     cerr << "ERROR:\t" << e.what() << endl;
@@ -23,191 +23,252 @@
  */
 
 #include <ctime>
-#include <numeric>
 #include <cmath>
 #include <fstream>
-#include <iterator>
+#include <limits>
+#include <utility>
+#include <stdint.h>
+
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
 
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
-#include "GenomicRegion.hpp"
 #include "OptionParser.hpp"
-#include "RNG.hpp"
+#include "CpGBinary.hpp"
+#include "BufferedWriter.hpp"
 
 using std::string;
 using std::vector;
-using std::cout;
+using std::pair;
 using std::endl;
 using std::cerr;
 using std::numeric_limits;
 
-using std::ostream_iterator;
-using std::ofstream;
 
+/* A counter-based generator for the GSL distributions: draw n of a
+ * stream is the SplitMix64 mix of key + n*GAMMA, so a stream depends
+ * only on its key. Each chromosome draws from the stream of its name
+ * and the seed, on any thread and in any order of chromosomes.
+ */
+struct CounterState {
+  uint64_t key;
+  uint64_t counter;
+};
 
+static const uint64_t GOLDEN_GAMMA = 0x9e3779b97f4a7c15ULL;
 
-struct cpg
-{
-  cpg() : chr("chrZ"), start(1), strand("+"), name("CpG"),
-          meth(0), cov(0) {}
-  cpg(const string c, const size_t s, const double m, const size_t cov) :
-      chr(c), start(s), strand("+"), name("CpG"), meth(m), cov(cov) {}
+static inline uint64_t
+splitmix64(uint64_t z) {
+  z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
 
+static inline uint64_t
+counter_next(void *vstate) {
+  CounterState *s = static_cast<CounterState *>(vstate);
+  return splitmix64(s->key + (++s->counter)*GOLDEN_GAMMA);
+}
 
-  string tostring() {
-    std::ostringstream s;
-    s << chr << "\t" << start << "\t" << strand << "\t" << name << "\t"
-      << meth << "\t" << cov;
-    return s.str();
-  }
+static void
+counter_set(void *vstate, unsigned long seed) {
+  CounterState *s = static_cast<CounterState *>(vstate);
+  s->key = seed;
+  s->counter = 0;
+}
 
-  bool from_buffer(std::istream& s) {
-    return static_cast<bool>(s >> chr >> start >> strand >> name >> meth >> cov);
-  }
+static unsigned long
+counter_get(void *vstate) {
+  return counter_next(vstate) >> 32;
+}
 
-  string chr;
-  size_t start;
-  string strand;
-  string name;
-  double meth;
-  size_t cov;
+static double
+counter_get_double(void *vstate) {
+  return (counter_next(vstate) >> 11)*(1.0/9007199254740992.0);
+}
+
+static const gsl_rng_type counter_rng_type = {
+  "splitmix64_counter", 0xffffffffUL, 0, sizeof(CounterState),
+  &counter_set, &counter_get, &counter_get_double
 };
 
+// FNV-1a, so stream keys do not depend on the standard library
+static uint64_t
+name_hash(const string &name) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < name.size(); ++i)
+    h = (h ^ static_cast<unsigned char>(name[i]))*0x100000001b3ULL;
+  return h;
+}
 
-struct interval
-{
-  interval() : chr("chrZ"), start(1), end(2), name("HMR"), num_cpgs(0),
-  strand("+"), score(0) {}
-  interval(const string c, const size_t s, const size_t e, const size_t n) :
-  chr(c), start(s), end(e), name("HMR"), num_cpgs(n), strand("+"), score(0) {}
-
-  string tostring() {
-    std::ostringstream s;
-    s << chr << "\t" << start << "\t" << end << "\t" << name << "\t"
-    << num_cpgs << "\t" << strand << "\t" << score;
-    return s.str();
-  }
+static gsl_rng *
+chrom_stream(const size_t seed, const string &chrom) {
+  gsl_rng *r = gsl_rng_alloc(&counter_rng_type);
+  CounterState *s = static_cast<CounterState *>(r->state);
+  s->key = splitmix64(seed ^ name_hash(chrom));
+  s->counter = 0;
+  return r;
+}
 
-  string chr;
-  size_t start;
-  size_t end;
-  string name;
-  size_t num_cpgs;
-  string strand;
-  double score;
+
+struct SimParams {
+  double readdepth_n, readdepth_p;
+  double bg_rate, fg_rate;
+  double bg_alpha, bg_beta, fg_alpha, fg_beta;
 };
 
+// the sites of one chromosome and what is simulated for them; HMRs
+// are ranges [first, last) of sites
+struct SimChrom {
+  string name;
+  vector<uint32_t> pos;
+  vector<uint32_t> meth;
+  vector<uint32_t> cov;
+  vector<pair<size_t, size_t> > hmrs;
+};
 
 
-static size_t
-sample_read_depth(const gsl_rng *rng, const double n, const double p) {
-  return static_cast<size_t>(gsl_ran_negative_binomial(rng, p, n));
+static void
+add_site(vector<SimChrom> &chroms, const string &chrom, const size_t pos) {
+  if (pos > numeric_limits<uint32_t>::max())
+    throw SMITHLABException("position too large: " + chrom + ":" +
+                            smithlab::toa(pos));
+  if (chroms.empty() || chrom != chroms.back().name) {
+    chroms.push_back(SimChrom());
+    chroms.back().name = chrom;
+  }
+  chroms.back().pos.push_back(pos);
 }
 
-
+// positions of a methcounts or binary CpG file; only the sites are used
 static void
-load_cpgs(const string &cpgs_file, vector<cpg> &cpgs,
-          const gsl_rng *rng, const double n, const double p) {
-
-  std::ifstream in(cpgs_file.c_str());
-  cpg read_one_cpg;
-  while (read_one_cpg.from_buffer(in)) {
-    size_t sample_cov = sample_read_depth(rng, n, p);
-    read_one_cpg.cov = sample_cov > 0 ? sample_cov : 1;
-    cpgs.push_back(read_one_cpg);
+load_sites(const string &cpgs_file, vector<SimChrom> &chroms) {
+  if (CpGBinaryReader::is_cpg_binary(cpgs_file)) {
+    CpGBinaryReader in(cpgs_file);
+    const uint32_t *pos = in.positions();
+    for (size_t c = 0; c < in.n_chroms(); ++c)
+      for (size_t i = in.chrom_begin(c); i < in.chrom_end(c); ++i)
+        add_site(chroms, in.chrom_name(c), pos[i]);
+    return;
   }
+  std::ifstream in(cpgs_file.c_str());
+  if (!in)
+    throw SMITHLABException("cannot open input file " + cpgs_file);
+  string chrom, strand, name;
+  size_t pos = 0, cov = 0;
+  double meth = 0.0;
+  while (in >> chrom >> pos >> strand >> name >> meth >> cov)
+    add_site(chroms, chrom, pos);
 }
 
 
-inline double
-p00(const double a, const double b, const cpg i, const cpg j) {
-  double p = 0;
-  if (i.chr == i.chr) {
-    p = 1-a + a*exp( -b * (j.start - i.start) );
-  }
-  return p;
+static void
+sample_site(gsl_rng *r, const SimParams &p, const double alpha,
+            const double beta, SimChrom &c, const size_t i) {
+  const size_t cov =
+    gsl_ran_negative_binomial(r, p.readdepth_p, p.readdepth_n);
+  c.cov[i] = cov > 0 ? cov : 1;
+  c.meth[i] = gsl_ran_binomial(r, gsl_ran_beta(r, alpha, beta), c.cov[i]);
 }
 
-inline double
-p11(const double a, const double b, const cpg i, const cpg j) {
-  double p = 0;
-  if (i.chr == j.chr) {
-    p = a + (1-a)*exp( -b * (j.start - i.start) );
+/* The continuous-time chain holds each state for an exponential
+ * waiting time, with rate bg_rate out of the background and fg_rate
+ * out of the foreground, and the sites take the state of the domain
+ * their position falls in. This is the chain the per-site transition
+ * probabilities of cthmm describe. A domain no site falls in is
+ * skipped, so the HMRs on either side of it are one. Each chromosome
+ * starts in the background at its first site.
+ */
+static void
+simulate_chrom(gsl_rng *r, const SimParams &p, SimChrom &c) {
+  const size_t n = c.pos.size();
+  c.meth.resize(n);
+  c.cov.resize(n);
+  c.hmrs.clear();
+
+  const double bg_mean = 1.0/p.bg_rate, fg_mean = 1.0/p.fg_rate;
+  double boundary = n > 0 ? c.pos[0] : 0.0;
+  bool fg = false;
+  size_t i = 0;
+  while (i < n) {
+    boundary += gsl_ran_exponential(r, fg ? fg_mean : bg_mean);
+    const size_t first = i;
+    const double alpha = fg ? p.fg_alpha : p.bg_alpha;
+    const double beta = fg ? p.fg_beta : p.bg_beta;
+    for (; i < n && c.pos[i] < boundary; ++i)
+      sample_site(r, p, alpha, beta, c, i);
+    if (fg && i > first) {
+      if (!c.hmrs.empty() && c.hmrs.back().second == first)
+        c.hmrs.back().second = i;
+      else
+        c.hmrs.push_back(std::make_pair(first, i));
+    }
+    fg = !fg;
   }
-  return p;
 }
 
-
-
-double
-noisy_meth(const size_t count, const double meth)
-{
-  static Runif rng(time(NULL));
-  double n_meth = floor(meth * count);
-  n_meth += static_cast<double>(meth * count - n_meth
-                                > rng.runif(0.0, 1.0));
-  double n_unmeth = count - n_meth;
-
-  return n_meth / (n_meth + n_unmeth);
+// keeps the first num_hmr HMRs and the sites before the next one
+static void
+truncate_hmrs(const size_t num_hmr, vector<SimChrom> &chroms) {
+  size_t remaining = num_hmr;
+  for (size_t c = 0; c < chroms.size(); ++c) {
+    SimChrom &chrom = chroms[c];
+    if (chrom.hmrs.size() > remaining) {
+      const size_t cut = chrom.hmrs[remaining].first;
+      chrom.hmrs.resize(remaining);
+      chrom.pos.resize(cut);
+      chrom.meth.resize(cut);
+      chrom.cov.resize(cut);
+      chroms.resize(c + 1);
+      return;
+    }
+    remaining -= chrom.hmrs.size();
+  }
 }
 
 
 static void
-sample_bg_cpgs(vector<cpg> &cpgs, size_t &idx,
-               const gsl_rng *r, const gsl_rng *r_meth,
-               const double a, const double b,
-               const double alpha, const double beta) {
-  size_t L = cpgs.size();
-  if (idx < L) {
-    // sample the first cpg
-    double meth = gsl_ran_beta(r_meth, alpha, beta);
-    cpgs[idx].meth = noisy_meth(cpgs[idx].cov, meth);
-    if (idx < L-1) {
-      bool stay = gsl_ran_bernoulli(r, p00(a, b, cpgs[idx], cpgs[idx+1])) == 1;
-      idx++;
-      while (idx < L-1 && stay) {
-        meth = gsl_ran_beta(r_meth, alpha, beta);
-        cpgs[idx].meth = noisy_meth(cpgs[idx].cov, meth);
-        stay = gsl_ran_bernoulli(r, p00(a, b, cpgs[idx], cpgs[idx+1])) == 1;
-        idx++;
-      }
-      if (stay) { // the last cpg?
-        meth = gsl_ran_beta(r_meth, alpha, beta);
-        cpgs[idx].meth = noisy_meth(cpgs[idx].cov, meth);
-      }
-    }
+write_cpgs(const string &outfile, const bool BINARY,
+           const vector<SimChrom> &chroms) {
+  if (BINARY) {
+    CpGBinaryWriter out(outfile);
+    for (size_t c = 0; c < chroms.size(); ++c)
+      for (size_t i = 0; i < chroms[c].pos.size(); ++i)
+        out.add(chroms[c].name, chroms[c].pos[i], chroms[c].meth[i],
+                chroms[c].cov[i] - chroms[c].meth[i]);
+    out.close();
+    return;
+  }
+  BufferedWriter out(outfile);
+  for (size_t c = 0; c < chroms.size(); ++c) {
+    const SimChrom &chrom = chroms[c];
+    for (size_t i = 0; i < chrom.pos.size(); ++i)
+      out << chrom.name << '\t' << chrom.pos[i] << "\t+\tCpG\t"
+          << static_cast<double>(chrom.meth[i])/chrom.cov[i] << '\t'
+          << chrom.cov[i] << '\n';
   }
+  out.close();
 }
 
-
 static void
-sample_fg_cpgs(vector<cpg> &cpgs, size_t &idx,
-               const gsl_rng *r, const gsl_rng *r_meth,
-               const double a, const double b,
-               const double alpha, const double beta) {
-  size_t L = cpgs.size();
-  if (idx < L) {
-    // sample the first cpg
-    double meth = gsl_ran_beta(r_meth, alpha, beta);
-    cpgs[idx].meth = noisy_meth(cpgs[idx].cov, meth);
-    if (idx < L-1) {
-      bool stay = gsl_ran_bernoulli(r, p11(a, b, cpgs[idx], cpgs[idx+1])) == 1;
-      idx++;
-      while (idx < L-1 && stay) {
-        meth = gsl_ran_beta(r_meth, alpha, beta);
-        cpgs[idx].meth = noisy_meth(cpgs[idx].cov, meth);
-        stay = gsl_ran_bernoulli(r, p11(a, b, cpgs[idx], cpgs[idx+1])) == 1;
-        idx++;
-      }
-      if (stay) { // the last cpg?
-        meth = gsl_ran_beta(r_meth, alpha, beta);
-        cpgs[idx].meth = noisy_meth(cpgs[idx].cov, meth);
-      }
+write_segments(const string &segment_file, const vector<SimChrom> &chroms) {
+  BufferedWriter out(segment_file);
+  for (size_t c = 0; c < chroms.size(); ++c) {
+    const SimChrom &chrom = chroms[c];
+    for (size_t k = 0; k < chrom.hmrs.size(); ++k) {
+      const size_t first = chrom.hmrs[k].first, last = chrom.hmrs[k].second;
+      out << chrom.name << '\t' << chrom.pos[first] << '\t'
+          << chrom.pos[last - 1] << "\tHMR\t" << last - first << "\t+\t0\n";
     }
   }
+  out.close();
 }
 
 
@@ -220,43 +281,56 @@ main(int argc, const char **argv)
     string outfile;
     string segment_file;
 
-    double readdepth_distro_n = 20;
-    double readdepth_distro_p = 0.7;
+    SimParams params;
+    params.readdepth_n = 20;
+    params.readdepth_p = 0.7;
 
-    double bg_rate = 0.0003;
-    double fg_rate = 0.005;
+    params.bg_rate = 0.0003;
+    params.fg_rate = 0.005;
 
-    double bg_alpha = 2.4;
-    double bg_beta = 0.6;
-    double fg_alpha = 0.5;
-    double fg_beta = 5.4;
+    params.bg_alpha = 2.4;
+    params.bg_beta = 0.6;
+    params.fg_alpha = 0.5;
+    params.fg_beta = 5.4;
 
     size_t num_hmr = std::numeric_limits<int>::max();
+    size_t rng_seed = time(0) + getpid();
+    size_t n_threads = 1;
 
+    bool BINARY = false;
     bool VERBOSE = false;
 
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(argv[0], "A program to simulate BS-Seq data",
-                           "<cpg-BED-file>");
+                           "<cpg-BED-file or binary CpG file>");
     opt_parse.add_opt("out", 'o', "output file (BED format)",
                       true, outfile);
     opt_parse.add_opt("segment", 's', "output file of segments",
                       true, segment_file);
+    opt_parse.add_opt("binary", 'b', "write the output file in binary "
+                      "CpG format", false, BINARY);
     opt_parse.add_opt("nhmr", 'n', "num of hmrs", false, num_hmr);
     opt_parse.add_opt("readdepth_n", '\0',
                       "Read depth negbin distribution n",
-                      false, readdepth_distro_n);
+                      false, params.readdepth_n);
     opt_parse.add_opt("readdepth_p", '\0',
                       "Read depth negbin distribution p",
-                      false, readdepth_distro_p);
+                      false, params.readdepth_p);
     opt_parse.add_opt("fg_rate", 'F', "foreground transition rate",
-                      false, fg_rate);
+                      false, params.fg_rate);
     opt_parse.add_opt("bg_rate", 'B', "background transition rate",
-                      false, bg_rate);
-    opt_parse.add_opt("bg_alpha", '\0', "background alpha", false, bg_alpha);
-    opt_parse.add_opt("bg_beta", '\0', "background beta", false, bg_beta);
-    opt_parse.add_opt("fg_alpha", '\0', "foreground alpha", false, fg_alpha);
-    opt_parse.add_opt("fg_beta", '\0', "foreground beta", false, fg_beta);
+                      false, params.bg_rate);
+    opt_parse.add_opt("bg_alpha", '\0', "background alpha", false,
+                      params.bg_alpha);
+    opt_parse.add_opt("bg_beta", '\0', "background beta", false,
+                      params.bg_beta);
+    opt_parse.add_opt("fg_alpha", '\0', "foreground alpha", false,
+                      params.fg_alpha);
+    opt_parse.add_opt("fg_beta", '\0', "foreground beta", false,
+                      params.fg_beta);
+    opt_parse.add_opt("seed", 'e', "rng seed (default: from time)",
+                      false, rng_seed);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info",
                       false, VERBOSE);
 
@@ -277,76 +351,56 @@ main(int argc, const char **argv)
       cerr << opt_parse.option_missing_message() << endl;
       return EXIT_SUCCESS;
     }
+    if (leftover_args.empty())
+    {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (params.bg_rate <= 0 || params.fg_rate <= 0)
+      throw SMITHLABException("transition rates must be positive");
 
     const string cpgs_file = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
-    if (VERBOSE)
-      cerr << "READCOV_N\t" << readdepth_distro_n << endl
-      << "READCOV_P\t" << readdepth_distro_p << endl
-      << "F_RATE\t" << fg_rate << endl
-      << "B_RATE\t" << bg_rate << endl
-      << "F_ALPHA\t" << fg_alpha << endl
-      << "F_BETA\t" << fg_beta << endl
-      << "B_ALPHA\t" << bg_alpha << endl
-      << "B_BETA\t" << bg_beta << endl;
-
-    Runif rng(time(NULL));
-    const gsl_rng_type * T;
-    gsl_rng_env_setup();
-    T = gsl_rng_default;
+#ifdef _OPENMP
+    omp_set_num_threads(n_threads);
+#endif
 
-    gsl_rng *readdepth_rng = gsl_rng_alloc(T);
-    gsl_rng_set(readdepth_rng, rng.runif(1, std::numeric_limits<int>::max()));
-
-
-    vector<cpg> cpgs;
-    load_cpgs(cpgs_file, cpgs,
-              readdepth_rng, readdepth_distro_n, readdepth_distro_p);
-
-
-    gsl_rng *r = gsl_rng_alloc (T);
-    gsl_rng_set(r, rng.runif(1, std::numeric_limits<int>::max()));
-
-    gsl_rng *r_fgmeth = gsl_rng_alloc(T);
-    gsl_rng_set(r_fgmeth, rng.runif(1, std::numeric_limits<int>::max()));
-
-    gsl_rng *r_bgmeth = gsl_rng_alloc(T);
-    gsl_rng_set(r_bgmeth, rng.runif(1, std::numeric_limits<int>::max()));
-
-
-    // simulation;
-    vector<interval> hmrs;
-    size_t idx = 0;
-
-    double b = fg_rate + bg_rate;
-    double a = bg_rate/b;
-    // first region on each chromosome is always background
-    sample_bg_cpgs(cpgs, idx, r, r_bgmeth, a, b, bg_alpha, bg_beta);
-
-    size_t L = cpgs.size();
-    for (size_t i = 0; i < num_hmr && idx < L; ++i) {
-      const size_t begin_idx = idx;
-      sample_fg_cpgs(cpgs, idx, r, r_fgmeth, a, b, fg_alpha, fg_beta);
-      hmrs.push_back(interval(cpgs[begin_idx].chr, cpgs[begin_idx].start,
-                              cpgs[idx-1].start, idx - begin_idx));
-
-      sample_bg_cpgs(cpgs, idx, r, r_fgmeth, a, b, bg_alpha, bg_beta);
+    if (VERBOSE)
+      cerr << "READCOV_N\t" << params.readdepth_n << endl
+      << "READCOV_P\t" << params.readdepth_p << endl
+      << "F_RATE\t" << params.fg_rate << endl
+      << "B_RATE\t" << params.bg_rate << endl
+      << "F_ALPHA\t" << params.fg_alpha << endl
+      << "F_BETA\t" << params.fg_beta << endl
+      << "B_ALPHA\t" << params.bg_alpha << endl
+      << "B_BETA\t" << params.bg_beta << endl
+      << "SEED\t" << rng_seed << endl;
+
+    vector<SimChrom> chroms;
+    load_sites(cpgs_file, chroms);
+
+    // simulation; chromosomes are independent given their streams
+#pragma omp parallel for schedule(dynamic)
+    for (size_t c = 0; c < chroms.size(); ++c) {
+      gsl_rng *r = chrom_stream(rng_seed, chroms[c].name);
+      simulate_chrom(r, params, chroms[c]);
+      gsl_rng_free(r);
     }
+    truncate_hmrs(num_hmr, chroms);
 
-    std::ostream *out = new std::ofstream(outfile.c_str());
-    std::ostream *out_segments = new std::ofstream(segment_file.c_str());
-
-    // write cpgs and intervals
-    for (size_t i = 0; i < cpgs.size() && i < idx; ++i) {
-      *out << cpgs[i].tostring() << endl;
-    }
+    write_cpgs(outfile, BINARY, chroms);
+    write_segments(segment_file, chroms);
 
-    for (size_t k = 0; k < hmrs.size(); ++k) {
-      *out_segments << hmrs[k].tostring() << endl;
+    if (VERBOSE) {
+      size_t n_sites = 0, n_hmrs = 0;
+      for (size_t c = 0; c < chroms.size(); ++c) {
+        n_sites += chroms[c].pos.size();
+        n_hmrs += chroms[c].hmrs.size();
+      }
+      cerr << "SITES\t" << n_sites << endl
+           << "HMRS\t" << n_hmrs << endl;
     }
-
-
   }
   catch (SMITHLABException &e)
   {
@@ -360,4 +414,3 @@ main(int argc, const char **argv)
   }
   return EXIT_SUCCESS;
 }
-
@@ -25,14 +25,27 @@
 #include <cmath>
 #include <fstream>
 #include <iomanip>
+#include <random>
+#include <algorithm>
+#include <sstream>
+#include <map>
 
 #include <unistd.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "OptionParser.hpp"
 #include "NBVDHMM.hpp"
+#include "CpGBinary.hpp"
+#include "CpGStream.hpp"
+#include "WarmStart.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
 #include "distribution.hpp"
 
 
@@ -48,11 +61,35 @@ using std::pair;
 using std::setw;
 
 
+static void
+load_cpgs_binary(const string &cpgs_file, vector<SimpleGenomicRegion> &cpgs,
+                 vector<pair<double, double> > &meth, vector<size_t> &reads) {
+  const CpGBinaryReader in(cpgs_file);
+  const uint32_t *pos = in.positions();
+  const uint16_t *n_meth = in.meth();
+  const uint16_t *n_unmeth = in.unmeth();
+  cpgs.reserve(in.size());
+  meth.reserve(in.size());
+  reads.reserve(in.size());
+  for (size_t c = 0; c < in.n_chroms(); ++c)
+    for (size_t i = in.chrom_begin(c); i < in.chrom_end(c); ++i) {
+      cpgs.push_back(SimpleGenomicRegion(in.chrom_name(c), pos[i], pos[i] + 1));
+      reads.push_back(n_meth[i] + n_unmeth[i]);
+      meth.push_back(std::make_pair(n_meth[i], n_unmeth[i]));
+    }
+}
+
+
 static void
 load_cpgs(const string &cpgs_file, vector<SimpleGenomicRegion> &cpgs,
           vector<pair<double, double> > &meth, vector<size_t> &reads)
 {
 
+  if (CpGBinaryReader::is_cpg_binary(cpgs_file)) {
+    load_cpgs_binary(cpgs_file, cpgs, meth, reads);
+    return;
+  }
+
   string chrom, prev_chrom;
   size_t pos, prev_pos = 0;
   string strand, seq;
@@ -144,37 +181,36 @@ separate_regions(const bool VERBOSE, const size_t desert_size,
 }
 
 
+// the score of a single-site domain, whose p-value is 1; the shuffles
+// leave these out of the null
+static const double SINGLE_SITE_SCORE = -numeric_limits<double>::infinity();
+
+// One score per domain of build_domains, in the same order: runs of a
+// class broken at the reset points, scored by the sum of 1 - level
+// over their sites
 static void
 get_domain_scores(const vector<int> &classes,
                   const vector<pair<double, double> > &meth,
                   const vector<size_t> &reset_points,
                   vector<double> &scores) {
   size_t n_cpgs = 0, reset_idx = 1;
-  bool in_domain = false;
   double score = 0;
-  int prev_class = classes[0];
-  
+
   for (size_t i = 0; i < classes.size(); ++i) {
-    if (reset_points[reset_idx] == i) {
-      if (in_domain) {
-        in_domain = false;
-        scores.push_back(score);
-        score = 0;
-      }
+    const bool reset =
+      reset_idx < reset_points.size() && reset_points[reset_idx] == i;
+    if (reset)
       ++reset_idx;
-    }
-    if (classes[i] == prev_class) {
-      in_domain = true;
-      score += 1.0 - (meth[i].first/(meth[i].first + meth[i].second));
-      ++n_cpgs;
-    }
-    else if (in_domain) {
-      in_domain = false;
-      scores.push_back(score);
+    if (i > 0 && (reset || classes[i] != classes[i - 1])) {
+      scores.push_back(n_cpgs > 1 ? score : SINGLE_SITE_SCORE);
+      n_cpgs = 0;
       score = 0;
     }
-    prev_class = classes[i];
+    score += 1.0 - (meth[i].first/(meth[i].first + meth[i].second));
+    ++n_cpgs;
   }
+  if (n_cpgs > 0)
+    scores.push_back(n_cpgs > 1 ? score : SINGLE_SITE_SCORE);
 }
 
 
@@ -286,19 +322,47 @@ build_hmr_domains(const bool VERBOSE, const vector<GenomicRegion> &domains,
 
 
 
+// Decode n_shuffles random permutations of the data in parallel. Each
+// thread owns a copy of the trained parameters, without the lattices
+// of training, and a scratch array, so their buffers are reused across
+// replicates. Replicate r draws from its own stream seeded by
+// (rng_seed, r), and the sorted replicate scores are merged in
+// replicate order, so results do not depend on the threads.
 static void
-shuffle_cpgs(TwoVarHMM &hmm, vector<pair<double, double> > meth,
-             vector<size_t> reset_points,
-             vector<double> &domain_scores) {
-  srand(time(0) + getpid());
-  random_shuffle(meth.begin(), meth.end());
-  vector<int> classes;
-  vector<double> scores;
-  hmm.PosteriorDecoding(meth, reset_points, classes, scores);
-  get_domain_scores(classes, meth, reset_points, domain_scores);
-  sort(domain_scores.begin(), domain_scores.end());
+shuffle_cpgs(const TwoVarHMM &hmm, const vector<pair<double, double> > &meth,
+             const vector<size_t> &reset_points,
+             vector<double> &domain_scores,
+             const size_t n_shuffles, const size_t rng_seed) {
+  vector<vector<double> > replicate_scores(n_shuffles);
+#pragma omp parallel
+  {
+    TwoVarHMM worker(hmm.parameter_copy());
+    vector<pair<double, double> > shuffled;
+    vector<int> classes;
+    vector<double> scores;
+#pragma omp for schedule(dynamic)
+    for (size_t r = 0; r < n_shuffles; ++r) {
+      std::seed_seq seeds{rng_seed, r};
+      std::mt19937 gen(seeds);
+      shuffled.assign(meth.begin(), meth.end());
+      std::shuffle(shuffled.begin(), shuffled.end(), gen);
+      worker.PosteriorDecoding(shuffled, reset_points, classes, scores);
+      vector<double> &rs = replicate_scores[r];
+      get_domain_scores(classes, shuffled, reset_points, rs);
+      rs.erase(std::remove(rs.begin(), rs.end(), SINGLE_SITE_SCORE), rs.end());
+      sort(rs.begin(), rs.end());
+    }
+  }
+  for (size_t r = 0; r < n_shuffles; ++r) {
+    const size_t n_merged = domain_scores.size();
+    domain_scores.insert(domain_scores.end(), replicate_scores[r].begin(),
+                         replicate_scores[r].end());
+    std::inplace_merge(domain_scores.begin(), domain_scores.begin() + n_merged,
+                       domain_scores.end());
+  }
 }
 
+
 static void
 assign_p_values(const vector<double> &random_scores,
                 const vector<double> &observed_scores,
@@ -306,10 +370,109 @@ assign_p_values(const vector<double> &random_scores,
   const double n_randoms =
       random_scores.size() == 0 ? 1 : random_scores.size();
   for (size_t i = 0; i < observed_scores.size(); ++i) {
-    p_values.push_back((random_scores.end() -
-                        upper_bound(random_scores.begin(),
-                                    random_scores.end(),
-                                    observed_scores[i]))/n_randoms);
+    if (observed_scores[i] == SINGLE_SITE_SCORE)
+      p_values.push_back(1.0);
+    else
+      p_values.push_back((random_scores.end() -
+                          upper_bound(random_scores.begin(),
+                                      random_scores.end(),
+                                      observed_scores[i]))/n_randoms);
+  }
+}
+
+
+// Decode one chromosome at a time. Chromosomes are independent since
+// the model resets at every desert, so all output is written as it is
+// produced and nothing is kept across chromosomes.
+static void
+decode_chromosomes(const bool VERBOSE, const bool VITERBI,
+                   const size_t desert_size, const size_t fg_mode,
+                   const string &cpgs_file, TwoVarHMM &hmm,
+                   const vector<double> &random_scores,
+                   const string &outfile, const string &segments_file,
+                   const string &scores_file) {
+
+  BufferedWriter out(outfile);
+  BufferedWriter *out_seg = segments_file.empty() ?
+    0 : new BufferedWriter(segments_file);
+  BufferedWriter *out_scores = (!scores_file.empty() && !VITERBI) ?
+    new BufferedWriter(scores_file) : 0;
+
+  size_t hmr_count = 0;
+  CpGChromStream in(cpgs_file);
+  CpGBlock chrom;
+  while (in.next(chrom)) {
+    vector<size_t> reset_points;
+    ProfileTimer separate_timer("separate_regions", chrom.size());
+    separate_regions(false, desert_size, chrom.cpgs, chrom.meth,
+                     chrom.reads, reset_points);
+    separate_timer.stop();
+    if (chrom.cpgs.empty())
+      continue;
+    if (VERBOSE)
+      cerr << "[DECODING " << chrom.cpgs.front().get_chrom() << ": "
+           << chrom.size() << " CPGS]" << endl;
+
+    vector<int> classes;
+    vector<GenomicRegion> domains;
+    vector<double> p_values;
+    ProfileTimer decode_timer("decode", chrom.size());
+    if (!VITERBI) {
+      vector<double> scores;
+      vector<vector<double> > class_scores =
+        vector<vector<double> >(chrom.size(), vector<double> (fg_mode+1, 0));
+      hmm.PosteriorDecoding(chrom.meth, reset_points, classes, scores,
+                            class_scores);
+      vector<double> domain_scores;
+      get_domain_scores(classes, chrom.meth, reset_points, domain_scores);
+      assign_p_values(random_scores, domain_scores, p_values);
+      build_domains(VERBOSE, chrom.cpgs, scores, reset_points, classes,
+                    domains);
+      decode_timer.stop();
+
+      // the sites are counted with the rest of the output below
+      ProfileTimer scores_timer("output");
+      if (out_scores)
+        for (size_t i = 0; i < chrom.size(); ++i) {
+          *out_scores << chrom.cpgs[i] << '\t';
+          for (size_t j = 0; j <= fg_mode; ++j)
+            *out_scores << class_scores[i][j] << '\t';
+          *out_scores << '\n';
+        }
+    }
+    else {
+      hmm.ViterbiDecoding(chrom.meth, reset_points, classes);
+      build_domains(VERBOSE, chrom.cpgs, reset_points, classes, domains);
+      decode_timer.stop();
+    }
+
+    ProfileTimer domain_timer("domains", chrom.size());
+    vector<GenomicRegion> hmrs;
+    build_hmr_domains(VERBOSE, domains, hmrs, toa(fg_mode));
+    domain_timer.stop();
+
+    ProfileTimer output_timer("output", chrom.size());
+    if (out_seg)
+      for (size_t i = 0; i < domains.size(); ++i) {
+        *out_seg << domains[i];
+        if (!VITERBI)
+          *out_seg << '\t' << p_values[i];
+        *out_seg << '\n';
+      }
+
+    for (size_t i = 0; i < hmrs.size(); ++i) {
+      hmrs[i].set_name(toa(++hmr_count));
+      out << hmrs[i] << '\t' << 0 << '\n';
+    }
+  }
+  out.close();
+  if (out_seg) {
+    out_seg->close();
+    delete out_seg;
+  }
+  if (out_scores) {
+    out_scores->close();
+    delete out_scores;
   }
 }
 
@@ -319,6 +482,8 @@ write_params_file(const string &outfile, TwoVarHMM &hmm) {
 
   std::ofstream of;
   if (!outfile.empty()) of.open(outfile.c_str());
+  if (!outfile.empty() && !of)
+    throw SMITHLABException("cannot open params file " + outfile);
   std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
   
   out.precision(30);
@@ -327,6 +492,7 @@ write_params_file(const string &outfile, TwoVarHMM &hmm) {
       << "BG_ALPHA\t" << hmm.get_bg_emission().alpha << endl
       << "BG_BETA\t" << hmm.get_bg_emission().beta << endl
       << "FG_MODE\t" << hmm.get_fg_mode() << endl
+      << "BG_MODE\t" << hmm.get_bg_mode() << endl
       << "S_F\t" << hmm.get_p_sf() << endl
       << "S_B\t" << hmm.get_p_sb() << endl
       << "F_IN\t" << 1 - hmm.get_fg_p() << endl
@@ -338,6 +504,86 @@ write_params_file(const string &outfile, TwoVarHMM &hmm) {
 }
 
 
+// reads the output of write_params_file; files without BG_MODE keep
+// the bg_mode given
+static void
+read_params_file(const bool VERBOSE, const string &params_file,
+                 BetaBin &fg_emission, BetaBin &bg_emission,
+                 size_t &fg_mode, size_t &bg_mode,
+                 double &fg_p, double &bg_p, double &p_sf, double &p_sb,
+                 double &p_ft, double &p_bt) {
+  std::ifstream in(params_file.c_str());
+  if (!in)
+    throw SMITHLABException("cannot open params file " + params_file);
+  std::map<string, double> params;
+  string key;
+  double value = 0;
+  while (in >> key >> value)
+    params[key] = value;
+
+  static const char *required[] = {"FG_ALPHA", "FG_BETA", "BG_ALPHA",
+                                   "BG_BETA", "FG_MODE", "S_F", "S_B",
+                                   "F_OUT", "B_OUT", "F_E", "B_E"};
+  for (size_t i = 0; i < sizeof(required)/sizeof(required[0]); ++i)
+    if (params.find(required[i]) == params.end())
+      throw SMITHLABException("no " + string(required[i]) +
+                              " in params file " + params_file);
+
+  fg_emission = BetaBin(params["FG_ALPHA"], params["FG_BETA"]);
+  bg_emission = BetaBin(params["BG_ALPHA"], params["BG_BETA"]);
+  fg_mode = static_cast<size_t>(params["FG_MODE"]);
+  if (params.find("BG_MODE") != params.end())
+    bg_mode = static_cast<size_t>(params["BG_MODE"]);
+  fg_p = params["F_OUT"];
+  bg_p = params["B_OUT"];
+  p_sf = params["S_F"];
+  p_sb = params["S_B"];
+  p_ft = params["F_E"];
+  p_bt = params["B_E"];
+  if (VERBOSE)
+    cerr << "FG_EMISSION\t" << fg_emission.tostring() << endl
+         << "BG_EMISSION\t" << bg_emission.tostring() << endl
+         << "FG_MODE\t" << fg_mode << endl
+         << "BG_MODE\t" << bg_mode << endl
+         << "F_OUT\t" << fg_p << endl
+         << "B_OUT\t" << bg_p << endl;
+}
+
+
+// Cuts the segments between reset points into blocks of at most
+// block_size sites and keeps a stratified fraction of the blocks of
+// each chromosome, each block a segment of its own
+static void
+subsample_segments(const vector<SimpleGenomicRegion> &cpgs,
+                   const vector<pair<double, double> > &meth,
+                   const vector<size_t> &reset_points, const double fraction,
+                   const size_t block_size,
+                   vector<pair<double, double> > &smeth,
+                   vector<size_t> &sreset_points) {
+  vector<size_t> starts, strata;
+  for (size_t i = 0; i + 1 < reset_points.size(); ++i) {
+    const size_t first = reset_points[i];
+    const bool new_chrom = (i > 0 && !cpgs[first].same_chrom(cpgs[first - 1]));
+    const size_t chrom = strata.empty() ? 0 : strata.back() + new_chrom;
+    for (size_t j = first; j < reset_points[i + 1]; j += block_size) {
+      starts.push_back(j);
+      strata.push_back(chrom);
+    }
+  }
+  starts.push_back(meth.size());
+
+  vector<size_t> chosen;
+  select_training_blocks(starts, strata, fraction, chosen);
+  smeth.clear();
+  sreset_points.assign(1, 0);
+  for (size_t j = 0; j < chosen.size(); ++j) {
+    smeth.insert(smeth.end(), meth.begin() + starts[chosen[j]],
+                 meth.begin() + starts[chosen[j] + 1]);
+    sreset_points.push_back(smeth.size());
+  }
+}
+
+
 
 int
 main(int argc, const char **argv) {
@@ -349,6 +595,26 @@ main(int argc, const char **argv) {
     size_t fg_mode = 3;
     size_t bg_mode = 1;
     size_t mode_search_k = 3;
+    size_t n_threads = 1;
+    size_t n_shuffles = 1;
+    size_t rng_seed = time(0) + getpid();
+
+    // stream mode: train on a sample, decode a chromosome at a time
+    bool STREAM = false;
+    size_t train_every = 10;
+    static const size_t TRAIN_BLOCK_SIZE = 100000;
+    // keep every sqrt(n)-th lattice row while decoding
+    bool CHECKPOINT = false;
+    // SQUAREM steps between the EM passes of training
+    bool ACCELERATE = false;
+    // train on part of the segments, then refine on all the data
+    double train_fraction = 1.0;
+    static const size_t SUBSAMPLE_BLOCK_SIZE = 10000;
+    static const size_t REFINE_ITERATIONS = 2;
+    // fitted parameters by input and settings, reused instead of training
+    string param_cache_dir;
+    // JSON report of the time and memory of each phase
+    string profile_file;
     
     // run mode flags
     bool VERBOSE = false;
@@ -387,6 +653,29 @@ main(int argc, const char **argv) {
 		      false, params_in_file);
     opt_parse.add_opt("params-out", 'p', "write HMM parameters to this file", 
 		      false, params_out_file);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("shuffles", 'N', "number of shuffles for the "
+                      "domain score null", false, n_shuffles);
+    opt_parse.add_opt("seed", 'e', "rng seed for the shuffles "
+                      "(default: from time)", false, rng_seed);
+    opt_parse.add_opt("stream", 'w', "decode one chromosome at a time",
+                      false, STREAM);
+    opt_parse.add_opt("train-every", 'k', "in stream mode train on every "
+                      "k-th block of " + toa(TRAIN_BLOCK_SIZE) + " sites "
+                      "of each chromosome",
+                      false, train_every);
+    opt_parse.add_opt("checkpoint", 'L', "decode in O(sqrt(n)) memory, "
+                      "about twice as slow", false, CHECKPOINT);
+    opt_parse.add_opt("accelerate", 'A', "accelerate training with SQUAREM "
+                      "steps", false, ACCELERATE);
+    opt_parse.add_opt("train-fraction", 'T', "train on this fraction of the "
+                      "segments of each chromosome, then refine on all sites",
+                      false, train_fraction);
+    opt_parse.add_opt("param-cache", 'C', "directory of fitted parameters "
+                      "reused for the same input and settings",
+                      false, param_cache_dir);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, profile_file);
     
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -408,7 +697,17 @@ main(int argc, const char **argv) {
       return EXIT_SUCCESS;
     }
     const string cpgs_file = leftover_args.front();
+    if (!(train_fraction > 0.0 && train_fraction <= 1.0)) {
+      cerr << "train fraction must be in (0, 1]" << endl;
+      return EXIT_FAILURE;
+    }
     /****************** END COMMAND LINE OPTIONS *****************/
+
+#ifdef _OPENMP
+    omp_set_num_threads(n_threads);
+#endif
+    if (!profile_file.empty())
+      Profile::get().enable();
     
     // separate the regions by chrom and by desert
     vector<SimpleGenomicRegion> cpgs;
@@ -416,9 +715,20 @@ main(int argc, const char **argv) {
     vector<size_t> reads;
     if (VERBOSE)
       cerr << "[READING CPGS AND METH PROPS]" << endl;
-    load_cpgs(cpgs_file, cpgs, meth, reads);
+    ProfileTimer load_timer("load");
+    if (STREAM) {
+      CpGBlock sample;
+      load_cpg_sample(cpgs_file, train_every, TRAIN_BLOCK_SIZE, sample);
+      cpgs.swap(sample.cpgs);
+      meth.swap(sample.meth);
+      reads.swap(sample.reads);
+    }
+    else load_cpgs(cpgs_file, cpgs, meth, reads);
+    load_timer.add_items(cpgs.size());
+    load_timer.stop();
     if (VERBOSE)
-      cerr << "TOTAL CPGS: " << cpgs.size() << endl
+      cerr << (STREAM ? "TRAINING CPGS: " : "TOTAL CPGS: ")
+      << cpgs.size() << endl
       << "MEAN COVERAGE: "
       << accumulate(reads.begin(), reads.end(), 0.0)/reads.size()
       << endl << endl;
@@ -427,7 +737,9 @@ main(int argc, const char **argv) {
     // those isolated CpGs
     vector<size_t> reset_points;
     
+    ProfileTimer separate_timer("separate_regions", cpgs.size());
     separate_regions(VERBOSE, desert_size, cpgs, meth, reads, reset_points);
+    separate_timer.stop();
     
     // set-up distributions
     double fg_alpha = 0;
@@ -455,36 +767,90 @@ main(int argc, const char **argv) {
     
     double p_ft = 1e-10;
     double p_bt = 1e-10;
+
+    string cache_file;
+    if (params_in_file.empty() && !param_cache_dir.empty()) {
+      std::ostringstream settings;
+      settings << "DESERT " << desert_size << " FG_MODE " << fg_mode
+               << " BG_MODE " << bg_mode << " ITR " << max_iterations
+               << " ACCELERATE " << ACCELERATE
+               << " TRAIN_FRACTION " << train_fraction
+               << " STREAM " << STREAM << " TRAIN_EVERY " << train_every;
+      cache_file = param_cache_file(param_cache_dir, "vdhmr", cpgs_file,
+                                    settings.str());
+      if (std::ifstream(cache_file.c_str())) {
+        if (VERBOSE)
+          cerr << "[CACHED PARAMETERS: " << cache_file << "]" << endl;
+        params_in_file = cache_file;
+      }
+    }
+    if (!params_in_file.empty())
+      read_params_file(VERBOSE, params_in_file, fg_emission, bg_emission,
+                       fg_mode, bg_mode, fg_p, bg_p, p_sf, p_sb, p_ft, p_bt);
    
   // HMM initialization
     
-    double prev_score = -std::numeric_limits<double>::max();
-    
-    
     TwoVarHMM hmm(min_prob, tolerance, max_iterations, VERBOSE);
+    hmm.set_checkpointing(CHECKPOINT);
+    hmm.set_acceleration(ACCELERATE);
     hmm.set_parameters(fg_emission, bg_emission, fg_mode, bg_mode,
                        fg_p, bg_p, p_sf, p_sb, p_ft, p_bt);
     
     // HMM training
-    double score = hmm.BaumWelchTraining(meth, reset_points);
-    
-/*
+    if (params_in_file.empty()) {
+      ProfileTimer train_timer("train", meth.size());
+      if (train_fraction < 1.0) {
+        vector<pair<double, double> > smeth;
+        vector<size_t> sreset_points;
+        subsample_segments(cpgs, meth, reset_points, train_fraction,
+                           SUBSAMPLE_BLOCK_SIZE, smeth, sreset_points);
+        if (VERBOSE)
+          cerr << "SUBSAMPLE CPGS: " << smeth.size() << endl;
+        hmm.BaumWelchTraining(smeth, sreset_points);
+        hmm.set_max_iterations(REFINE_ITERATIONS);
+      }
+      hmm.BaumWelchTraining(meth, reset_points);
+      if (!cache_file.empty()) {
+        // renamed into place so a reader never sees part of a file
+        const string partial = cache_file + ".tmp." + toa(getpid());
+        write_params_file(partial, hmm);
+        if (rename(partial.c_str(), cache_file.c_str()) != 0) {
+          unlink(partial.c_str());
+          throw SMITHLABException("cannot write params file " + cache_file);
+        }
+      }
+    }
     
     if (!params_out_file.empty()) {
       // WRITE ALL THE HMM PARAMETERS:
       write_params_file(params_out_file, hmm);
     }
- */
  
     /***********************************
      * STEP 5: DECODE THE DOMAINS
      */
     
-    if (!VITERBI) {
+    if (STREAM) {
+      // the null is drawn from the training sample
+      vector<double> random_scores;
+      ProfileTimer shuffle_timer("shuffle",
+                                 VITERBI ? 0 : n_shuffles*meth.size());
+      if (!VITERBI)
+        shuffle_cpgs(hmm, meth, reset_points, random_scores,
+                     n_shuffles, rng_seed);
+      shuffle_timer.stop();
+      vector<SimpleGenomicRegion>().swap(cpgs);
+      vector<pair<double, double> >().swap(meth);
+      decode_chromosomes(VERBOSE, VITERBI, desert_size, fg_mode, cpgs_file,
+                         hmm, random_scores, outfile, segments_file,
+                         scores_file);
+    }
+    else if (!VITERBI) {
       vector<int> classes;
       vector<double> scores;
       //hmm.PosteriorDecoding(meth, reset_points, classes, scores);
       
+      ProfileTimer decode_timer("decode", meth.size());
       vector<vector<double> > class_scores =
         vector<vector<double> >(meth.size(), vector<double> (fg_mode+1, 0));
       hmm.PosteriorDecoding(meth, reset_points, classes, scores, class_scores);
@@ -492,81 +858,99 @@ main(int argc, const char **argv) {
       
       vector<double> domain_scores;
       get_domain_scores(classes, meth, reset_points, domain_scores);
+      decode_timer.stop();
       
       
       vector<double> random_scores;
-      shuffle_cpgs(hmm, meth, reset_points, random_scores);
+      ProfileTimer shuffle_timer("shuffle", n_shuffles*meth.size());
+      shuffle_cpgs(hmm, meth, reset_points, random_scores,
+                   n_shuffles, rng_seed);
+      shuffle_timer.stop();
       
       vector<double> p_values;
       assign_p_values(random_scores, domain_scores, p_values);
       
+      ProfileTimer domain_timer("domains", meth.size());
       vector<GenomicRegion> domains;
       build_domains(VERBOSE, cpgs, scores, reset_points, classes, domains);
       
       vector<GenomicRegion> hmrs;
       build_hmr_domains(VERBOSE, domains, hmrs, toa(fg_mode));
+      domain_timer.stop();
       
       
-      
+      ProfileTimer output_timer("output", cpgs.size());
+
       // output HMR segments
       if (!segments_file.empty()) {
-        std::ostream *out_seg = new std::ofstream(segments_file.c_str());
+        BufferedWriter out_seg(segments_file);
         for (size_t i = 0; i < domains.size(); ++i) {
-          *out_seg << domains[i] << '\t' << p_values[i] << endl;
+          out_seg << domains[i] << '\t' << p_values[i] << '\n';
         }
+        out_seg.close();
       }
       
       // output HMRs
-      std::ostream *out = outfile.empty() ?
-      &std::cout : new std::ofstream(outfile.c_str());
-      
+      BufferedWriter out(outfile);
       for (size_t i = 0; i < hmrs.size(); ++i) {
-        *out << hmrs[i] << '\t' << 0 << endl;
+        out << hmrs[i] << '\t' << 0 << '\n';
       }
+      out.close();
       
       // output posterior probabilities
       if (!scores_file.empty()) {
-        std::ostream *out_scores = new std::ofstream(scores_file.c_str());
+        BufferedWriter out_scores(scores_file);
         for (size_t i = 0; i < cpgs.size(); ++i) {
-          /**out_scores << cpgs[i] << '\t' << scores[i] << endl;*/
-          *out_scores << cpgs[i] << '\t';
+          out_scores << cpgs[i] << '\t';
           for (size_t j = 0; j <= fg_mode; ++j) {
-            *out_scores << class_scores[i][j] << '\t';
+            out_scores << class_scores[i][j] << '\t';
           }
-          *out_scores << endl;
+          out_scores << '\n';
         }
+        out_scores.close();
       }
 
     }
     else {
+      ProfileTimer decode_timer("decode", meth.size());
       vector<int> classes;
       hmm.ViterbiDecoding(meth, reset_points, classes);
+      decode_timer.stop();
       
+      ProfileTimer domain_timer("domains", meth.size());
       vector<GenomicRegion> domains;
       build_domains(VERBOSE, cpgs, reset_points, classes, domains);
       
       vector<GenomicRegion> hmrs;
       build_hmr_domains(VERBOSE, domains, hmrs, toa(fg_mode));
+      domain_timer.stop();
       
-      
+      ProfileTimer output_timer("output", cpgs.size());
+
       // output HMR segments
       if (!segments_file.empty()) {
-        std::ostream *out_seg = new std::ofstream(segments_file.c_str());
+        BufferedWriter out_seg(segments_file);
         for (size_t i = 0; i < domains.size(); ++i) {
-          *out_seg << domains[i] << endl;
+          out_seg << domains[i] << '\n';
         }
+        out_seg.close();
       }
       
       // output HMRs
-      std::ostream *out = outfile.empty() ?
-      &std::cout : new std::ofstream(outfile.c_str());
-      
+      BufferedWriter out(outfile);
       for (size_t i = 0; i < hmrs.size(); ++i) {
-        *out << hmrs[i] << '\t' << 0 << endl;
+        out << hmrs[i] << '\t' << 0 << '\n';
       }
+      out.close();
 
     }
-    
+
+    if (!profile_file.empty()) {
+      std::ofstream profile_out(profile_file.c_str());
+      if (!profile_out)
+        throw SMITHLABException("cannot open profile file " + profile_file);
+      Profile::get().write_json(profile_out, "vdhmr");
+    }
   }
   catch (SMITHLABException &e) {
     cerr << "ERROR:\t" << e.what() << endl;
@@ -29,9 +29,18 @@
 #include <algorithm>
 #include <iterator>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "OptionParser.hpp"
+#include "Lattice.hpp"
+#include "HMMCore.hpp"
+#include "EMAccel.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
 
 using std::istream_iterator;
 using std::string;
@@ -83,15 +92,6 @@ get_delta(const double a, const double b) {
   return (b - a)/max(abs(a), abs(b));
 }
 
-inline double
-log_sum_log(const double p, const double q) {
-  if (p == 0.0) {return q;}
-  else if (q == 0.0) {return p;}
-  const double larger = (p > q) ? p : q;
-  const double smaller = (p > q) ? q : p;
-  return larger + log(1.0 + exp(smaller - larger));
-}
-
 template <class T> void
 one_minus(T a, const T a_end, T b) {
     while (a != a_end)
@@ -129,6 +129,45 @@ Bernoulli::fit(const vector<bool> &vals, const vector<double> &pp) {
   
   p = min(max(nom / denom, epsilon), 1 - epsilon);
 }
+/* Running totals over sampled state paths, so many draws can be
+ * summarized without keeping the paths: per position, how often it
+ * is foreground, and how often a foreground domain starts or ends
+ * there (the state changes between it and the previous position).
+ */
+struct PathSummary {
+  PathSummary() : n_draws(0) {}
+  explicit PathSummary(const size_t n) :
+    n_draws(0), fg_count(n, 0), start_count(n, 0), end_count(n, 0) {}
+  void add(const vector<bool> &x);
+  void merge(const PathSummary &other);
+
+  size_t n_draws;
+  vector<size_t> fg_count;
+  vector<size_t> start_count;
+  vector<size_t> end_count;
+};
+
+void
+PathSummary::add(const vector<bool> &x) {
+  ++n_draws;
+  fg_count[0] += x[0];
+  for (size_t i = 1; i < x.size(); ++i) {
+    fg_count[i] += x[i];
+    start_count[i] += (x[i] && !x[i-1]);
+    end_count[i] += (!x[i] && x[i-1]);
+  }
+}
+
+void
+PathSummary::merge(const PathSummary &other) {
+  n_draws += other.n_draws;
+  for (size_t i = 0; i < fg_count.size(); ++i) {
+    fg_count[i] += other.fg_count[i];
+    start_count[i] += other.start_count[i];
+    end_count[i] += other.end_count[i];
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 ///////
@@ -143,22 +182,22 @@ struct TwoStateHMM {
   
   TwoStateHMM(const double tol, const size_t max_itr,
               const bool v, const bool e) :
-  tolerance(tol), max_iterations(max_itr), VERBOSE(v), FIX_EMIT(e) {}
+  tolerance(tol), max_iterations(max_itr), VERBOSE(v), FIX_EMIT(e),
+  ACCELERATE(false) {}
   void initialize(const vector<bool> &obs);
   void initialize(const string params_file);
-  double single_iteration(const vector<bool> &obs,
-                          vector<pair<double, double> > &forward,
-                          vector<pair<double, double> > &backward,
-                          vector<pair<double, double> > &emit,
-                          vector<two_by_two> &joint);
+  double single_iteration(const vector<bool> &obs);
   double BaumWelchTraining(const vector<bool> &obs);
   void StatesSampling(const vector<bool> &obs, vector<bool> &x,
-                      std::mt19937 &gen) const;
+                      std::mt19937 &gen);
+  void StatesSampling(const vector<bool> &obs, const size_t n_draws,
+                      const size_t rng_seed, PathSummary &summary);
   
   double tolerance;
   size_t max_iterations;
   bool VERBOSE;
   bool FIX_EMIT;
+  bool ACCELERATE; // SQUAREM steps between EM passes
 
   double p_fb;
   double p_bf;
@@ -166,6 +205,13 @@ struct TwoStateHMM {
   Bernoulli bg_distr;
   
   double llh; // log likelihood of observed data
+  EMTrace trace; // likelihood and time of each training pass
+
+  // buffers reused across iterations, indexed [position][state]
+  Lattice<double> log_forward;
+  Lattice<double> log_backward;
+  Lattice<double> emit;
+  Lattice<double> joint;
 };
 
 
@@ -201,109 +247,103 @@ TwoStateHMM::initialize(const string params_file) {
 ////////////////////////////////////////////////////////////////////////////////
 
 
+// an observation takes one of two values, so each distribution is
+// evaluated twice rather than at every position
 static void
-get_log_emissions(const vector<bool> &v, vector<pair<double, double> > &emit,
+get_log_emissions(const vector<bool> &v, Lattice<double> &emit,
                   const Bernoulli &fg_distr, const Bernoulli &bg_distr) {
-  for(size_t i = 0; i < v.size(); i++)
-    emit[i] = make_pair(log(bg_distr(v[i])), log(fg_distr(v[i])));
+  const double bg_lp[2] = {log(bg_distr(false)), log(bg_distr(true))};
+  const double fg_lp[2] = {log(fg_distr(false)), log(fg_distr(true))};
+  emit.resize(v.size(), 2);
+  for(size_t i = 0; i < v.size(); i++) {
+    emit[i][0] = bg_lp[v[i]];
+    emit[i][1] = fg_lp[v[i]];
+  }
 }
 
 inline static double
-get_posterior(const pair<double, double> &f, const pair<double, double> &b) {
-  const double fg = f.second + b.second;
-  return exp(fg - log_sum_log(fg, f.first + b.first));
+get_posterior(const double *f, const double *b) {
+  const double fg = f[1] + b[1];
+  return exp(fg - log_sum_log(fg, f[0] + b[0]));
 }
 
 inline static void
-get_posteriors(const vector<pair<double, double> > &forward,
-               const vector<pair<double, double> > &backward,
+get_posteriors(const Lattice<double> &forward,
+               const Lattice<double> &backward,
                vector<double> &posteriors) {
   posteriors.resize(forward.size());
   for (size_t i = 0; i < forward.size(); ++i)
     posteriors[i] = get_posterior(forward[i], backward[i]);
 }
 
+static DiscreteTransitions
+log_transitions(const vector<double> &ls, const two_by_two &lt) {
+  return DiscreteTransitions(lt[0][0], lt[0][1], lt[1][0], lt[1][1],
+                             ls[0], ls[1]);
+}
+
 static double
 forward_algorithm(const vector<double> &ls, const two_by_two &lt,
-                  const vector<pair<double, double> > &emit,
-                  vector<pair<double, double> > &f) {
-  f[0] = make_pair(emit[0].first + ls[0], emit[0].second + ls[1]);
-  for (size_t j = 1; j < f.size(); ++j) {
-    const size_t i = j - 1;
-    f[j].first = emit[j].first + log_sum_log(f[i].first + lt[0][0],
-                                             f[i].second + lt[1][0]);
-    f[j].second = emit[j].second + log_sum_log(f[i].first + lt[0][1],
-                                               f[i].second + lt[1][1]);
-  }
-  return log_sum_log(f.back().first, f.back().second);
+                  const Lattice<double> &emit, Lattice<double> &f) {
+  f.resize(emit.size(), 2);
+  return forward_algorithm(LatticeEmissions(emit), log_transitions(ls, lt),
+                           0, emit.size(), f);
 }
 
 static double
 backward_algorithm(const vector<double> &ls, const two_by_two &lt,
-                   const vector<pair<double, double> > &emit,
-                   vector<pair<double, double> > &b) {
-  b.back() = make_pair(0.0, 0.0);
-  for (size_t j = b.size() - 1; j > 0; --j) {
-    const size_t i = j - 1;
-    const double bg_a = emit[j].first + b[j].first;
-    const double fg_a = emit[j].second + b[j].second;
-    b[i].first = log_sum_log(lt[0][0] + bg_a, lt[0][1] + fg_a);
-    b[i].second = log_sum_log(lt[1][0] + bg_a, lt[1][1] + fg_a);
-  }
-  return log_sum_log(b[0].first + emit[0].first + ls[0],
-                     b[0].second + emit[0].second + ls[1]);
+                   const Lattice<double> &emit, Lattice<double> &b) {
+  b.resize(emit.size(), 2);
+  return backward_algorithm(LatticeEmissions(emit), log_transitions(ls, lt),
+                            0, emit.size(), b);
 }
 
 static void
-backward_sampling(const two_by_two &lt,
-                  const vector<pair<double, double> > &emit,
-                  vector<pair<double, double> > &f,
+backward_sampling(const two_by_two &lt, const Lattice<double> &emit,
+                  const Lattice<double> &f,
                   vector<bool> &x, std::mt19937 &gen) {
 
   std::uniform_real_distribution<double> unif(0.0, 1.0);
   
-  pair<double, double> b = make_pair(0.0, 0.0);
+  const double b[2] = {0.0, 0.0};
   double p1 = get_posterior(f.back(), b);
   x.back() = (unif(gen) < p1);
 
   for (size_t j = f.size() - 1; j > 0; --j) {
     const size_t i = j - 1;
-    const double em = x[j] ? emit[j].second : emit[j].first;
-    const double bg = f[i].first + lt[0][x[j]] + em;
-    const double fg = f[i].second + lt[1][x[j]] + em;
+    const double em = emit[j][x[j]];
+    const double bg = f[i][0] + lt[0][x[j]] + em;
+    const double fg = f[i][1] + lt[1][x[j]] + em;
     
     p1 = exp(fg - log_sum_log(fg, bg));
     x[i] = (unif(gen) < p1);
   }
 }
 
+// joint[i] holds the posterior of the (bb, bf, fb, ff) transitions
+// between positions i and i + 1
 static void
-summarize_transitions(const vector<pair<double, double> > &f,
-                      const vector<pair<double, double> > &b,
-                      const double total,
-                      const vector<pair<double, double> > &emit,
-                      const two_by_two &lt, vector<two_by_two> &joint) {
+summarize_transitions(const Lattice<double> &f, const Lattice<double> &b,
+                      const double total, const Lattice<double> &emit,
+                      const two_by_two &lt, Lattice<double> &joint) {
   
-  for (size_t j = 1; j < joint.size(); ++j) {
+  joint.resize(f.size() - 1, 4);
+  for (size_t j = 1; j < f.size(); ++j) {
     const size_t i = j - 1;
-    const double left_bg = f[i].first;
-    const double left_fg = f[i].second;
-    const double right_bg = b[j].first + emit[j].first - total;
-    const double right_fg = b[j].second + emit[j].second - total;
-
-    joint[i][0][0] = exp(left_bg + lt[0][0] + right_bg);
-    joint[i][0][1] = exp(left_bg + lt[0][1] + right_fg);
-    joint[i][1][0] = exp(left_fg + lt[1][0] + right_bg);
-    joint[i][1][1] = exp(left_fg + lt[1][1] + right_fg);
+    const double left_bg = f[i][0];
+    const double left_fg = f[i][1];
+    const double right_bg = b[j][0] + emit[j][0] - total;
+    const double right_fg = b[j][1] + emit[j][1] - total;
+
+    joint[i][0] = exp(left_bg + lt[0][0] + right_bg);
+    joint[i][1] = exp(left_bg + lt[0][1] + right_fg);
+    joint[i][2] = exp(left_fg + lt[1][0] + right_bg);
+    joint[i][3] = exp(left_fg + lt[1][1] + right_fg);
   }
 }
 
 double
-TwoStateHMM::single_iteration(const vector<bool> &obs,
-                              vector<pair<double, double> > &log_forward,
-                              vector<pair<double, double> > &log_backward,
-                              vector<pair<double, double> > &emit,
-                              vector<two_by_two> &joint) {
+TwoStateHMM::single_iteration(const vector<bool> &obs) {
   
   const vector<double> ls = {log(p_fb/(p_bf + p_fb)), log(p_bf/(p_bf + p_fb))};
   const two_by_two lt { {log(1.0 - p_bf), log(p_bf)},
@@ -312,21 +352,25 @@ TwoStateHMM::single_iteration(const vector<bool> &obs,
   assert(isfinite(ls[0]) && isfinite(ls[1]) && isfinite(lt[0][0]) &&
          isfinite(lt[0][1]) && isfinite(lt[1][0]) && isfinite(lt[1][1]));
   
+  ProfileTimer e_step("em_e_step", obs.size());
   get_log_emissions(obs, emit, fg_distr, bg_distr);
+  profile_count("emissions", obs.size());
   
   const double new_llh = forward_algorithm(ls, lt, emit, log_forward);
   const double backward_llh = backward_algorithm(ls, lt, emit, log_backward);
    
   assert(fabs(get_delta(new_llh, backward_llh)) < tolerance);
   summarize_transitions(log_forward, log_backward, new_llh, emit, lt, joint);
+  e_step.stop();
   
+  ProfileTimer m_step("em_m_step", obs.size());
   if (get_delta(llh, new_llh) > tolerance) { // not converged
     two_by_two sum_joint = two_by_two(2, vector<double> (2, 0.0));
     for (size_t i = 0; i < joint.size(); ++i) {
-      sum_joint[0][0] += joint[i][0][0];
-      sum_joint[0][1] += joint[i][0][1];
-      sum_joint[1][0] += joint[i][1][0];
-      sum_joint[1][1] += joint[i][1][1];
+      sum_joint[0][0] += joint[i][0];
+      sum_joint[0][1] += joint[i][1];
+      sum_joint[1][0] += joint[i][2];
+      sum_joint[1][1] += joint[i][3];
     }
     
     // Update transition probabilities
@@ -349,15 +393,50 @@ TwoStateHMM::single_iteration(const vector<bool> &obs,
 }
 
 
+// the EM map of single_iteration for squarem_training; llh holds the
+// score of the previous pass, as in the plain loop
+struct TwoStateEM {
+  TwoStateEM(TwoStateHMM &h, const vector<bool> &o) : hmm(h), obs(o) {}
+
+  double
+  pass(const size_t) {
+    hmm.llh = hmm.single_iteration(obs);
+    return hmm.llh;
+  }
+  bool
+  converged(const double score, const double prev_score) const {
+    return get_delta(prev_score, score) < hmm.tolerance;
+  }
+
+  void
+  get(vector<double> &theta) const {
+    theta.resize(4);
+    theta[0] = em_logit(hmm.fg_distr.p);
+    theta[1] = em_logit(hmm.bg_distr.p);
+    theta[2] = em_logit(hmm.p_fb);
+    theta[3] = em_logit(hmm.p_bf);
+  }
+  void
+  set(const vector<double> &theta) {
+    hmm.fg_distr.p = to_prob(theta[0]);
+    hmm.bg_distr.p = to_prob(theta[1]);
+    hmm.p_fb = to_prob(theta[2]);
+    hmm.p_bf = to_prob(theta[3]);
+  }
+  static double
+  to_prob(const double x) {
+    const double min_prob = 1e-10;
+    return min(max(em_expit(x), min_prob), 1.0 - min_prob);
+  }
+
+  TwoStateHMM &hmm;
+  const vector<bool> &obs;
+};
+
+
 double
 TwoStateHMM::BaumWelchTraining(const vector<bool> &obs) {
   
-  const size_t n_vals = obs.size();
-  vector<pair<double, double> > log_forward(n_vals, make_pair(0.0, 0.0));
-  vector<pair<double, double> > log_backward(n_vals, make_pair(0.0, 0.0));
-  vector<pair<double, double> > emit(n_vals, make_pair(0.0, 0.0));
-  vector<two_by_two> joint(n_vals, two_by_two(2, vector<double>(2, 0.0)));
-  
   llh = - std::numeric_limits<double>::max();
   double delta = std::numeric_limits<double>::max();
   
@@ -366,9 +445,17 @@ TwoStateHMM::BaumWelchTraining(const vector<bool> &obs) {
     report_params_for_verbose(0, fg_distr.p, bg_distr.p, p_fb, p_bf, delta);
   }
   
+  trace.clear();
+  if (ACCELERATE) {
+    TwoStateEM model(*this, obs);
+    llh = squarem_training(model, max_iterations, trace);
+    delta = 0.0;
+  }
+  
   for (size_t i = 0; i < max_iterations && (delta > tolerance); ++i) {
-    const double new_llh =
-    single_iteration(obs, log_forward, log_backward, emit, joint);
+    const double start = em_seconds();
+    const double new_llh = single_iteration(obs);
+    trace.add(new_llh, em_seconds() - start, 'E');
     delta = get_delta(llh, new_llh);
     
     if (delta < tolerance) {
@@ -382,13 +469,15 @@ TwoStateHMM::BaumWelchTraining(const vector<bool> &obs) {
       llh = new_llh;
     }
   }
+  if (VERBOSE)
+    trace.report(cerr);
   return llh;
 }
 
 
 void
 TwoStateHMM::StatesSampling(const vector<bool> &obs, vector<bool> &x,
-                            std::mt19937 &gen) const {
+                            std::mt19937 &gen) {
   
   const vector<double> ls = {log(p_fb/(p_bf + p_fb)), log(p_bf/(p_bf + p_fb))};
   const two_by_two lt { {log(1.0 - p_bf), log(p_bf)},
@@ -397,10 +486,7 @@ TwoStateHMM::StatesSampling(const vector<bool> &obs, vector<bool> &x,
   assert(isfinite(ls[0]) && isfinite(ls[1]) && isfinite(lt[0][0]) &&
          isfinite(lt[0][1]) && isfinite(lt[1][0]) && isfinite(lt[1][1]));
   
-  const size_t n_vals = obs.size();
-  vector<pair<double, double> > log_forward(n_vals, make_pair(0.0, 0.0));
-  vector<pair<double, double> > emit(n_vals, make_pair(0.0, 0.0));
-  x.resize(n_vals, false);
+  x.resize(obs.size(), false);
   
   get_log_emissions(obs, emit, fg_distr, bg_distr);
   
@@ -409,8 +495,56 @@ TwoStateHMM::StatesSampling(const vector<bool> &obs, vector<bool> &x,
 }
 
 
+/* Draws n_draws paths from the one forward pass, in parallel. Draw d
+ * uses its own generator seeded by (rng_seed, d) and the per-thread
+ * totals are integers, so the summary is the same for any number of
+ * threads.
+ */
+void
+TwoStateHMM::StatesSampling(const vector<bool> &obs, const size_t n_draws,
+                            const size_t rng_seed, PathSummary &summary) {
+
+  const vector<double> ls = {log(p_fb/(p_bf + p_fb)), log(p_bf/(p_bf + p_fb))};
+  const two_by_two lt { {log(1.0 - p_bf), log(p_bf)},
+    {log(p_fb), log(1.0 - p_fb)}};
+
+  assert(isfinite(ls[0]) && isfinite(ls[1]) && isfinite(lt[0][0]) &&
+         isfinite(lt[0][1]) && isfinite(lt[1][0]) && isfinite(lt[1][1]));
+
+  get_log_emissions(obs, emit, fg_distr, bg_distr);
+  forward_algorithm(ls, lt, emit, log_forward);
+
+  summary = PathSummary(obs.size());
+#pragma omp parallel
+  {
+    PathSummary local(obs.size());
+    vector<bool> x(obs.size(), false);
+#pragma omp for schedule(dynamic)
+    for (size_t d = 0; d < n_draws; ++d) {
+      std::seed_seq seeds{rng_seed, d};
+      std::mt19937 gen(seeds);
+      backward_sampling(lt, emit, log_forward, x, gen);
+      local.add(x);
+    }
+#pragma omp critical
+    summary.merge(local);
+  }
+}
+
+
 ////////////////////////////////////////////////////////////////////////
 
+static void
+write_path_summary(const string &outfile, const PathSummary &summary) {
+  BufferedWriter out(outfile);
+  const double n = summary.n_draws;
+  for (size_t i = 0; i < summary.fg_count.size(); ++i)
+    out << i << '\t' << summary.fg_count[i]/n << '\t'
+        << summary.start_count[i]/n << '\t' << summary.end_count[i]/n << '\n';
+  out.close();
+}
+
+
 static void
 write_params_file(const string &outfile, const double fg_p, const double bg_p,
                   const double p_fb, const double p_bf) {
@@ -440,13 +574,18 @@ main(int argc, const char **argv) {
     const static double tolerance = 1e-10;
     size_t max_iterations = 100;
     size_t rng_seed = std::numeric_limits<size_t>::max();
+    size_t n_draws = 1;
+    size_t n_threads = 1;
 
     // run mode flags
     bool VERBOSE = false;
     bool FIX_EMIT = false;
+    bool ACCELERATE = false;
 
     string params_in_file;
     string params_out_file;
+    // JSON report of the time and memory of each phase
+    string profile_file;
 
     double fg_p = 0.8;
     double bg_p = 0.1;
@@ -459,6 +598,8 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("itr", 'i', "max iterations", false, max_iterations);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     opt_parse.add_opt("fixemit", 'e', "do not update emit", false, FIX_EMIT);
+    opt_parse.add_opt("accelerate", 'A', "accelerate training with SQUAREM "
+                      "steps", false, ACCELERATE);
     opt_parse.add_opt("fgemit", 'F', "foreground emission", false, fg_p);
     opt_parse.add_opt("bgemit", 'B', "background emission", false, bg_p);
     opt_parse.add_opt("params-in", 'P', "HMM parameter file "
@@ -466,6 +607,13 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("params-out", 'p', "write HMM parameters to this "
                       "file (default: none)", false, params_out_file);
     opt_parse.add_opt("seed", 's', "rng seed", false, rng_seed);
+    opt_parse.add_opt("draws", 'n', "number of paths to sample; with more "
+                      "than one, output is the per-position fraction of "
+                      "paths in foreground, starting and ending a foreground "
+                      "domain", false, n_draws);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, profile_file);
     opt_parse.set_show_defaults();
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -489,18 +637,28 @@ main(int argc, const char **argv) {
     const string states_file = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
+#ifdef _OPENMP
+    omp_set_num_threads(n_threads);
+#endif
+    if (!profile_file.empty())
+      Profile::get().enable();
+
     // READ OBSERVED DATA
     if (VERBOSE)
       cerr << "[OBTAINING OBSERVED SEQUENCE]" << endl;
+    ProfileTimer load_timer("load");
     std::ifstream states_in(states_file);
     vector<bool> obs;
     copy(istream_iterator<bool>(states_in), istream_iterator<bool>(),
          std::back_inserter(obs));
+    load_timer.add_items(obs.size());
+    load_timer.stop();
     
     // HMM INITIALIZATION
     if (VERBOSE)
       cerr << "[HMM INITIALIZATION]" << endl;
     TwoStateHMM hmm(tolerance, max_iterations, VERBOSE, FIX_EMIT);
+    hmm.ACCELERATE = ACCELERATE;
 
     if (!params_in_file.empty()) { // load parameters file
       hmm.initialize(params_in_file);
@@ -515,8 +673,10 @@ main(int argc, const char **argv) {
     if (VERBOSE)
       cerr << "[HMM TRAINING]" << endl;
     
-    if (max_iterations > 0)
+    if (max_iterations > 0) {
+      ProfileTimer train_timer("train", obs.size());
       hmm.BaumWelchTraining(obs);
+    }
 
     // HMM OUTPUT
     if (!params_out_file.empty())
@@ -528,25 +688,47 @@ main(int argc, const char **argv) {
       std::random_device rd;
       rng_seed = rd();
     }
-    std::mt19937 gen(rng_seed);
 
     if (VERBOSE)
       cerr << "[HMM SAMPLING]" << endl;
-    
-    vector<bool> states;
-    hmm.StatesSampling(obs, states, gen);
-    
-    std::ofstream of;
-    if (!outfile.empty()) of.open(outfile.c_str());
-    std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
-    copy(begin(states), end(states), std::ostream_iterator<double>(out, "\n"));
-  
 
+    if (n_draws > 1) {
+      PathSummary summary;
+      ProfileTimer sampling_timer("sampling", n_draws*obs.size());
+      hmm.StatesSampling(obs, n_draws, rng_seed, summary);
+      sampling_timer.stop();
+      ProfileTimer output_timer("output", obs.size());
+      write_path_summary(outfile, summary);
+    }
+    else {
+      std::mt19937 gen(rng_seed);
+      vector<bool> states;
+      ProfileTimer sampling_timer("sampling", obs.size());
+      hmm.StatesSampling(obs, states, gen);
+      sampling_timer.stop();
+
+      ProfileTimer output_timer("output", obs.size());
+      BufferedWriter out(outfile);
+      for (size_t i = 0; i < states.size(); ++i)
+        out << (states[i] ? '1' : '0') << '\n';
+      out.close();
+    }
+
+    if (!profile_file.empty()) {
+      std::ofstream profile_out(profile_file.c_str());
+      if (!profile_out)
+        throw runtime_error("cannot open profile file " + profile_file);
+      Profile::get().write_json(profile_out, "hmm_sampling");
+    }
   }
   catch (runtime_error &e) {
     cerr << e.what() << endl;
     return EXIT_FAILURE;
   }
+  catch (SMITHLABException &e) {
+    cerr << "ERROR:\t" << e.what() << endl;
+    return EXIT_FAILURE;
+  }
   catch (std::bad_alloc &ba) {
     cerr << "ERROR: could not allocate memory" << endl;
     return EXIT_FAILURE;
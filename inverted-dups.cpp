@@ -27,10 +27,23 @@
 #include <numeric>
 #include <sstream>
 #include <algorithm>
+#include <future>
+#include <cstdio>
+#include <cstring>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
 
 using std::string;
 using std::vector;
@@ -93,80 +106,337 @@ operator<<(std::ostream& s, const FASTQRecord &r) {
   return s << r.tostring();
 }
 
-// Read 4 lines one time from fastq and fill in the FASTQRecord structure
-std::istream&
-operator>>(std::istream& s, FASTQRecord &r) {
-  if (getline(s, r.name)) {
-    if (r.name.empty() || r.name[0] != '@')
-      throw SMITHLABException("FASTQ file out of sync at '@'");
 
-    if (!getline(s, r.seq))
-      throw SMITHLABException("FASTQ file truncated expecting seq");
+/* Reads FASTQ records through a large buffer, with lines cut out of
+ * the buffer directly instead of through getline. With HAVE_ZLIB the
+ * input may be gzip compressed (plain files are read as-is).
+ */
+class FASTQReader {
+public:
+  explicit FASTQReader(const string &filename);
+  ~FASTQReader();
+
+  // false at the end of the file
+  bool read(FASTQRecord &r);
+
+private:
+  FASTQReader(const FASTQReader &) = delete;
+  FASTQReader &operator=(const FASTQReader &) = delete;
+
+  bool getline(string &line);
+  bool fill();
+
+  static const size_t BUFFER_SIZE = 1 << 22;
+
+#ifdef HAVE_ZLIB
+  gzFile in;
+#else
+  FILE *in;
+#endif
+  vector<char> buffer;
+  size_t pos;
+  size_t filled;
+};
 
-    if (!getline(s, r.seqtag))
-      throw SMITHLABException("FASTQ file truncated expecting '+' line");
 
-    if (r.seqtag.empty() || r.seqtag[0] != '+')
-      throw SMITHLABException("FASTQ file out of sync [missing '+']");
+FASTQReader::FASTQReader(const string &filename) :
+  buffer(BUFFER_SIZE), pos(0), filled(0) {
+#ifdef HAVE_ZLIB
+  in = gzopen(filename.c_str(), "rb");
+  if (in) gzbuffer(in, BUFFER_SIZE);
+#else
+  if (filename.size() > 3 &&
+      filename.compare(filename.size() - 3, 3, ".gz") == 0)
+    throw SMITHLABException("gzip input needs a build with HAVE_ZLIB: " +
+                            filename);
+  in = fopen(filename.c_str(), "rb");
+#endif
+  if (!in)
+    throw SMITHLABException("cannot open input file " + filename);
+}
+
+
+FASTQReader::~FASTQReader() {
+#ifdef HAVE_ZLIB
+  gzclose(in);
+#else
+  fclose(in);
+#endif
+}
 
-    if (!getline(s, r.score))
-      throw SMITHLABException("FASTQ file truncated expecting score");
+
+bool
+FASTQReader::fill() {
+#ifdef HAVE_ZLIB
+  const int n = gzread(in, &buffer[0], buffer.size());
+  if (n < 0)
+    throw SMITHLABException("error reading compressed FASTQ input");
+#else
+  const size_t n = fread(&buffer[0], 1, buffer.size(), in);
+#endif
+  pos = 0;
+  filled = n;
+  return n > 0;
+}
+
+
+bool
+FASTQReader::getline(string &line) {
+  line.clear();
+  for (;;) {
+    if (pos == filled && !fill())
+      return !line.empty();
+    const char *start = &buffer[0] + pos;
+    const char *newline =
+      static_cast<const char *>(memchr(start, '\n', filled - pos));
+    if (newline) {
+      line.append(start, newline);
+      pos += newline - start + 1;
+      return true;
+    }
+    line.append(start, filled - pos);
+    pos = filled;
   }
-  else s.setstate(std::ios::badbit);
+}
 
-  return s;
+
+// Read 4 lines one time from fastq and fill in the FASTQRecord structure
+bool
+FASTQReader::read(FASTQRecord &r) {
+  if (!getline(r.name))
+    return false;
+  if (r.name.empty() || r.name[0] != '@')
+    throw SMITHLABException("FASTQ file out of sync at '@'");
+
+  if (!getline(r.seq))
+    throw SMITHLABException("FASTQ file truncated expecting seq");
+
+  if (!getline(r.seqtag))
+    throw SMITHLABException("FASTQ file truncated expecting '+' line");
+
+  if (r.seqtag.empty() || r.seqtag[0] != '+')
+    throw SMITHLABException("FASTQ file out of sync [missing '+']");
+
+  if (!getline(r.score))
+    throw SMITHLABException("FASTQ file truncated expecting score");
+  return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static bool
-similar_letters_bisulfite(const char a, const char b) {
-  return (a == b) || (a == 'T' && b == 'C') || (a == 'G' && b == 'A');
+/* Compares the two ends position by position. sim_both counts
+ * positions that agree allowing T/C and G/A bisulfite wildcards at
+ * once, and those positions are added to pos_count; sim_one counts
+ * agreement allowing only one of the wildcards, whichever is larger.
+ * The loop is branch-free byte compares so it vectorizes.
+ */
+static void
+invdup_similarity(const string &s1, const string &s2,
+                  size_t &sim_both, size_t &sim_one, size_t *pos_count) {
+  const size_t n = min(s1.length(), s2.length());
+  const unsigned char *a = reinterpret_cast<const unsigned char *>(s1.data());
+  const unsigned char *b = reinterpret_cast<const unsigned char *>(s2.data());
+  unsigned both = 0, sim_TC = 0, sim_GA = 0;
+#pragma omp simd reduction(+:both,sim_TC,sim_GA)
+  for (size_t i = 0; i < n; ++i) {
+    const unsigned same = (a[i] == b[i]);
+    const unsigned t_c = (a[i] == 'T') & (b[i] == 'C');
+    const unsigned g_a = (a[i] == 'G') & (b[i] == 'A');
+    const unsigned similar = same | t_c | g_a;
+    both += similar;
+    sim_TC += same | t_c;
+    sim_GA += same | g_a;
+    pos_count[i] += similar;
+  }
+  sim_both = both;
+  sim_one = max(sim_TC, sim_GA);
 }
 
-static bool
-similar_letters_bisulfite_TCwildcard(const char a, const char b) {
-  return (a == b) || (a == 'T' && b == 'C');
+
+// the alignment shown for a suspect pair: '*' where the ends agree,
+// the letters where they agree through a wildcard, '-' otherwise
+static void
+invdup_bricks(const string &s1, const string &s2,
+              string &brick1, string &brick2) {
+  const size_t n = min(s1.length(), s2.length());
+  brick1.resize(n);
+  brick2.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    const char a = s1[i], b = s2[i];
+    if (a == b) {
+      brick1[i] = '*'; brick2[i] = '*';
+    }
+    else if ((a == 'T' && b == 'C') || (a == 'G' && b == 'A')) {
+      brick1[i] = a; brick2[i] = b;
+    }
+    else {
+      brick1[i] = '-'; brick2[i] = '-';
+    }
+  }
 }
 
-static bool
-similar_letters_bisulfite_GAwildcard(const char a, const char b) {
-  return (a == b) || (a == 'G' && b == 'A');
+
+/* A batch of read pairs moving through the pipeline: read on one
+ * thread, scored by the workers, then written in input order. The
+ * output text is formatted by the workers, one string per chunk.
+ */
+struct PairBatch {
+  vector<FASTQRecord> end1, end2;
+  size_t n_pairs;
+  vector<size_t> sim_both, sim_one;
+  vector<string> report, masked, bricks;
+  PairBatch() : n_pairs(0) {}
+};
+
+static const size_t PAIRS_PER_BATCH = 1 << 16;
+static const size_t PAIRS_PER_CHUNK = 1 << 10;
+
+
+static size_t
+read_batch(FASTQReader &reads1, FASTQReader &reads2,
+           const size_t to_ignore_at_end_of_name, PairBatch &batch) {
+  ProfileTimer timer("read");
+  batch.end1.resize(PAIRS_PER_BATCH);
+  batch.end2.resize(PAIRS_PER_BATCH);
+  size_t n = 0;
+  while (n < PAIRS_PER_BATCH &&
+         reads1.read(batch.end1[n]) && reads2.read(batch.end2[n])) {
+    // Two reads should be in paired-ends
+    if (!FASTQRecord::mates(to_ignore_at_end_of_name,
+                            batch.end1[n], batch.end2[n]))
+      throw SMITHLABException("expected mates, got:" +
+                              batch.end1[n].tostring() + "\n" +
+                              batch.end2[n].tostring());
+    ++n;
+  }
+  batch.n_pairs = n;
+  timer.add_items(n);
+  return n;
 }
 
 
-// Compare two reads to detect the overlapped region
-vector<size_t>
-invdup_similarity(FASTQRecord &r1, FASTQRecord &r2,
-                  string &brick1, string &brick2,
-                  vector<size_t> &pos_count_overlap) {
-  vector<size_t> sim (2, 0);
-  size_t sim_TC = 0;
-  size_t sim_GA = 0;
-
-  if (pos_count_overlap.empty()) pos_count_overlap.resize(r1.seq.size());
-
-  string::const_iterator it1(r1.seq.begin());
-  string::const_iterator it2(r2.seq.begin());
-  vector<size_t>::iterator it_pos(pos_count_overlap.begin());
-  while (it1 < r1.seq.end() && it2 < r2.seq.end()) {
-    if (similar_letters_bisulfite(*it1, *it2)) {
-      sim[0]++;
-      *it_pos += 1;
-      if (*it1 == *it2) {
-        brick1 += '*'; brick2 += '*';
-      } else {
-        brick1 += *it1; brick2 += *it2;
+// percent_overlap[0] = two wildcards are allowed at the same time
+// percent_overlap[1] = two wildcards are not allowed at the same time
+static inline double
+percent_overlap(const size_t sim, const FASTQRecord &r) {
+  return static_cast<double>(sim)/r.seq.length();
+}
+
+
+/* Scores a batch. Each thread keeps its own per-position counts and
+ * adds them to pos_count_overlap once; these are integers, so the
+ * totals do not depend on the number of threads.
+ */
+static void
+score_batch(PairBatch &batch, const double cutoff, const bool masking,
+            const bool bricks, vector<size_t> &pos_count_overlap) {
+  const size_t n_pairs = batch.n_pairs;
+  ProfileTimer timer("score", n_pairs);
+  const size_t n_chunks = (n_pairs + PAIRS_PER_CHUNK - 1)/PAIRS_PER_CHUNK;
+  batch.sim_both.resize(n_pairs);
+  batch.sim_one.resize(n_pairs);
+  batch.report.resize(n_chunks);
+  batch.masked.resize(masking ? n_chunks : 0);
+  batch.bricks.resize(bricks ? n_chunks : 0);
+
+  size_t max_length = pos_count_overlap.size();
+  for (size_t i = 0; i < n_pairs; ++i)
+    max_length = max(max_length, batch.end1[i].seq.length());
+  pos_count_overlap.resize(max_length, 0);
+
+#pragma omp parallel
+  {
+    vector<size_t> pos_count(max_length, 0);
+    string brick_end1, brick_end2;
+#pragma omp for schedule(dynamic)
+    for (size_t c = 0; c < n_chunks; ++c) {
+      std::ostringstream report, masked, brick_out;
+      const size_t chunk_end = min(n_pairs, (c + 1)*PAIRS_PER_CHUNK);
+      for (size_t i = c*PAIRS_PER_CHUNK; i < chunk_end; ++i) {
+        const FASTQRecord &end_one = batch.end1[i];
+        const FASTQRecord &end_two = batch.end2[i];
+        invdup_similarity(end_one.seq, end_two.seq,
+                          batch.sim_both[i], batch.sim_one[i], &pos_count[0]);
+        const double overlap_both = percent_overlap(batch.sim_both[i], end_one);
+        const double overlap_one = percent_overlap(batch.sim_one[i], end_one);
+        report << batch.sim_both[i] << "," << batch.sim_one[i] << '\t'
+               << overlap_both << "," << overlap_one << "\n";
+
+        // Write new fastq file if -m
+        if (masking) {
+          masked << end_two.name << "\n";
+          if (overlap_both > cutoff)
+            masked << string(end_two.seq.length(), 'N') << "\n";
+          else masked << end_two.seq << "\n";
+          masked << end_two.seqtag << "\n" << end_two.score << "\n";
+        }
+        if (bricks && overlap_both > cutoff) {
+          invdup_bricks(end_one.seq, end_two.seq, brick_end1, brick_end2);
+          brick_out << brick_end1 << "\n" << brick_end2 << "\n\n";
+        }
       }
-    } else {
-      brick1 += '-'; brick2 += '-';
+      batch.report[c] = report.str();
+      if (masking) batch.masked[c] = masked.str();
+      if (bricks) batch.bricks[c] = brick_out.str();
+    }
+#pragma omp critical
+    {
+      for (size_t j = 0; j < max_length; ++j)
+        pos_count_overlap[j] += pos_count[j];
+    }
+  }
+}
+
+
+/* The ordered output stage. It also adds up the summary statistics,
+ * in input order, so the sums match a single-threaded scan exactly.
+ */
+struct ScanWriter {
+  ScanWriter(BufferedWriter &r, BufferedWriter *m, BufferedWriter *b,
+             const double c) :
+    report(r), masked(m), bricks(b), cutoff(c), num_read(0),
+    num_bad_read(2, 0), sum_percent_overlap(2, 0),
+    sum_bad_percent_overlap(2, 0) {}
+
+  void write(const PairBatch &batch);
+
+  BufferedWriter &report;
+  BufferedWriter *masked;
+  BufferedWriter *bricks;
+  const double cutoff;
+
+  size_t num_read;
+  vector<size_t> num_bad_read;
+  vector<double> sum_percent_overlap;
+  vector<double> sum_bad_percent_overlap;
+};
+
+
+void
+ScanWriter::write(const PairBatch &batch) {
+  ProfileTimer timer("write", batch.n_pairs);
+  for (size_t c = 0; c < batch.report.size(); ++c) {
+    report << batch.report[c];
+    if (masked) *masked << batch.masked[c];
+    if (bricks) *bricks << batch.bricks[c];
+  }
+  for (size_t i = 0; i < batch.n_pairs; ++i) {
+    const double overlap_both = percent_overlap(batch.sim_both[i],
+                                                batch.end1[i]);
+    const double overlap_one = percent_overlap(batch.sim_one[i],
+                                               batch.end1[i]);
+    if (overlap_both > cutoff) {
+      num_bad_read[0]++;
+      sum_bad_percent_overlap[0] += overlap_both;
     }
-    sim_TC += similar_letters_bisulfite_TCwildcard(*it1, *it2);
-    sim_GA += similar_letters_bisulfite_GAwildcard(*it1, *it2);
-    it1++; it2++; it_pos++;
+    if (overlap_one > cutoff) {
+      num_bad_read[1]++;
+      sum_bad_percent_overlap[1] += overlap_one;
+    }
+    num_read++;
+    sum_percent_overlap[0] += overlap_both;
+    sum_percent_overlap[1] += overlap_one;
   }
-  sim[1] = max(sim_TC, sim_GA);
-  return sim;
 }
 
 int
@@ -177,9 +447,13 @@ main(int argc, const char **argv) {
     string fp_repo;
     string fp_stat;
     string fp_proc_fq;
+    string fp_brick;
     double cutoff = 0.95;
     size_t to_ignore_at_end_of_name = 0;
+    size_t n_threads = 1;
     bool VERBOSE = false;
+    // JSON report of the time and memory of each phase
+    string fp_profile;
 
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "count the invdup reads "
@@ -194,12 +468,18 @@ main(int argc, const char **argv) {
                       "Name of the new second-end fastq file "
                       "if you want to mask the invdup reads",
                       false, fp_proc_fq);
+    opt_parse.add_opt("brick", 'b',
+                      "Name of the file showing the alignment of each "
+                      "invdup read pair", false, fp_brick);
     opt_parse.add_opt("cutoff", 'c',
                       "The cutoff for invdup reads (default: 0.95)",
                       false, cutoff);
     opt_parse.add_opt("ignore", 'i', "Ignore this number of letters "
                       "at end of name", false, to_ignore_at_end_of_name);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, fp_profile);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
     if (argc == 1 || opt_parse.help_requested()) {
@@ -219,89 +499,73 @@ main(int argc, const char **argv) {
     const string reads_file_two = leftover_args.back();
     /****************** END COMMAND LINE OPTIONS *****************/
 
-    // Input: paired-end reads with end1 and end2
-    std::ifstream if_read1(reads_file_one.c_str());
-    if(!if_read1)
-      throw SMITHLABException("cannot open input file " + reads_file_one);
-
-    std::ifstream if_read2(reads_file_two.c_str());
-    if(!if_read2)
-      throw SMITHLABException("cannot open input file " + reads_file_two);
+#ifdef _OPENMP
+    omp_set_num_threads(n_threads);
+#endif
+    if (!fp_profile.empty())
+      Profile::get().enable();
 
-    // Output scanning results:
-    std::ofstream of_repo;
-    if (!fp_repo.empty()) of_repo.open(fp_repo.c_str());
-    std::ostream os_repo(fp_repo.empty() ? cout.rdbuf() : of_repo.rdbuf());
+    // Input: paired-end reads with end1 and end2
+    FASTQReader reads1(reads_file_one);
+    FASTQReader reads2(reads_file_two);
 
-    string fp_repo_brick = fp_repo + ".brick";
-    std::ofstream of_repo_brick(fp_repo_brick.c_str());
+    // Output scanning results; names ending in .gz are compressed
+    BufferedWriter os_repo(fp_repo);
+    BufferedWriter *of_repo_brick =
+      fp_brick.empty() ? 0 : new BufferedWriter(fp_brick);
 
     // Output the proccessed fastq files:
-    std::ofstream of_proc_fq(fp_proc_fq.c_str());
-    if(!fp_proc_fq.empty() && !of_proc_fq)
-      throw SMITHLABException("cannot write new fastq file " + fp_proc_fq);
+    BufferedWriter *of_proc_fq =
+      fp_proc_fq.empty() ? 0 : new BufferedWriter(fp_proc_fq);
 
     //------------SCAN THE READS------------//
-    size_t num_read = 0;
-    vector<size_t> num_bad_read (2, 0);
-    vector<double> sum_percent_overlap (2, 0);
-    vector<double> sum_bad_percent_overlap (2, 0);
+    // three batches rotate: one is read while the one before it is
+    // scored and the one before that is written
+    vector<PairBatch> batches(3);
     vector<size_t> pos_count_overlap;
-    FASTQRecord end_one, end_two;
-
-    while (if_read1 >> end_one && if_read2 >> end_two) {
-
-      // Two reads should be in paired-ends
-      if (!FASTQRecord::mates(to_ignore_at_end_of_name, end_one, end_two))
-        throw SMITHLABException("expected mates, got:" +
-              end_one.tostring() + "\n" + end_two.tostring());
-
-      // See if inverted duplicates emerge
-      string brick_end1;
-      string brick_end2;
-      const vector<size_t> sim = invdup_similarity(end_one, end_two,
-                                 brick_end1, brick_end2, pos_count_overlap);
-      vector<double> percent_overlap (2, 0);
-      // percent_overlap[0] = two wildcards are allowed at the same time
-      // percent_overlap[1] = two wildcards are not allowed at the same time
-      percent_overlap[0] = static_cast<double>(sim[0])/end_one.seq.length();
-      percent_overlap[1] = static_cast<double>(sim[1])/end_one.seq.length();
-
-      if (percent_overlap[0] > cutoff) {
-        num_bad_read[0]++;
-        sum_bad_percent_overlap[0] += percent_overlap[0];
-      }
-      if (percent_overlap[1] > cutoff) {
-        num_bad_read[1]++;
-        sum_bad_percent_overlap[1] += percent_overlap[1];
-      }
+    ScanWriter writer(os_repo, of_proc_fq, of_repo_brick, cutoff);
+
+    size_t curr = 0;
+    std::future<size_t> reading =
+      std::async(std::launch::async, read_batch, std::ref(reads1),
+                 std::ref(reads2), to_ignore_at_end_of_name,
+                 std::ref(batches[curr]));
+    std::future<void> writing;
+    while (reading.get() > 0) {
+      const size_t next = (curr + 1) % batches.size();
+      reading = std::async(std::launch::async, read_batch, std::ref(reads1),
+                           std::ref(reads2), to_ignore_at_end_of_name,
+                           std::ref(batches[next]));
+      score_batch(batches[curr], cutoff, !fp_proc_fq.empty(),
+                  !fp_brick.empty(), pos_count_overlap);
+      if (writing.valid()) writing.get();
+      if (VERBOSE)
+        cerr << "\rREAD PAIRS SCANNED: " << writer.num_read;
+      writing = std::async(std::launch::async, &ScanWriter::write, &writer,
+                           std::cref(batches[curr]));
+      curr = next;
+    }
+    if (writing.valid()) writing.get();
+    if (VERBOSE)
+      cerr << "\rREAD PAIRS SCANNED: " << writer.num_read << endl;
+    os_repo.close();
+    if (of_repo_brick) {
+      of_repo_brick->close();
+      delete of_repo_brick;
+    }
+    if (of_proc_fq) {
+      of_proc_fq->close();
+      delete of_proc_fq;
+    }
 
-      // Write new fastq file if -n
-      if (of_proc_fq) {
-        const string masked_seq(end_two.seq.length(), 'N');
-        of_proc_fq << end_two.name << "\n";
-        if (percent_overlap[0] > cutoff)
-          of_proc_fq << masked_seq << "\n";
-        else {
-          of_proc_fq << end_two.seq << "\n";
-          of_proc_fq << end_two.seqtag << "\n"
-                    << end_two.score << "\n";
-        }
-      }
+    const size_t num_read = writer.num_read;
+    const vector<size_t> &num_bad_read = writer.num_bad_read;
+    const vector<double> &sum_percent_overlap = writer.sum_percent_overlap;
+    const vector<double> &sum_bad_percent_overlap =
+      writer.sum_bad_percent_overlap;
 
-      num_read++;
-      sum_percent_overlap[0] += percent_overlap[0];
-      sum_percent_overlap[1] += percent_overlap[1];
-      os_repo << sim[0] << "," << sim[1] << '\t'
-              << percent_overlap[0] << "," << percent_overlap[1] << "\n";
-      if (percent_overlap[0] > cutoff)
-        of_repo_brick << brick_end1 << "\n"
-                      << brick_end2 << "\n" << endl;
-    }
     //------------WRITE STAT INFORMATION------------//
-    std::ofstream of_stat;
-    if (!fp_stat.empty()) of_stat.open(fp_stat.c_str());
-    std::ostream os_stat(fp_stat.empty() ? cout.rdbuf() : of_stat.rdbuf());
+    BufferedWriter os_stat(fp_stat);
     os_stat << "CUTOFF:\t" << cutoff << "\n"
             << "TOTAL READ PAIRS:\t" << num_read << "\n"
             << "SUSPECT INVERTED-DUPLICATED READ PAIRS:\t"
@@ -315,15 +579,23 @@ main(int argc, const char **argv) {
             << "MEAN OVERLAP PERCENTAGE OF INVERTED-DUPLICATES:\t"
             << sum_bad_percent_overlap[0]/num_bad_read[0] << ","
             << sum_bad_percent_overlap[1]/num_bad_read[1] << "\n"
-            << endl;
+            << '\n';
 
     size_t count_pos = 0;
     vector<size_t>::iterator it(pos_count_overlap.begin());
     while (it < pos_count_overlap.end()) {
       os_stat << count_pos << ' '
-              << static_cast<double>(*it++)/num_read << endl;
+              << static_cast<double>(*it++)/num_read << '\n';
       count_pos++;
     }
+    os_stat.close();
+
+    if (!fp_profile.empty()) {
+      std::ofstream of_profile(fp_profile.c_str());
+      if (!of_profile)
+        throw SMITHLABException("cannot open profile file " + fp_profile);
+      Profile::get().write_json(of_profile, "inverted-dups");
+    }
   }
   catch (const SMITHLABException &e) {
     cerr << e.what() << endl;
@@ -17,139 +17,227 @@
  */
 
 #include <cstring>
-#include <string> 
+#include <cstdlib>
+#include <cmath>
+#include <string>
 #include <iostream>
 #include <fstream>
-#include <sstream>
-#include <numeric>
-#include <limits>
-#include <cmath>
+#include <algorithm>
+#include <unordered_map>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
-#include "ProcSubunit.hpp"
+#include "CpGBinary.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
 
 using std::string;
 using std::vector;
-using std::pair;
 using std::endl;
 using std::cerr;
-using std::sort;
 using std::unordered_map;
 
 
 ///////////////////////////////////////////////////////////////////////////
 // DATA STRUCTURES
 
-struct cpg {
-  cpg(const string c, const size_t s) : chr(c), start(s) {}
-  
-  bool operator<(const cpg &other) const {
-    return (chr < other.chr ||
-            (chr == other.chr &&
-             (start < other.start)));
-  }
-  bool operator==(const cpg &other) const {
-    return (chr == other.chr && start == other.start);
+/* The CpGs of one chromosome, sorted by position. With aggregates,
+ * meth_sum and cov_sum are prefix sums over the sites (one more entry
+ * than pos), so the counts inside any interval come from its two
+ * ends without visiting the sites between them.
+ */
+struct chrom_cpgs {
+  chrom_cpgs(const string &n, const bool aggregate) : name(n) {
+    if (aggregate) {
+      meth_sum.push_back(0);
+      cov_sum.push_back(0);
+    }
   }
-  string chr;
-  size_t start;
+  string name;
+  vector<size_t> pos;
+  vector<size_t> meth_sum;
+  vector<size_t> cov_sum;
+  vector<size_t> intervals; // indices of the intervals on this chromosome
 };
 
 struct interval {
-  interval(const string c, const size_t s, const size_t e, const string t) :
-    chr(c), start(s), end(e), state(t), num_cpg(0) {}
-  
-  bool contains_cpg(const cpg &target) const{
-    return(chr == target.chr && start <= target.start && end >= target.start);
-  }
-  bool operator<(const interval &other) const {
-    return (chr < other.chr ||
-            (chr == other.chr && start < other.start) ||
-             (chr == other.chr && start == other.start && end < other.end));
-  }
-  bool operator==(const interval &other) const {
-    return (chr == other.chr && start == other.start && end == other.end);
-  }
-  
-  string chr;
+  interval(const size_t c, const size_t s, const size_t e, const string &t) :
+    chrom(c), start(s), end(e), state(t), num_cpg(0), meth(0), coverage(0) {}
+
+  size_t chrom;
   size_t start;
   size_t end;
   string state;
   size_t num_cpg;
+  size_t meth;
+  size_t coverage;
+};
+
+struct chrom_table {
+  chrom_table(const bool a) : aggregate(a) {}
+
+  size_t
+  intern(const string &name) {
+    unordered_map<string, size_t>::const_iterator i = ids.find(name);
+    if (i != ids.end())
+      return i->second;
+    ids[name] = chroms.size();
+    chroms.push_back(chrom_cpgs(name, aggregate));
+    return chroms.size() - 1;
+  }
+
+  bool aggregate;
+  unordered_map<string, size_t> ids;
+  vector<chrom_cpgs> chroms;
 };
 
-static cpg
-cpg_from_buffer(string buffer) {
-  std::istringstream os(buffer);
-  string chr;
-  size_t start;
-  os >> chr >> start;
-  return cpg(chr, start);
-}
 
-static interval
-interval_from_buffer(string buffer) {
-  std::istringstream os(buffer);
-  string chr, state;
-  size_t start, end;
-  os >> chr >> start >> end >> state;
-  return interval(chr, start, end, state);
+static const char *
+skip_field(const char *c) {
+  c += strspn(c, " \t");
+  return c + strcspn(c, " \t");
 }
 
 
 static void
-load_cpgs(const string &cpgfile, vector<cpg> &cpgs) {
-    std::fstream in(cpgfile.c_str());
-    if (!in)
-      throw BEDFileException("cannot open input file " + cpgfile);
-    string buffer;
-    while (getline(in, buffer)) {
-      cpgs.push_back(cpg_from_buffer(buffer));
+add_cpg(const string &cpgfile, const size_t chrom, const size_t pos,
+        const size_t meth, const size_t coverage, chrom_table &table) {
+  chrom_cpgs &c = table.chroms[chrom];
+  if (!c.pos.empty() && pos < c.pos.back())
+    throw BEDFileException("CpGs not sorted in " + cpgfile + " at: " +
+                           c.name + ":" + smithlab::toa(pos));
+  c.pos.push_back(pos);
+  if (table.aggregate) {
+    c.meth_sum.push_back(c.meth_sum.back() + meth);
+    c.cov_sum.push_back(c.cov_sum.back() + coverage);
+  }
+}
+
+
+// text input is "chrom pos" per line, or a methcounts file
+// "chrom pos strand context level coverage" when aggregating
+static size_t
+load_cpgs(const string &cpgfile, chrom_table &table) {
+  if (CpGBinaryReader::is_cpg_binary(cpgfile)) {
+    const CpGBinaryReader in(cpgfile);
+    const uint32_t *pos = in.positions();
+    const uint16_t *meth = in.meth();
+    const uint16_t *unmeth = in.unmeth();
+    for (size_t c = 0; c < in.n_chroms(); ++c) {
+      const size_t chrom = table.intern(in.chrom_name(c));
+      table.chroms[chrom].pos.reserve(in.chrom_end(c) - in.chrom_begin(c));
+      for (size_t i = in.chrom_begin(c); i < in.chrom_end(c); ++i)
+        add_cpg(cpgfile, chrom, pos[i], meth[i], meth[i] + unmeth[i], table);
+    }
+    return in.size();
+  }
+
+  std::ifstream in(cpgfile.c_str());
+  if (!in)
+    throw BEDFileException("cannot open input file " + cpgfile);
+  size_t n_cpgs = 0;
+  size_t chrom = 0;
+  string buffer;
+  while (getline(in, buffer)) {
+    if (buffer.empty()) continue;
+    const char *c = buffer.c_str();
+    const size_t chrom_len = strcspn(c, " \t");
+    char *field_end = 0;
+    const size_t pos = strtoul(c + chrom_len, &field_end, 10);
+    if (field_end == c + chrom_len)
+      throw BEDFileException("bad line in " + cpgfile + ": " + buffer);
+    size_t meth = 0, coverage = 0;
+    if (table.aggregate) {
+      const char *level_begin = skip_field(skip_field(field_end));
+      char *level_end = 0;
+      const double level = strtod(level_begin, &level_end);
+      coverage = strtoul(level_end, &field_end, 10);
+      if (field_end == level_end || level < 0.0 || level > 1.0)
+        throw BEDFileException("no methylation counts in " + cpgfile +
+                               ": " + buffer);
+      meth = static_cast<size_t>(round(level*coverage));
     }
+    // consecutive lines are almost always on the same chromosome
+    if (n_cpgs == 0 || table.chroms[chrom].name.compare(0, string::npos,
+                                                        c, chrom_len) != 0)
+      chrom = table.intern(string(c, chrom_len));
+    add_cpg(cpgfile, chrom, pos, meth, coverage, table);
+    ++n_cpgs;
+  }
+  return n_cpgs;
 }
 
 
 static void
-load_intervals(const string &interval_file, vector<interval> &intervals) {
-  std::fstream in(interval_file.c_str());
+load_intervals(const string &interval_file, chrom_table &table,
+               vector<interval> &intervals) {
+  std::ifstream in(interval_file.c_str());
   if (!in)
     throw BEDFileException("cannot open input file " + interval_file);
   string buffer;
   while (getline(in, buffer)) {
-    intervals.push_back(interval_from_buffer(buffer));
+    if (buffer.empty()) continue;
+    const char *c = buffer.c_str();
+    const size_t chrom_len = strcspn(c, " \t");
+    char *start_end = 0, *end_end = 0;
+    const size_t start = strtoul(c + chrom_len, &start_end, 10);
+    const size_t end = strtoul(start_end, &end_end, 10);
+    if (start_end == c + chrom_len || end_end == start_end)
+      throw BEDFileException("bad line in " + interval_file + ": " + buffer);
+    const char *state = end_end + strspn(end_end, " \t");
+    const size_t chrom = table.intern(string(c, chrom_len));
+    table.chroms[chrom].intervals.push_back(intervals.size());
+    intervals.push_back(interval(chrom, start, end,
+                                 string(state, strcspn(state, " \t"))));
   }
 }
 
 
+/* Each interval counts the CpGs with start <= pos <= end by binary
+ * search, so overlapping and nested intervals are counted
+ * independently and need not be sorted. Chromosomes are counted in
+ * parallel; every interval is written by exactly one thread.
+ */
 static void
-count_cpgs(vector<interval> &intervals, const vector<cpg> &cpgs) {
-  size_t cpg_pointer = 0;
-  for (size_t i=0; i < intervals.size(); ++i) {
-    while (cpg_pointer < cpgs.size() &&
-           !intervals[i].contains_cpg(cpgs[cpg_pointer])) {
-      cpg_pointer++;
-    }
-    while (cpg_pointer < cpgs.size() &&
-           intervals[i].contains_cpg(cpgs[cpg_pointer])) {
-      intervals[i].num_cpg++;
-      cpg_pointer++;
+count_cpgs(const chrom_table &table, vector<interval> &intervals) {
+  const size_t n_chroms = table.chroms.size();
+#pragma omp parallel for schedule(dynamic)
+  for (size_t c = 0; c < n_chroms; ++c) {
+    const chrom_cpgs &chrom = table.chroms[c];
+    const vector<size_t>::const_iterator first = chrom.pos.begin();
+    const vector<size_t>::const_iterator last = chrom.pos.end();
+    for (size_t i = 0; i < chrom.intervals.size(); ++i) {
+      interval &iv = intervals[chrom.intervals[i]];
+      const size_t lo = std::lower_bound(first, last, iv.start) - first;
+      const size_t hi =
+        std::upper_bound(first + lo, last, iv.end) - first;
+      iv.num_cpg = hi - lo;
+      if (table.aggregate) {
+        iv.meth = chrom.meth_sum[hi] - chrom.meth_sum[lo];
+        iv.coverage = chrom.cov_sum[hi] - chrom.cov_sum[lo];
+      }
     }
   }
 }
-  
+
 
 static void
-intervals_to_file(const string &outfile, const vector<interval> &intervals) {
-  std::ofstream of;
-  of.open(outfile.c_str());
-  
+intervals_to_file(const string &outfile, const chrom_table &table,
+                  const vector<interval> &intervals) {
+  BufferedWriter of(outfile);
   for (size_t i = 0; i < intervals.size(); ++i) {
-     of << intervals[i].chr << '\t'
-        << intervals[i].start << '\t' << intervals[i].end << '\t'
-        << intervals[i].state << '\t' << intervals[i].num_cpg << endl;
+    of << table.chroms[intervals[i].chrom].name << '\t'
+       << intervals[i].start << '\t' << intervals[i].end << '\t'
+       << intervals[i].state << '\t' << intervals[i].num_cpg;
+    if (table.aggregate)
+      of << '\t' << intervals[i].meth << '\t' << intervals[i].coverage;
+    of << '\n';
   }
+  of.close();
 }
 
 
@@ -163,12 +251,22 @@ main(int argc, const char **argv) {
     /* FILES */
     string cpgfile;
     string outfile;
+    bool aggregate = false;
+    size_t n_threads = 1;
+    // JSON report of the time and memory of each phase
+    string profile_file;
 
     /****************** GET COMMAND LINE ARGUMENTS ***************************/
     OptionParser opt_parse(strip_path(argv[0]), "Assign CpGs to intervals",
                            "<interval-file>");
     opt_parse.add_opt("cpg", 'c', "Cpg index file", true , cpgfile);
     opt_parse.add_opt("output", 'o', "Out put file", true , outfile);
+    opt_parse.add_opt("aggregate", 'a', "also output methylated reads and "
+                      "coverage per interval (needs methcounts or binary "
+                      "CpGs)", false, aggregate);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, profile_file);
 
     
     vector<string> leftover_args;
@@ -191,27 +289,44 @@ main(int argc, const char **argv) {
     }
     const string interval_file = leftover_args[0];
     /**********************************************************************/
+#ifdef _OPENMP
+    omp_set_num_threads(n_threads);
+#endif
+    if (!profile_file.empty())
+      Profile::get().enable();
 
-    vector<cpg> cpgs;
-    load_cpgs(cpgfile, cpgs);
-    std::cout << "Got " << cpgs.size() << " CpGs." << endl;
-    //sort(cpgs.begin(), cpgs.end());
-    //std::cout << "Sort: over." << endl;
+    chrom_table table(aggregate);
+    ProfileTimer load_timer("load");
+    const size_t n_cpgs = load_cpgs(cpgfile, table);
+    load_timer.add_items(n_cpgs);
+    load_timer.stop();
+    std::cout << "Got " << n_cpgs << " CpGs." << endl;
 
     vector<interval> intervals;
-    load_intervals(interval_file, intervals);
+    ProfileTimer intervals_timer("load_intervals");
+    load_intervals(interval_file, table, intervals);
+    intervals_timer.add_items(intervals.size());
+    intervals_timer.stop();
     std::cout << "Got " << intervals.size() << " intervals." << endl;
-    //sort(intervals.begin(), intervals.end());
-    //std::cout << "Sort: over." << endl;
     
-    count_cpgs(intervals, cpgs);
+    ProfileTimer count_timer("count", intervals.size());
+    count_cpgs(table, intervals);
+    count_timer.stop();
     std::cout << "Count CpGs: over." << endl;
-    intervals_to_file(outfile, intervals);
+    ProfileTimer output_timer("output", intervals.size());
+    intervals_to_file(outfile, table, intervals);
+    output_timer.stop();
     std::cout << "Write: over." << endl;
 
+    if (!profile_file.empty()) {
+      std::ofstream profile_out(profile_file.c_str());
+      if (!profile_out)
+        throw SMITHLABException("cannot open profile file " + profile_file);
+      Profile::get().write_json(profile_out, "AssignCpGs");
+    }
   }
   catch (SMITHLABException &e) {
-
+    cerr << "ERROR:\t" << e.what() << endl;
     return EXIT_FAILURE;
   }
   catch (std::bad_alloc &ba) {
@@ -16,210 +16,357 @@
  *    You should have received a copy of the GNU General Public License
  *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-
 #include <cstring>
+#include <cstdlib>
 #include <string> 
 #include <iostream>
 #include <fstream>
-#include <sstream>
-#include <numeric>
 #include <limits>
-#include <cmath>
+#include <algorithm>
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "ProcSubunit.hpp"
+#include "CpGBinary.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
 
-using std::unordered_map;
 using std::string;
 using std::vector;
-using std::pair;
 using std::endl;
 using std::cerr;
-using std::sort;
 
 
 ///////////////////////////////////////////////////////////////////////////
-// DATA STRUCTURES
-
-struct cpg {
-  cpg(const string c, const size_t p) : chr(c), pos(p) {}
-  
-  size_t distance_to_next(cpg &other) const {
-    size_t dist = 0;
-    if (other.chr == chr) {
-      dist = other.pos - pos;
-    }
-    else {
-      dist = std::numeric_limits<size_t>::max();
+// INPUT STREAMS
+
+/* The CpG file one site at a time, text "chrom pos" lines or binary
+ * CpGs. Either way sites must be sorted by chromosome name then
+ * position, the order the sample files are merged in.
+ */
+class CpGReader {
+public:
+  CpGReader(const string &f) : filename(f), binary(0), chrom_idx(0), site(0) {
+    if (CpGBinaryReader::is_cpg_binary(filename)) {
+      binary = new CpGBinaryReader(filename);
+      return;
     }
-    return dist;
+    in.open(filename.c_str());
+    if (!in)
+      throw BEDFileException("cannot open input file " + filename);
   }
-  
-  bool in_interval(const Subunit &interval) const{
-    return(chr == interval.chr && pos >= interval.start && pos <= interval.end);
+  ~CpGReader() {delete binary;}
+
+  // false at the end of the file
+  bool next(string &chrom, size_t &pos);
+
+private:
+  CpGReader(const CpGReader &);
+  CpGReader &operator=(const CpGReader &);
+
+  string filename;
+  CpGBinaryReader *binary;
+  size_t chrom_idx;
+  size_t site;
+  std::ifstream in;
+  string buffer;
+};
+
+
+bool
+CpGReader::next(string &chrom, size_t &pos) {
+  if (binary) {
+    while (chrom_idx < binary->n_chroms() &&
+           site == binary->chrom_end(chrom_idx))
+      ++chrom_idx;
+    if (chrom_idx == binary->n_chroms())
+      return false;
+    if (chrom != binary->chrom_name(chrom_idx))
+      chrom = binary->chrom_name(chrom_idx);
+    pos = binary->positions()[site++];
+    return true;
   }
-  bool in_interval(const GenomicRegion &interval) const{
-    return(chr == interval.get_chrom() &&
-            pos >= interval.get_start() && pos <= interval.get_end());
+
+  while (getline(in, buffer) && buffer.empty());
+  if (buffer.empty())
+    return false;
+  const char *c = buffer.c_str();
+  const size_t chrom_len = strcspn(c, " \t");
+  char *field_end = 0;
+  const size_t new_pos = strtoul(c + chrom_len, &field_end, 10);
+  if (field_end == c + chrom_len)
+    throw BEDFileException("bad line in " + filename + ": " + buffer);
+  const int order = chrom.compare(0, string::npos, c, chrom_len);
+  if (site > 0 && (order > 0 || (order == 0 && new_pos < pos)))
+    throw BEDFileException("CpGs not sorted in " + filename +
+                           " at: " + buffer);
+  if (order != 0)
+    chrom.assign(c, chrom_len);
+  pos = new_pos;
+  buffer.clear();
+  ++site;
+  return true;
+}
+
+
+/* The sorted intervals of one sample, read only as far as the CpGs
+ * have reached. covered_to is the furthest end of the intervals on
+ * the current chromosome starting at or before the last position
+ * asked about, so overlapping intervals need no extra state. The file
+ * stays open until it is read to the end.
+ */
+class SampleCursor {
+public:
+  SampleCursor(const string &f) :
+    filename(f), in(f.c_str()), has_next(false), next_start(0),
+    next_end(0), next_here(false), any_open(false), covered_to(0) {
+    if (!in)
+      throw BEDFileException("cannot open input file " + filename);
+    read_interval();
   }
-  
-  string chr;
-  size_t pos;
-  vector<bool> member;
+
+  // skips the intervals on chromosomes before chrom
+  void start_chrom(const string &chrom);
+  // true if pos, which never decreases within a chromosome, is in an
+  // interval of the sample
+  bool covers(const size_t pos);
+
+private:
+  void read_interval();
+
+  string filename;
+  std::ifstream in;
+  string buffer;
+  string chrom;
+  bool has_next; // next_* hold the interval read ahead
+  string next_chrom;
+  size_t next_start;
+  size_t next_end;
+  bool next_here; // the interval read ahead is on chrom
+  bool any_open;
+  size_t covered_to;
 };
 
-static cpg
-cpg_from_str(string buffer) {
-  std::istringstream os(buffer);
-  string chr;
-  size_t pos;
-  os >> chr >> pos;
-  return(cpg(chr, pos));
+
+void
+SampleCursor::read_interval() {
+  while (getline(in, buffer) && buffer.empty());
+  if (buffer.empty()) {
+    in.close();
+    has_next = next_here = false;
+    return;
+  }
+  const char *c = buffer.c_str();
+  const size_t chrom_len = strcspn(c, " \t");
+  char *start_end = 0, *end_end = 0;
+  const size_t start = strtoul(c + chrom_len, &start_end, 10);
+  const size_t end = strtoul(start_end, &end_end, 10);
+  if (start_end == c + chrom_len || end_end == start_end)
+    throw BEDFileException("bad line in " + filename + ": " + buffer);
+  const int order = next_chrom.compare(0, string::npos, c, chrom_len);
+  if (has_next && (order > 0 || (order == 0 && start < next_start)))
+    throw BEDFileException("intervals not sorted in " + filename +
+                           " at: " + buffer);
+  if (order != 0)
+    next_chrom.assign(c, chrom_len);
+  next_start = start;
+  next_end = end;
+  has_next = true;
+  next_here = next_chrom == chrom;
+  buffer.clear();
 }
 
-static void
-load_cpgs(const string cpgfile, const string indexfile,
-          const size_t desert_size, const size_t fill_num,
-          const size_t num_files, vector<cpg> &cpgs, vector<string> &chrs) {
-  std::fstream in(cpgfile.c_str());
-  if (!in)
-    throw BEDFileException("cannot open input file " + cpgfile);
-  
-  std::ofstream of;
-  of.open(indexfile.c_str());
-  
-  string buffer;
-  cpg lastcpg = cpg("chr1", 10468); // the first cpg
-  string lastchr = "chrStart";
-  while (getline(in, buffer)) {
-    cpg newcpg = cpg_from_str(buffer);
-    newcpg.member = vector<bool> (num_files, false);
-    if (newcpg.chr != lastchr) {
-      chrs.push_back(newcpg.chr);
-      lastchr = newcpg.chr;
-    }
-    if (newcpg.chr == lastcpg.chr &&
-        lastcpg.distance_to_next(newcpg) > desert_size) {
-      size_t startpos = lastcpg.pos;
-      size_t bin = lastcpg.distance_to_next(newcpg) / fill_num;
-      for (size_t i=0; i < fill_num - 1; ++i) {
-        cpg fillcpg = cpg(lastcpg.chr, startpos + bin);
-        fillcpg.member = vector<bool> (num_files, false);
-        cpgs.push_back(fillcpg);
-        of << endl;
-      }
-    }
-    cpgs.push_back(newcpg);
-    lastcpg = newcpg;
-    of << newcpg.chr << '\t' << newcpg.pos << endl;
+
+void
+SampleCursor::start_chrom(const string &c) {
+  chrom = c;
+  any_open = false;
+  while (has_next && next_chrom < chrom)
+    read_interval();
+  next_here = has_next && next_chrom == chrom;
+}
+
+
+bool
+SampleCursor::covers(const size_t pos) {
+  while (next_here && next_start <= pos) {
+    if (!any_open || next_end > covered_to)
+      covered_to = next_end;
+    any_open = true;
+    read_interval();
   }
+  return any_open && pos <= covered_to;
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// OUTPUT
+
+/* One file per chromosome in outdir. The text subhmr_<chrom>_binary.txt
+ * has the header lines "subhmr <chrom>" and the sample names, then one
+ * tab separated row of 0/1 per CpG. The compact
+ * subhmr_<chrom>_binary.bin is, in native byte order:
+ *
+ *   header   char[4] "SBIN", uint32 version, uint64 n_samples,
+ *            uint64 n_rows
+ *   names    uint32 length then the name, for the chromosome followed
+ *            by each sample; zero padded to a multiple of 8 bytes
+ *   rows     (n_samples + 7)/8 bytes per CpG, sample i in bit i % 8
+ *            of byte i/8
+ */
+class SignalWriter {
+public:
+  SignalWriter(const string &d, const vector<string> &names,
+               const bool b) :
+    outdir(d), sample_names(names), binary(b), out(0), n_rows(0),
+    packed((names.size() + 7)/8, 0) {}
+  ~SignalWriter() {delete out;}
+
+  void start_chrom(const string &chrom);
+  void write(const SampleSet &row);
+  void close() {if (out) finish_chrom();}
+
+private:
+  void finish_chrom();
+
+  string outdir;
+  vector<string> sample_names;
+  bool binary;
+  string filename;
+  BufferedWriter *out;
+  size_t n_rows;
+  vector<char> packed;
+};
+
+
+static const char SIGNAL_MAGIC[4] = {'S', 'B', 'I', 'N'};
+static const uint32_t SIGNAL_VERSION = 1;
+static const size_t SIGNAL_ROWS_OFFSET =
+  4 + sizeof(uint32_t) + sizeof(uint64_t);
+
+
 static void
-load_units(const size_t &num_files, const string &interval_file,
-           vector<cpg> &cpgs,
-           const vector<string> chrs,
-           vector <string> &sample_name) {
-  // assign sample id (id_idx)
-  const int id_idx = sample_name.size();
-  const string source = basename(interval_file);
-  sample_name.push_back(source);
-  // construct source vector;
-  vector<bool> sources(num_files, false);
-  sources[id_idx] = 1;
-  //load endpoints of units and cpgs
-  std::fstream in(interval_file.c_str());
-  if (!in)
-    throw BEDFileException("cannot open input file " + interval_file);
-
-  size_t i = 0;
-  string buffer;
-  pair<string, bool> lastchr(chrs[0], false); // lastchr in chrs?
-  if (find(chrs.begin(), chrs.end(), lastchr.first) != chrs.end()) {
-    lastchr.second = true;
-  }
-  while (getline(in, buffer)) {
-    GenomicRegion interval = GenomicRegion(buffer);
-    pair<string, bool> newchr(interval.get_chrom(), false);
-    if (newchr.first == lastchr.first ) {
-      newchr.second = lastchr.second;
-    }
-    else{
-      if (find(chrs.begin(), chrs.end(), newchr.first) != chrs.end()) {
-        newchr.second = true;
-      }
-    }
-    if (newchr.second) {
-      while (i < cpgs.size() && !cpgs[i].in_interval(interval)) {
-        ++i;
-      }
-      while (i < cpgs.size() && cpgs[i].in_interval(interval)) {
-        cpgs[i].member[id_idx] = true;
-        ++i;
-      }
-    }
-  }
+write_name(BufferedWriter &out, const string &name, size_t &offset) {
+  const uint32_t len = name.size();
+  out.write(reinterpret_cast<const char *>(&len), sizeof(uint32_t));
+  out.write(name.data(), len);
+  offset += sizeof(uint32_t) + len;
 }
 
 
+void
+SignalWriter::start_chrom(const string &chrom) {
+  if (out)
+    finish_chrom();
+  filename = path_join(outdir, "subhmr_" + chrom +
+                       (binary ? "_binary.bin" : "_binary.txt"));
+  out = new BufferedWriter(filename);
+  n_rows = 0;
+
+  if (!binary) {
+    *out << "subhmr" << '\t' << chrom << '\n';
+    for (size_t i = 0; i < sample_names.size(); ++i)
+      *out << (i > 0 ? "\t" : "") << sample_names[i];
+    *out << '\n';
+    return;
+  }
+  const uint64_t n_samples = sample_names.size();
+  const uint64_t rows = 0; // written by finish_chrom
+  out->write(SIGNAL_MAGIC, 4);
+  out->write(reinterpret_cast<const char *>(&SIGNAL_VERSION), sizeof(uint32_t));
+  out->write(reinterpret_cast<const char *>(&n_samples), sizeof(uint64_t));
+  out->write(reinterpret_cast<const char *>(&rows), sizeof(uint64_t));
+  size_t offset = SIGNAL_ROWS_OFFSET + sizeof(uint64_t);
+  write_name(*out, chrom, offset);
+  for (size_t i = 0; i < sample_names.size(); ++i)
+    write_name(*out, sample_names[i], offset);
+  const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  out->write(zeros, ((offset + 7) & ~static_cast<size_t>(7)) - offset);
+}
 
-////////////////////////////////////////////////////////////////////////////////
 
-static string
-join_source(const vector<bool> &s, const string sep) {
-  string js = "";
-  if (s.size() == 1) {
-    js = toa(s[0]);
+void
+SignalWriter::write(const SampleSet &row) {
+  if (binary) {
+    std::fill(packed.begin(), packed.end(), 0);
+    for (size_t i = 0; i < row.size(); ++i)
+      if (row[i])
+        packed[i/8] |= 1 << (i % 8);
+    out->write(&packed[0], packed.size());
   }
-  else if (s.size() > 1) {
-    for(size_t i = 0; i < s.size() - 1; ++i ) {
-      js = js + toa(s[i]) + sep;
-    }
-    js = js + toa(s[s.size()-1]);
+  else {
+    write_source(*out, row, '\t');
+    out->put('\n');
   }
-  return js;
+  ++n_rows;
 }
 
-static string
-join_strings(const vector<string> &s, const string sep) {
-  string js = "";
-  if (s.size() == 1) {
-    js = s[0];
-  }
-  else if (s.size() > 1) {
-    for(size_t i = 0; i < s.size() - 1; ++i ) {
-      js = js + s[i] + sep;
-    }
-    js = js + s[s.size()-1];
+
+void
+SignalWriter::finish_chrom() {
+  if (binary) {
+    const uint64_t rows = n_rows;
+    out->overwrite(SIGNAL_ROWS_OFFSET, &rows, sizeof(uint64_t));
   }
-  return js;
+  BufferedWriter *finished = out;
+  out = 0;
+  finished->close();
+  delete finished;
 }
 
-static void
-write_signal(const vector<cpg> &cpgs, const vector <string> &sample_name,
-             const string outdir) {
-  string lastchr = cpgs[0].chr;
-  string file = path_join(outdir, "subhmr_"+lastchr+"_binary.txt");
-  std::ofstream of;
-  of.open(file.c_str());
-  of << "subhmr" << '\t' << lastchr << endl;
-  of << join_strings(sample_name, "\t") << endl;
-
-  for (size_t i=0; i < cpgs.size(); ++i) {
-    if (cpgs[i].chr != lastchr) {
-      of.close();
-        // write a new chromosome
-      lastchr = cpgs[i].chr;
-      file = path_join(outdir, "subhmr_"+lastchr+"_binary.txt");
-      of.open(file.c_str());
-      of << "subhmr" << '\t' << lastchr << endl;
-      of << join_strings(sample_name, "\t") << endl;
+
+////////////////////////////////////////////////////////////////////////////////
+
+/* Merge-joins the CpGs against every sample's intervals, writing each
+ * row of the matrix as soon as it is known, so memory is one row and
+ * one interval per sample. In a desert longer than desert_size,
+ * fill_num - 1 evenly spaced virtual CpGs are added, which have an
+ * empty line in the index file.
+ */
+static size_t
+binarize(const string &cpgfile, const string &indexfile,
+         const size_t desert_size, const size_t fill_num,
+         vector<SampleCursor *> &samples, SignalWriter &signal) {
+  BufferedWriter index(indexfile);
+
+  CpGReader cpgs(cpgfile);
+  SampleSet row(samples.size());
+  string chrom, last_chrom;
+  size_t pos = 0, last_pos = 0, n_rows = 0;
+  bool started = false;
+  while (cpgs.next(chrom, pos)) {
+    if (!started || chrom != last_chrom) {
+      signal.start_chrom(chrom);
+      for (size_t i = 0; i < samples.size(); ++i)
+        samples[i]->start_chrom(chrom);
+      last_chrom = chrom;
+    }
+    else if (fill_num > 1 && pos - last_pos > desert_size) {
+      const size_t bin = (pos - last_pos)/fill_num;
+      for (size_t f = 1; f < fill_num; ++f) {
+        row.clear();
+        for (size_t i = 0; i < samples.size(); ++i)
+          if (samples[i]->covers(last_pos + f*bin))
+            row.set(i);
+        signal.write(row);
+        index << '\n';
+        ++n_rows;
+      }
     }
-    of << join_source(cpgs[i].member, "\t") << endl;
+    row.clear();
+    for (size_t i = 0; i < samples.size(); ++i)
+      if (samples[i]->covers(pos))
+        row.set(i);
+    signal.write(row);
+    index << chrom << '\t' << pos << '\n';
+    ++n_rows;
+    last_pos = pos;
+    started = true;
   }
+  signal.close();
+  index.close();
+  return n_rows;
 }
 
 
@@ -237,6 +384,9 @@ main(int argc, const char **argv) {
     float ppcutoff = 0.95;
     size_t desert_size = 1000;
     size_t fill_num = 20;
+    bool binary_out = false;
+    // JSON report of the time and memory of each phase
+    string profile_file;
     /****************** GET COMMAND LINE ARGUMENTS ***************************/
     OptionParser opt_parse(strip_path(argv[0]), "Binarize Cpgs",
                            "<interval_files>");
@@ -251,6 +401,10 @@ main(int argc, const char **argv) {
                       true, outdir);
     opt_parse.add_opt("map", 'm', "the indexes on genome of reported entries",
                       true, indexfile);
+    opt_parse.add_opt("binary", 'b', "write the bit-packed binary matrix "
+                      "instead of text", false, binary_out);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, profile_file);
     
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -272,25 +426,45 @@ main(int argc, const char **argv) {
     }
     const vector<string> interval_files(leftover_args);
     /**********************************************************************/
+    if (!profile_file.empty())
+      Profile::get().enable();
     
-    std::cout << "Load CpGs ... " << endl;
-    vector<string> chrs;
-    vector<cpg> cpgs;
-    size_t num_files = interval_files.size();
-    load_cpgs(cpgfile, indexfile, desert_size, fill_num, num_files, cpgs, chrs);
-    std::cout << "Load cpgs: over. \n" << endl;
-    
-    
-    //unordered_map <string, vector<Endpoint> > endpoints;
-    std::cout << "Load intervals ... " << endl;
-    vector <string> sample_name;
-    for (size_t i = 0; i < num_files; ++i) {
-      load_units(num_files, interval_files[i], cpgs, chrs, sample_name);
+    vector<string> sample_name;
+    vector<SampleCursor *> samples;
+    // every sample file is open for the whole pass
+    reserve_open_files(interval_files.size());
+    try {
+      for (size_t i = 0; i < interval_files.size(); ++i) {
+        sample_name.push_back(basename(interval_files[i]));
+        samples.push_back(new SampleCursor(interval_files[i]));
+      }
+      std::cout << "Binarize CpGs ... " << endl;
+      SignalWriter signal(outdir, sample_name, binary_out);
+      // reading, merging and writing are one streaming pass
+      ProfileTimer binarize_timer("binarize");
+      const size_t n_rows = binarize(cpgfile, indexfile, desert_size,
+                                     fill_num, samples, signal);
+      binarize_timer.add_items(n_rows);
+      binarize_timer.stop();
+      std::cout << "Binarize CpGs: over, " << n_rows << " rows" << endl;
+    }
+    catch (...) {
+      for (size_t i = 0; i < samples.size(); ++i)
+        delete samples[i];
+      throw;
+    }
+    for (size_t i = 0; i < samples.size(); ++i)
+      delete samples[i];
+
+    if (!profile_file.empty()) {
+      std::ofstream profile_out(profile_file.c_str());
+      if (!profile_out)
+        throw SMITHLABException("cannot open profile file " + profile_file);
+      Profile::get().write_json(profile_out, "BinarizeCpG");
     }
-    std::cout << "Load intervals: over " << endl;
-    write_signal(cpgs, sample_name, outdir);
   }
   catch (SMITHLABException &e) {
+    cerr << "ERROR:\t" << e.what() << endl;
     return EXIT_FAILURE;
   }
   catch (std::bad_alloc &ba) {
@@ -25,11 +25,18 @@
 #include <numeric>
 #include <limits>
 #include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "ProcSubunit.hpp"
+#include "EndpointMerger.hpp"
+#include "PostProbIndex.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
 
 using std::unordered_map;
 using std::string;
@@ -45,59 +52,21 @@ using std::sort;
 // DATA STRUCTURES
 
 static void
-load_units(const size_t &num_files, const string &interval_file,
-           vector<Endpoint> &endpoints, unordered_map <size_t, string> &fidmap) {
-    // assign sample id (id_idx)
-    const int id_idx = fidmap.size();
-    const string source = basename(interval_file);
-    fidmap[id_idx] = source;
-    // construct source vector;
-    vector<bool> sources(num_files, false);
-    sources[id_idx] = 1;
-    //load endpoints of units and cpgs
-    std::fstream in(interval_file.c_str());
-    if (!in)
-      throw BEDFileException("cannot open input file " + interval_file);
-    string buffer;
-    while (getline(in, buffer)) {
-      GenomicRegion interval = GenomicRegion(buffer);
-      Endpoint lhs = Endpoint(interval, true, sources);
-      Endpoint rhs = Endpoint(interval, false, sources);
-      endpoints.push_back(lhs);
-      endpoints.push_back(rhs);
-    }
-}
-
-static void
-collapse_endpoints(vector<Endpoint> &ep) {
-  size_t j = 0;
-  for (size_t i = 1; i < ep.size(); ++i) {
-    if (ep[i] == ep[j]) {
-      ep[j].count++;
-      ep[j].source = bv_union(ep[i].source, ep[j].source);
-    }
-    else ep[++j] = ep[i];
-  }
-  ep.erase(ep.begin() + j + 1, ep.end());
-}
-
-static void
-part_intervals(const size_t &min_cover, vector<Endpoint> &endpoints,
+part_intervals(const size_t &min_cover, EndpointMerger &endpoints,
                vector<Subunit> &smallunits) {
 
-  collapse_endpoints(endpoints);
-
-  vector<Subunit> newunits;
-  vector<bool> inter(endpoints[0].source.size(), 0);
+  Endpoint ep, next_ep;
+  if (!endpoints.next(ep)) return;
+  SampleSet inter(endpoints.n_samples());
 
   size_t count = 0;
   size_t firstone = 0;
   size_t lastend = 0;
   size_t cover = 0;
-  for (size_t i = 0; i < endpoints.size() - 1; ++i) {
-    if (endpoints[i].is_first) {
-      if (smallunits.size() > 0 && (endpoints[i].start > lastend ||
-          endpoints[i].chr != smallunits.back().chr)) {
+  while (endpoints.next(next_ep)) {
+    if (ep.is_first) {
+      if (smallunits.size() > 0 && (ep.start > lastend ||
+          ep.chr != smallunits.back().chr)) {
         for (size_t j = firstone; j < smallunits.size(); j++) {
           smallunits[j].istart = smallunits[firstone].start;
           smallunits[j].iend = smallunits.back().end;
@@ -105,21 +74,21 @@ part_intervals(const size_t &min_cover, vector<Endpoint> &endpoints,
         }
         firstone = smallunits.size();
       }
-      count += endpoints[i].count;
+      count += ep.count();
       if (cover < count)  cover = count;
-      inter = bv_union(inter, endpoints[i].source);
+      inter |= ep.source;
     } else {
-      count -= endpoints[i].count;
-      inter = bv_diff(inter, endpoints[i].source);
+      count -= ep.count();
+      inter -= ep.source;
     }
     if (count >= min_cover) {
-      Subunit addone = Subunit(endpoints[i].chr, endpoints[i].start,
-                               endpoints[i+1].start, inter, count);
+      Subunit addone = Subunit(ep.chr, ep.start, next_ep.start, inter, count);
       addone.cpgbound = vector<pair<size_t, size_t> >(inter.size(),
                         pair<size_t, size_t> (0, 0));
       smallunits.push_back(addone);
-      lastend = endpoints[i+1].start;
+      lastend = next_ep.start;
     }
+    std::swap(ep, next_ep);
   } // assign final island
   for (size_t j = firstone; j < smallunits.size(); j++) {
     smallunits[j].istart = smallunits[firstone].start;
@@ -128,56 +97,46 @@ part_intervals(const size_t &min_cover, vector<Endpoint> &endpoints,
   }
 }
 
-static GenomicRegion
-construct_GenomicRegion(string buffer) {
-  std::istringstream os(buffer);
-  string chr;
-  size_t start, end;
-  float score;
-  os >> chr >> start >> end >> score;
-  return GenomicRegion(chr, start, end, "X", score, '+');
+// cpgbound[idx] of each unit indexes the posteriors of the CpGs it
+// contains, as copied into scores in unit order
+static void
+load_cpgs(const size_t &idx, const string &sample_name, const string &ppdir,
+          vector<Subunit> &smallunits, vector<float> &scores) {
+  const PostProbIndex pp(path_join(ppdir, sample_name + ".hmrpp"));
+  scores.clear();
+  for (size_t i = 0; i < smallunits.size(); ++i) {
+    const pair<size_t, size_t> sites =
+      pp.sites_in(smallunits[i].chr, smallunits[i].start, smallunits[i].end);
+    if (sites.first < sites.second) {
+      smallunits[i].cpgbound[idx] =
+        pair<size_t, size_t>(scores.size() + 1,
+                             scores.size() + sites.second - sites.first);
+      scores.insert(scores.end(), pp.scores() + sites.first,
+                    pp.scores() + sites.second);
+    }
+  }
 }
 
 
+// samples are loaded in parallel; each writes only its own cpgbound
 static void
-load_cpgs(const size_t &idx, const string &sample_name, const string &ppdir,
-          vector<Subunit> &smallunits, vector<vector<GenomicRegion> > &cpgs) {
-  const string pp_file = path_join(ppdir, sample_name + ".hmrpp");
-  std::fstream in(pp_file.c_str());
-  if (!in)
-    throw BEDFileException("cannot open input file " + pp_file);
-  vector<GenomicRegion> newcpgs;
-  string buffer;
-  bool hit_next = false;
-  getline(in, buffer);
-  GenomicRegion cpg = construct_GenomicRegion(buffer);
-  for (size_t i = 0; i < smallunits.size() && in.good(); ++i) {
-    while (smallunits[i].behind(cpg) && in.good()) {
-      getline(in, buffer);
-      cpg = construct_GenomicRegion(buffer);
+load_all_cpgs(const string &ppdir, unordered_map <size_t, string> &fidmap,
+              vector<Subunit> &smallunits, vector<vector<float> > &cpgs) {
+  const size_t num_files = fidmap.size();
+  cpgs.resize(num_files);
+  string error;
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < num_files; ++i) {
+    try {
+      load_cpgs(i, fidmap.find(i)->second, ppdir, smallunits, cpgs[i]);
     }
-    if(smallunits[i].contains(cpg)) { // hit the first cpg
-      if (!hit_next) // not overlapped with the last fragment
-        smallunits[i].cpgbound[idx].first = newcpgs.size() + 1;
-      while (smallunits[i].contains(cpg) && in.good()) {
-        if (!hit_next) { // not overlapped with the last fragment
-          smallunits[i].cpgbound[idx].second = newcpgs.size() + 1;
-          // check if hit the next fragment
-          if (i < smallunits.size()-1 && smallunits[i+1].contains(cpg)) {
-            smallunits[i+1].cpgbound[idx].first = newcpgs.size() + 1;
-            smallunits[i+1].cpgbound[idx].second = newcpgs.size() + 1;
-            hit_next = true;
-          }
-          newcpgs.push_back(cpg);
-        } else {
-          hit_next = false;
-        }
-        getline(in, buffer);
-        cpg = construct_GenomicRegion(buffer);
-      } // hit the last cpg
+    catch (SMITHLABException &e) {
+#pragma omp critical
+      if (error.empty()) error = e.what();
     }
   }
-  cpgs.push_back(newcpgs);
+  if (!error.empty())
+    throw BEDFileException(error);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -200,56 +159,44 @@ rm_junk(const float &min_del_freq, const size_t &min_size,
 
 
 static void
-score_a_subunit(Subunit &subunit, const vector<vector<GenomicRegion> > &cpgs) {
+score_a_subunit(Subunit &subunit, const vector<vector<float> > &cpgs) {
   for (size_t i = 0; i < subunit.source.size(); ++i) { // i sample
     float p = 0, np = 0;
     if (subunit.cpgbound[i].first != 0) { // cover hmr cpg(s)
       for (size_t k = subunit.cpgbound[i].first - 1;
            k < subunit.cpgbound[i].second; ++k) {
-        p += cpgs[i][k].get_score();
+        p += cpgs[i][k];
       }
       np = (subunit.cpgbound[i].second - subunit.cpgbound[i].first + 1) - p;
       subunit.score[i] = subunit.source[i] ? p : np;
     }
   }
+  subunit.sum_scores();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static string
-join_source(const vector<bool> &s, string sep) {
-  string js;
-  for(size_t i = 0; i < s.size(); ++i ) {
-    js = js + toa(s[i]) + sep;
-  }
-  js.erase(js.end()-1, js.end());
-  return js;
-}
-
-
-
 static void
 subunits_to_file(const string &outfile, const vector<Subunit> &subunits) {
-  std::ofstream of;
-  if (!outfile.empty()) of.open(outfile.c_str());
-  std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+  BufferedWriter out(outfile);
   for (size_t i = 0; i < subunits.size(); ++i) {
      out << subunits[i].chr << '\t'
          << subunits[i].start << '\t' << subunits[i].end << '\t'
-         << subunits[i].istart << '\t' << subunits[i].iend << '\t'
-         << join_source(subunits[i].source, ",") << '\t'
-         << subunits[i].num_cpg() << '\t' << subunits[i].score_sum() << endl;
+         << subunits[i].istart << '\t' << subunits[i].iend << '\t';
+     write_source(out, subunits[i].source, ',');
+     out << '\t' << subunits[i].num_cpg() << '\t' << subunits[i].score_sum()
+         << '\n';
     }
+  out.close();
 }
 
 static void
 write_list(const string &listfile, unordered_map <size_t, string> &fidmap) {
-  std::ofstream of;
-  if (!listfile.empty()) of.open(listfile.c_str());
-  std::ostream out(listfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+  BufferedWriter out(listfile);
   for (size_t i = 0; i < fidmap.size(); ++i) {
-    out << i << '\t' << fidmap[i] << endl;
+    out << i << '\t' << fidmap[i] << '\n';
   }
+  out.close();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -270,6 +217,9 @@ main(int argc, const char **argv) {
     size_t min_size = 100;
     //float size_factor = 0.5;
     float degcutoff = 1;
+    size_t n_threads = 1;
+    // JSON report of the time and memory of each phase
+    string profile_file;
     /****************** GET COMMAND LINE ARGUMENTS ***************************/
     OptionParser opt_parse(strip_path(argv[0]), "subUnitFinder", 
                            "<interval-files>");
@@ -286,6 +236,9 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("min_size", 's', "min size", false, min_size);
     //opt_parse.add_opt("size", 'S', "the size factor", false, size_factor);
     opt_parse.add_opt("degcutoff", 'd', "merging degeneration", false, degcutoff);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, profile_file);
 
     // opt_parse.add_opt("verbose", 'v', "print more run info",
     //                false , VERBOSE);
@@ -310,43 +263,58 @@ main(int argc, const char **argv) {
     }
     const vector<string> interval_files(leftover_args);
     /**********************************************************************/
-    vector<Endpoint> endpoints;
+#ifdef _OPENMP
+    omp_set_num_threads(n_threads);
+#endif
+    if (!profile_file.empty())
+      Profile::get().enable();
     unordered_map <size_t, string> fidmap;
-    
     size_t num_files = interval_files.size();
     for (size_t i = 0; i < num_files; ++i) {
       if (VERBOSE)
         cerr << interval_files[i] << endl;
-      load_units(num_files, interval_files[i], endpoints, fidmap);
+      fidmap[i] = basename(interval_files[i]);
     }
-    std::cout << "Got " << endpoints.size() << " end points." << endl;
-
-    sort(endpoints.begin(), endpoints.end());
-    std::cout << "Sort: over." << endl;
+    ProfileTimer partition_timer("partition");
+    EndpointMerger endpoints(interval_files);
 
     vector<Subunit> smallunits;
     part_intervals(min_cover, endpoints, smallunits);
+    partition_timer.add_items(endpoints.n_read());
+    partition_timer.stop();
+    std::cout << "Got " << endpoints.n_read() << " end points." << endl;
     std::cout << "Got " << smallunits.size() << " smallunits." << endl;
     
     rm_junk(min_del_freq, min_size, smallunits);
     std::cout << "Got " << smallunits.size()
     << " smallunits left after throwing away too small ones." << endl;
 
-    vector<vector<GenomicRegion> > cpgs;
-    for (size_t i = 0; i < num_files; ++i) {
-      load_cpgs(i, fidmap[i], ppdir, smallunits, cpgs);
-    }
+    vector<vector<float> > cpgs;
+    ProfileTimer load_timer("load", smallunits.size()*num_files);
+    load_all_cpgs(ppdir, fidmap, smallunits, cpgs);
+    load_timer.stop();
     std::cout << "Load cpgs: over." << endl;
     
+    ProfileTimer score_timer("score", smallunits.size());
     for (size_t i = 0; i < smallunits.size(); ++i) {
       score_a_subunit(smallunits[i], cpgs);
     }
+    score_timer.stop();
     
+    ProfileTimer output_timer("output", smallunits.size());
     subunits_to_file(outfile, smallunits);
     write_list(listfile, fidmap);
+    output_timer.stop();
+
+    if (!profile_file.empty()) {
+      std::ofstream profile_out(profile_file.c_str());
+      if (!profile_out)
+        throw SMITHLABException("cannot open profile file " + profile_file);
+      Profile::get().write_json(profile_out, "CollapseIntervals");
+    }
   }
   catch (SMITHLABException &e) {
-
+    cerr << "ERROR:\t" << e.what() << endl;
     return EXIT_FAILURE;
   }
   catch (std::bad_alloc &ba) {
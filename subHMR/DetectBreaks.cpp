@@ -25,9 +25,13 @@
 #include <numeric>
 #include <cmath>
 #include <algorithm>
+#include <deque>
+#include <unordered_map>
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
 
 using std::string;
 using std::vector;
@@ -41,16 +45,25 @@ using std::min;
 ///////////////////////////////////////////////////////////////////////////////
 // DATA STRUCTURES
 
+enum BreakType {NO_BREAK, BREAK, BROKEN};
+
+static const char *
+break_type_name(const BreakType b) {
+  return b == BREAK ? "break" : (b == BROKEN ? "broken" : "na");
+}
+
 struct interval {
   interval(const string c, const size_t s, const size_t e, const string n) :
-    chr(c), start(s), end(e), state(n), size(e-s), break_type("na") {}
+    chr(c), start(s), end(e), state(n), state_id(0), size(e-s),
+    break_type(NO_BREAK) {}
 
   string chr;
   size_t start;
   size_t end;
   string state;
+  size_t state_id;
   size_t size;
-  string break_type;
+  BreakType break_type;
 };
 
 static interval
@@ -62,13 +75,20 @@ interval_from_str(string buffer) {
   return(interval(chr, start, end, state));
 }
 
-static void
+// states are numbered in order of appearance; returns how many
+static size_t
 load_units(const string &interval_file, vector<interval> &units) {
   std::fstream in(interval_file.c_str());
+  std::unordered_map<string, size_t> state_ids;
   string buffer;
   while (getline(in, buffer)) {
     units.push_back(interval_from_str(buffer));
+    std::unordered_map<string, size_t>::const_iterator s =
+      state_ids.insert(std::make_pair(units.back().state,
+                                      state_ids.size())).first;
+    units.back().state_id = s->second;
   }
+  return state_ids.size();
 }
 
 static void
@@ -82,24 +102,121 @@ separate_regions(const vector<interval> &units, vector<size_t> &reset_points) {
   reset_points.push_back(units.size());
 }
 
+/* Sliding window extremes over the positions of a region, kept in a
+ * monotonic deque of positions: the front is the extreme of the
+ * window. Positions are added in the direction of the sweep and
+ * expire once the window has moved past them.
+ */
+struct WindowExtreme {
+  WindowExtreme(const vector<interval> &u, const bool m) :
+    units(u), want_max(m) {}
+  void add(const size_t i) {
+    while (!window.empty() && !better(units[window.back()].size, units[i].size))
+      window.pop_back();
+    window.push_back(i);
+  }
+  // drops positions outside [lo, hi]
+  void expire(const size_t lo, const size_t hi) {
+    while (!window.empty() && (window.front() < lo || window.front() > hi))
+      window.pop_front();
+  }
+  bool empty() const {return window.empty();}
+  size_t best() const {return units[window.front()].size;}
+  void clear() {window.clear();}
+
+  bool better(const size_t a, const size_t b) const {
+    return want_max ? a > b : a < b;
+  }
+  const vector<interval> &units;
+  const bool want_max;
+  std::deque<size_t> window;
+};
+
+
+/* Unit i in (mostleft, mostright) is a break if, for some state, units
+ * j in [i - degree, i) and k in (i, i + degree] of that state both have
+ * size/2 > size of i. Every such j and k is then broken, unless it is
+ * itself a break. For a state s, i is a break exactly when the largest
+ * s-units on both sides qualify. A unit j of state s is broken as a
+ * left partner if the smallest unit i within degree to its right that
+ * has a qualifying s-unit on its right side is smaller than size_j/2;
+ * broken right partners are symmetric. Each state is one sweep of
+ * sliding windows in each direction.
+ */
+static void
+mark_break(vector<interval> &units, const size_t mostleft,
+           const size_t mostright, const size_t degree,
+           const vector<size_t> &states) {
+  if (mostright <= mostleft + 1)
+    return;
+  const size_t n = mostright - mostleft + 1;
+  vector<bool> is_break(n, false), is_broken(n, false);
+  vector<bool> left_ok(n), right_ok(n);
+  WindowExtreme max_window(units, true), min_window(units, false);
+
+  for (size_t s = 0; s < states.size(); ++s) {
+    const size_t state = states[s];
+
+    // left_ok: a state unit within degree to the left has size/2 > size
+    max_window.clear();
+    for (size_t i = mostleft; i <= mostright; ++i) {
+      max_window.expire(i >= mostleft + degree ? i - degree : mostleft, i);
+      left_ok[i - mostleft] = !max_window.empty() &&
+        units[i].size < max_window.best()/2;
+      if (units[i].state_id == state) max_window.add(i);
+    }
+    // right_ok: the same to the right
+    max_window.clear();
+    for (size_t i = mostright + 1; i-- > mostleft;) {
+      max_window.expire(i, i + degree);
+      right_ok[i - mostleft] = !max_window.empty() &&
+        units[i].size < max_window.best()/2;
+      if (units[i].state_id == state) max_window.add(i);
+    }
+    for (size_t i = mostleft + 1; i < mostright; ++i)
+      if (left_ok[i - mostleft] && right_ok[i - mostleft])
+        is_break[i - mostleft] = true;
+
+    // left partners: the smallest i in (j, j + degree] with right_ok
+    min_window.clear();
+    for (size_t j = mostright + 1; j-- > mostleft;) {
+      if (j + 1 < mostright && right_ok[j + 1 - mostleft])
+        min_window.add(j + 1);
+      min_window.expire(j + 1, j + degree);
+      if (units[j].state_id == state && !min_window.empty() &&
+          min_window.best() < units[j].size/2)
+        is_broken[j - mostleft] = true;
+    }
+    // right partners: the smallest i in [k - degree, k) with left_ok
+    min_window.clear();
+    for (size_t k = mostleft; k <= mostright; ++k) {
+      if (k > mostleft + 1 && left_ok[k - 1 - mostleft])
+        min_window.add(k - 1);
+      min_window.expire(k >= degree ? k - degree : 0, k - 1);
+      if (units[k].state_id == state && !min_window.empty() &&
+          min_window.best() < units[k].size/2)
+        is_broken[k - mostleft] = true;
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (is_break[i]) units[mostleft + i].break_type = BREAK;
+    else if (is_broken[i]) units[mostleft + i].break_type = BROKEN;
+  }
+}
+
+
+// the states present in units[mostleft..mostright]
 static void
-mark_break(vector<interval> &units, size_t mostleft, size_t mostright,
-    size_t degree) {
-  for (size_t i = mostleft+1; i < mostright; i++) {
-    size_t search_start = max(mostleft, i-degree);
-    size_t search_end = min(mostright, i+degree);
-    bool over_domain = false;
-    for (size_t j = search_start; j < i && !over_domain; j++) {
-      for (size_t k = i+1; k <= search_end && !over_domain; k++) {
-        if (units[j].state == units[k].state &&
-          units[i].size < (min(units[j].size, units[k].size)) / 2) {
-          units[i].break_type = "break";
-          if (units[j].break_type != "break")
-            units[j].break_type = "broken";
-          if (units[k].break_type != "break")
-            units[k].break_type = "broken";
-        }
-      }
+region_states(const vector<interval> &units, const size_t mostleft,
+              const size_t mostright, vector<size_t> &last_seen,
+              vector<size_t> &states) {
+  states.clear();
+  for (size_t i = mostleft; i <= mostright; ++i) {
+    const size_t s = units[i].state_id;
+    if (last_seen[s] != mostleft + 1) {
+      last_seen[s] = mostleft + 1;
+      states.push_back(s);
     }
   }
 }
@@ -110,15 +227,13 @@ mark_break(vector<interval> &units, size_t mostleft, size_t mostright,
 
 static void
 write_units(const vector<interval> &units, const string outfile) {
-  std::ofstream of;
-  if (!outfile.empty()) of.open(outfile.c_str());
-  std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
-
+  BufferedWriter out(outfile);
   for (size_t i=0; i < units.size(); ++i) {
     out << units[i].chr << '\t' << units[i].start << '\t'
         << units[i].end << '\t' << units[i].state << '\t'
-        << units[i].break_type << endl;
+        << break_type_name(units[i].break_type) << '\n';
   }
+  out.close();
 }
 
 
@@ -133,12 +248,16 @@ main(int argc, const char **argv) {
     string outfile;
 
     size_t degree = 4;
+    // JSON report of the time and memory of each phase
+    string profile_file;
     /****************** GET COMMAND LINE ARGUMENTS ***************************/
     OptionParser opt_parse(strip_path(argv[0]), "DetectBreaks",
                            "<interval_files>");
     opt_parse.add_opt("degree", 'd', "the degree of checking",
                       false , degree);
     opt_parse.add_opt("output", 'o', "output file", true, outfile);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, profile_file);
     
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -160,29 +279,49 @@ main(int argc, const char **argv) {
     }
     const vector<string> interval_file(leftover_args);
     /**********************************************************************/
+    if (!profile_file.empty())
+      Profile::get().enable();
     
     std::cout << "Load units ... " << endl;
     vector<interval> units;
-    load_units(interval_file[0], units);
+    ProfileTimer load_timer("load");
+    const size_t n_states = load_units(interval_file[0], units);
+    load_timer.add_items(units.size());
+    load_timer.stop();
     std::cout << "Load units: over. \n" << endl;
     
     std::cout << "Set boundaries ... " << endl;
     vector<size_t> reset_points;
+    ProfileTimer separate_timer("separate_regions", units.size());
     separate_regions(units, reset_points);
+    separate_timer.stop();
     std::cout << "Set boundaries: over. \n" << endl;
     
     std::cout << "Mark breaks ... " << endl;
+    ProfileTimer breaks_timer("mark_breaks", units.size());
+    vector<size_t> last_seen(n_states, 0), states;
     for (size_t i = 0; i < reset_points.size()-1; ++i) {
       size_t mostleft = max(static_cast<size_t> (0), reset_points[i]);
       size_t mostright = min(units.size()-1, reset_points[i+1]-1);
-      mark_break(units, mostleft, mostright, degree);
+      region_states(units, mostleft, mostright, last_seen, states);
+      mark_break(units, mostleft, mostright, degree, states);
     }
     
+    breaks_timer.stop();
     std::cout << "Mark breaks: over ... " << endl;
     
     std::cout << "Write units ..." << endl;
+    ProfileTimer output_timer("output", units.size());
     write_units(units, outfile);
+    output_timer.stop();
     std::cout << "Write units: over " << endl;
+
+    if (!profile_file.empty()) {
+      std::ofstream profile_out(profile_file.c_str());
+      if (!profile_out)
+        throw SMITHLABException("cannot open profile file " + profile_file);
+      Profile::get().write_json(profile_out, "DetectBreaks");
+    }
   }
   catch (SMITHLABException &e) {
     return EXIT_FAILURE;
@@ -25,11 +25,19 @@
 #include <numeric>
 #include <limits>
 #include <cmath>
+#include <queue>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "ProcSubunit.hpp"
+#include "EndpointMerger.hpp"
+#include "PostProbIndex.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
 
 using std::unordered_map;
 using std::string;
@@ -45,59 +53,21 @@ using std::sort;
 // DATA STRUCTURES
 
 static void
-load_units(const size_t &num_files, const string &interval_file,
-           vector<Endpoint> &endpoints, unordered_map <size_t, string> &fidmap) {
-    // assign sample id (id_idx)
-    const int id_idx = fidmap.size();
-    const string source = basename(interval_file);
-    fidmap[id_idx] = source;
-    // construct source vector;
-    vector<bool> sources(num_files, false);
-    sources[id_idx] = 1;
-    //load endpoints of units and cpgs
-    std::fstream in(interval_file.c_str());
-    if (!in)
-      throw BEDFileException("cannot open input file " + interval_file);
-    string buffer;
-    while (getline(in, buffer)) {
-      GenomicRegion interval = GenomicRegion(buffer);
-      Endpoint lhs = Endpoint(interval, true, sources);
-      Endpoint rhs = Endpoint(interval, false, sources);
-      endpoints.push_back(lhs);
-      endpoints.push_back(rhs);
-    }
-}
-
-static void
-collapse_endpoints(vector<Endpoint> &ep) {
-  size_t j = 0;
-  for (size_t i = 1; i < ep.size(); ++i) {
-    if (ep[i] == ep[j]) {
-      ep[j].count++;
-      ep[j].source = bv_union(ep[i].source, ep[j].source);
-    }
-    else ep[++j] = ep[i];
-  }
-  ep.erase(ep.begin() + j + 1, ep.end());
-}
-
-static void
-part_intervals(const size_t &min_cover, vector<Endpoint> &endpoints,
+part_intervals(const size_t &min_cover, EndpointMerger &endpoints,
                vector<Subunit> &smallunits) {
 
-  collapse_endpoints(endpoints);
-
-  vector<Subunit> newunits;
-  vector<bool> inter(endpoints[0].source.size(), 0);
+  Endpoint ep, next_ep;
+  if (!endpoints.next(ep)) return;
+  SampleSet inter(endpoints.n_samples());
 
   size_t count = 0;
   size_t firstone = 0;
   size_t lastend = 0;
   size_t cover = 0;
-  for (size_t i = 0; i < endpoints.size() - 1; ++i) {
-    if (endpoints[i].is_first) {
-      if (smallunits.size() > 0 && (endpoints[i].start > lastend ||
-          endpoints[i].chr != smallunits.back().chr)) {
+  while (endpoints.next(next_ep)) {
+    if (ep.is_first) {
+      if (smallunits.size() > 0 && (ep.start > lastend ||
+          ep.chr != smallunits.back().chr)) {
         for (size_t j = firstone; j < smallunits.size(); j++) {
           smallunits[j].istart = smallunits[firstone].start;
           smallunits[j].iend = smallunits.back().end;
@@ -105,21 +75,21 @@ part_intervals(const size_t &min_cover, vector<Endpoint> &endpoints,
         }
         firstone = smallunits.size();
       }
-      count += endpoints[i].count;
+      count += ep.count();
       if (cover < count)  cover = count;
-      inter = bv_union(inter, endpoints[i].source);
+      inter |= ep.source;
     } else {
-      count -= endpoints[i].count;
-      inter = bv_diff(inter, endpoints[i].source);
+      count -= ep.count();
+      inter -= ep.source;
     }
     if (count >= min_cover) {
-      Subunit addone = Subunit(endpoints[i].chr, endpoints[i].start,
-                               endpoints[i+1].start, inter, count);
+      Subunit addone = Subunit(ep.chr, ep.start, next_ep.start, inter, count);
       addone.cpgbound = vector<pair<size_t, size_t> >(inter.size(),
                         pair<size_t, size_t> (0, 0));
       smallunits.push_back(addone);
-      lastend = endpoints[i+1].start;
+      lastend = next_ep.start;
     }
+    std::swap(ep, next_ep);
   } // assign final island
   for (size_t j = firstone; j < smallunits.size(); j++) {
     smallunits[j].istart = smallunits[firstone].start;
@@ -128,56 +98,56 @@ part_intervals(const size_t &min_cover, vector<Endpoint> &endpoints,
   }
 }
 
-static GenomicRegion
-construct_GenomicRegion(string buffer) {
-  std::istringstream os(buffer);
-  string chr;
-  size_t start, end;
-  float score;
-  os >> chr >> start >> end >> score;
-  return GenomicRegion(chr, start, end, "X", score, '+');
-}
+// the posterior indexes of all samples, in sample order
+struct PostProbs {
+  ~PostProbs() {
+    for (size_t i = 0; i < files.size(); ++i)
+      delete files[i];
+  }
+  vector<PostProbIndex *> files;
+};
 
 
+// samples are opened in parallel, which builds any missing index
 static void
-load_cpgs(const size_t &idx, const string &sample_name, const string &ppdir,
-          vector<Subunit> &smallunits, vector<vector<GenomicRegion> > &cpgs) {
-  const string pp_file = path_join(ppdir, sample_name + ".hmrpp");
-  std::fstream in(pp_file.c_str());
-  if (!in)
-    throw BEDFileException("cannot open input file " + pp_file);
-  vector<GenomicRegion> newcpgs;
-  string buffer;
-  bool hit_next = false;
-  getline(in, buffer);
-  GenomicRegion cpg = construct_GenomicRegion(buffer);
-  for (size_t i = 0; i < smallunits.size() && in.good(); ++i) {
-    while (smallunits[i].behind(cpg) && in.good()) {
-      getline(in, buffer);
-      cpg = construct_GenomicRegion(buffer);
+open_postprobs(const string &ppdir, unordered_map <size_t, string> &fidmap,
+               PostProbs &pp) {
+  const size_t num_files = fidmap.size();
+  pp.files.resize(num_files, 0);
+  string error;
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < num_files; ++i) {
+    try {
+      pp.files[i] = new PostProbIndex(path_join(ppdir, fidmap.find(i)->second +
+                                                ".hmrpp"));
     }
-    if(smallunits[i].contains(cpg)) { // hit the first cpg
-      if (!hit_next) // not overlapped with the last fragment
-        smallunits[i].cpgbound[idx].first = newcpgs.size() + 1;
-      while (smallunits[i].contains(cpg) && in.good()) {
-        if (!hit_next) { // not overlapped with the last fragment
-          smallunits[i].cpgbound[idx].second = newcpgs.size() + 1;
-          // check if hit the next fragment
-          if (i < smallunits.size()-1 && smallunits[i+1].contains(cpg)) {
-            smallunits[i+1].cpgbound[idx].first = newcpgs.size() + 1;
-            smallunits[i+1].cpgbound[idx].second = newcpgs.size() + 1;
-            hit_next = true;
-          }
-          newcpgs.push_back(cpg);
-        } else {
-          hit_next = false;
-        }
-        getline(in, buffer);
-        cpg = construct_GenomicRegion(buffer);
-      } // hit the last cpg
+    catch (SMITHLABException &e) {
+#pragma omp critical
+      if (error.empty()) error = e.what();
+    }
+  }
+  if (!error.empty())
+    throw BEDFileException(error);
+}
+
+
+// cpgbound[idx] of each unit indexes the posteriors of the CpGs it
+// contains, as copied into scores in unit order
+static void
+load_cpgs(const size_t idx, const PostProbIndex &pp,
+          vector<Subunit> &units, vector<float> &scores) {
+  scores.clear();
+  for (size_t i = 0; i < units.size(); ++i) {
+    const pair<size_t, size_t> sites =
+      pp.sites_in(units[i].chr, units[i].start, units[i].end);
+    if (sites.first < sites.second) {
+      units[i].cpgbound[idx] =
+        pair<size_t, size_t>(scores.size() + 1,
+                             scores.size() + sites.second - sites.first);
+      scores.insert(scores.end(), pp.scores() + sites.first,
+                    pp.scores() + sites.second);
     }
   }
-  cpgs.push_back(newcpgs);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -198,40 +168,22 @@ rm_junk(const float &min_del_freq, const size_t &min_size,
   smallunits.erase(smallunits.begin() + j, smallunits.end());
 }
 
-struct idxed_val {
-  idxed_val( ) : idx(0), val(0) {}
-  idxed_val(const size_t i, const float v) : idx(i), val(v) {}
-  bool operator>(const idxed_val &other) const { return (val > other.val); }
-  size_t idx;
-  float val;
-};
-
 static void
-score_a_subunit(Subunit &subunit, const vector<vector<GenomicRegion> > &cpgs) {
+score_a_subunit(Subunit &subunit, const vector<vector<float> > &cpgs) {
   for (size_t i = 0; i < subunit.source.size(); ++i) { // i sample
     float p = 0, np = 0;
     if (subunit.cpgbound[i].first != 0) { // cover hmr cpg(s)
       for (size_t k = subunit.cpgbound[i].first - 1;
            k < subunit.cpgbound[i].second; ++k) {
-        p += cpgs[i][k].get_score();
+        p += cpgs[i][k];
       }
       np = (subunit.cpgbound[i].second - subunit.cpgbound[i].first + 1) - p;
       subunit.score[i] = subunit.source[i] ? p : np;
     }
   }
+  subunit.sum_scores();
 }
 
-static void
-score_subunits_and_sort(const vector<vector<GenomicRegion> > &cpgs,
-                        vector<Subunit> &subunits, vector<idxed_val> &scores) {
-  scores.resize(subunits.size());
-  for (size_t i = 0; i < subunits.size(); ++i) {
-    score_a_subunit(subunits[i], cpgs);
-    scores[i].idx = i;
-    scores[i].val = subunits[i].score_sum();
-  }
-  sort(scores.begin(), scores.end(), std::greater<idxed_val>());
-}
 ////////////////////////////////////////////////////////////////////////////////
 // FUNCTIONS FOR MERGING UNITS
 static vector<Subunit>::iterator
@@ -253,11 +205,11 @@ get_last_in_island(const vector<Subunit> &smallunits,
 
 static Subunit
 generate_merged_subunit(Subunit &x, Subunit &y, char core, float &mscore,
-                        const vector<vector<GenomicRegion> > &cpgs) {
+                        const vector<vector<float> > &cpgs) {
   Subunit z = Subunit(x);
   z.end = y.end;
-  z.count = 0;
   if (core == 'r') z.source = y.source;
+  z.count = z.source.count(); // set as HMR
   for (size_t i = 0; i < x.source.size(); ++i) {
     if (x.cpgbound[i].first != 0 && y.cpgbound[i].first != 0) {
       z.cpgbound[i].second = y.cpgbound[i].second;
@@ -265,7 +217,6 @@ generate_merged_subunit(Subunit &x, Subunit &y, char core, float &mscore,
     else if (x.cpgbound[i].first == 0 && y.cpgbound[i].first != 0) {
       z.cpgbound[i] = y.cpgbound[i];
     }
-    if (z.source[i]) z.count++; // set as HMR
   }
   score_a_subunit(z, cpgs);
   float sep_score = x.score_sum_len() + y.score_sum_len();
@@ -277,50 +228,193 @@ generate_merged_subunit(Subunit &x, Subunit &y, char core, float &mscore,
   return z;
 }
 
-static bool
-merge_two(const float &degcutoff, const vector<idxed_val> &scores,
-          vector<Subunit> &island, const vector<vector<GenomicRegion> > &cpgs) {
-  
-  bool has_merged = false;
+// merge score of x with its right neighbour y: 'l' keeps the sources
+// of x, 'r' those of y
+static float
+merge_score(Subunit &x, Subunit &y, char core,
+            const vector<vector<float> > &cpgs) {
   float mscore = 0;
-  float mscore_left = 0;
-  float mscore_right = 0;
-  Subunit lhs, rhs;
+  generate_merged_subunit(x, y, core, mscore, cpgs);
+  return mscore;
+}
 
-  size_t i = 0;
-  for (size_t k = 0; k < scores.size() && mscore < degcutoff; ++k) {
-    i = scores[k].idx;
-    if ( i == 0)
-      rhs = generate_merged_subunit(island[i], island[i+1], 'l', mscore_right, cpgs);
-    else if (i == island.size() - 1 )
-      lhs = generate_merged_subunit(island[i-1], island[i], 'r', mscore_left, cpgs);
-    else {
-      lhs = generate_merged_subunit(island[i-1], island[i], 'r', mscore_left, cpgs);
-      rhs = generate_merged_subunit(island[i], island[i+1], 'l', mscore_right, cpgs);
+
+/* Greedy merging within one island. Each round, the subunit with the
+ * highest score_sum (leftmost on ties) that has a neighbour with merge
+ * score at least degcutoff is merged with the better of its two
+ * neighbours (the right one on ties), and the result is dropped if it
+ * is empty or has no CpGs. The subunits form a linked list indexed by
+ * their position in the island, a merged unit taking the position of
+ * its left part. Mergeable subunits wait in a heap with lazy deletion,
+ * so a merge only rescores the merged unit and its neighbours.
+ */
+class IslandMerger {
+public:
+  IslandMerger(const float d, const vector<vector<float> > &c,
+               const vector<Subunit> &island);
+  void merge_all();
+  void get_subunits(vector<Subunit> &out) const;
+
+private:
+  static const size_t NONE = static_cast<size_t>(-1);
+
+  struct Candidate {
+    float score;
+    size_t node;
+    size_t version;
+  };
+  struct CandidateLess {
+    bool operator()(const Candidate &a, const Candidate &b) const {
+      return a.score < b.score || (a.score == b.score && a.node > b.node);
     }
-    mscore = mscore_left > mscore_right ? mscore_left : mscore_right;
+  };
+
+  void update(const size_t i);
+  void remove(const size_t i);
+  void merge(const size_t i);
+
+  const float degcutoff;
+  const vector<vector<float> > &cpgs;
+  vector<Subunit> units;
+  vector<size_t> prev;
+  vector<size_t> next;
+  vector<bool> alive;
+  vector<size_t> version;
+  std::priority_queue<Candidate, vector<Candidate>, CandidateLess> heap;
+};
+
+const size_t IslandMerger::NONE;
+
+
+IslandMerger::IslandMerger(const float d, const vector<vector<float> > &c,
+                           const vector<Subunit> &island) :
+  degcutoff(d), cpgs(c), units(island), prev(island.size()),
+  next(island.size()), alive(island.size(), true),
+  version(island.size(), 0) {
+  for (size_t i = 0; i < units.size(); ++i) {
+    score_a_subunit(units[i], cpgs);
+    prev[i] = i == 0 ? NONE : i - 1;
+    next[i] = i + 1 == units.size() ? NONE : i + 1;
   }
-  
-  if (mscore >= degcutoff) {
-    has_merged = true;
-    if (mscore_left > mscore_right) {
-      island[i-1] = lhs;
-      island.erase(island.begin() + i);
-      if (island[i-1].empty() || island[i-1].zero_density()) island.erase(island.begin() + i-1);
-    } else {
-      island[i] = rhs;
-      island.erase(island.begin() + i+1);
-      if (island[i].empty() || island[i].zero_density()) island.erase(island.begin() + i);
-    }
+  for (size_t i = 0; i < units.size(); ++i)
+    update(i);
+}
+
+
+// invalidates any queued entry for i, and queues i again if it can
+// merge with a neighbour
+void
+IslandMerger::update(const size_t i) {
+  if (i == NONE || !alive[i])
+    return;
+  ++version[i];
+  const bool mergeable =
+    (prev[i] != NONE &&
+     merge_score(units[prev[i]], units[i], 'r', cpgs) >= degcutoff) ||
+    (next[i] != NONE &&
+     merge_score(units[i], units[next[i]], 'l', cpgs) >= degcutoff);
+  if (mergeable) {
+    const Candidate c = {units[i].score_sum(), i, version[i]};
+    heap.push(c);
   }
-  return has_merged;
 }
 
+
+void
+IslandMerger::remove(const size_t i) {
+  alive[i] = false;
+  if (prev[i] != NONE) next[prev[i]] = next[i];
+  if (next[i] != NONE) prev[next[i]] = prev[i];
+}
+
+
+void
+IslandMerger::merge(const size_t i) {
+  const size_t p = prev[i], n = next[i];
+  float mscore_left = 0, mscore_right = 0;
+  Subunit lhs, rhs;
+  if (p != NONE)
+    lhs = generate_merged_subunit(units[p], units[i], 'r', mscore_left, cpgs);
+  if (n != NONE)
+    rhs = generate_merged_subunit(units[i], units[n], 'l', mscore_right, cpgs);
+
+  size_t m = i;
+  if (n == NONE || (p != NONE && mscore_left > mscore_right)) {
+    units[p] = lhs;
+    remove(i);
+    m = p;
+  }
+  else {
+    units[i] = rhs;
+    remove(n);
+  }
+  if (units[m].empty() || units[m].zero_density()) {
+    remove(m);
+    update(prev[m]);
+    update(next[m]);
+  }
+  else {
+    update(m);
+    update(prev[m]);
+    update(next[m]);
+  }
+}
+
+
+void
+IslandMerger::merge_all() {
+  while (!heap.empty()) {
+    const Candidate c = heap.top();
+    heap.pop();
+    if (alive[c.node] && c.version == version[c.node])
+      merge(c.node);
+  }
+}
+
+
+void
+IslandMerger::get_subunits(vector<Subunit> &out) const {
+  for (size_t i = 0; i < units.size(); ++i)
+    if (alive[i])
+      out.push_back(units[i]);
+}
+
+
+// larger islands first, so the longest tasks start early
+struct LargerIsland {
+  LargerIsland(const vector<pair<size_t, size_t> > &i) : islands(i) {}
+  bool operator()(const size_t a, const size_t b) const {
+    const size_t size_a = islands[a].second - islands[a].first;
+    const size_t size_b = islands[b].second - islands[b].first;
+    return size_a > size_b || (size_a == size_b && a < b);
+  }
+  const vector<pair<size_t, size_t> > &islands;
+};
+
+
+// one task: the island's posteriors are looked up for each sample and
+// its subunits merged
+static void
+merge_island(const float degcutoff, const PostProbs &pp,
+             const vector<Subunit> &smallunits,
+             const pair<size_t, size_t> &bounds, vector<Subunit> &merged) {
+  vector<Subunit> island(smallunits.begin() + bounds.first,
+                         smallunits.begin() + bounds.second);
+  vector<vector<float> > cpgs(pp.files.size());
+  for (size_t i = 0; i < pp.files.size(); ++i)
+    load_cpgs(i, *pp.files[i], island, cpgs[i]);
+  IslandMerger merger(degcutoff, cpgs, island);
+  merger.merge_all();
+  merger.get_subunits(merged);
+}
+
+
+// islands are independent tasks; their results are collected in
+// island order, so the output does not depend on the threads
 static void
-merge_smallunits(const float &degcutoff,
-                 const vector<vector<GenomicRegion> > &cpgs,
+merge_smallunits(const float &degcutoff, const PostProbs &pp,
                  vector<Subunit> &smallunits, vector<Subunit> &subunits) {
-  // merge smallunits by clustering
+  vector<pair<size_t, size_t> > islands;
   vector<Subunit>::iterator si = smallunits.begin();
   string chr = "";
   while(si != smallunits.end()) {
@@ -328,59 +422,52 @@ merge_smallunits(const float &degcutoff,
       chr = (*si).chr;
       std::cout << chr << endl;
     }
-    
     vector<Subunit>::iterator ei = get_last_in_island(smallunits, si);
-    vector<Subunit> island = vector<Subunit>(si, ei+1);
-    
-    vector<idxed_val> ranked_scores(island.size(), idxed_val(0, 0));
-    score_subunits_and_sort(cpgs, island, ranked_scores);
-    while (island.size() > 1
-           && merge_two(degcutoff, ranked_scores, island, cpgs)) {
-      score_subunits_and_sort(cpgs, island, ranked_scores);
-    }
-    subunits.insert(subunits.end(), island.begin(), island.end());
+    islands.push_back(pair<size_t, size_t>(si - smallunits.begin(),
+                                           ei + 1 - smallunits.begin()));
     si = ++ei;
   }
-}
 
-////////////////////////////////////////////////////////////////////////////////
-
-static string
-join_source(const vector<bool> &s, string sep) {
-  string js;
-  for(size_t i = 0; i < s.size(); ++i ) {
-    js = js + toa(s[i]) + sep;
+  vector<size_t> by_size(islands.size());
+  for (size_t i = 0; i < by_size.size(); ++i)
+    by_size[i] = i;
+  sort(by_size.begin(), by_size.end(), LargerIsland(islands));
+  vector<vector<Subunit> > merged(islands.size());
+#pragma omp parallel
+#pragma omp single
+  for (size_t i = 0; i < by_size.size(); ++i) {
+    const size_t k = by_size[i];
+#pragma omp task firstprivate(k) shared(islands, merged, pp, smallunits)
+    merge_island(degcutoff, pp, smallunits, islands[k], merged[k]);
   }
-  js.erase(js.end()-1, js.end());
-  return js;
+  for (size_t i = 0; i < merged.size(); ++i)
+    subunits.insert(subunits.end(), merged[i].begin(), merged[i].end());
 }
 
-
+////////////////////////////////////////////////////////////////////////////////
 
 static void
 subunits_to_file(const string &outfile, const vector<Subunit> &subunits) {
   size_t num = subunits[0].source.size();
-  std::ofstream of;
-  if (!outfile.empty()) of.open(outfile.c_str());
-  std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+  BufferedWriter out(outfile);
   for (size_t i = 0; i < subunits.size(); ++i) {
     float freq = static_cast<float> (subunits[i].count) / static_cast<float> (num);
      out << subunits[i].chr << '\t'
-          << subunits[i].start << '\t' << subunits[i].end << '\t'
-          << join_source(subunits[i].source, ",") << '\t'
-          << freq << '\t'// << subunits[i].score_sum() << '\t'
-          << subunits[i].strand << endl;
+          << subunits[i].start << '\t' << subunits[i].end << '\t';
+     write_source(out, subunits[i].source, ',');
+     out << '\t' << freq << '\t'// << subunits[i].score_sum() << '\t'
+         << subunits[i].strand << '\n';
     }
+  out.close();
 }
 
 static void
 write_list(const string &listfile, unordered_map <size_t, string> &fidmap) {
-  std::ofstream of;
-  if (!listfile.empty()) of.open(listfile.c_str());
-  std::ostream out(listfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+  BufferedWriter out(listfile);
   for (size_t i = 0; i < fidmap.size(); ++i) {
-    out << i << '\t' << fidmap[i] << endl;
+    out << i << '\t' << fidmap[i] << '\n';
   }
+  out.close();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -401,6 +488,9 @@ main(int argc, const char **argv) {
     size_t min_size = 100;
     //float size_factor = 0.5;
     float degcutoff = 1;
+    size_t n_threads = 1;
+    // JSON report of the time and memory of each phase
+    string profile_file;
     /****************** GET COMMAND LINE ARGUMENTS ***************************/
     OptionParser opt_parse(strip_path(argv[0]), "subUnitFinder", 
                            "<interval-files>");
@@ -417,6 +507,9 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("min_size", 's', "min size", false, min_size);
     //opt_parse.add_opt("size", 'S', "the size factor", false, size_factor);
     opt_parse.add_opt("degcutoff", 'd', "merging degeneration", false, degcutoff);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, profile_file);
 
     // opt_parse.add_opt("verbose", 'v', "print more run info",
     //                false , VERBOSE);
@@ -441,47 +534,62 @@ main(int argc, const char **argv) {
     }
     const vector<string> interval_files(leftover_args);
     /**********************************************************************/
-    vector<Endpoint> endpoints;
+#ifdef _OPENMP
+    omp_set_num_threads(n_threads);
+#endif
+    if (!profile_file.empty())
+      Profile::get().enable();
     unordered_map <size_t, string> fidmap;
-    
     size_t num_files = interval_files.size();
     for (size_t i = 0; i < num_files; ++i) {
       if (VERBOSE)
         cerr << interval_files[i] << endl;
-      load_units(num_files, interval_files[i], endpoints, fidmap);
+      fidmap[i] = basename(interval_files[i]);
     }
-    std::cout << "Got " << endpoints.size() << " end points." << endl;
-
-    sort(endpoints.begin(), endpoints.end());
-    std::cout << "Sort: over." << endl;
+    ProfileTimer partition_timer("partition");
+    EndpointMerger endpoints(interval_files);
 
     vector<Subunit> smallunits;
     part_intervals(min_cover, endpoints, smallunits);
+    partition_timer.add_items(endpoints.n_read());
+    partition_timer.stop();
+    std::cout << "Got " << endpoints.n_read() << " end points." << endl;
     std::cout << "Got " << smallunits.size() << " smallunits." << endl;
     
     rm_junk(min_del_freq, min_size, smallunits);
     std::cout << "Got " << smallunits.size()
     << " smallunits left after throwing away too small ones." << endl;
 
-    vector<vector<GenomicRegion> > cpgs;
-    for (size_t i = 0; i < num_files; ++i) {
-      load_cpgs(i, fidmap[i], ppdir, smallunits, cpgs);
-    }
+    PostProbs pp;
+    ProfileTimer load_timer("load", num_files);
+    open_postprobs(ppdir, fidmap, pp);
+    load_timer.stop();
     std::cout << "Load cpgs: over." << endl;
 
     std::cout << "Merge smallunits: start" << endl;
     vector<Subunit> subunits;
-    merge_smallunits(degcutoff, cpgs, smallunits, subunits);
+    ProfileTimer merge_timer("merge", smallunits.size());
+    merge_smallunits(degcutoff, pp, smallunits, subunits);
+    merge_timer.stop();
     std::cout << "Merge smallunits: over" << endl;
     std::cout << "Got " << subunits.size() << " subunits left." << endl;
     
     sort(subunits.begin(), subunits.end(), std::greater<Subunit>());
   
+    ProfileTimer output_timer("output", smallunits.size());
     subunits_to_file(outfile, smallunits);
     write_list(listfile, fidmap);
+    output_timer.stop();
+
+    if (!profile_file.empty()) {
+      std::ofstream profile_out(profile_file.c_str());
+      if (!profile_out)
+        throw SMITHLABException("cannot open profile file " + profile_file);
+      Profile::get().write_json(profile_out, "SubunitFinder");
+    }
   }
   catch (SMITHLABException &e) {
-
+    cerr << "ERROR:\t" << e.what() << endl;
     return EXIT_FAILURE;
   }
   catch (std::bad_alloc &ba) {
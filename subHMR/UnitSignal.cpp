@@ -25,12 +25,18 @@
 #include <numeric>
 #include <limits>
 #include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "ProcSubunit.hpp"
+#include "EndpointMerger.hpp"
 #include "UnitCluster.hpp"
+#include "Instrument.hpp"
+#include "BufferedWriter.hpp"
 
 using std::unordered_map;
 using std::string;
@@ -44,132 +50,109 @@ using std::sort;
 
 ///////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////
-// DATA STRUCTURES
+// OUTPUT
 
-static void
-load_units(const size_t &num_files, const string &interval_file,
-           vector<Endpoint> &endpoints, unordered_map <size_t, string> &fidmap) {
-    // assign sample id (id_idx)
-    const int id_idx = fidmap.size();
-    const string source = basename(interval_file);
-    fidmap[id_idx] = source;
-    // construct source vector;
-    vector<bool> sources(num_files, false);
-    sources[id_idx] = 1;
-    //load endpoints of units and cpgs
-    std::fstream in(interval_file.c_str());
-    if (!in)
-      throw BEDFileException("cannot open input file " + interval_file);
-    string buffer;
-    while (getline(in, buffer)) {
-      GenomicRegion interval = GenomicRegion(buffer);
-      Endpoint lhs = Endpoint(interval, true, sources);
-      Endpoint rhs = Endpoint(interval, false, sources);
-      endpoints.push_back(lhs);
-      endpoints.push_back(rhs);
-    }
+/* Scales islands in blocks: the panels of a block are built in
+ * parallel and written in island order, so the output is the same for
+ * any number of threads and only one block is held in memory.
+ */
+class IslandWriter {
+public:
+  IslandWriter(BufferedWriter &o, const size_t w) :
+    out(o), window_size(w), n_islands(0) {}
+
+  // takes the subunits of island, leaving it empty
+  void add(Island &island);
+  void flush();
+  size_t size() const {return n_islands;}
+
+private:
+  static const size_t BLOCK_SIZE = 4096;
+
+  BufferedWriter &out;
+  size_t window_size;
+  size_t n_islands;
+  vector<Island> block;
+  vector<Panel> panels;
+};
+
+
+void
+IslandWriter::add(Island &island) {
+  block.push_back(Island());
+  std::swap(block.back(), island);
+  ++n_islands;
+  if (block.size() == BLOCK_SIZE)
+    flush();
 }
 
-static void
-collapse_endpoints(vector<Endpoint> &ep) {
-  size_t j = 0;
-  for (size_t i = 1; i < ep.size(); ++i) {
-    if (ep[i] == ep[j]) {
-      ep[j].count++;
-      ep[j].source = bv_union(ep[i].source, ep[j].source);
-    }
-    else ep[++j] = ep[i];
+
+void
+IslandWriter::flush() {
+  const size_t n = block.size();
+  panels.resize(n);
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < n; ++i)
+    panels[i] = Panel(block[i], window_size);
+
+  for (size_t i = 0; i < n; ++i) {
+    const vector<float> &signal = panels[i].signal;
+    for (size_t j = 0; j < signal.size(); ++j)
+      out << (j > 0 ? "," : "") << signal[j];
+    out << '\t' << panels[i].xscale << '\t' << panels[i].yscale << '\n';
   }
-  ep.erase(ep.begin() + j + 1, ep.end());
+  block.clear();
 }
 
-static void
-part_intervals(vector<Endpoint> &endpoints, vector<Subunit> &subunits,
-               vector<pair<size_t, size_t> > &island_bound) {
 
-  collapse_endpoints(endpoints);
+////////////////////////////////////////////////////////////////////////////////
+// SWEEP
+
+/* Every sample covering a subunit scores 1, so the score of each
+ * subunit is fixed by the sweep and islands are handed to the writer
+ * as soon as they close.
+ */
+static size_t
+part_intervals(EndpointMerger &endpoints, IslandWriter &islands) {
 
-  vector<Subunit> newunits;
-  vector<bool> inter(endpoints[0].source.size(), 0);
+  Endpoint ep, next_ep;
+  if (!endpoints.next(ep)) return 0;
+  SampleSet inter(endpoints.n_samples());
 
+  Island island;
+  size_t n_subunits = 0;
   size_t count = 0;
-  size_t firstone = 0;
   size_t lastend = 0;
-  size_t cover = 0;
-  size_t j = 0;
-  for (size_t i = 0; i < endpoints.size() - 1; ++i) {
-    if (endpoints[i].is_first) {
-      if (subunits.size() > 0 && (endpoints[i].start > lastend ||
-          endpoints[i].chr != subunits.back().chr)) {
-        for (j = firstone; j < subunits.size(); ++j) {
-          subunits[j].istart = subunits[firstone].start;
-          subunits[j].iend = subunits.back().end;
-          subunits[j].icover = cover;
-        }
-        island_bound.push_back(pair<size_t, size_t> (firstone,
-                                                     subunits.size() - 1));
-        firstone = subunits.size();
-      }
-      count += endpoints[i].count;
-      if (cover < count)  cover = count;
-      inter = bv_union(inter, endpoints[i].source);
+  while (endpoints.next(next_ep)) {
+    if (ep.is_first) {
+      if (!island.empty() && (ep.start > lastend || ep.chr != island.chr))
+        islands.add(island);
+      count += ep.count();
+      inter |= ep.source;
     } else {
-      count -= endpoints[i].count;
-      inter = bv_diff(inter, endpoints[i].source);
+      count -= ep.count();
+      inter -= ep.source;
     }
     if (count >= 1) {
-      Subunit addone = Subunit(endpoints[i].chr, endpoints[i].start,
-                               endpoints[i+1].start, inter, count);
-      addone.cpgbound = vector<pair<size_t, size_t> >(inter.size(),
-                        pair<size_t, size_t> (0, 0));
-      subunits.push_back(addone);
-      lastend = endpoints[i+1].start;
+      if (island.empty()) {
+        island.chr = ep.chr;
+        island.start = ep.start;
+      }
+      island.ends.push_back(next_ep.start);
+      island.scores.push_back(inter.count());
+      ++n_subunits;
+      lastend = next_ep.start;
     }
+    std::swap(ep, next_ep);
   } // assign final island
-  for (size_t j = firstone; j < subunits.size(); ++j) {
-    subunits[j].istart = subunits[firstone].start;
-    subunits[j].iend = subunits.back().end;
-    subunits[j].icover = cover;
-  }
-  island_bound.push_back(pair<size_t, size_t> (firstone, subunits.size() - 1));
+  if (!island.empty())
+    islands.add(island);
+  islands.flush();
+  return n_subunits;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
-// SCORING FUNCTIONS
-static void
-score_a_subunit(Subunit &subunit) {
-  for (size_t i = 0; i < subunit.source.size(); ++i) { // i sample
-    if (subunit.source[i]) subunit.score[i] = 1;
-  }
-}
-
-
-////////////////////////////////////////////////////////////////////////////////
-
-static string
-join_signal(const vector<float> &v, string sep) {
-  string s;
-  for(size_t i = 0; i < v.size(); ++i ) {
-      s = s + toa(v[i]) + sep;
-  }
-  s.erase(s.end() - sep.size(), s.end());
-  return s;
-}
-
-
-static void
-islands_to_file(const string &outfile, const vector<Panel> &islands) {
-  std::ofstream of;
-  if (!outfile.empty()) of.open(outfile.c_str());
-  std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
-  for (size_t i = 0; i < islands.size(); ++i) {
-     out << join_signal(islands[i].signal, ",") << '\t'
-         << islands[i].xscale << '\t' << islands[i].yscale << endl;
-  }
-}
-
-
 
 int
 main(int argc, const char **argv) {
@@ -182,6 +165,9 @@ main(int argc, const char **argv) {
 
     bool VERBOSE = false;
     size_t window_size = 100;
+    size_t n_threads = 1;
+    // JSON report of the time and memory of each phase
+    string profile_file;
     
     /****************** GET COMMAND LINE ARGUMENTS ***************************/
     OptionParser opt_parse(strip_path(argv[0]), "subUnitFinder", 
@@ -192,6 +178,9 @@ main(int argc, const char **argv) {
                       false , outfile);
     opt_parse.add_opt("window", 'w', "window_size to scale the unit in",
                       false , window_size);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("profile", '\0', "write the time, CPU and memory "
+                      "of each phase to this JSON file", false, profile_file);
     // opt_parse.add_opt("verbose", 'v', "print more run info",
     //                false , VERBOSE);
     
@@ -215,51 +204,42 @@ main(int argc, const char **argv) {
     }
     const vector<string> interval_files(leftover_args);
     /**********************************************************************/
-    vector<Endpoint> endpoints;
+#ifdef _OPENMP
+    omp_set_num_threads(n_threads);
+#endif
+    if (!profile_file.empty())
+      Profile::get().enable();
     unordered_map <size_t, string> fidmap;
     size_t num_files = interval_files.size();
-
     for (size_t i = 0; i < num_files; ++i) {
       if (VERBOSE)
         cerr << interval_files[i] << endl;
-      load_units(num_files, interval_files[i], endpoints, fidmap);
-    }
-    std::cout << "Got " << endpoints.size() << " end points." << endl;
-
-    sort(endpoints.begin(), endpoints.end());
-    std::cout << "Sort: over." << endl;
-
-    vector<Subunit> subunits;
-    vector<pair<size_t, size_t> > island_bound;
-    part_intervals(endpoints, subunits, island_bound);
-    std::cout << "Got " << subunits.size() << " subunits." << endl;
-/*
-    vector<vector<GenomicRegion> > cpgs;
-    for (size_t i = 0; i < num_files; ++i) {
-      load_cpgs(i, fidmap[i], ppdir, subunits, cpgs);
-    }
-    std::cout << "Load cpgs: over." << endl;
-*/
-    for (size_t i = 0; i < subunits.size(); ++i) {
-      score_a_subunit(subunits[i]);
+      fidmap[i] = basename(interval_files[i]);
     }
-    std::cout << "Calculate fragment scores: over." << endl;
-  
-    vector<Panel> islands;
-    for (size_t i = 0; i < island_bound.size(); ++i) {
-      Panel new_island = Panel(subunits, island_bound[i], window_size);
-      islands.push_back(new_island);
-    }
-    std::cout << "Scale islands: over." << endl;
+    EndpointMerger endpoints(interval_files);
+
+    BufferedWriter out(outfile);
+    IslandWriter islands(out, window_size);
+    // partitioning, scaling and writing are one streaming pass
+    ProfileTimer partition_timer("partition");
+    const size_t n_subunits = part_intervals(endpoints, islands);
+    out.close();
+    partition_timer.add_items(endpoints.n_read());
+    partition_timer.stop();
+    std::cout << "Got " << endpoints.n_read() << " end points." << endl;
+    std::cout << "Got " << n_subunits << " subunits." << endl;
     std::cout << "Got " << islands.size() << " scaled islands." << endl;
-
-
-    islands_to_file(outfile, islands);
     std::cout << "Write islands: over." << endl;
- 
+
+    if (!profile_file.empty()) {
+      std::ofstream profile_out(profile_file.c_str());
+      if (!profile_out)
+        throw SMITHLABException("cannot open profile file " + profile_file);
+      Profile::get().write_json(profile_out, "UnitSignal");
+    }
   }
   catch (SMITHLABException &e) {
-
+    cerr << "ERROR:\t" << e.what() << endl;
     return EXIT_FAILURE;
   }
   catch (std::bad_alloc &ba) {
@@ -0,0 +1,166 @@
+/*
+ *    Part of SubunitFinder
+ *
+ *    Copyright (C) 2015-2016 University of Southern California and
+ *                            Andrew D. Smith
+ *
+ *    Authors: Liz Ji
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "EndpointMerger.hpp"
+#include "GenomicRegion.hpp"
+#include "smithlab_utils.hpp"
+
+
+bool
+EndpointMerger::KeyGreater::operator()(const Key &a, const Key &b) const {
+  if (a.chrom != b.chrom)
+    return (*names)[a.chrom] > (*names)[b.chrom];
+  if (a.pos != b.pos)
+    return a.pos > b.pos;
+  return a.is_first > b.is_first;
+}
+
+
+EndpointMerger::EndpointMerger(const vector<string> &interval_files) :
+  heap(KeyGreater(&chrom_names)), total_read(0) {
+  reserve_open_files(interval_files.size());
+  try {
+    for (size_t i = 0; i < interval_files.size(); ++i) {
+      samples.push_back(new Sample(interval_files[i]));
+      if (!samples.back()->in)
+        throw BEDFileException("cannot open input file " + interval_files[i]);
+      read_interval(*samples.back());
+    }
+    for (size_t i = 0; i < samples.size(); ++i) {
+      Key key;
+      if (advance(i, key))
+        heap.push(key);
+    }
+  }
+  catch (...) {
+    for (size_t i = 0; i < samples.size(); ++i)
+      delete samples[i];
+    throw;
+  }
+}
+
+
+EndpointMerger::~EndpointMerger() {
+  for (size_t i = 0; i < samples.size(); ++i)
+    delete samples[i];
+}
+
+
+size_t
+EndpointMerger::intern(const string &chrom) {
+  std::unordered_map<string, size_t>::const_iterator i = chrom_ids.find(chrom);
+  if (i != chrom_ids.end())
+    return i->second;
+  chrom_ids[chrom] = chrom_names.size();
+  chrom_names.push_back(chrom);
+  return chrom_names.size() - 1;
+}
+
+
+void
+EndpointMerger::read_interval(Sample &s) {
+  string buffer;
+  while (getline(s.in, buffer) && buffer.empty());
+  if (buffer.empty()) {
+    // the descriptor is not held for the rest of the merge
+    s.in.close();
+    s.has_next = false;
+    return;
+  }
+  const GenomicRegion interval(buffer);
+  const size_t chrom = intern(interval.get_chrom());
+  // the merge relies on every file being in Endpoint order
+  if (s.started &&
+      (chrom != s.next_chrom ?
+       chrom_names[chrom] < chrom_names[s.next_chrom] :
+       interval.get_start() < s.next_start))
+    throw BEDFileException("intervals not sorted in " + s.filename +
+                           " at: " + buffer);
+  s.started = true;
+  s.has_next = true;
+  s.next_chrom = chrom;
+  s.next_start = interval.get_start();
+  s.next_end = interval.get_end();
+}
+
+
+// next endpoint of one sample: the ends of its open intervals come
+// before a start at the same position, as in Endpoint::operator<
+bool
+EndpointMerger::advance(const size_t sample, Key &key) {
+  Sample &s = *samples[sample];
+  key.sample = sample;
+  for (;;) {
+    if (s.has_next && s.next_chrom == s.chrom &&
+        (s.ends.empty() || s.next_start < s.ends.top())) {
+      key.chrom = s.chrom;
+      key.pos = s.next_start;
+      key.is_first = true;
+      s.ends.push(s.next_end);
+      read_interval(s);
+      ++total_read;
+      return true;
+    }
+    if (!s.ends.empty()) {
+      key.chrom = s.chrom;
+      key.pos = s.ends.top();
+      key.is_first = false;
+      s.ends.pop();
+      ++total_read;
+      return true;
+    }
+    if (!s.has_next)
+      return false;
+    s.chrom = s.next_chrom;
+  }
+}
+
+
+bool
+EndpointMerger::next(Endpoint &ep) {
+  if (heap.empty())
+    return false;
+
+  const Key first = heap.top();
+  if (ep.source.size() != samples.size())
+    ep.source = SampleSet(samples.size());
+  else ep.source.clear();
+  ep.chr = chrom_names[first.chrom];
+  ep.start = first.pos;
+  ep.is_first = first.is_first;
+  ep.n_intervals = 0;
+
+  // the same endpoint from every sample that has it, counted once per
+  // interval so that the starts and ends of a sample always balance
+  while (!heap.empty() && heap.top().chrom == first.chrom &&
+         heap.top().pos == first.pos &&
+         heap.top().is_first == first.is_first) {
+    const size_t sample = heap.top().sample;
+    heap.pop();
+    ep.source.set(sample);
+    ++ep.n_intervals;
+    Key key;
+    if (advance(sample, key))
+      heap.push(key);
+  }
+  return true;
+}
@@ -0,0 +1,105 @@
+/*
+ *    Part of SubunitFinder
+ *
+ *    Copyright (C) 2015-2016 University of Southern California and
+ *                            Andrew D. Smith
+ *
+ *    Authors: Liz Ji
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENDPOINT_MERGER_HPP
+#define ENDPOINT_MERGER_HPP
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <fstream>
+#include <unordered_map>
+#include "ProcSubunit.hpp"
+
+using std::string;
+using std::vector;
+
+
+/* Streams the endpoints of all intervals in a set of per-sample
+ * interval files in the order of Endpoint::operator<, with equal
+ * endpoints from different samples collapsed into one carrying the
+ * union of their sources and the number of intervals that share it.
+ * Each file must be sorted by chromosome name and start (sort -k1,1
+ * -k2,2n); only one line per file and the ends of its currently open
+ * intervals are held in memory, but every file stays open until it is
+ * read to the end, so the limit on open files is raised to fit them
+ * (see reserve_open_files). Chromosome names are interned, so
+ * endpoints on the same chromosome are ordered without comparing
+ * strings.
+ */
+class EndpointMerger {
+public:
+  EndpointMerger(const vector<string> &interval_files);
+  ~EndpointMerger();
+
+  // false once every file is exhausted
+  bool next(Endpoint &ep);
+  size_t n_samples() const {return samples.size();}
+  // endpoints read so far, before collapsing
+  size_t n_read() const {return total_read;}
+
+private:
+  EndpointMerger(const EndpointMerger &);
+  EndpointMerger &operator=(const EndpointMerger &);
+
+  struct Key {
+    size_t chrom;
+    size_t pos;
+    bool is_first;
+    size_t sample;
+  };
+
+  // orders the heap so the smallest endpoint is on top
+  struct KeyGreater {
+    KeyGreater(const vector<string> *n) : names(n) {}
+    bool operator()(const Key &a, const Key &b) const;
+    const vector<string> *names;
+  };
+
+  struct Sample {
+    Sample(const string &f) : filename(f), in(f.c_str()), started(false),
+                              has_next(false), chrom(0), next_start(0),
+                              next_end(0), next_chrom(0) {}
+    string filename;
+    std::ifstream in;
+    bool started;
+    bool has_next; // next_* hold the interval read ahead
+    size_t chrom;  // chromosome of the open intervals
+    std::priority_queue<size_t, vector<size_t>,
+                        std::greater<size_t> > ends;
+    size_t next_start;
+    size_t next_end;
+    size_t next_chrom;
+  };
+
+  size_t intern(const string &chrom);
+  void read_interval(Sample &s);
+  bool advance(const size_t sample, Key &key);
+
+  vector<Sample *> samples;
+  vector<string> chrom_names;
+  std::unordered_map<string, size_t> chrom_ids;
+  std::priority_queue<Key, vector<Key>, KeyGreater> heap;
+  size_t total_read;
+};
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ *    Part of SubunitFinder
+ *
+ *    Copyright (C) 2015-2016 University of Southern California and
+ *                            Andrew D. Smith
+ *
+ *    Authors: Liz Ji
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PostProbIndex.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <limits>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "smithlab_utils.hpp"
+#include "GenomicRegion.hpp"
+
+static const char MAGIC[4] = {'H', 'M', 'P', 'P'};
+static const uint32_t VERSION = 1;
+static const size_t HEADER_SIZE = 4 + sizeof(uint32_t) + 4*sizeof(uint64_t);
+
+
+static size_t
+pad8(const size_t n) {
+  return (n + 7) & ~static_cast<size_t>(7);
+}
+
+
+static void
+source_stamp(const string &filename, uint64_t &size, int64_t &mtime) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0)
+    throw BEDFileException("cannot open input file " + filename);
+  size = st.st_size;
+  mtime = st.st_mtime;
+}
+
+
+PostProbIndex::PostProbIndex(const string &hmrpp_file) :
+  map(MAP_FAILED), map_size(0), n_sites(0), pos(0), score(0) {
+
+  uint64_t source_size = 0;
+  int64_t source_mtime = 0;
+  source_stamp(hmrpp_file, source_size, source_mtime);
+  const string sidecar = sidecar_name(hmrpp_file);
+  if (map_file(sidecar, source_size, source_mtime))
+    return;
+
+  // build beside the .hmrpp file if possible, otherwise into a
+  // temporary file that is removed once mapped
+  string target = sidecar + ".tmp." + smithlab::toa(getpid());
+  bool in_place = true;
+  int fd = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    const char *tmpdir = getenv("TMPDIR");
+    target = string(tmpdir ? tmpdir : "/tmp") + "/hmrpp.XXXXXX";
+    vector<char> templ(target.begin(), target.end());
+    templ.push_back('\0');
+    fd = mkstemp(&templ[0]);
+    if (fd < 0)
+      throw BEDFileException("cannot write an index for " + hmrpp_file);
+    target = &templ[0];
+    in_place = false;
+  }
+  ::close(fd);
+
+  try {
+    build(hmrpp_file, target);
+  }
+  catch (SMITHLABException &e) {
+    unlink(target.c_str());
+    throw;
+  }
+  if (in_place && rename(target.c_str(), sidecar.c_str()) == 0)
+    target = sidecar;
+  const bool mapped = map_file(target, source_size, source_mtime);
+  if (target != sidecar)
+    unlink(target.c_str());
+  if (!mapped)
+    throw BEDFileException("cannot map the index of " + hmrpp_file);
+}
+
+
+PostProbIndex::~PostProbIndex() {
+  if (map != MAP_FAILED)
+    munmap(map, map_size);
+}
+
+
+// false if the file is missing, damaged or was built from a different
+// version of the source
+bool
+PostProbIndex::map_file(const string &filename, const uint64_t source_size,
+                        const int64_t source_mtime) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < HEADER_SIZE) {
+    ::close(fd);
+    return false;
+  }
+  map_size = st.st_size;
+  map = mmap(0, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const char *data = static_cast<const char *>(map);
+  uint32_t version = 0;
+  uint64_t n = 0, n_chroms = 0, size = 0;
+  int64_t mtime = 0;
+  memcpy(&version, data + 4, sizeof(uint32_t));
+  memcpy(&n, data + 8, sizeof(uint64_t));
+  memcpy(&n_chroms, data + 16, sizeof(uint64_t));
+  memcpy(&size, data + 24, sizeof(uint64_t));
+  memcpy(&mtime, data + 32, sizeof(int64_t));
+
+  bool valid = memcmp(data, MAGIC, 4) == 0 && version == VERSION &&
+    size == source_size && mtime == source_mtime;
+  size_t offset = HEADER_SIZE;
+  chrom_ids.clear();
+  chrom_starts.clear();
+  for (size_t i = 0; i < n_chroms && valid; ++i) {
+    uint64_t first = 0;
+    uint32_t len = 0;
+    valid = offset + sizeof(uint64_t) + sizeof(uint32_t) <= map_size;
+    if (valid) {
+      memcpy(&first, data + offset, sizeof(uint64_t));
+      memcpy(&len, data + offset + sizeof(uint64_t), sizeof(uint32_t));
+      offset += sizeof(uint64_t) + sizeof(uint32_t);
+      valid = offset + len <= map_size && first <= n;
+    }
+    if (valid) {
+      chrom_ids[string(data + offset, len)] = chrom_starts.size();
+      chrom_starts.push_back(first);
+      offset += len;
+    }
+  }
+  offset = pad8(offset);
+  if (!valid || offset + n*(sizeof(uint32_t) + sizeof(float)) > map_size) {
+    munmap(map, map_size);
+    map = MAP_FAILED;
+    return false;
+  }
+  n_sites = n;
+  chrom_starts.push_back(n_sites);
+  pos = reinterpret_cast<const uint32_t *>(data + offset);
+  score = reinterpret_cast<const float *>(pos + n_sites);
+  return true;
+}
+
+
+pair<size_t, size_t>
+PostProbIndex::sites_in(const string &chrom, const size_t start,
+                        const size_t end) const {
+  std::unordered_map<string, size_t>::const_iterator c = chrom_ids.find(chrom);
+  if (c == chrom_ids.end() || end <= start)
+    return pair<size_t, size_t>(0, 0);
+  const uint32_t *first = pos + chrom_starts[c->second];
+  const uint32_t *last = pos + chrom_starts[c->second + 1];
+  const uint32_t *lo = std::lower_bound(first, last, start);
+  const uint32_t *hi = std::lower_bound(lo, last, end);
+  return pair<size_t, size_t>(lo - pos, hi - pos);
+}
+
+
+void
+PostProbIndex::build(const string &hmrpp_file, const string &outfile) {
+  uint64_t source_size = 0;
+  int64_t source_mtime = 0;
+  source_stamp(hmrpp_file, source_size, source_mtime);
+  std::ifstream in(hmrpp_file.c_str());
+  if (!in)
+    throw BEDFileException("cannot open input file " + hmrpp_file);
+
+  vector<string> names;
+  vector<uint64_t> chrom_starts;
+  vector<uint32_t> positions;
+  vector<float> scores;
+  string line;
+  while (getline(in, line)) {
+    if (line.empty()) continue;
+    const char *c = line.c_str();
+    const size_t chrom_len = strcspn(c, " \t");
+    char *field_end = 0;
+    const unsigned long start = strtoul(c + chrom_len, &field_end, 10);
+    strtoul(field_end, &field_end, 10); // end, always start + 1
+    const float posterior = strtof(field_end, &field_end);
+    if (field_end == c + chrom_len)
+      throw BEDFileException("bad line in " + hmrpp_file + ": " + line);
+
+    const string chrom(c, chrom_len);
+    if (names.empty() || chrom != names.back()) {
+      if (!names.empty() && chrom < names.back())
+        throw BEDFileException("CpGs not sorted in " + hmrpp_file +
+                               " at: " + line);
+      names.push_back(chrom);
+      chrom_starts.push_back(positions.size());
+    }
+    else if (start < positions.back())
+      throw BEDFileException("CpGs not sorted in " + hmrpp_file +
+                             " at: " + line);
+    if (start > std::numeric_limits<uint32_t>::max())
+      throw BEDFileException("position too large in " + hmrpp_file +
+                             ": " + line);
+    positions.push_back(start);
+    scores.push_back(posterior);
+  }
+
+  std::ofstream out(outfile.c_str(), std::ios::binary);
+  if (!out)
+    throw BEDFileException("cannot open output file " + outfile);
+  const uint64_t n_sites = positions.size();
+  const uint64_t n_chroms = names.size();
+  out.write(MAGIC, 4);
+  out.write(reinterpret_cast<const char *>(&VERSION), sizeof(uint32_t));
+  out.write(reinterpret_cast<const char *>(&n_sites), sizeof(uint64_t));
+  out.write(reinterpret_cast<const char *>(&n_chroms), sizeof(uint64_t));
+  out.write(reinterpret_cast<const char *>(&source_size), sizeof(uint64_t));
+  out.write(reinterpret_cast<const char *>(&source_mtime), sizeof(int64_t));
+
+  size_t offset = HEADER_SIZE;
+  for (size_t i = 0; i < names.size(); ++i) {
+    const uint32_t len = names[i].size();
+    out.write(reinterpret_cast<const char *>(&chrom_starts[i]),
+              sizeof(uint64_t));
+    out.write(reinterpret_cast<const char *>(&len), sizeof(uint32_t));
+    out.write(names[i].data(), len);
+    offset += sizeof(uint64_t) + sizeof(uint32_t) + len;
+  }
+  const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  out.write(zeros, pad8(offset) - offset);
+
+  if (n_sites > 0) {
+    out.write(reinterpret_cast<const char *>(&positions[0]),
+              n_sites*sizeof(uint32_t));
+    out.write(reinterpret_cast<const char *>(&scores[0]),
+              n_sites*sizeof(float));
+  }
+  if (!out)
+    throw BEDFileException("error writing output file " + outfile);
+}
@@ -0,0 +1,85 @@
+/*
+ *    Part of SubunitFinder
+ *
+ *    Copyright (C) 2015-2016 University of Southern California and
+ *                            Andrew D. Smith
+ *
+ *    Authors: Liz Ji
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POST_PROB_INDEX_HPP
+#define POST_PROB_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+using std::string;
+using std::vector;
+using std::pair;
+
+/* Binary sidecar <sample>.hmrpp.bin of a posterior file, in native
+ * byte order:
+ *
+ *   header   char[4] "HMPP", uint32 version, uint64 n_sites,
+ *            uint64 n_chroms, uint64 source size, int64 source mtime
+ *   chroms   per chrom: uint64 first site, uint32 name length, name;
+ *            the table is zero padded to a multiple of 8 bytes
+ *   columns  uint32 pos[n_sites], float score[n_sites]
+ *
+ * The .hmrpp lines are "chrom start end score", sorted by chromosome
+ * name then start. Each chromosome is a contiguous range of sites, so
+ * the sites inside an interval are found by binary search on the
+ * mapped positions without reading the rest of the file.
+ */
+class PostProbIndex {
+public:
+  // maps the sidecar, first building it if it is missing or older
+  // than the .hmrpp file
+  explicit PostProbIndex(const string &hmrpp_file);
+  ~PostProbIndex();
+
+  size_t size() const {return n_sites;}
+
+  // the sites with start <= pos < end, as a half-open range of indices
+  pair<size_t, size_t>
+  sites_in(const string &chrom, const size_t start, const size_t end) const;
+  const float *scores() const {return score;}
+
+  static string
+  sidecar_name(const string &hmrpp_file) {return hmrpp_file + ".bin";}
+  // writes the sidecar for the .hmrpp file to outfile
+  static void
+  build(const string &hmrpp_file, const string &outfile);
+
+private:
+  PostProbIndex(const PostProbIndex &);
+  PostProbIndex &operator=(const PostProbIndex &);
+
+  bool map_file(const string &filename, const uint64_t source_size,
+                const int64_t source_mtime);
+
+  void *map;
+  size_t map_size;
+  size_t n_sites;
+  std::unordered_map<string, size_t> chrom_ids;
+  vector<size_t> chrom_starts; // n_chroms + 1 entries
+  const uint32_t *pos;
+  const float *score;
+};
+
+#endif
@@ -23,19 +23,24 @@
 #include "ProcSubunit.hpp"
 #include <iostream>
 #include <vector>
+
+#include <sys/resource.h>
+
+#include "smithlab_utils.hpp"
+
 using std::vector;
 
 
 Endpoint::Endpoint(const GenomicRegion &r, const bool isfirst,
-                       const vector<bool> &input_source) {
+                       const SampleSet &input_source) {
   chr = r.get_chrom();
   if (isfirst)
     start = r.get_start();
   else
     start = r.get_end();
-    count = 1;
   is_first = isfirst;
   source = input_source;
+  n_intervals = source.count();
 }
 
 
@@ -61,11 +66,7 @@ Subunit::behind(const GenomicRegion& other) const {
 
 bool
 Subunit::empty() const {
-  bool empty = true;
-  for (size_t i = 0; i < source.size() && empty; ++i) {
-    if (source[i]) empty = false;
-  }
-  return empty;
+  return source.none();
 }
 
 bool
@@ -88,53 +89,32 @@ Subunit::num_cpg() const {
   return num;
 }
 
-float
-Subunit::score_sum() const {
+void
+Subunit::sum_scores() {
   float sum = 0;
   for (size_t i = 0; i < score.size(); ++i) {
     sum += score[i];
   }
-  return sum;
+  score_total = sum;
 }
 
 float
 Subunit::score_sum_len() const {
-  float sum = 0;
-  for (size_t i = 0; i < score.size(); ++i) {
-    sum += score[i];
-  }
-  return sum * static_cast<float> (end - start) / 1000;
+  return score_total * static_cast<float> (end - start) / 1000;
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // FUNCTIONS TO OPERATE BIT VECTORS
 
-vector<bool>
-bv_union(const vector<bool> &s1, const vector<bool> &s2) {
-  vector<bool> uni(s1.size());
-  for(size_t i = 0; i < s1.size(); ++i) {
-    uni[i] = s1[i] | s2[i];
-  }
-  return uni;
-}
-
-vector<bool>
-bv_diff(const vector<bool> &s1, const vector<bool> &s2) {
-  // remove the intersection of s1 & s2 from s1
-  vector<bool> diff(s1.size());
-  for(size_t i = 0; i < s1.size(); ++i) {
-    diff[i] = s1[i] & ~(s1[i] & s2[i]);
-  }
-  return diff;
-}
-
-vector<bool>
-bv_exist(const vector<bool> &s) {
-  vector<bool> exist;
-  for(size_t i = 0; i < s.size(); ++i) {
-    if (s[i]) exist.push_back(i);
+string
+join_source(const SampleSet &s, const string &sep) {
+  string js;
+  js.reserve(s.size()*(1 + sep.size()));
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (i > 0) js += sep;
+    js += s[i] ? '1' : '0';
   }
-  return exist;
+  return js;
 }
 
 vector<size_t>
@@ -155,3 +135,29 @@ void
 set_pairvec_second(vector<pair<T, T> > &pv, const vector<T> &v) {
   for(size_t i = 0; i < v.size(); ++i) { pv[i].second = v[i]; }
 }
+
+
+// the standard streams, the outputs and the few files opened while
+// the inputs are streamed, such as one index per thread
+static const size_t OTHER_OPEN_FILES = 64;
+
+void
+reserve_open_files(const size_t n_files) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    return;
+  if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < limit.rlim_max) {
+    struct rlimit raised = limit;
+    raised.rlim_cur = limit.rlim_max;
+    // macOS refuses an unlimited soft limit; the old one then stays
+    if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+      limit = raised;
+  }
+  const size_t needed = n_files + OTHER_OPEN_FILES;
+  if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < needed)
+    throw SMITHLABException(smithlab::toa(n_files) + " input files are read "
+                            "at once and need about " +
+                            smithlab::toa(needed) + " open files, but the "
+                            "limit is " + smithlab::toa(limit.rlim_cur) +
+                            " (see ulimit -n)");
+}
@@ -26,6 +26,8 @@
 #include <string>
 #include <vector>
 #include <numeric>
+#include <cstring>
+#include <stdint.h>
 #include "GenomicRegion.hpp"
 
 using std::string;
@@ -33,11 +35,164 @@ using std::vector;
 using std::pair;
 
 
+/* The set of samples an interval comes from, as a bitset over sample
+ * indices. Sets for up to 128 samples are stored in the object
+ * itself; larger ones use a single heap array. Union, difference and
+ * the member count work a 64-bit word at a time.
+ */
+class SampleSet {
+public:
+  SampleSet() : n_bits(0) {}
+  explicit SampleSet(const size_t n);
+  SampleSet(const SampleSet &other);
+  SampleSet(SampleSet &&other);
+  SampleSet &operator=(const SampleSet &other);
+  SampleSet &operator=(SampleSet &&other);
+  ~SampleSet() {if (!is_local()) delete[] words.heap;}
+
+  size_t size() const {return n_bits;}
+  bool operator[](const size_t i) const {
+    return (data()[i/WORD_BITS] >> (i % WORD_BITS)) & 1u;
+  }
+  void set(const size_t i) {
+    data()[i/WORD_BITS] |= static_cast<uint64_t>(1) << (i % WORD_BITS);
+  }
+  void clear() {memset(data(), 0, n_words()*sizeof(uint64_t));}
+
+  size_t count() const;
+  bool none() const;
+  bool operator==(const SampleSet &other) const;
+
+  SampleSet &operator|=(const SampleSet &other);
+  // remove the members of other
+  SampleSet &operator-=(const SampleSet &other);
+
+private:
+  static const size_t WORD_BITS = 64;
+  static const size_t LOCAL_WORDS = 2;
+
+  size_t n_words() const {return (n_bits + WORD_BITS - 1)/WORD_BITS;}
+  bool is_local() const {return n_words() <= LOCAL_WORDS;}
+  uint64_t *data() {return is_local() ? words.local : words.heap;}
+  const uint64_t *data() const {return is_local() ? words.local : words.heap;}
+
+  size_t n_bits;
+  union {
+    uint64_t local[LOCAL_WORDS];
+    uint64_t *heap;
+  } words;
+};
+
+
+inline
+SampleSet::SampleSet(const size_t n) : n_bits(n) {
+  if (!is_local()) words.heap = new uint64_t[n_words()];
+  memset(data(), 0, (is_local() ? LOCAL_WORDS : n_words())*sizeof(uint64_t));
+}
+
+inline
+SampleSet::SampleSet(const SampleSet &other) : n_bits(other.n_bits) {
+  if (is_local()) words = other.words;
+  else {
+    words.heap = new uint64_t[n_words()];
+    memcpy(words.heap, other.words.heap, n_words()*sizeof(uint64_t));
+  }
+}
+
+inline
+SampleSet::SampleSet(SampleSet &&other) :
+  n_bits(other.n_bits), words(other.words) {
+  other.n_bits = 0;
+}
+
+inline SampleSet &
+SampleSet::operator=(const SampleSet &other) {
+  if (this != &other) {
+    if (n_words() == other.n_words()) {
+      n_bits = other.n_bits;
+      memcpy(data(), other.data(), n_words()*sizeof(uint64_t));
+    }
+    else {
+      SampleSet tmp(other);
+      *this = std::move(tmp);
+    }
+  }
+  return *this;
+}
+
+inline SampleSet &
+SampleSet::operator=(SampleSet &&other) {
+  if (this != &other) {
+    if (!is_local()) delete[] words.heap;
+    n_bits = other.n_bits;
+    words = other.words;
+    other.n_bits = 0;
+  }
+  return *this;
+}
+
+inline size_t
+SampleSet::count() const {
+  const uint64_t *w = data();
+  size_t total = 0;
+  for (size_t i = 0; i < n_words(); ++i)
+    total += __builtin_popcountll(w[i]);
+  return total;
+}
+
+inline bool
+SampleSet::none() const {
+  const uint64_t *w = data();
+  uint64_t any = 0;
+  for (size_t i = 0; i < n_words(); ++i)
+    any |= w[i];
+  return any == 0;
+}
+
+inline bool
+SampleSet::operator==(const SampleSet &other) const {
+  return n_bits == other.n_bits &&
+    memcmp(data(), other.data(), n_words()*sizeof(uint64_t)) == 0;
+}
+
+inline SampleSet &
+SampleSet::operator|=(const SampleSet &other) {
+  uint64_t *w = data();
+  const uint64_t *o = other.data();
+  for (size_t i = 0; i < n_words(); ++i)
+    w[i] |= o[i];
+  return *this;
+}
+
+inline SampleSet &
+SampleSet::operator-=(const SampleSet &other) {
+  uint64_t *w = data();
+  const uint64_t *o = other.data();
+  for (size_t i = 0; i < n_words(); ++i)
+    w[i] &= ~o[i];
+  return *this;
+}
+
+// the membership flags as "1" and "0" separated by sep
+string
+join_source(const SampleSet &s, const string &sep);
+
+// the same text as join_source, written to out without the string
+template <class T> void
+write_source(T &out, const SampleSet &s, const char sep) {
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (i > 0) out << sep;
+    out << (s[i] ? '1' : '0');
+  }
+}
+
+
 struct Endpoint {
+  Endpoint() : start(0), is_first(false), n_intervals(0) {}
   Endpoint(const string c, const size_t s, const bool isf) :
-  chr(c), start(s), count(1), is_first(isf) {}
+  chr(c), start(s), is_first(isf), n_intervals(0) {}
   Endpoint(const GenomicRegion &r, const bool isfirst,
-           const vector<bool> &source);
+           const SampleSet &source);
   bool operator<(const Endpoint &other) const {
     return (chr < other.chr ||
             (chr == other.chr &&
@@ -49,60 +204,62 @@ struct Endpoint {
     return (chr == other.chr &&
             start == other.start && is_first == other.is_first);
   }
+  // number of intervals with this endpoint, which exceeds the number
+  // of samples in source when a sample has several
+  size_t count() const {return n_intervals;}
+
   string chr;
   size_t start;
-  size_t count;
   bool is_first;
-  vector<bool> source;
+  SampleSet source;
+  size_t n_intervals;
 };
 
 
 class Subunit {
 public:
   Subunit( ) :
-          chr("chr1"), start(1), end(1) {}
-  Subunit(const string c, const size_t b, const size_t e, const vector<bool> n,
+          chr("chr1"), start(1), end(1), score_total(0) {}
+  Subunit(const string c, const size_t b, const size_t e, const SampleSet &n,
           const size_t ct) :
           chr(c), start(b), end(e), strand('+'), source(n), count(ct),
-          istart(0), iend(0), icover(0), score(vector<float> (n.size(), 0) ) {}
+          istart(0), iend(0), icover(0), score(vector<float> (n.size(), 0) ),
+          score_total(0) {}
   Subunit(const Subunit &other) :
     chr(other.chr), start(other.start), end(other.end), strand(other.strand),
     source(other.source), cpgbound(other.cpgbound), count(other.count),
     istart(other.istart), iend(other.iend), icover(other.icover),
-    score(other.score) {}
+    score(other.score), score_total(other.score_total) {}
   
   bool contains(const GenomicRegion &other) const;
   bool front(const GenomicRegion &other) const;
   bool behind(const GenomicRegion &other) const;
   bool operator>(const Subunit &other) const {
-    return (std::accumulate(score.begin(), score.end(), 0) >
-            std::accumulate(other.score.begin(), other.score.end(), 0) );
+    return score_total > other.score_total;
   }
   bool empty() const;
   bool zero_density() const;
   size_t num_cpg() const;
-  float score_sum() const;
+  float score_sum() const {return score_total;}
   float score_sum_len() const;
+  // to be called whenever score changes
+  void sum_scores();
   
   string chr;
   size_t start;
   size_t end;
   char strand;
-  vector<bool> source;
+  SampleSet source;
   vector<pair<size_t, size_t> > cpgbound;
   size_t count;
   size_t istart;
   size_t iend;
   size_t icover; // island cover
   vector<float> score;
-};
 
-// bit vector operation
-vector<bool>
-bv_union(const vector<bool> &s1, const vector<bool> &s2);
-
-vector<bool>
-bv_diff(const vector<bool> &s1, const vector<bool> &s2);
+private:
+  float score_total; // sum of score, as of the last sum_scores()
+};
 
 vector<size_t>
 operator+(const vector<size_t> &v1, const vector<size_t> &v2);
@@ -114,4 +271,10 @@ template< typename T >
 void
 set_pairvec_second(vector<pair<T, T> > &pv, const vector<T> &v);
 
+// For programs that keep one stream open per input file: raises the
+// soft limit on open files to the hard limit, and throws if n_files
+// inputs and the program's other files still do not fit under it
+void
+reserve_open_files(const size_t n_files);
+
 #endif
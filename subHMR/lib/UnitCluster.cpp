@@ -27,20 +27,21 @@
 using std::vector;
 
 
-Panel::Panel(const vector<Subunit> &subunits, const pair<size_t, size_t> &b,
-             const size_t &window_size) {
-  size_t s = subunits[b.first].start;
-  size_t e = subunits[b.second].end;
+// each subunit paints its score over the windows it reaches, in one
+// pass over the island since the ends only increase
+Panel::Panel(const Island &island, const size_t &window_size) {
+  const size_t s = island.start;
+  const size_t e = island.ends.back();
   xscale = static_cast<float> (e - s) / static_cast<float> (window_size);
   signal = vector<float> (window_size, 0);
   
   size_t idx_lhs = 0, idx_rhs = 0;
   float score = 0, max_score = 0;
-  for (size_t i = b.first; i <= b.second; ++i) {
-    idx_rhs = round(static_cast<float> (subunits[i].end - s + 1) /
+  for (size_t i = 0; i < island.ends.size(); ++i) {
+    idx_rhs = round(static_cast<float> (island.ends[i] - s + 1) /
                          xscale);
     idx_rhs = idx_rhs > 0 ? idx_rhs - 1: idx_rhs;
-    score = subunits[i].score_sum();
+    score = island.scores[i];
     size_t lfill = idx_lhs < window_size? idx_lhs : window_size - 1;
     size_t rfill = idx_rhs < window_size? idx_rhs : window_size - 1;
     std::fill(signal.begin()+lfill, signal.begin()+rfill+1, score);
@@ -52,4 +53,4 @@ Panel::Panel(const vector<Subunit> &subunits, const pair<size_t, size_t> &b,
     signal[i] = signal[i] / max_score;
   }
   yscale = max_score;
-}
\ No newline at end of file
+}
@@ -32,12 +32,25 @@ using std::string;
 using std::vector;
 using std::pair;
 
+// The subunits of one island, which tile it from start: subunit i
+// ends at ends[i] and its score is scores[i]
+struct Island {
+  Island() : start(0) {}
+  void clear() {ends.clear(); scores.clear();}
+  bool empty() const {return ends.empty();}
+
+  string chr;
+  size_t start;
+  vector<size_t> ends;
+  vector<float> scores;
+};
+
 class Panel{
 public:
+  Panel() : xscale(0), yscale(0) {}
   Panel(const vector<float> s, const float x, const float y) :
         signal(s), xscale(x), yscale(y) {}
-  Panel(const vector<Subunit> &subunits, const pair<size_t, size_t> &b,
-        const size_t &window_size);
+  Panel(const Island &island, const size_t &window_size);
 
   vector<float> signal;
   float xscale;